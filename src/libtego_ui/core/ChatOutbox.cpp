@@ -0,0 +1,319 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "ChatOutbox.h"
+#include "utils/SecureRNG.h"
+#include "utils/Useful.h"
+
+ChatOutbox::ChatOutbox(QObject *parent)
+    : QObject(parent)
+    , m_queuedCount(0)
+    , m_lastSerial(0)
+    , m_timeout(InitialTimeout)
+    , m_minimumTimeout(MinimumTimeout)
+    , m_maximumTimeout(MaximumTimeout)
+    , m_smoothedRtt(-1)
+    , m_rttVariation(0)
+{
+    // The peer might use recent message IDs between connections to handle
+    // re-send. Start at a random ID to reduce chance of collisions, then increment
+    m_lastId = SecureRNG::randomInt(UINT32_MAX);
+
+    m_clock.start();
+    m_timer.setSingleShot(true);
+    connect(&m_timer, &WheelTimer::timeout, this, &ChatOutbox::checkTimeouts);
+}
+
+ChatOutbox::MessageId ChatOutbox::enqueue()
+{
+    // Zero means that no acknowledgement is expected
+    do {
+        m_lastId++;
+    } while (m_lastId == 0 || m_messages.contains(m_lastId));
+
+    Message message = { true, 0, 0, ++m_lastSerial, -1, -1 };
+    m_messages.insert(m_lastId, message);
+    m_queue.enqueue(Entry{ m_lastId, message.serial });
+    m_queuedCount++;
+    return m_lastId;
+}
+
+bool ChatOutbox::isQueued(MessageId id) const
+{
+    auto it = m_messages.constFind(id);
+    return it != m_messages.constEnd() && it->queued;
+}
+
+int ChatOutbox::attemptCount(MessageId id) const
+{
+    auto it = m_messages.constFind(id);
+    return it != m_messages.constEnd() ? it->attempts : 0;
+}
+
+QList<ChatOutbox::MessageId> ChatOutbox::queued(int max) const
+{
+    QList<MessageId> ids;
+    for (const Entry &entry : m_queue) {
+        if (ids.size() >= max)
+            break;
+        if (isLive(entry))
+            ids.append(entry.id);
+    }
+    return ids;
+}
+
+ChatOutbox::MessageId ChatOutbox::firstQueued() const
+{
+    return m_queue.isEmpty() ? 0 : m_queue.head().id;
+}
+
+void ChatOutbox::markSent(MessageId id, Route route)
+{
+    if (m_queue.isEmpty() || m_queue.head().id != id) {
+        BUG() << "Chat message" << id << "was sent out of order from the outbox";
+        return;
+    }
+
+    m_queue.dequeue();
+    m_queuedCount--;
+    trimQueue();
+
+    Message &message = m_messages[id];
+    message.queued = false;
+    message.attempts++;
+    message.route = route;
+    message.serial = ++m_lastSerial;
+    message.sentAt = m_clock.elapsed();
+    message.deadline = message.sentAt + qMin(qint64(m_timeout) * StallTimeouts, qint64(m_maximumTimeout));
+    m_inFlight.enqueue(Entry{ id, message.serial });
+
+    if (!m_timer.isActive())
+        scheduleTimeout();
+}
+
+bool ChatOutbox::acknowledge(MessageId id)
+{
+    auto it = m_messages.find(id);
+    if (it == m_messages.end())
+        return false;
+
+    // Only the first attempt gives a useful sample; an acknowledgement for a
+    // message that was sent again could be for either attempt.
+    if (it->queued)
+        m_queuedCount--;
+    else if (it->attempts == 1)
+        sampleRoundTrip(m_clock.elapsed() - it->sentAt);
+
+    m_messages.erase(it);
+    trimQueue();
+    trimInFlight();
+    return true;
+}
+
+void ChatOutbox::remove(MessageId id)
+{
+    auto it = m_messages.find(id);
+    if (it == m_messages.end())
+        return;
+
+    if (it->queued)
+        m_queuedCount--;
+    m_messages.erase(it);
+    trimQueue();
+    trimInFlight();
+}
+
+void ChatOutbox::clear()
+{
+    m_messages.clear();
+    m_queue.clear();
+    m_inFlight.clear();
+    m_queuedCount = 0;
+    m_timer.stop();
+}
+
+void ChatOutbox::setTimeoutRange(int minimum, int maximum)
+{
+    m_minimumTimeout = minimum;
+    m_maximumTimeout = maximum;
+    m_timeout = qBound(minimum, m_timeout, maximum);
+}
+
+void ChatOutbox::requeueInFlight()
+{
+    QQueue<Entry> requeued;
+    QList<MessageId> failed;
+
+    while (!m_inFlight.isEmpty())
+        takeInFlight(m_inFlight.dequeue(), requeued, failed);
+
+    finishRequeue(requeued, failed);
+}
+
+void ChatOutbox::requeueRoute(Route route, bool handedOver)
+{
+    QQueue<Entry> requeued;
+    QList<MessageId> failed;
+
+    // Entries taken from the middle become stale, and are dropped once they reach the front
+    const QQueue<Entry> inFlight = m_inFlight;
+    for (const Entry &entry : inFlight) {
+        if (isLive(entry) && m_messages.value(entry.id).route == route)
+            takeInFlight(entry, requeued, failed, handedOver);
+    }
+    trimInFlight();
+
+    finishRequeue(requeued, failed);
+}
+
+void ChatOutbox::checkTimeouts()
+{
+    QList<Route> stalled;
+    qint64 now = m_clock.elapsed();
+
+    // Messages are checked in the order they were sent, and stay in flight
+    // until their route is lost. Each overdue message is reported once.
+    for (int i = 0; i < m_inFlight.size(); i++) {
+        const Entry &entry = m_inFlight.at(i);
+        if (!isLive(entry))
+            continue;
+
+        Message &message = m_messages[entry.id];
+        if (message.deadline > now)
+            break;
+        if (message.deadline < 0)
+            continue;
+
+        message.deadline = -1;
+        if (!stalled.contains(message.route))
+            stalled.append(message.route);
+    }
+
+    scheduleTimeout();
+
+    foreach (Route route, stalled)
+        emit routeStalled(route);
+}
+
+void ChatOutbox::takeInFlight(const Entry &entry, QQueue<Entry> &requeued, QList<MessageId> &failed, bool handedOver)
+{
+    if (!isLive(entry))
+        return;
+
+    Message &message = m_messages[entry.id];
+    if (handedOver) {
+        message.attempts--;
+    } else if (message.attempts >= MaxAttempts) {
+        m_messages.remove(entry.id);
+        failed.append(entry.id);
+        return;
+    }
+
+    message.queued = true;
+    message.serial = ++m_lastSerial;
+    requeued.enqueue(Entry{ entry.id, message.serial });
+    m_queuedCount++;
+}
+
+void ChatOutbox::finishRequeue(QQueue<Entry> &requeued, const QList<MessageId> &failed)
+{
+    QList<MessageId> ids;
+    for (const Entry &entry : requeued)
+        ids.append(entry.id);
+
+    // Messages that were in flight are older than anything still queued
+    if (!requeued.isEmpty()) {
+        requeued.append(m_queue);
+        m_queue.swap(requeued);
+        trimQueue();
+    }
+    scheduleTimeout();
+
+    foreach (MessageId id, ids)
+        emit messageRequeued(id);
+    foreach (MessageId id, failed)
+        emit messageFailed(id);
+}
+
+bool ChatOutbox::isLive(const Entry &entry) const
+{
+    auto it = m_messages.constFind(entry.id);
+    return it != m_messages.constEnd() && it->serial == entry.serial;
+}
+
+void ChatOutbox::trimQueue()
+{
+    while (!m_queue.isEmpty() && !isLive(m_queue.head()))
+        m_queue.dequeue();
+}
+
+void ChatOutbox::trimInFlight()
+{
+    while (!m_inFlight.isEmpty() && !isLive(m_inFlight.head()))
+        m_inFlight.dequeue();
+}
+
+/* Update the timeout from a round trip sample, as RFC 6298 does for TCP */
+void ChatOutbox::sampleRoundTrip(qint64 rtt)
+{
+    if (m_smoothedRtt < 0) {
+        m_smoothedRtt = rtt;
+        m_rttVariation = rtt / 2;
+    } else {
+        m_rttVariation = (3 * m_rttVariation + qAbs(m_smoothedRtt - rtt)) / 4;
+        m_smoothedRtt = (7 * m_smoothedRtt + rtt) / 8;
+    }
+
+    m_timeout = int(qBound(qint64(m_minimumTimeout), m_smoothedRtt + 4 * m_rttVariation, qint64(m_maximumTimeout)));
+}
+
+void ChatOutbox::scheduleTimeout()
+{
+    trimInFlight();
+
+    // Skip messages that were already reported as stalled
+    for (int i = 0; i < m_inFlight.size(); i++) {
+        const Entry &entry = m_inFlight.at(i);
+        if (!isLive(entry))
+            continue;
+
+        qint64 deadline = m_messages.value(entry.id).deadline;
+        if (deadline < 0)
+            continue;
+
+        qint64 delay = deadline - m_clock.elapsed();
+        m_timer.start(int(qBound(qint64(0), delay, qint64(INT_MAX))));
+        return;
+    }
+
+    m_timer.stop();
+}
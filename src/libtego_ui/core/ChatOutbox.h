@@ -0,0 +1,169 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CHATOUTBOX_H
+#define CHATOUTBOX_H
+
+#include "protocol/ChatChannel.h"
+#include "utils/TimerWheel.h"
+
+/* Delivery state for outgoing chat messages
+ *
+ * ChatOutbox tracks messages from when they are written until they are
+ * acknowledged, independently of how they are displayed. Each message is
+ * given its ID when it's queued, so every lookup is by hash. Queued
+ * messages are kept in order, and leave the queue from the front as they
+ * are sent; messages in flight are kept in the order they were sent.
+ *
+ * Each message in flight remembers the route it was sent on, which is the
+ * channel. Messages are only queued again when their route is lost, with
+ * requeueRoute, and are then sent with the same ID on the next one; the peer
+ * drops duplicates. After MaxAttempts lost routes, the message has failed.
+ *
+ * The route is a reliable stream, so sending a message again on it would
+ * not help. Instead, a message that isn't acknowledged within StallTimeouts
+ * times timeout() reports its route as stalled, and the owner decides
+ * whether to drop that connection. The timeout follows the observed time
+ * between sending and acknowledgement, like TCP's RTO.
+ */
+class ChatOutbox : public QObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(ChatOutbox)
+
+public:
+    typedef Protocol::ChatChannel::MessageId MessageId;
+    // Identifies the channel a message was sent on; any value unique among open channels
+    typedef quintptr Route;
+
+    static const int MaxAttempts = 5;
+    // Multiple of timeout() without an acknowledgement before a route is stalled
+    static const int StallTimeouts = 4;
+    // Timeouts in milliseconds; InitialTimeout is used until the first acknowledgement
+    static const int InitialTimeout = 30000;
+    static const int MinimumTimeout = 5000;
+    static const int MaximumTimeout = 300000;
+
+    explicit ChatOutbox(QObject *parent = 0);
+
+    /* Queue a new message, and return its ID */
+    MessageId enqueue();
+
+    bool contains(MessageId id) const { return m_messages.contains(id); }
+    bool isQueued(MessageId id) const;
+    int queuedCount() const { return m_queuedCount; }
+    int inFlightCount() const { return m_messages.size() - m_queuedCount; }
+    int attemptCount(MessageId id) const;
+
+    /* The oldest queued messages, in order; at most 'max' of them */
+    QList<MessageId> queued(int max) const;
+    /* The oldest queued message, or 0 if there are none */
+    MessageId firstQueued() const;
+
+    /* Record that the first queued message was sent, on 'route' */
+    void markSent(MessageId id, Route route = 0);
+    /* Remove an acknowledged message, and return false if it isn't known */
+    bool acknowledge(MessageId id);
+    /* Queue every message in flight again, ahead of queued messages */
+    void requeueInFlight();
+    /* Queue the messages in flight on 'route' again, ahead of queued messages
+     *
+     * A route that was handed over to another connection didn't lose its
+     * messages, so with 'handedOver' the attempt isn't counted and the
+     * messages can't fail.
+     */
+    void requeueRoute(Route route, bool handedOver);
+    /* Forget a message without delivering it */
+    void remove(MessageId id);
+    void clear();
+
+    /* The current round trip timeout, in milliseconds */
+    int timeout() const { return m_timeout; }
+    void setTimeoutRange(int minimum, int maximum);
+
+signals:
+    /* A message in flight was queued again, and should be sent */
+    void messageRequeued(MessageId id);
+    /* A message lost its route MaxAttempts times, and was removed */
+    void messageFailed(MessageId id);
+    /* A message on 'route' is overdue; emitted once for each such message's route */
+    void routeStalled(Route route);
+
+private slots:
+    void checkTimeouts();
+
+private:
+    struct Message {
+        bool queued;
+        quint8 attempts;
+        Route route;
+        // Matches the live entry for this message in m_queue or m_inFlight
+        quint32 serial;
+        qint64 sentAt;
+        // When the route is stalled, or -1 once that was reported
+        qint64 deadline;
+    };
+
+    struct Entry {
+        MessageId id;
+        quint32 serial;
+    };
+
+    QHash<MessageId,Message> m_messages;
+    // Queued and in flight messages, in order. Entries for messages that have
+    // moved or were removed stay in place until they reach the front, where
+    // they're dropped; the front entry is always live.
+    QQueue<Entry> m_queue;
+    QQueue<Entry> m_inFlight;
+    int m_queuedCount;
+    MessageId m_lastId;
+    quint32 m_lastSerial;
+
+    QElapsedTimer m_clock;
+    WheelTimer m_timer;
+    int m_timeout;
+    int m_minimumTimeout;
+    int m_maximumTimeout;
+    // Smoothed round trip time and its variation, or -1 before the first sample
+    qint64 m_smoothedRtt;
+    qint64 m_rttVariation;
+
+    bool isLive(const Entry &entry) const;
+    void trimQueue();
+    void trimInFlight();
+    void takeInFlight(const Entry &entry, QQueue<Entry> &requeued, QList<MessageId> &failed, bool handedOver = false);
+    void finishRequeue(QQueue<Entry> &requeued, const QList<MessageId> &failed);
+    void sampleRoundTrip(qint64 rtt);
+    void scheduleTimeout();
+};
+
+#endif
@@ -0,0 +1,320 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "ConnectionPolicy.h"
+#include "utils/Useful.h"
+
+ConnectionPolicy *ConnectionPolicy::instance()
+{
+    // Never deleted; contacts can outlive the application object
+    static ConnectionPolicy *policy = 0;
+    if (!policy)
+        policy = new ConnectionPolicy;
+    return policy;
+}
+
+ConnectionPolicy::ConnectionPolicy(QObject *parent)
+    : QObject(parent)
+    , m_maxConnections(DefaultMaxConnections)
+    , m_liveCount(0)
+    , m_updateScheduled(false)
+{
+    m_clock.start();
+    m_timer.setSingleShot(true);
+    connect(&m_timer, &WheelTimer::timeout, this, &ConnectionPolicy::update);
+}
+
+ConnectionPolicy::~ConnectionPolicy()
+{
+}
+
+qint64 ConnectionPolicy::now() const
+{
+    return m_clock.elapsed();
+}
+
+void ConnectionPolicy::setMaxConnections(int max)
+{
+    max = qMax(1, max);
+    if (max == m_maxConnections)
+        return;
+
+    m_maxConnections = max;
+    scheduleUpdate();
+}
+
+void ConnectionPolicy::add(Client *client)
+{
+    if (m_clients.contains(client))
+        return;
+
+    Entry entry;
+    entry.eligible = false;
+    entry.connected = false;
+    entry.connecting = false;
+    entry.lastConnected = -1;
+    entry.lastActivity = -1;
+    entry.lastEvicted = -1;
+    entry.evictions = 0;
+    entry.keepUntil = -1;
+    m_clients.insert(client, entry);
+}
+
+void ConnectionPolicy::remove(Client *client)
+{
+    auto it = m_clients.find(client);
+    if (it == m_clients.end())
+        return;
+
+    if (it->connected)
+        m_liveCount--;
+    m_clients.erase(it);
+    scheduleUpdate();
+}
+
+void ConnectionPolicy::setEligible(Client *client, bool eligible)
+{
+    auto it = m_clients.find(client);
+    if (it == m_clients.end()) {
+        BUG() << "Connection policy has no client" << client;
+        return;
+    }
+
+    if (it->eligible == eligible)
+        return;
+    it->eligible = eligible;
+    scheduleUpdate();
+}
+
+void ConnectionPolicy::setDemand(Client *client, Demand demand, bool enabled)
+{
+    auto it = m_clients.find(client);
+    if (it == m_clients.end()) {
+        BUG() << "Connection policy has no client" << client;
+        return;
+    }
+
+    Demands demands = it->demands;
+    if (enabled)
+        demands |= demand;
+    else
+        demands &= ~demand;
+
+    if (demands == it->demands)
+        return;
+    it->demands = demands;
+    scheduleUpdate();
+}
+
+void ConnectionPolicy::setConnected(Client *client, bool connected)
+{
+    auto it = m_clients.find(client);
+    if (it == m_clients.end()) {
+        BUG() << "Connection policy has no client" << client;
+        return;
+    }
+
+    // Connections closed by the policy are no longer counted, but are still
+    // reported when they are lost
+    if (it->connected == connected)
+        return;
+
+    qint64 time = now();
+    if (connected && it->lastEvicted >= 0) {
+        if (it->connecting || time - it->lastEvicted >= MaxEvictionBackoff) {
+            // Asked to connect, or stayed away; no longer a repeat
+            it->evictions = 0;
+        }
+
+        if (!it->connecting) {
+            // The peer came back on its own. Closing it again would only
+            // start a loop, so keep it for a while, longer each time.
+            it->keepUntil = time + qMin(qint64(EvictionBackoff) << qMin(it->evictions, 4), qint64(MaxEvictionBackoff));
+            it->evictions++;
+        }
+        it->lastEvicted = -1;
+    }
+
+    it->connected = connected;
+    it->lastConnected = time;
+    m_liveCount += connected ? 1 : -1;
+    scheduleUpdate();
+}
+
+void ConnectionPolicy::touch(Client *client)
+{
+    auto it = m_clients.find(client);
+    if (it == m_clients.end())
+        return;
+
+    bool wasWarm = tier(*it, now()) != Idle;
+    it->lastActivity = now();
+    if (!wasWarm)
+        scheduleUpdate();
+}
+
+bool ConnectionPolicy::isConnecting(Client *client) const
+{
+    return m_clients.value(client).connecting;
+}
+
+bool ConnectionPolicy::isConnected(Client *client) const
+{
+    return m_clients.value(client).connected;
+}
+
+bool ConnectionPolicy::isWanted(Client *client) const
+{
+    auto it = m_clients.find(client);
+    return it != m_clients.end() && tier(*it, now()) != Idle;
+}
+
+bool ConnectionPolicy::isKept(Client *client) const
+{
+    auto it = m_clients.find(client);
+    return it != m_clients.end() && it->connected && it->keepUntil > now();
+}
+
+int ConnectionPolicy::connectingCount() const
+{
+    int count = 0;
+    for (const Entry &entry : m_clients) {
+        if (entry.connecting)
+            count++;
+    }
+    return count;
+}
+
+ConnectionPolicy::Tier ConnectionPolicy::tier(const Entry &entry, qint64 time) const
+{
+    if (entry.demands)
+        return Demanded;
+    if (entry.lastActivity >= 0 && time - entry.lastActivity < WarmPeriod)
+        return Warm;
+    return Idle;
+}
+
+void ConnectionPolicy::scheduleUpdate()
+{
+    if (m_updateScheduled)
+        return;
+
+    m_updateScheduled = true;
+    metaObject()->invokeMethod(this, "update", Qt::QueuedConnection);
+}
+
+void ConnectionPolicy::update()
+{
+    m_updateScheduled = false;
+    qint64 time = now();
+
+    // Sort keys: least important first when closing connections, and most
+    // important first when choosing attempts
+    QMultiMap<QPair<int,qint64>,Client*> idleConnections;
+    QMultiMap<QPair<int,qint64>,Client*> candidates;
+    QList<Client*> close, start, stop;
+    qint64 nextChange = -1;
+
+    for (auto it = m_clients.begin(); it != m_clients.end(); it++) {
+        Tier t = tier(*it, time);
+        if (it->connected) {
+            if (it->keepUntil > time) {
+                if (nextChange < 0 || it->keepUntil < nextChange)
+                    nextChange = it->keepUntil;
+            } else if (t != Demanded) {
+                idleConnections.insert(qMakePair(-int(t), lastUsed(*it)), it.key());
+            }
+        } else if (it->eligible) {
+            candidates.insert(qMakePair(int(t), -lastUsed(*it)), it.key());
+        }
+
+        // Contacts need another look when they stop being warm
+        if (t == Warm) {
+            qint64 cooled = it->lastActivity + WarmPeriod;
+            if (nextChange < 0 || cooled < nextChange)
+                nextChange = cooled;
+        }
+    }
+
+    int live = m_liveCount;
+    for (auto it = idleConnections.begin(); it != idleConnections.end() && live > m_maxConnections; it++) {
+        Entry &entry = m_clients[it.value()];
+        entry.connected = false;
+        entry.lastEvicted = time;
+        live--;
+        close.append(it.value());
+    }
+    m_liveCount = live;
+
+    // Attempts that succeed together can go over the limit, until the next
+    // update closes the extra connections
+    int spare = m_maxConnections - live;
+    for (auto it = candidates.begin(); it != candidates.end(); it++) {
+        Entry &entry = m_clients[it.value()];
+        bool connecting = it.key().first == Demanded || spare > 0;
+        if (connecting && it.key().first != Demanded)
+            spare--;
+
+        if (connecting != entry.connecting) {
+            entry.connecting = connecting;
+            (connecting ? start : stop).append(it.value());
+        }
+    }
+
+    for (auto it = m_clients.begin(); it != m_clients.end(); it++) {
+        if ((it->connected || !it->eligible) && it->connecting) {
+            it->connecting = false;
+            stop.append(it.key());
+        }
+    }
+
+    if (nextChange >= 0)
+        m_timer.start(int(qBound(qint64(0), nextChange - time, qint64(INT_MAX))));
+    else
+        m_timer.stop();
+
+    // Clients may call back into the policy, so the decisions are all made first
+    for (Client *client : close) {
+        if (m_clients.contains(client)) {
+            qDebug() << "Closing idle connection to stay within the limit of" << m_maxConnections << "connections";
+            client->closeIdleConnection();
+        }
+    }
+    for (Client *client : stop) {
+        if (m_clients.contains(client) && !m_clients.value(client).connecting)
+            client->setConnecting(false);
+    }
+    for (Client *client : start) {
+        if (m_clients.contains(client) && m_clients.value(client).connecting)
+            client->setConnecting(true);
+    }
+}
@@ -0,0 +1,178 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CONNECTIONPOLICY_H
+#define CONNECTIONPOLICY_H
+
+#include "utils/TimerWheel.h"
+
+/* Decides which contacts to keep connected
+ *
+ * Every connection costs a Tor circuit and a SOCKS stream, so with
+ * thousands of contacts it isn't possible to stay connected to all of
+ * them. ConnectionPolicy aims for at most maxConnections() live connections,
+ * and tells each client whether to try connecting:
+ *
+ * - Contacts with demand, such as undelivered messages or a visible
+ *   conversation, always try to connect.
+ * - Contacts with activity in the last WarmPeriod are kept warm: they
+ *   connect while there are spare connections, before other contacts.
+ * - Other contacts connect only while there are still spare connections,
+ *   most recently used first. Small contact lists behave as if there was
+ *   no limit.
+ *
+ * When there are more live connections than the limit, e.g. because of
+ * inbound connections, connections without demand are closed. Contacts
+ * that aren't warm go first, and within each group the least recently used
+ * go first. Connections with demand are never closed.
+ *
+ * A peer can't be told why its connection was closed, and one that isn't
+ * idle on its side reconnects right away. When a contact reconnects without
+ * being asked to after its connection was closed, that connection is kept
+ * for EvictionBackoff before it can be closed again, doubling each time it
+ * happens. Those connections and ones with demand are the only way to
+ * exceed the limit.
+ *
+ * Changes are applied together once control returns to the event loop.
+ * Subclasses can replace now() and call update() themselves to simulate
+ * time.
+ */
+class ConnectionPolicy : public QObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(ConnectionPolicy)
+
+public:
+    class Client
+    {
+    public:
+        virtual ~Client() { }
+
+        /* Start or stop trying to connect */
+        virtual void setConnecting(bool connecting) = 0;
+        /* Close the live connection; it must be reported with setConnected */
+        virtual void closeIdleConnection() = 0;
+    };
+
+    enum Demand {
+        NoDemand = 0,
+        UndeliveredMessages = 0x1,
+        ConversationVisible = 0x2,
+        ContactRequest = 0x4
+    };
+    Q_DECLARE_FLAGS(Demands, Demand)
+
+    static const int DefaultMaxConnections = 64;
+    // Milliseconds after the last activity that a contact is kept warm
+    static const int WarmPeriod = 10 * 60 * 1000;
+    // Milliseconds that a connection is kept when the peer reconnects after
+    // it was closed as idle; doubles for each repeat, up to MaxEvictionBackoff
+    static const int EvictionBackoff = WarmPeriod;
+    static const int MaxEvictionBackoff = 16 * WarmPeriod;
+
+    /* The policy used by ContactUser */
+    static ConnectionPolicy *instance();
+
+    explicit ConnectionPolicy(QObject *parent = 0);
+    virtual ~ConnectionPolicy();
+
+    int maxConnections() const { return m_maxConnections; }
+    void setMaxConnections(int max);
+
+    void add(Client *client);
+    /* Forget a client; it must be called before a client is destroyed */
+    void remove(Client *client);
+
+    /* Clients that aren't eligible never connect, e.g. because they were rejected */
+    void setEligible(Client *client, bool eligible);
+    void setDemand(Client *client, Demand demand, bool enabled);
+    /* Report a live connection being established or lost */
+    void setConnected(Client *client, bool connected);
+    /* Record activity, such as a message sent or received */
+    void touch(Client *client);
+
+    bool isConnecting(Client *client) const;
+    bool isConnected(Client *client) const;
+    /* Whether the client has demand or recent activity */
+    bool isWanted(Client *client) const;
+    /* Whether the connection is kept after the peer reconnected on its own */
+    bool isKept(Client *client) const;
+    int liveCount() const { return m_liveCount; }
+    int connectingCount() const;
+
+public slots:
+    /* Close connections and start or stop attempts as needed */
+    void update();
+
+protected:
+    /* Current time, in milliseconds */
+    virtual qint64 now() const;
+
+private:
+    enum Tier {
+        Demanded,
+        Warm,
+        Idle
+    };
+
+    struct Entry {
+        Demands demands;
+        bool eligible;
+        bool connected;
+        bool connecting;
+        // When the client was last connected or had activity, or -1
+        qint64 lastConnected;
+        qint64 lastActivity;
+        // When the connection was last closed as idle, or -1, and how often
+        // the peer has reconnected since without being asked to
+        qint64 lastEvicted;
+        int evictions;
+        // The connection isn't closed as idle before this time
+        qint64 keepUntil;
+    };
+
+    QHash<Client*,Entry> m_clients;
+    int m_maxConnections;
+    int m_liveCount;
+    bool m_updateScheduled;
+
+    WheelTimer m_timer;
+    QElapsedTimer m_clock;
+
+    Tier tier(const Entry &entry, qint64 time) const;
+    static qint64 lastUsed(const Entry &entry) { return qMax(entry.lastConnected, entry.lastActivity); }
+    void scheduleUpdate();
+};
+
+Q_DECLARE_OPERATORS_FOR_FLAGS(ConnectionPolicy::Demands)
+
+#endif // CONNECTIONPOLICY_H
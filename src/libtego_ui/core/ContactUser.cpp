@@ -47,6 +47,7 @@ ContactUser::ContactUser(UserIdentity *ident, int id, QObject *parent)
     , uniqueID(id)
     , m_connection(0)
     , m_outgoingSocket(0)
+    , m_connecting(false)
     , m_status(Offline)
     , m_lastReceivedChatID(0)
     , m_contactRequest(0)
@@ -60,14 +61,22 @@ ContactUser::ContactUser(UserIdentity *ident, int id, QObject *parent)
 
     m_conversation = new ConversationModel(this);
     m_conversation->setContact(this);
-
+    connect(m_conversation, &ConversationModel::queuedMessagesChanged, this, &ContactUser::updateConnectPriority);
+    connect(m_conversation, &ConversationModel::undeliveredMessagesChanged, this, &ContactUser::updateConnectionPolicy);
+    connect(m_conversation, &ConversationModel::visibleChanged, this, &ContactUser::updateConnectionPolicy);
+    connect(m_conversation, &ConversationModel::rowsInserted, this,
+        [this]() { ConnectionPolicy::instance()->touch(this); }
+    );
+
+    ConnectionPolicy::instance()->add(this);
     loadContactRequest();
     updateStatus();
-    updateOutgoingSocket();
+    updateConnectionPolicy();
 }
 
 ContactUser::~ContactUser()
 {
+    ConnectionPolicy::instance()->remove(this);
     delete m_settings;
 }
 
@@ -120,6 +129,7 @@ void ContactUser::updateStatus()
     m_status = newStatus;
     emit statusChanged();
 
+    updateConnectionPolicy();
     updateOutgoingSocket();
 }
 
@@ -130,9 +140,49 @@ void ContactUser::onSettingsModified(const QString &key, const QJsonValue &value
         emit nicknameChanged();
 }
 
+/* Contacts that were seen recently or have queued messages are tried first
+ * when many contacts are waiting to connect
+ */
+void ContactUser::updateConnectPriority()
+{
+    if (!m_outgoingSocket)
+        return;
+
+    m_outgoingSocket->setConnectPriority(m_settings->read<QDateTime>("lastConnected"),
+                                         m_conversation && m_conversation->hasQueuedMessages());
+}
+
+void ContactUser::updateConnectionPolicy()
+{
+    ConnectionPolicy *policy = ConnectionPolicy::instance();
+    bool eligible = (m_status == Offline || m_status == RequestPending) && hostname() != identity->hostname();
+    policy->setEligible(this, eligible);
+    policy->setConnected(this, m_connection && m_connection->isConnected() && m_connection.data() != m_idleClosing);
+    policy->setDemand(this, ConnectionPolicy::ContactRequest, m_contactRequest != 0);
+    policy->setDemand(this, ConnectionPolicy::UndeliveredMessages, m_conversation->hasUndeliveredMessages());
+    policy->setDemand(this, ConnectionPolicy::ConversationVisible, m_conversation->isVisible());
+}
+
+void ContactUser::setConnecting(bool connecting)
+{
+    if (connecting == m_connecting)
+        return;
+    m_connecting = connecting;
+    updateOutgoingSocket();
+}
+
+void ContactUser::closeIdleConnection()
+{
+    if (m_connection) {
+        qDebug() << "Closing idle connection to contact" << uniqueID;
+        m_idleClosing = m_connection.data();
+        m_connection->close();
+    }
+}
+
 void ContactUser::updateOutgoingSocket()
 {
-    if (m_status != Offline && m_status != RequestPending) {
+    if ((m_status != Offline && m_status != RequestPending) || !m_connecting) {
         if (m_outgoingSocket) {
             m_outgoingSocket->disconnect(this);
             m_outgoingSocket->abort();
@@ -156,6 +206,9 @@ void ContactUser::updateOutgoingSocket()
     if (!m_outgoingSocket) {
         m_outgoingSocket = new Protocol::OutboundConnector(this);
         m_outgoingSocket->setAuthPrivateKey(identity->hiddenService()->privateKey());
+        // Contacts that have connected before use the current protocol, so skip a round trip
+        m_outgoingSocket->setPipelined(!m_settings->read("lastConnected").isNull());
+        updateConnectPriority();
         connect(m_outgoingSocket, &Protocol::OutboundConnector::ready, this,
             [this]() {
                 assignConnection(m_outgoingSocket->takeConnection());
@@ -220,6 +273,7 @@ void ContactUser::onConnected()
     }
 
     m_settings->write("lastConnected", QDateTime::currentDateTime());
+    updateConnectionPolicy();
 
     if (m_contactRequest && m_connection->purpose() == Protocol::Connection::Purpose::OutboundRequest) {
         qDebug() << "Sending contact request for" << uniqueID << nickname();
@@ -243,6 +297,8 @@ void ContactUser::onConnected()
     if (isConnected()) {
         emit connected();
         emit connectionChanged(m_connection);
+        // The new connection has its own measurement, or none yet
+        emit roundTripTimeChanged();
     }
 
     if (m_status != Online && m_status != RequestPending) {
@@ -268,8 +324,15 @@ void ContactUser::onDisconnected()
     }
 
     updateStatus();
+    updateConnectionPolicy();
     emit disconnected();
     emit connectionChanged(m_connection);
+    emit roundTripTimeChanged();
+}
+
+int ContactUser::roundTripTime() const
+{
+    return m_connection ? m_connection->roundTripTime() : -1;
 }
 
 SettingsObject *ContactUser::settings()
@@ -310,6 +373,7 @@ void ContactUser::setHostname(const QString &hostname)
         fh.append(QLatin1String(".onion"));
 
     m_settings->write("hostname", fh);
+    updateConnectionPolicy();
     updateOutgoingSocket();
 }
 
@@ -412,36 +476,20 @@ void ContactUser::assignConnection(const QSharedPointer<Protocol::Connection> &c
         clearConnection();
     }
 
-    /* To resolve a race if two contacts try to connect at the same time:
-     *
-     * If the existing connection is in the same direction as the new one,
-     * always use the new one.
-     */
-    if (m_connection && connection->direction() == m_connection->direction()) {
-        qDebug() << "Replacing existing connection with contact because the new one goes the same direction";
-        clearConnection();
-    }
-
-    /* If the existing connection is more than 30 seconds old, measured from
-     * when it was successfully established, it's replaced with the new one.
-     */
-    if (m_connection && m_connection->age() > 30) {
-        qDebug() << "Replacing existing connection with contact because it's more than 30 seconds old";
-        clearConnection();
-    }
-
-    /* Otherwise, close the connection for which the server's onion-formatted
-     * hostname compares less with a strcmp function
+    /* To resolve a race if two contacts try to connect at the same time, both
+     * sides pick the same connection; see preferNewConnection. The other one
+     * isn't closed right away: it drains, so messages and acknowledgements
+     * already on their way over it are still delivered.
      */
     bool preferOutbound = QString::compare(hostname(), identity->hostname()) < 0;
     if (m_connection) {
-        if (isOutbound == preferOutbound) {
-            // New connection wins
-            clearConnection();
+        if (preferNewConnection(m_connection.data(), connection.data(), hostname(), identity->hostname())) {
+            qDebug() << "Replacing existing connection with contact" << uniqueID << "and draining the old one";
+            drainConnection(m_connection);
+            m_connection.clear();
         } else {
-            // Old connection wins
-            qDebug() << "Closing new connection with contact because the old connection won comparison";
-            connection->close();
+            qDebug() << "Keeping existing connection with contact" << uniqueID << "and draining the new one";
+            drainNewConnection(connection);
             return;
         }
     }
@@ -456,8 +504,8 @@ void ContactUser::assignConnection(const QSharedPointer<Protocol::Connection> &c
             qDebug() << "Aborting outbound connection attempt because we got an inbound connection instead";
         } else {
             // Outbound attempt wins
-            qDebug() << "Closing inbound connection with contact because the pending outbound connection won comparison";
-            connection->close();
+            qDebug() << "Draining inbound connection with contact because the pending outbound connection won comparison";
+            drainNewConnection(connection);
             return;
         }
     }
@@ -496,6 +544,7 @@ void ContactUser::assignConnection(const QSharedPointer<Protocol::Connection> &c
      * effectively any time we call into protocol code, which would be dangerous.
      */
     connect(m_connection.data(), &Protocol::Connection::closed, this, &ContactUser::onDisconnected, Qt::QueuedConnection);
+    connect(m_connection.data(), &Protocol::Connection::roundTripTimeChanged, this, &ContactUser::roundTripTimeChanged);
 
     /* Delay the call to onConnected to allow protocol code to finish before everything
      * kicks in. In particular, this is important to allow AuthHiddenServiceChannel to
@@ -504,6 +553,68 @@ void ContactUser::assignConnection(const QSharedPointer<Protocol::Connection> &c
         BUG() << "Failed queuing invocation of onConnected method";
 }
 
+bool ContactUser::preferNewConnection(Protocol::Connection *existing, Protocol::Connection *incoming,
+                                      const QString &peerHostname, const QString &localHostname)
+{
+    /* If the existing connection is in the same direction as the new one,
+     * always use the new one.
+     */
+    if (incoming->direction() == existing->direction())
+        return true;
+
+    /* If the existing connection is more than 30 seconds old, measured from
+     * when it was successfully established, it's replaced with the new one.
+     */
+    if (existing->age() > 30)
+        return true;
+
+    /* Otherwise, keep the connection for which the server's onion-formatted
+     * hostname compares less with a strcmp function. Both sides agree on
+     * that, whichever connection arrived first.
+     */
+    bool preferOutbound = QString::compare(peerHostname, localHostname) < 0;
+    return (incoming->direction() == Protocol::Connection::ClientSide) == preferOutbound;
+}
+
+/* Stop using a connection that was replaced, and close it once traffic in
+ * flight has been delivered. Messages on it that are still unacknowledged
+ * when it closes are sent again on the new connection; see
+ * ConversationModel::outboundChannelClosed.
+ */
+void ContactUser::drainConnection(const QSharedPointer<Protocol::Connection> &connection)
+{
+    disconnect(connection.data(), 0, this, 0);
+    m_drainingConnections.append(connection);
+
+    Protocol::Connection *ptr = connection.data();
+    connect(ptr, &Protocol::Connection::closed, this,
+        [this,ptr]() {
+            for (auto it = m_drainingConnections.begin(); it != m_drainingConnections.end(); it++) {
+                if (it->data() == ptr) {
+                    m_drainingConnections.erase(it);
+                    break;
+                }
+            }
+        }, Qt::QueuedConnection
+    );
+
+    connection->closeWhenDrained(DrainTimeout);
+}
+
+/* Drain a connection that lost a race before it was assigned. The peer may
+ * have picked it first, and sent messages on it before seeing the other.
+ */
+void ContactUser::drainNewConnection(const QSharedPointer<Protocol::Connection> &connection)
+{
+    if (m_contactRequest || !connection->setPurpose(Protocol::Connection::Purpose::KnownContact)) {
+        connection->close();
+        return;
+    }
+
+    drainConnection(connection);
+    emit connectionDraining(connection.data());
+}
+
 void ContactUser::clearConnection()
 {
     if (!m_connection)
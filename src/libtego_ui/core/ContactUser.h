@@ -35,6 +35,7 @@
 
 #include "utils/Settings.h"
 #include "protocol/Connection.h"
+#include "ConnectionPolicy.h"
 
 class UserIdentity;
 class OutgoingContactRequest;
@@ -48,9 +49,11 @@ namespace Protocol
 /* Represents a user on the contact list.
  * All persistent uses of a ContactUser instance must either connect to the
  * contactDeleted() signal, or use a QWeakPointer to track deletion. A ContactUser
- * can be removed at essentially any time. */
+ * can be removed at essentially any time.
+ *
+ * Whether to connect to an offline contact is decided by ConnectionPolicy. */
 
-class ContactUser : public QObject
+class ContactUser : public QObject, private ConnectionPolicy::Client
 {
     Q_OBJECT
     Q_DISABLE_COPY(ContactUser)
@@ -64,6 +67,7 @@ class ContactUser : public QObject
     Q_PROPERTY(OutgoingContactRequest *contactRequest READ contactRequest NOTIFY statusChanged)
     Q_PROPERTY(SettingsObject *settings READ settings CONSTANT)
     Q_PROPERTY(ConversationModel *conversation READ conversation CONSTANT)
+    Q_PROPERTY(int roundTripTime READ roundTripTime NOTIFY roundTripTimeChanged)
 
     friend class ContactsManager;
     friend class OutgoingContactRequest;
@@ -102,6 +106,12 @@ public:
 
     Status status() const { return m_status; }
 
+    /* Round trip time to the contact in milliseconds, or -1 if unknown
+     *
+     * This is measured by the connection; see Protocol::Connection::roundTripTime.
+     */
+    int roundTripTime() const;
+
     SettingsObject *settings();
 
     Q_INVOKABLE void deleteContact();
@@ -117,12 +127,22 @@ public slots:
      * a connection, protocol-specific rules are applied and the new connection
      * may be closed to favor the older one.
      *
-     * If the existing connection is replaced, that is equivalent to disconnecting
-     * and reconnectng immediately - any ongoing operations will fail and need to
-     * be retried at a higher level.
+     * The connection that isn't used drains before it closes: traffic already
+     * in flight on it is still delivered, and chat messages that are still
+     * unacknowledged when it closes are sent again on the other connection.
+     * Other ongoing operations on it will fail and need to be retried at a
+     * higher level.
      */
     void assignConnection(const QSharedPointer<Protocol::Connection> &connection);
 
+    /* Decide whether 'incoming' replaces 'existing' as the connection to a contact
+     *
+     * For connections made at the same time from both sides, the peer makes
+     * the same decision about the same pair of connections.
+     */
+    static bool preferNewConnection(Protocol::Connection *existing, Protocol::Connection *incoming,
+                                    const QString &peerHostname, const QString &localHostname);
+
     void setNickname(const QString &nickname);
     void setHostname(const QString &hostname);
 
@@ -133,6 +153,9 @@ signals:
     void connected();
     void disconnected();
     void connectionChanged(const QWeakPointer<Protocol::Connection> &connection);
+    /* A connection that lost a race is draining before it closes; see assignConnection */
+    void connectionDraining(Protocol::Connection *connection);
+    void roundTripTimeChanged();
 
     void nicknameChanged();
     void contactDeleted(ContactUser *user);
@@ -143,10 +166,21 @@ private slots:
     void requestRemoved();
     void requestAccepted();
     void onSettingsModified(const QString &key, const QJsonValue &value);
+    void updateConnectPriority();
+    void updateConnectionPolicy();
 
 private:
+    // Milliseconds that a replaced connection may take to drain before it's closed
+    static const int DrainTimeout = 30000;
+
     QSharedPointer<Protocol::Connection> m_connection;
+    // Connections that were replaced, until they have closed
+    QList<QSharedPointer<Protocol::Connection>> m_drainingConnections;
     Protocol::OutboundConnector *m_outgoingSocket;
+    // Set by ConnectionPolicy while an outbound connection should be attempted
+    bool m_connecting;
+    // Connection closed by closeIdleConnection, which is no longer live while it closes
+    QPointer<Protocol::Connection> m_idleClosing;
 
     Status m_status;
     quint16 m_lastReceivedChatID;
@@ -160,6 +194,11 @@ private:
     void loadContactRequest();
     void updateOutgoingSocket();
 
+    void setConnecting(bool connecting) override;
+    void closeIdleConnection() override;
+
+    void drainConnection(const QSharedPointer<Protocol::Connection> &connection);
+    void drainNewConnection(const QSharedPointer<Protocol::Connection> &connection);
     void clearConnection();
 };
 
@@ -46,6 +46,9 @@ ContactsManager::ContactsManager(UserIdentity *id)
 
 void ContactsManager::loadFromSettings()
 {
+    SettingsObject connections(QStringLiteral("connections"));
+    ConnectionPolicy::instance()->setMaxConnections(connections.read("maxLive", ConnectionPolicy::DefaultMaxConnections).toInt());
+
     SettingsObject settings(QStringLiteral("contacts"));
     foreach (const QString &key, settings.data().keys())
     {
@@ -33,12 +33,20 @@
 #include "ConversationModel.h"
 #include "protocol/Connection.h"
 #include "protocol/ChatChannel.h"
+#include "protocol/FileTransferChannel.h"
+#include "utils/Settings.h"
 
 ConversationModel::ConversationModel(QObject *parent)
     : QAbstractListModel(parent)
     , m_contact(0)
     , m_unreadCount(0)
+    , m_hasUndelivered(false)
+    , m_visible(false)
+    , m_firstPosition(0)
 {
+    connect(&m_outbox, &ChatOutbox::messageRequeued, this, &ConversationModel::outboxMessageRequeued);
+    connect(&m_outbox, &ChatOutbox::messageFailed, this, &ConversationModel::outboxMessageFailed);
+    connect(&m_outbox, &ChatOutbox::routeStalled, this, &ConversationModel::outboxRouteStalled);
 }
 
 void ConversationModel::setContact(ContactUser *contact)
@@ -47,7 +55,7 @@ void ConversationModel::setContact(ContactUser *contact)
         return;
 
     beginResetModel();
-    messages.clear();
+    resetMessages();
 
     if (m_contact)
         disconnect(m_contact, 0, this, 0);
@@ -59,23 +67,31 @@ void ConversationModel::setContact(ContactUser *contact)
                 connect(chat, &Protocol::ChatChannel::messageAcknowledged, this, &ConversationModel::messageAcknowledged);
 
                 if (chat->direction() == Protocol::Channel::Outbound) {
-                    connect(chat, &Protocol::Channel::invalidated, this, &ConversationModel::outboundChannelClosed);
+                    connect(chat, &Protocol::Channel::invalidated, this, [this,chat]() { outboundChannelClosed(chat); });
+                    connect(chat, &Protocol::Channel::writable, this, &ConversationModel::sendQueuedMessages);
                     sendQueuedMessages();
                 }
             }
         };
 
-        auto connectConnection = [this,connectChannel]() {
+        auto connectConnection = [this,connectChannel](Protocol::Connection *connection) {
+            connect(connection, &Protocol::Connection::channelOpened, this, connectChannel);
+            connect(connection, &Protocol::Connection::channelRequestingInboundApproval, this, &ConversationModel::approveFileTransfer);
+            foreach (auto channel, connection->findChannels<Protocol::ChatChannel>())
+                connectChannel(channel);
+        };
+
+        auto contactConnected = [this,connectConnection]() {
             if (m_contact->connection()) {
-                connect(m_contact->connection().data(), &Protocol::Connection::channelOpened, this, connectChannel);
-                foreach (auto channel, m_contact->connection()->findChannels<Protocol::ChatChannel>())
-                    connectChannel(channel);
+                connectConnection(m_contact->connection().data());
                 sendQueuedMessages();
             }
         };
 
-        connect(m_contact, &ContactUser::connected, this, connectConnection);
-        connectConnection();
+        connect(m_contact, &ContactUser::connected, this, contactConnected);
+        // Messages from the peer on a connection that lost a race are still delivered
+        connect(m_contact, &ContactUser::connectionDraining, this, connectConnection);
+        contactConnected();
         connect(m_contact, &ContactUser::statusChanged,
                 this, &ConversationModel::onContactStatusChanged);
     }
@@ -89,83 +105,141 @@ void ConversationModel::sendMessage(const QString &text)
     if (text.isEmpty())
         return;
 
-    MessageData message(text, QDateTime::currentDateTime(), 0, Queued);
+    // Messages always go through the outbox, so they're sent in order. They
+    // wait there while the connection is backed up, and are sent from
+    // sendQueuedMessages when it is writable again.
+    MessageId id = m_outbox.enqueue();
+    insertMessage(0, MessageData(text, QDateTime::currentDateTime(), id, Queued));
+    prune();
+    sendQueuedMessages();
 
-    if (m_contact->connection()) {
-        auto channel = m_contact->connection()->findChannel<Protocol::ChatChannel>(Protocol::Channel::Outbound);
-        if (!channel) {
-            channel = new Protocol::ChatChannel(Protocol::Channel::Outbound, m_contact->connection().data());
-            if (!channel->openChannel()) {
-                message.status = Error;
-                delete channel;
-                channel = 0;
-            }
-        }
+    if (m_outbox.isQueued(id))
+        emit queuedMessagesChanged();
+    updateUndelivered();
+}
 
-        if (channel && channel->isOpened()) {
-            MessageId id = 0;
-            if (channel->sendChatMessage(text, QDateTime(), id))
-                message.status = Sending;
-            else
-                message.status = Error;
-            message.identifier = id;
-            message.attemptCount++;
+/* Open the outbound chat channel, attaching the oldest queued messages to
+ * the request. Peers that support it deliver those without waiting for the
+ * channel to open. Returns false if the channel can't be opened.
+ */
+bool ConversationModel::openOutboundChannel()
+{
+    auto channel = new Protocol::ChatChannel(Protocol::Channel::Outbound, m_contact->connection().data());
+
+    QList<MessageId> attached;
+    foreach (MessageId id, m_outbox.queued(Protocol::ChatChannel::MaxEarlyMessages)) {
+        int row = indexOfIdentifier(id, true);
+        if (row < 0) {
+            m_outbox.remove(id);
+            continue;
         }
+
+        const MessageData &message = messages[row];
+        if (!channel->attachChatMessageWithId(message.text, message.time, id))
+            break;
+        attached.append(id);
     }
 
-    beginInsertRows(QModelIndex(), 0, 0);
-    messages.prepend(message);
-    endInsertRows();
-    prune();
+    if (!channel->openChannel()) {
+        delete channel;
+        return false;
+    }
+
+    foreach (MessageId id, attached) {
+        m_outbox.markSent(id, ChatOutbox::Route(channel));
+        setStatus(indexOfIdentifier(id, true), Sending);
+    }
+    return true;
 }
 
 void ConversationModel::sendQueuedMessages()
 {
-    if (!m_contact->connection())
-        return;
-
-    // Quickly scan to see if we have any queued messages
-    bool haveQueued = false;
-    foreach (const MessageData &data, messages) {
-        if (data.status == Queued) {
-            haveQueued = true;
-            break;
-        }
-    }
-
-    if (!haveQueued)
+    if (!m_outbox.queuedCount() || !m_contact || !m_contact->connection())
         return;
 
     auto channel = m_contact->connection()->findChannel<Protocol::ChatChannel>(Protocol::Channel::Outbound);
     if (!channel) {
-        channel = new Protocol::ChatChannel(Protocol::Channel::Outbound, m_contact->connection().data());
-        if (!channel->openChannel()) {
-            delete channel;
-            return;
-        }
+        // Messages that aren't attached to the request are sent at channelOpened
+        if (!openOutboundChannel())
+            qDebug() << "Failed to open outbound chat channel; messages stay queued";
+        return;
     }
 
     // sendQueuedMessages is called at channelOpened
     if (!channel->isOpened())
         return;
 
-    // Iterate backwards, from oldest to newest messages
-    for (int i = messages.size() - 1; i >= 0; i--) {
-        if (messages[i].status == Queued) {
-            qDebug() << "Sending queued chat message";
-            bool ok = false;
-            if (messages[i].identifier)
-                ok = channel->sendChatMessageWithId(messages[i].text, messages[i].time, messages[i].identifier);
-            else
-                ok = channel->sendChatMessage(messages[i].text, messages[i].time, messages[i].identifier);
-            if (ok)
-                messages[i].status = Sending;
-            else
-                messages[i].status = Error;
-            messages[i].attemptCount++;
-            emit dataChanged(index(i, 0), index(i, 0));
+    // Send from the front of the queue, which is the oldest message. Stop if the
+    // channel is no longer writable; this is called again when it emits writable.
+    while (MessageId id = m_outbox.firstQueued()) {
+        if (!channel->canWrite())
+            break;
+
+        int row = indexOfIdentifier(id, true);
+        if (row < 0) {
+            m_outbox.remove(id);
+            continue;
+        }
+
+        if (channel->sendChatMessageWithId(messages[row].text, messages[row].time, id)) {
+            m_outbox.markSent(id, ChatOutbox::Route(channel));
+            setStatus(row, Sending);
+        } else {
+            m_outbox.remove(id);
+            setStatus(row, Error);
         }
     }
+    updateUndelivered();
+}
+
+bool ConversationModel::sendFile(const QString &path)
+{
+    if (!m_contact || !m_contact->connection() || !m_contact->connection()->isConnected())
+        return false;
+
+    auto transfer = new Protocol::FileTransferChannel(Protocol::Channel::Outbound, m_contact->connection().data());
+    if (!transfer->setFile(path)) {
+        delete transfer;
+        return false;
+    }
+
+    connectFileTransfer(transfer);
+    if (!transfer->openChannel()) {
+        delete transfer;
+        return false;
+    }
+    return true;
+}
+
+/* Accept an inbound file into the configured directory, from the
+ * connection's channelRequestingInboundApproval signal
+ */
+void ConversationModel::approveFileTransfer(Protocol::Channel *channel)
+{
+    auto transfer = qobject_cast<Protocol::FileTransferChannel*>(channel);
+    if (!transfer)
+        return;
+
+    SettingsObject settings(QStringLiteral("fileTransfers"));
+    QString directory = settings.read("directory").toString();
+    if (directory.isEmpty() || !QFileInfo(directory).isDir()) {
+        qDebug() << "Rejecting file transfer from contact without a directory to store it";
+        return;
+    }
+
+    // fileName has no path separators; the channel rejects names that do
+    if (transfer->setDestination(QDir(directory).filePath(transfer->fileName())))
+        connectFileTransfer(transfer);
+}
+
+void ConversationModel::connectFileTransfer(Protocol::FileTransferChannel *transfer)
+{
+    bool isOutgoing = transfer->direction() == Protocol::Channel::Outbound;
+    connect(transfer, &Protocol::FileTransferChannel::transferFinished, this,
+        [this,transfer,isOutgoing](bool completed) {
+            emit fileTransferFinished(transfer->fileName(), isOutgoing, completed);
+        }
+    );
 }
 
 void ConversationModel::messageReceived(const QString &text, const QDateTime &time, MessageId id)
@@ -174,11 +248,9 @@ void ConversationModel::messageReceived(const QString &text, const QDateTime &ti
     // causes the other party to resend the message. Discard the duplicate.
     // We don't need to resend the old acknowledgement packet because
     // it is identical to the one for the duplicate message.
-    for (int i = 0; i < messages.size() && i < 5; i++) {
-        if (messages[i].status == Delivered) {
-            break;
-        }
-        if (messages[i].identifier == id && messages[i].text == text) {
+    if (id) {
+        int existing = indexOfIdentifier(id, false);
+        if (existing >= 0 && messages[existing].text == text) {
             qDebug() << "duplicate incoming message" << id;
             return;
         }
@@ -195,10 +267,7 @@ void ConversationModel::messageReceived(const QString &text, const QDateTime &ti
         }
     }
 
-    beginInsertRows(QModelIndex(), row, row);
-    MessageData message(text, time, id, Received);
-    messages.insert(row, message);
-    endInsertRows();
+    insertMessage(row, MessageData(text, time, id, Received));
     prune();
 
     m_unreadCount++;
@@ -207,30 +276,28 @@ void ConversationModel::messageReceived(const QString &text, const QDateTime &ti
 
 void ConversationModel::messageAcknowledged(MessageId id, bool accepted)
 {
+    m_outbox.acknowledge(id);
+    updateUndelivered();
+
     int row = indexOfIdentifier(id, true);
     if (row < 0)
         return;
 
-    MessageData &data = messages[row];
-    data.status = accepted ? Delivered : Error;
-    emit dataChanged(index(row, 0), index(row, 0));
+    setStatus(row, accepted ? Delivered : Error);
 }
 
-void ConversationModel::outboundChannelClosed()
+void ConversationModel::outboundChannelClosed(Protocol::ChatChannel *channel)
 {
-    // Any messages that are Sending are moved back to Queued, so they
-    // will be re-sent when we reconnect.
-    for (int i = 0; i < messages.size(); i++) {
-        if (messages[i].status != Sending)
-            continue;
-        if (messages[i].attemptCount >= 2) {
-            qDebug() << "Outbound chat channel closed, and unacknowledged message has been tried twice already. Marking as error.";
-            messages[i].status = Error;
-        } else {
-            qDebug() << "Outbound chat channel closed, putting unacknowledged chat message back in queue";
-            messages[i].status = Queued;
-        }
-        emit dataChanged(index(i, 0), index(i, 0));
+    // Messages that are Sending on this channel are moved back to Queued, so
+    // they will be re-sent when we reconnect. If the connection was replaced
+    // by another, they are sent there with the same IDs, and the peer drops
+    // any it already has; that doesn't count as a failed attempt.
+    bool handedOver = channel->connection()->isDraining();
+    int inFlight = m_outbox.inFlightCount();
+    m_outbox.requeueRoute(ChatOutbox::Route(channel), handedOver);
+    if (m_outbox.inFlightCount() < inFlight) {
+        qDebug() << "Outbound chat channel closed, putting" << inFlight - m_outbox.inFlightCount()
+                 << "unacknowledged chat messages back in queue" << (handedOver ? "for the new connection" : "");
     }
 
     // Try to reopen the channel if we're still connected
@@ -239,13 +306,47 @@ void ConversationModel::outboundChannelClosed()
     }
 }
 
+void ConversationModel::outboxMessageRequeued(MessageId id)
+{
+    int row = indexOfIdentifier(id, true);
+    if (row >= 0)
+        setStatus(row, Queued);
+}
+
+void ConversationModel::outboxMessageFailed(MessageId id)
+{
+    qDebug() << "Chat message lost its connection" << ChatOutbox::MaxAttempts << "times without being acknowledged. Marking as error.";
+    updateUndelivered();
+    int row = indexOfIdentifier(id, true);
+    if (row >= 0)
+        setStatus(row, Error);
+}
+
+void ConversationModel::outboxRouteStalled(ChatOutbox::Route route)
+{
+    if (!m_contact || !m_contact->connection())
+        return;
+
+    // Messages aren't sent again on the same channel, because the connection
+    // is reliable; one that isn't acknowledged in time is stuck behind a
+    // connection that no longer works. Closing it puts them back in the
+    // queue, to be sent on the next connection. Channels on a connection
+    // that is draining are closed with it.
+    auto channel = m_contact->connection()->findChannel<Protocol::ChatChannel>(Protocol::Channel::Outbound);
+    if (!channel || ChatOutbox::Route(channel) != route || !m_contact->connection()->isConnected())
+        return;
+
+    qDebug() << "Chat messages weren't acknowledged in time; closing the stalled connection to" << m_contact->uniqueID;
+    m_contact->connection()->close();
+}
+
 void ConversationModel::clear()
 {
     if (messages.isEmpty())
         return;
 
     beginRemoveRows(QModelIndex(), 0, messages.size()-1);
-    messages.clear();
+    resetMessages();
     endRemoveRows();
 
     resetUnreadCount();
@@ -259,6 +360,23 @@ void ConversationModel::resetUnreadCount()
     emit unreadCountChanged();
 }
 
+void ConversationModel::setVisible(bool visible)
+{
+    if (visible == m_visible)
+        return;
+    m_visible = visible;
+    emit visibleChanged();
+}
+
+void ConversationModel::updateUndelivered()
+{
+    bool undelivered = m_outbox.queuedCount() > 0 || m_outbox.inFlightCount() > 0;
+    if (undelivered == m_hasUndelivered)
+        return;
+    m_hasUndelivered = undelivered;
+    emit undeliveredMessagesChanged();
+}
+
 void ConversationModel::onContactStatusChanged()
 {
     // Update in case section has changed
@@ -324,11 +442,51 @@ QVariant ConversationModel::data(const QModelIndex &index, int role) const
 
 int ConversationModel::indexOfIdentifier(MessageId identifier, bool isOutgoing) const
 {
-    for (int i = 0; i < messages.size(); i++) {
-        if (messages[i].identifier == identifier && (messages[i].status != Received) == isOutgoing)
-            return i;
+    const QHash<MessageId,qint64> &positions = isOutgoing ? m_outgoingPositions : m_incomingPositions;
+    auto it = positions.constFind(identifier);
+    if (it == positions.constEnd())
+        return -1;
+    return int(m_firstPosition + messages.size() - 1 - *it);
+}
+
+void ConversationModel::insertMessage(int row, const MessageData &message)
+{
+    beginInsertRows(QModelIndex(), row, row);
+    messages.insert(row, message);
+
+    // Newer messages above the row move one position away from the oldest.
+    // Only a few messages are ever inserted below the newest.
+    for (int i = 0; i <= row; i++) {
+        const MessageData &data = messages[i];
+        if (!data.identifier)
+            continue;
+
+        QHash<MessageId,qint64> &positions = data.status == Received ? m_incomingPositions : m_outgoingPositions;
+        qint64 position = positionOfRow(i);
+        auto it = positions.find(data.identifier);
+        if (i == row)
+            positions.insert(data.identifier, position);
+        else if (it != positions.end() && *it == position - 1)
+            *it = position;
     }
-    return -1;
+
+    endInsertRows();
+}
+
+void ConversationModel::setStatus(int row, MessageStatus status)
+{
+    messages[row].status = status;
+    emit dataChanged(index(row, 0), index(row, 0));
+}
+
+void ConversationModel::resetMessages()
+{
+    messages.clear();
+    m_outbox.clear();
+    m_outgoingPositions.clear();
+    m_incomingPositions.clear();
+    m_firstPosition = 0;
+    updateUndelivered();
 }
 
 void ConversationModel::prune()
@@ -337,8 +495,18 @@ void ConversationModel::prune()
     if (messages.size() > history_limit) {
         beginRemoveRows(QModelIndex(), history_limit, messages.size()-1);
         while (messages.size() > history_limit) {
+            const MessageData &data = messages.last();
+            QHash<MessageId,qint64> &positions = data.status == Received ? m_incomingPositions : m_outgoingPositions;
+            auto it = positions.find(data.identifier);
+            if (it != positions.end() && *it == m_firstPosition)
+                positions.erase(it);
+            if (data.status != Received)
+                m_outbox.remove(data.identifier);
+
             messages.removeLast();
+            m_firstPosition++;
         }
         endRemoveRows();
+        updateUndelivered();
     }
 }
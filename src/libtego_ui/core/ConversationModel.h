@@ -34,8 +34,13 @@
 #define CONVERSATIONMODEL_H
 
 #include "core/ContactUser.h"
+#include "core/ChatOutbox.h"
 #include "protocol/ChatChannel.h"
 
+namespace Protocol {
+    class FileTransferChannel;
+}
+
 class ConversationModel : public QAbstractListModel
 {
     Q_OBJECT
@@ -43,6 +48,7 @@ class ConversationModel : public QAbstractListModel
 
     Q_PROPERTY(ContactUser* contact READ contact WRITE setContact NOTIFY contactChanged)
     Q_PROPERTY(int unreadCount READ unreadCount RESET resetUnreadCount NOTIFY unreadCountChanged)
+    Q_PROPERTY(bool visible READ isVisible WRITE setVisible NOTIFY visibleChanged)
 
 public:
     typedef Protocol::ChatChannel::MessageId MessageId;
@@ -71,6 +77,14 @@ public:
     int unreadCount() const { return m_unreadCount; }
     Q_INVOKABLE void resetUnreadCount();
 
+    bool hasQueuedMessages() const { return m_outbox.queuedCount() > 0; }
+    /* Whether any outgoing message is queued or waiting for acknowledgement */
+    bool hasUndeliveredMessages() const { return m_hasUndelivered; }
+
+    /* Set by the UI while the conversation is shown; the contact is kept connected */
+    bool isVisible() const { return m_visible; }
+    void setVisible(bool visible);
+
     virtual QHash<int,QByteArray> roleNames() const;
     virtual int rowCount(const QModelIndex &parent = QModelIndex()) const;
     virtual QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const;
@@ -78,17 +92,33 @@ public:
 public slots:
     void sendMessage(const QString &text);
     void clear();
+    /* Send the file at 'path' to the contact, who must be connected
+     *
+     * Returns false if there is no connection or the file can't be opened.
+     */
+    bool sendFile(const QString &path);
 
 signals:
     void contactChanged();
     void unreadCountChanged();
+    /* Emitted when a message is queued because it couldn't be sent yet */
+    void queuedMessagesChanged();
+    void undeliveredMessagesChanged();
+    void visibleChanged();
+    /* Emitted when a file transfer to or from the contact ends. Inbound files
+     * are stored in the directory set as "fileTransfers.directory"; requests
+     * are rejected if it isn't set.
+     */
+    void fileTransferFinished(const QString &fileName, bool isOutgoing, bool completed);
 
 private slots:
     void messageReceived(const QString &text, const QDateTime &time, MessageId id);
     void messageAcknowledged(MessageId id, bool accepted);
-    void outboundChannelClosed();
     void sendQueuedMessages();
     void onContactStatusChanged();
+    void outboxMessageRequeued(MessageId id);
+    void outboxMessageFailed(MessageId id);
+    void outboxRouteStalled(ChatOutbox::Route route);
 
 private:
     struct MessageData {
@@ -96,10 +126,9 @@ private:
         QDateTime time;
         MessageId identifier;
         MessageStatus status;
-        quint8 attemptCount;
 
         MessageData(const QString &text, const QDateTime &time, MessageId id, MessageStatus status)
-            : text(text), time(time), identifier(id), status(status), attemptCount(0)
+            : text(text), time(time), identifier(id), status(status)
         {
         }
     };
@@ -107,9 +136,31 @@ private:
     ContactUser *m_contact;
     QList<MessageData> messages;
     int m_unreadCount;
+    bool m_hasUndelivered;
+    bool m_visible;
+    // Delivery state of outgoing messages that aren't acknowledged yet
+    ChatOutbox m_outbox;
+
+    /* Rows are indexed by position, counted from the oldest message that was
+     * ever in the list. Messages are almost always added as the newest, and
+     * removed as the oldest, so positions rarely change; the row is derived
+     * from the position and m_firstPosition.
+     */
+    qint64 m_firstPosition;
+    QHash<MessageId,qint64> m_outgoingPositions;
+    QHash<MessageId,qint64> m_incomingPositions;
 
     int indexOfIdentifier(MessageId identifier, bool isOutgoing) const;
+    qint64 positionOfRow(int row) const { return m_firstPosition + messages.size() - 1 - row; }
+    void insertMessage(int row, const MessageData &message);
+    void setStatus(int row, MessageStatus status);
+    void resetMessages();
+    bool openOutboundChannel();
+    void outboundChannelClosed(Protocol::ChatChannel *channel);
+    void approveFileTransfer(Protocol::Channel *channel);
+    void connectFileTransfer(Protocol::FileTransferChannel *transfer);
     void prune();
+    void updateUndelivered();
 };
 
 #endif
@@ -35,6 +35,7 @@
 #include "tor/HiddenService.h"
 #include "core/ContactIDValidator.h"
 #include "protocol/Connection.h"
+#include "protocol/DirectTransport.h"
 #include "utils/Useful.h"
 
 using namespace Protocol;
@@ -103,6 +104,17 @@ void UserIdentity::setupService()
         address = QHostAddress::LocalHost;
     quint16 port = (quint16)m_settings->read("localListenPort").toInt();
 
+    // In direct mode, peers connect to the route for our own hostname
+    if (DirectTransport::isEnabled()) {
+        DirectTransport::Endpoint endpoint = DirectTransport::route(m_hiddenService->hostname());
+        if (endpoint.isValid()) {
+            address = endpoint.address;
+            port = endpoint.port;
+        } else {
+            qWarning() << "No direct route for our own hostname; peers can't connect directly";
+        }
+    }
+
     m_incomingServer = new QTcpServer(this);
     if (!m_incomingServer->listen(address, port)) {
         // XXX error case
@@ -44,12 +44,16 @@ SOURCES += \
     core/UserIdentity.cpp \
     core/IdentityManager.cpp \
     core/ConversationModel.cpp \
+    core/ChatOutbox.cpp \
+    core/ConnectionPolicy.cpp \
     tor/TorProcess.cpp \
     tor/TorManager.cpp \
     tor/TorSocket.cpp \
+    tor/ConnectScheduler.cpp \
     ui/LinkedText.cpp \
     utils/Settings.cpp \
     utils/PendingOperation.cpp \
+    utils/TimerWheel.cpp \
     ui/LanguagesModel.cpp
 
 HEADERS += \
@@ -75,23 +79,34 @@ HEADERS += \
     core/UserIdentity.h \
     core/IdentityManager.h \
     core/ConversationModel.h \
+    core/ChatOutbox.h \
+    core/ConnectionPolicy.h \
     tor/TorProcess.h \
     tor/TorProcess_p.h \
     tor/TorManager.h \
     tor/TorSocket.h \
+    tor/ConnectScheduler.h \
     ui/LinkedText.h \
     utils/Settings.h \
     utils/PendingOperation.h \
+    utils/SpscQueue.h \
+    utils/TimerWheel.h \
     ui/LanguagesModel.h
 
 SOURCES += \
     protocol/Channel.cpp \
     protocol/ControlChannel.cpp \
     protocol/Connection.cpp \
+    protocol/ChannelTable.cpp \
+    protocol/ChannelTypeRegistry.cpp \
     protocol/OutboundConnector.cpp \
     protocol/AuthHiddenServiceChannel.cpp \
+    protocol/ResumptionTicket.cpp \
     protocol/ChatChannel.cpp \
-    protocol/ContactRequestChannel.cpp
+    protocol/ContactRequestChannel.cpp \
+    protocol/FileTransferChannel.cpp \
+    protocol/NetworkThread.cpp \
+    protocol/DirectTransport.cpp
 
 HEADERS += \
     protocol/Channel.h \
@@ -99,10 +114,16 @@ HEADERS += \
     protocol/ControlChannel.h \
     protocol/Connection.h \
     protocol/Connection_p.h \
+    protocol/ChannelTable.h \
+    protocol/ChannelTypeRegistry.h \
     protocol/OutboundConnector.h \
     protocol/AuthHiddenServiceChannel.h \
+    protocol/ResumptionTicket.h \
     protocol/ChatChannel.h \
-    protocol/ContactRequestChannel.h
+    protocol/ContactRequestChannel.h \
+    protocol/FileTransferChannel.h \
+    protocol/NetworkThread.h \
+    protocol/DirectTransport.h
 
 include($${QMAKE_INCLUDES}/protobuf.pri)
 
@@ -110,7 +131,8 @@ PROTOS += \
     protocol/ControlChannel.proto \
     protocol/AuthHiddenService.proto \
     protocol/ChatChannel.proto \
-    protocol/ContactRequestChannel.proto
+    protocol/ContactRequestChannel.proto \
+    protocol/FileTransferChannel.proto
 
 include($${QMAKE_INCLUDES}/openssl.pri)
 include($${PWD}/../libtego/libtego.pri)
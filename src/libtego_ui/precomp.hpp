@@ -31,6 +31,7 @@
 #include <cassert>
 #include <type_traits>
 #include <cstdint>
+#include <atomic>
 
 // Qt
 #include <QAbstractListModel>
@@ -39,6 +40,7 @@
 #include <QByteArray>
 #include <QClipboard>
 #include <QCoreApplication>
+#include <QCryptographicHash>
 #include <QDateTime>
 #include <QDebug>
 #include <QDir>
@@ -94,6 +96,8 @@
 #include <QtDebug>
 #include <QtEndian>
 #include <QtGlobal>
+#include <QThread>
+#include <QThreadStorage>
 #include <QTime>
 #include <QTimer>
 #ifdef Q_OS_MAC
@@ -34,6 +34,8 @@
 #include "AuthHiddenService.pb.h"
 #include "Connection.h"
 #include "Channel_p.h"
+#include "ChannelTypeRegistry.h"
+#include "ResumptionTicket.h"
 #include "utils/SecureRNG.h"
 #include "utils/CryptoKey.h"
 #include "utils/Useful.h"
@@ -47,20 +49,32 @@ class AuthHiddenServiceChannelPrivate : public ChannelPrivate
 {
 public:
     CryptoKey privateKey;
+    QString clientServiceId;
     QByteArray clientCookie, serverCookie;
     bool accepted;
+    // Outbound: a resumption ticket was sent
+    bool sentTicket;
+    // The server accepted a resumption ticket, and no proof is used
+    bool resuming;
 
     AuthHiddenServiceChannelPrivate(Channel *q, Channel::Direction direction, Connection *conn)
-        : ChannelPrivate(q, QStringLiteral("im.ricochet.auth.hidden-service"), direction, conn)
+        : ChannelPrivate(q, AuthHiddenServiceChannel::TypeId, direction, conn)
         , accepted(false)
+        , sentTicket(false)
+        , resuming(false)
     {
+        // Authentication gates everything else on the connection
+        isPriority = true;
     }
 
     QByteArray getProofData(const QString &clientHostname);
+    QString serverServiceId() const;
 };
 
 }
 
+const int AuthHiddenServiceChannel::TypeId = ChannelTypeRegistry::registerType<AuthHiddenServiceChannel>("im.ricochet.auth.hidden-service");
+
 AuthHiddenServiceChannel::AuthHiddenServiceChannel(Direction dir, Connection *conn)
     : Channel(new AuthHiddenServiceChannelPrivate(this, dir, conn))
 {
@@ -70,10 +84,14 @@ AuthHiddenServiceChannel::AuthHiddenServiceChannel(Direction dir, Connection *co
     connect(this, &Channel::invalidated, this,
         [this]() {
             Q_D(AuthHiddenServiceChannel);
-            if (d->accepted)
+            if (d->accepted) {
                 emit authSuccessful();
-            else
+            } else {
+                // Don't keep presenting a ticket that didn't work
+                if (d->sentTicket)
+                    ResumptionTicket::discard(d->clientServiceId, d->serverServiceId());
                 emit authFailed();
+            }
         }
     );
 }
@@ -92,6 +110,13 @@ void AuthHiddenServiceChannel::setPrivateKey(const CryptoKey &key)
     }
 
     d->privateKey = key;
+    d->clientServiceId = key.torServiceID();
+}
+
+bool AuthHiddenServiceChannel::isResumed() const
+{
+    Q_D(const AuthHiddenServiceChannel);
+    return d->resuming;
 }
 
 bool AuthHiddenServiceChannel::allowInboundChannelRequest(const Data::Control::OpenChannel *request, Data::Control::ChannelResult *result)
@@ -138,6 +163,20 @@ bool AuthHiddenServiceChannel::allowInboundChannelRequest(const Data::Control::O
     qDebug() << "Accepted inbound AuthHiddenServiceChannel";
 
     result->SetExtension(Data::AuthHiddenService::server_cookie, std::string(d->serverCookie.constData(), d->serverCookie.size()));
+
+    // A valid ticket authenticates the client without a proof
+    const std::string &ticket = request->GetExtension(Data::AuthHiddenService::resumption_ticket);
+    if (!ticket.empty() && ticket.size() <= size_t(ResumptionTicket::MaxSize)) {
+        QString serviceId = ResumptionTicket::redeem(QByteArray::fromRawData(ticket.data(), int(ticket.size())), d->serverServiceId());
+        if (!serviceId.isEmpty()) {
+            qDebug() << "Resuming authentication with ticket";
+            result->SetExtension(Data::AuthHiddenService::resumed, true);
+            // The Result must follow the ChannelResult, which is sent after this returns
+            d->clientServiceId = serviceId;
+            d->resuming = true;
+            metaObject()->invokeMethod(this, "sendResumedResult", Qt::QueuedConnection);
+        }
+    }
     return true;
 }
 
@@ -154,6 +193,12 @@ bool AuthHiddenServiceChannel::allowOutboundChannelRequest(Data::Control::OpenCh
     if (d->clientCookie.isEmpty())
         return false;
     request->SetExtension(Data::AuthHiddenService::client_cookie, std::string(d->clientCookie.constData(), d->clientCookie.size()));
+
+    QByteArray ticket = ResumptionTicket::find(d->clientServiceId, d->serverServiceId());
+    if (!ticket.isEmpty()) {
+        request->SetExtension(Data::AuthHiddenService::resumption_ticket, std::string(ticket.constData(), ticket.size()));
+        d->sentTicket = true;
+    }
     return true;
 }
 
@@ -169,6 +214,7 @@ bool AuthHiddenServiceChannel::processChannelOpenResult(const Data::Control::Cha
         }
 
         d->serverCookie = QByteArray(cookie.c_str(), cookie.size());
+        d->resuming = d->sentTicket && result->GetExtension(Data::AuthHiddenService::resumed);
         return true;
     }
 
@@ -187,19 +233,25 @@ void AuthHiddenServiceChannel::sendAuthMessage()
     if (!isOpened())
         return;
 
+    // The server accepted our ticket, and will send a Result without a proof
+    if (d->resuming) {
+        qDebug() << "AuthHiddenServiceChannel is resuming with a ticket";
+        return;
+    }
+
     if (d->clientCookie.size() != 16 || d->serverCookie.size() != 16) {
         BUG() << "AuthHiddenServiceChannel can't create a proof without valid cookies";
         closeChannel();
         return;
     }
 
-    QByteArray proofData = d->getProofData(d->privateKey.torServiceID());
+    QByteArray proofData = d->getProofData(d->clientServiceId);
     auto signature = d->privateKey.signData(proofData);
 
     QScopedPointer<Data::AuthHiddenService::Proof> proof(new Data::AuthHiddenService::Proof);
     proof->set_signature(std::string(signature.constData(), signature.size()));
 
-    proof->set_service_id(d->privateKey.torServiceID().toStdString());
+    proof->set_service_id(d->clientServiceId.toStdString());
 
     Data::AuthHiddenService::Packet message;
     message.set_allocated_proof(proof.take());
@@ -222,6 +274,11 @@ QByteArray AuthHiddenServiceChannelPrivate::getProofData(const QString &client)
     return proofData;
 }
 
+QString AuthHiddenServiceChannelPrivate::serverServiceId() const
+{
+    return connection->serverHostname().left(TEGO_V3_ONION_SERVICE_ID_LENGTH);
+}
+
 void AuthHiddenServiceChannel::receivePacket(const QByteArray &packet)
 {
     Data::AuthHiddenService::Packet message;
@@ -259,27 +316,52 @@ void AuthHiddenServiceChannel::handleProof(const Data::AuthHiddenService::Proof
     QByteArray signature(message.signature().c_str(), message.signature().size());
     QByteArray serviceId(message.service_id().c_str(), message.service_id().size());
 
-    QScopedPointer<Data::AuthHiddenService::Result> result(new Data::AuthHiddenService::Result);
-
-    result->set_accepted(false);
-
+    bool accepted = false;
     CryptoKey publicKey;
     if(!publicKey.loadFromServiceId(serviceId)) {
         qWarning() << "Unable to parse public key from" << type();
     }
     auto proofData = d->getProofData(serviceId);
     if (publicKey.verifyData(proofData, signature)) {
-        result->set_accepted(true);
+        accepted = true;
     } else {
 	    qWarning() << "Signature verification failed on" << type();
     }
 
-    const auto hostname = serviceId + ".onion";
+    sendResult(QString::fromLatin1(serviceId), accepted);
+}
+
+void AuthHiddenServiceChannel::sendResumedResult()
+{
+    Q_D(AuthHiddenServiceChannel);
+    if (!isOpened())
+        return;
+
+    sendResult(d->clientServiceId, true);
+}
+
+/* Send the Result for an inbound channel, and close it
+ *
+ * An accepted result grants authentication as 'serviceId', and carries a
+ * new resumption ticket for the client's next connection.
+ */
+void AuthHiddenServiceChannel::sendResult(const QString &serviceId, bool accepted)
+{
+    Q_D(AuthHiddenServiceChannel);
 
-    if (result->accepted()) {
-        connection()->grantAuthentication(Connection::HiddenServiceAuth, hostname);
+    QScopedPointer<Data::AuthHiddenService::Result> result(new Data::AuthHiddenService::Result);
+    result->set_accepted(accepted);
+
+    if (accepted) {
+        connection()->grantAuthentication(Connection::HiddenServiceAuth, serviceId + QStringLiteral(".onion"));
         d->accepted = true;
         result->set_is_known_contact(connection()->purpose() == Connection::Purpose::KnownContact);
+
+        QByteArray ticket = ResumptionTicket::issue(serviceId, d->serverServiceId());
+        if (!ticket.isEmpty()) {
+            result->set_resumption_ticket(std::string(ticket.constData(), ticket.size()));
+            result->set_ticket_lifetime(ResumptionTicket::Lifetime);
+        }
     } else {
         d->accepted = false;
     }
@@ -311,6 +393,11 @@ void AuthHiddenServiceChannel::handleResult(const Data::AuthHiddenService::Resul
         d->accepted = true;
         if (message.is_known_contact())
             connection()->grantAuthentication(Connection::KnownToPeer);
+
+        // Kept for the next connection to this peer; see ResumptionTicket
+        const std::string &ticket = message.resumption_ticket();
+        ResumptionTicket::store(d->clientServiceId, d->serverServiceId(),
+                                QByteArray(ticket.data(), int(ticket.size())), int(message.ticket_lifetime()));
     } else {
         qWarning() << "AuthHiddenServiceChannel rejected";
         d->accepted = false;
@@ -49,16 +49,23 @@ class AuthHiddenServiceChannel : public Channel
     Q_DECLARE_PRIVATE(AuthHiddenServiceChannel)
 
 public:
+    static const int TypeId;
+
     explicit AuthHiddenServiceChannel(Direction direction, Connection *connection);
 
     void setPrivateKey(const CryptoKey &key);
 
+    /* True if the client is authenticated with a resumption ticket instead
+     * of a proof; see ResumptionTicket */
+    bool isResumed() const;
+
 signals:
     void authSuccessful();
     void authFailed();
 
 private slots:
     void sendAuthMessage();
+    void sendResumedResult();
 
 protected:
     virtual bool allowInboundChannelRequest(const Data::Control::OpenChannel *request, Data::Control::ChannelResult *result);
@@ -69,6 +76,7 @@ protected:
 private:
     void handleProof(const Data::AuthHiddenService::Proof &message);
     void handleResult(const Data::AuthHiddenService::Result &message);
+    void sendResult(const QString &serviceId, bool accepted);
 };
 
 }
@@ -32,33 +32,25 @@
 
 #include "Channel_p.h"
 #include "Connection_p.h"
+#include "ChannelTypeRegistry.h"
 #include "ControlChannel.h"
 #include "utils/Useful.h"
-#include "AuthHiddenServiceChannel.h"
-#include "ChatChannel.h"
-#include "ContactRequestChannel.h"
 
 using namespace Protocol;
 
 Channel *Channel::create(const QString &type, Direction direction, Connection *connection)
 {
-    if (!connection)
-        return 0;
+    return ChannelTypeRegistry::create(ChannelTypeRegistry::typeId(type), direction, connection);
+}
 
-    if (type == QStringLiteral("im.ricochet.auth.hidden-service")) {
-        return new AuthHiddenServiceChannel(direction, connection);
-    } else if (type == QStringLiteral("im.ricochet.chat")) {
-        return new ChatChannel(direction, connection);
-    } else if (type == QStringLiteral("im.ricochet.contact.request")) {
-        return new ContactRequestChannel(direction, connection);
-    } else {
-        return 0;
-    }
+Channel *Channel::create(int typeId, Direction direction, Connection *connection)
+{
+    return ChannelTypeRegistry::create(typeId, direction, connection);
 }
 
-Channel::Channel(const QString &type, Direction direction, Connection *connection)
+Channel::Channel(int typeId, Direction direction, Connection *connection)
     : QObject(connection)
-    , d_ptr(new ChannelPrivate(this, type, direction, connection))
+    , d_ptr(new ChannelPrivate(this, typeId, direction, connection))
 {
 }
 
@@ -78,7 +70,13 @@ Channel::~Channel()
 QString Channel::type() const
 {
     Q_D(const Channel);
-    return d->type;
+    return ChannelTypeRegistry::typeName(d->typeId);
+}
+
+int Channel::typeId() const
+{
+    Q_D(const Channel);
+    return d->typeId;
 }
 
 // May return -1 for unassigned channels
@@ -110,6 +108,33 @@ bool Channel::isOpened() const
     return d->isOpened;
 }
 
+bool Channel::canWrite()
+{
+    Q_D(Channel);
+    if (!isOpened() || !d->connection->isConnected())
+        return false;
+    return !d->connection->d->isAboveWaterMark(this);
+}
+
+void Channel::setWriteWaterMarks(int high, int low)
+{
+    Q_D(Channel);
+    if (low < 0 || high < low) {
+        BUG() << "Invalid water marks for" << type() << "channel:" << high << low;
+        return;
+    }
+
+    d->highWaterMark = high;
+    d->lowWaterMark = low;
+    if (d->isWriteBlocked)
+        d->connection->d->updateWritableChannels();
+}
+
+bool Channel::isDrained() const
+{
+    return true;
+}
+
 bool Channel::openChannel()
 {
     Q_D(Channel);
@@ -210,7 +235,7 @@ bool ChannelPrivate::openChannelOutbound(Data::Control::OpenChannel *request)
     if (!q->allowOutboundChannelRequest(request))
         return false;
 
-    request->set_channel_type(type.toStdString());
+    request->set_channel_type(ChannelTypeRegistry::typeName(typeId).toStdString());
     identifier = request->channel_identifier();
     return true;
 }
@@ -255,22 +280,61 @@ bool Channel::processChannelOpenResult(const Data::Control::ChannelResult *resul
 bool Channel::sendPacket(const QByteArray &packet)
 {
     Q_D(Channel);
-    if (d->identifier < 0) {
-        BUG() << "Cannot send packet to channel" << type() << "without an assigned identifier";
+    if (d->isCompressible && d->connection->d->shouldCompress(packet.size()))
+        return d->sendCompressed(packet.constData(), packet.size());
+
+    char *data = d->beginPacket(packet.size());
+    if (!data)
         return false;
+
+    memcpy(data, packet.constData(), packet.size());
+    return true;
+}
+
+char *ChannelPrivate::beginPacket(int size)
+{
+    if (identifier < 0) {
+        BUG() << "Cannot send packet to channel" << ChannelTypeRegistry::typeName(typeId) << "without an assigned identifier";
+        return 0;
     }
 
-    if (packet.size() == 0) {
-        BUG() << "Cannot send empty packet to channel" << type();
-        return false;
+    if (size == 0) {
+        BUG() << "Cannot send empty packet to channel" << ChannelTypeRegistry::typeName(typeId);
+        return 0;
     }
 
-    if (packet.size() > ConnectionPrivate::PacketMaxDataSize) {
-        BUG() << "Packet is too big on channel" << type();
-        return false;
+    if (size > connection->d->maxOutboundDataSize) {
+        BUG() << "Packet is too big on channel" << ChannelTypeRegistry::typeName(typeId);
+        return 0;
     }
 
-    return connection()->d->writePacket(this, packet);
+    return connection->d->beginPacket(q_ptr, size);
+}
+
+void ChannelPrivate::cancelPacket(char *data)
+{
+    connection->d->cancelPacket(data);
+}
+
+bool ChannelPrivate::sendCompressed(const char *data, int size)
+{
+    QByteArray compressed = qCompress(reinterpret_cast<const uchar*>(data), size);
+
+    // Data that doesn't shrink is sent as it is
+    if (compressed.isEmpty() || compressed.size() + 1 >= size) {
+        char *packet = beginPacket(size);
+        if (!packet)
+            return false;
+        memcpy(packet, data, size);
+        return true;
+    }
+
+    char *packet = beginPacket(compressed.size() + 1);
+    if (!packet)
+        return false;
+    packet[0] = ConnectionPrivate::CompressedPacketMarker;
+    memcpy(packet + 1, compressed.constData(), compressed.size());
+    return true;
 }
 
 void Channel::requestInboundApproval()
@@ -283,15 +347,20 @@ void Channel::requestInboundApproval()
     emit connection()->channelRequestingInboundApproval(this);
 }
 
-ChannelPrivate::ChannelPrivate(Channel *q, const QString &type, Channel::Direction direction, Connection *conn)
+ChannelPrivate::ChannelPrivate(Channel *q, int typeId, Channel::Direction direction, Connection *conn)
     : q_ptr(q)
     , connection(conn)
-    , type(type)
+    , typeId(typeId)
     , identifier(-1)
     , direction(direction)
     , isOpened(false)
     , hasSentClose(false)
     , isInvalidated(false)
+    , isPriority(false)
+    , isCompressible(true)
+    , isWriteBlocked(false)
+    , highWaterMark(ConnectionPrivate::DefaultChannelHighWaterMark)
+    , lowWaterMark(ConnectionPrivate::DefaultChannelLowWaterMark)
 {
 }
 
@@ -299,7 +368,7 @@ ChannelPrivate::~ChannelPrivate()
 {
     Q_Q(Channel);
     if (identifier >= 0 && !isInvalidated) {
-        BUG() << "Channel of type" << type << "was deleted without being invalidated";
+        BUG() << "Channel of type" << ChannelTypeRegistry::typeName(typeId) << "was deleted without being invalidated";
         connection->d->removeChannel(q);
     }
 }
@@ -312,7 +381,7 @@ void ChannelPrivate::invalidate()
 
     Q_ASSERT(!isOpened);
 
-    qDebug() << "Invalidating channel" << q << "type" << type << "id" << identifier;
+    qDebug() << "Invalidating channel" << q << "type" << ChannelTypeRegistry::typeName(typeId) << "id" << identifier;
 
     isInvalidated = true;
     emit q->invalidated();
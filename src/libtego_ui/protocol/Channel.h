@@ -53,8 +53,9 @@ class ChannelPrivate;
  * ControlChannel::openChannel. The result is reported through the
  * outboundOpenResult callback, which will emit channelOpened or channelRejected.
  *
- * Incoming channel requests create an instance by name via the create method
- * and call the inboundOpenChannel method. If that method indicates success, the
+ * Channel types are registered with ChannelTypeRegistry, which assigns each an
+ * integer TypeId. Incoming channel requests create an instance by type via
+ * the create method and call the inboundOpenChannel method. If that method indicates success, the
  * channel is inserted. If failed, the channel will be closed and destroyed.
  *
  * When a channel is closed, the instance is invalidated and will be deleted
@@ -83,8 +84,10 @@ public:
      * Returns null if 'type' is unrecognized.
      */
     static Channel *create(const QString &type, Direction direction, Connection *connection);
+    static Channel *create(int typeId, Direction direction, Connection *connection);
 
     QString type() const;
+    int typeId() const;
     int identifier() const;
     Direction direction() const;
     Connection *connection();
@@ -105,10 +108,45 @@ public:
      */
     bool openChannel();
 
+    /* Check whether the channel should accept more outbound packets
+     *
+     * Outbound packets are queued until the socket can take them. Producers
+     * that can send a lot of data should check this method before sending, and
+     * wait for the writable signal when it returns false.
+     *
+     * This returns false when the connection's pending bytes or this channel's
+     * queued bytes are above their high water marks. The channel then waits
+     * until both are below their low water marks, and emits writable. Sending
+     * packets while this is false is allowed, but they will wait in the queue.
+     *
+     * Channels that are not open are never writable, and do not emit writable;
+     * wait for channelOpened instead.
+     */
+    bool canWrite();
+
+    /* Set the water marks for bytes queued on this channel
+     *
+     * The channel stops being writable above 'high' queued bytes, and becomes
+     * writable again at or below 'low'. See also Connection::setWriteWaterMarks.
+     */
+    void setWriteWaterMarks(int high, int low);
+
+    /* Check whether the channel has finished its work with the peer
+     *
+     * Channels that wait for responses, such as acknowledgements of chat
+     * messages, return false while any are outstanding. A connection that is
+     * draining closes once all of its channels are drained; see
+     * Connection::closeWhenDrained.
+     */
+    virtual bool isDrained() const;
+
 signals:
     void channelOpened();
     void channelRejected(Data::Control::ChannelResult::CommonError error);
 
+    /* Emitted when the channel can write again, after canWrite returned false */
+    void writable();
+
     /* Emitted when the channel has become invalid and will be destroyed
      *
      * This signal is emitted when a channel is closed, an outbound channel request is
@@ -125,7 +163,7 @@ public slots:
     void closeChannel();
 
 protected:
-    explicit Channel(const QString &type, Direction direction, Connection *connection);
+    explicit Channel(int typeId, Direction direction, Connection *connection);
     explicit Channel(ChannelPrivate *d);
     virtual ~Channel();
 
@@ -176,6 +214,10 @@ protected:
      * Subclasses must implement this method to handle inbound packets for this
      * channel. 'packet' is raw data from the packet, and will not be empty.
      *
+     * 'packet' refers directly to the connection's receive buffer, and is only
+     * valid until this method returns. Implementations that need to keep the
+     * data must make a deep copy, e.g. QByteArray(packet.constData(), packet.size()).
+     *
      * Generally, a channel will parse packets using the protobuf ParseFromArray
      * method of their packet message type, and call appropriate handlers for
      * the messages it contains.
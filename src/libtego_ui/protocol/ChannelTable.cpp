@@ -0,0 +1,217 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "ChannelTable.h"
+#include "utils/Useful.h"
+
+using namespace Protocol;
+
+ChannelTable::ChannelTable()
+    : m_count(0)
+{
+    memset(m_pages, 0, sizeof(m_pages));
+    memset(m_pageUsage, 0, sizeof(m_pageUsage));
+    memset(m_used, 0, sizeof(m_used));
+    memset(m_full, 0, sizeof(m_full));
+}
+
+ChannelTable::~ChannelTable()
+{
+    for (int i = 0; i < PageCount; i++)
+        delete[] m_pages[i];
+}
+
+Channel *ChannelTable::value(int identifier) const
+{
+    if (identifier < 0 || identifier > UINT16_MAX)
+        return 0;
+
+    Channel **page = m_pages[identifier >> PageBits];
+    return page ? page[identifier & (PageSize - 1)] : 0;
+}
+
+bool ChannelTable::insert(int identifier, Channel *channel)
+{
+    if (identifier < 0 || identifier > UINT16_MAX || !channel) {
+        BUG() << "Invalid channel table insert of" << channel << "with identifier" << identifier;
+        return false;
+    }
+
+    Channel **&page = m_pages[identifier >> PageBits];
+    if (!page)
+        page = new Channel*[PageSize]();
+
+    Channel *&entry = page[identifier & (PageSize - 1)];
+    if (entry)
+        return false;
+
+    entry = channel;
+    m_pageUsage[identifier >> PageBits]++;
+    m_count++;
+    setUsed(identifier, true);
+    return true;
+}
+
+Channel *ChannelTable::take(int identifier)
+{
+    if (identifier < 0 || identifier > UINT16_MAX)
+        return 0;
+
+    int pageIndex = identifier >> PageBits;
+    Channel **page = m_pages[pageIndex];
+    if (!page)
+        return 0;
+
+    Channel *channel = page[identifier & (PageSize - 1)];
+    if (!channel)
+        return 0;
+
+    page[identifier & (PageSize - 1)] = 0;
+    m_count--;
+    setUsed(identifier, false);
+
+    // Release pages that are no longer used
+    if (--m_pageUsage[pageIndex] == 0) {
+        delete[] page;
+        m_pages[pageIndex] = 0;
+    }
+
+    return channel;
+}
+
+bool ChannelTable::remove(Channel *channel)
+{
+    for (int i = 0; i < PageCount; i++) {
+        if (!m_pages[i])
+            continue;
+        for (int j = 0; j < PageSize; j++) {
+            if (m_pages[i][j] == channel) {
+                take((i << PageBits) | j);
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+QList<Channel*> ChannelTable::values() const
+{
+    QList<Channel*> re;
+    re.reserve(m_count);
+    for (int i = 0; i < PageCount && re.size() < m_count; i++) {
+        if (!m_pages[i])
+            continue;
+        for (int j = 0; j < PageSize; j++) {
+            if (m_pages[i][j])
+                re.append(m_pages[i][j]);
+        }
+    }
+    return re;
+}
+
+void ChannelTable::setUsed(int identifier, bool used)
+{
+    int side = identifier & 1;
+    int index = identifier >> 1;
+    quint64 &word = m_used[side][index / 64];
+    quint64 bit = quint64(1) << (index % 64);
+
+    if (used)
+        word |= bit;
+    else
+        word &= ~bit;
+
+    quint64 &summary = m_full[side][index / 64 / 64];
+    quint64 summaryBit = quint64(1) << ((index / 64) % 64);
+    if (word == ~quint64(0))
+        summary |= summaryBit;
+    else
+        summary &= ~summaryBit;
+}
+
+int ChannelTable::nextAvailable(bool evenNumbered, int start) const
+{
+    const int side = evenNumbered ? 0 : 1;
+    const int startIndex = qBound(0, start, int(UINT16_MAX)) >> 1;
+
+    // Search from the starting position to the end, then wrap around
+    int index = findAvailable(side, startIndex, SideSize);
+    if (index < 0)
+        index = findAvailable(side, 0, startIndex);
+    if (index < 0)
+        return -1;
+
+    return (index << 1) | side;
+}
+
+/* Find the first unused index in [from, to) within one side's bitmap, or -1
+ *
+ * Full bitmap words are skipped using the summary, so at most a few words of
+ * either bitmap are examined regardless of how many channels exist.
+ */
+int ChannelTable::findAvailable(int side, int from, int to) const
+{
+    int word = from / 64;
+    quint64 mask = ~quint64(0) << (from % 64);
+
+    while (word >= 0 && word * 64 < to) {
+        quint64 available = ~m_used[side][word] & mask;
+        // Identifier 0 is reserved for the control channel
+        if (side == 0 && word == 0)
+            available &= ~quint64(1);
+
+        if (available) {
+            int index = word * 64 + qCountTrailingZeroBits(available);
+            return (index < to) ? index : -1;
+        }
+
+        word = nextOpenWord(side, word + 1);
+        mask = ~quint64(0);
+    }
+
+    return -1;
+}
+
+/* Index of the first bitmap word at or after 'from' that isn't full, or -1 */
+int ChannelTable::nextOpenWord(int side, int from) const
+{
+    for (int s = from / 64; s < SummaryCount; s++) {
+        quint64 open = ~m_full[side][s];
+        if (s == from / 64)
+            open &= ~quint64(0) << (from % 64);
+        if (open)
+            return s * 64 + qCountTrailingZeroBits(open);
+    }
+
+    return -1;
+}
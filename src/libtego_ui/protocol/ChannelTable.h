@@ -0,0 +1,108 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PROTOCOL_CHANNELTABLE_H
+#define PROTOCOL_CHANNELTABLE_H
+
+namespace Protocol
+{
+
+class Channel;
+
+/* Table of the channels on a connection, indexed by identifier
+ *
+ * Channel identifiers are a 16-bit space, so the table is a two-level direct
+ * mapped array: a fixed directory of pages, each holding the channels for 256
+ * consecutive identifiers. Pages are allocated only while they have channels.
+ * Lookup, insertion and removal are O(1).
+ *
+ * Identifiers in use are also tracked by a bitmap for each side of the
+ * connection (odd identifiers are opened by the client, even by the server),
+ * with a summary of which bitmap words are full. Finding an available
+ * identifier is a bounded scan, and only fails if every identifier for that
+ * side is in use.
+ */
+class ChannelTable
+{
+    Q_DISABLE_COPY(ChannelTable)
+
+public:
+    ChannelTable();
+    ~ChannelTable();
+
+    Channel *value(int identifier) const;
+    bool contains(int identifier) const { return value(identifier) != 0; }
+    int count() const { return m_count; }
+    bool isEmpty() const { return m_count == 0; }
+
+    /* Insert a channel, which must not be null, with an identifier that isn't in use */
+    bool insert(int identifier, Channel *channel);
+    /* Remove and return the channel with this identifier, if any */
+    Channel *take(int identifier);
+    /* Remove a channel by pointer, wherever it is in the table. Returns false if not found. */
+    bool remove(Channel *channel);
+
+    /* All channels, ordered by identifier */
+    QList<Channel*> values() const;
+
+    /* Find the first unused identifier for one side of the connection at or
+     * after 'start', wrapping around to the lowest identifier. Identifier 0 is
+     * reserved for the control channel and is never returned.
+     *
+     * Returns -1 if all identifiers for that side are in use.
+     */
+    int nextAvailable(bool evenNumbered, int start) const;
+
+private:
+    static const int PageBits = 8;
+    static const int PageSize = 1 << PageBits;
+    static const int PageCount = (UINT16_MAX + 1) / PageSize;
+    // Identifiers per side, and the 64-bit bitmap words covering them
+    static const int SideSize = (UINT16_MAX + 1) / 2;
+    static const int WordCount = SideSize / 64;
+    static const int SummaryCount = WordCount / 64;
+
+    Channel **m_pages[PageCount];
+    quint16 m_pageUsage[PageCount];
+    int m_count;
+
+    quint64 m_used[2][WordCount];
+    quint64 m_full[2][SummaryCount];
+
+    void setUsed(int identifier, bool used);
+    int findAvailable(int side, int from, int to) const;
+    int nextOpenWord(int side, int from) const;
+};
+
+}
+
+#endif
@@ -0,0 +1,122 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "ChannelTypeRegistry.h"
+#include "utils/Useful.h"
+
+using namespace Protocol;
+
+namespace {
+
+struct ChannelType
+{
+    QByteArray name;
+    QString nameString;
+    ChannelTypeRegistry::Factory factory;
+};
+
+struct Registry
+{
+    ChannelType types[ChannelTypeRegistry::MaxTypes];
+    int count = 0;
+};
+
+// Constructed on first use, because registration happens during static initialization
+Registry &registry()
+{
+    static Registry registry;
+    return registry;
+}
+
+}
+
+int ChannelTypeRegistry::registerType(const char *name, Factory factory)
+{
+    Registry &r = registry();
+    QByteArray typeName(name);
+
+    for (int i = 0; i < r.count; i++) {
+        if (r.types[i].name == typeName) {
+            BUG() << "Channel type" << typeName << "is registered more than once";
+            return i;
+        }
+    }
+
+    if (r.count >= MaxTypes) {
+        BUG() << "Too many channel types registered; increase ChannelTypeRegistry::MaxTypes for" << typeName;
+        return -1;
+    }
+
+    ChannelType &type = r.types[r.count];
+    type.name = typeName;
+    type.nameString = QString::fromLatin1(typeName);
+    type.factory = factory;
+    return r.count++;
+}
+
+int ChannelTypeRegistry::typeId(const QString &name)
+{
+    const Registry &r = registry();
+    for (int i = 0; i < r.count; i++) {
+        if (r.types[i].nameString == name)
+            return i;
+    }
+    return -1;
+}
+
+int ChannelTypeRegistry::typeId(const std::string &name)
+{
+    const Registry &r = registry();
+    for (int i = 0; i < r.count; i++) {
+        const QByteArray &typeName = r.types[i].name;
+        if (size_t(typeName.size()) == name.size() && memcmp(typeName.constData(), name.data(), name.size()) == 0)
+            return i;
+    }
+    return -1;
+}
+
+QString ChannelTypeRegistry::typeName(int typeId)
+{
+    const Registry &r = registry();
+    if (typeId < 0 || typeId >= r.count)
+        return QString();
+    return r.types[typeId].nameString;
+}
+
+Channel *ChannelTypeRegistry::create(int typeId, Channel::Direction direction, Connection *connection)
+{
+    const Registry &r = registry();
+    if (!connection || typeId < 0 || typeId >= r.count || !r.types[typeId].factory)
+        return 0;
+    return r.types[typeId].factory(direction, connection);
+}
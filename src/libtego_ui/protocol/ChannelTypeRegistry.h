@@ -0,0 +1,98 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef PROTOCOL_CHANNELTYPEREGISTRY_H
+#define PROTOCOL_CHANNELTYPEREGISTRY_H
+
+#include "Channel.h"
+
+namespace Protocol
+{
+
+/* Channel types known to this implementation
+ *
+ * Each channel type is registered once during static initialization, and is
+ * assigned a small integer identifier. Channels carry that identifier rather
+ * than their type string, and connections use it to find channels of a type
+ * without searching.
+ *
+ * Channel classes register themselves in their implementation file when
+ * defining their TypeId, e.g.:
+ *
+ *   const int ChatChannel::TypeId = ChannelTypeRegistry::registerType<ChatChannel>("im.ricochet.chat");
+ *
+ * Types registered with a factory can be created for inbound OpenChannel
+ * requests by Channel::create; types without one (like the control channel)
+ * are never created by request. Registration runs with the static
+ * initializers of the type's object file, so the class must be referenced
+ * somewhere for the linker to keep it.
+ */
+class ChannelTypeRegistry
+{
+public:
+    typedef Channel *(*Factory)(Channel::Direction direction, Connection *connection);
+
+    // Upper bound on registered types, which sizes per-connection lookup tables
+    static const int MaxTypes = 16;
+
+    static int registerType(const char *name, Factory factory);
+    template<typename T> static int registerType(const char *name);
+
+    /* Look up the identifier for a type string
+     *
+     * Returns -1 if the type is not registered.
+     */
+    static int typeId(const QString &name);
+    static int typeId(const std::string &name);
+
+    static QString typeName(int typeId);
+
+    /* Create a channel of a registered type
+     *
+     * Returns null if the type is unknown or cannot be created by request.
+     */
+    static Channel *create(int typeId, Channel::Direction direction, Connection *connection);
+};
+
+template<typename T> int ChannelTypeRegistry::registerType(const char *name)
+{
+    return registerType(name,
+        [](Channel::Direction direction, Connection *connection) -> Channel* {
+            return new T(direction, connection);
+        }
+    );
+}
+
+}
+
+#endif
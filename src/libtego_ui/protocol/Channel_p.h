@@ -47,20 +47,34 @@ class ChannelPrivate : public QObject
     Q_DECLARE_PUBLIC(Channel)
 
 public:
-    explicit ChannelPrivate(Channel *q, const QString &type, Channel::Direction direction, Connection *conn);
+    explicit ChannelPrivate(Channel *q, int typeId, Channel::Direction direction, Connection *conn);
     virtual ~ChannelPrivate();
 
     Channel *q_ptr;
     Connection *connection;
-    QString type;
+    int typeId;
     int identifier;
     Channel::Direction direction;
     bool isOpened;
     bool hasSentClose;
     bool isInvalidated;
+    // Packets are sent ahead of other channels' traffic; see ConnectionPrivate::writeQueuedPackets
+    bool isPriority;
+    // Payloads may be compressed once negotiated; cleared for data that doesn't compress
+    bool isCompressible;
+    // Set while the channel is waiting for writable; see ConnectionPrivate::isAboveWaterMark
+    bool isWriteBlocked;
+    int highWaterMark;
+    int lowWaterMark;
 
     void invalidate();
 
+    // Reserve space for an outbound packet on this channel; see ConnectionPrivate::beginPacket
+    char *beginPacket(int size);
+    void cancelPacket(char *data);
+    // Queue a packet that the connection has chosen to compress; see ConnectionPrivate::shouldCompress
+    bool sendCompressed(const char *data, int size);
+
     // Called by ControlChannel to act on valid channel request/result messages
     bool openChannelInbound(const Data::Control::OpenChannel *request, Data::Control::ChannelResult *result);
     bool openChannelOutbound(Data::Control::OpenChannel *request);
@@ -69,8 +83,9 @@ public:
 
 template<typename T> bool Channel::sendMessage(const T &message)
 {
+    Q_D(Channel);
     int size = message.ByteSize();
-    if (size > ConnectionPrivate::PacketMaxDataSize) {
+    if (size > d->connection->d->maxOutboundDataSize) {
         BUG() << "Message on" << type() << "channel is too big -" << size << "bytes:"
               << QString::fromStdString(message.DebugString());
         return false;
@@ -82,15 +97,30 @@ template<typename T> bool Channel::sendMessage(const T &message)
         return false;
     }
 
-    QByteArray packet(size, 0);
-    quint8 *end = message.SerializeWithCachedSizesToArray(reinterpret_cast<quint8*>(packet.data()));
-    quint8 *expected_end = reinterpret_cast<quint8*>(packet.data() + size);
+    if (d->isCompressible && d->connection->d->shouldCompress(size)) {
+        QByteArray data(size, Qt::Uninitialized);
+        quint8 *end = message.SerializeWithCachedSizesToArray(reinterpret_cast<quint8*>(data.data()));
+        if (end != reinterpret_cast<quint8*>(data.data() + size)) {
+            BUG() << "Unexpected packet size after message serialization. Expected" << size;
+            return false;
+        }
+        return d->sendCompressed(data.constData(), size);
+    }
+
+    // Serialize directly into the connection's write buffer
+    char *packet = d->beginPacket(size);
+    if (!packet)
+        return false;
+
+    quint8 *end = message.SerializeWithCachedSizesToArray(reinterpret_cast<quint8*>(packet));
+    quint8 *expected_end = reinterpret_cast<quint8*>(packet + size);
     if (end != expected_end) {
         BUG() << "Unexpected packet size after message serialization. Expected" << size << "but got" << qptrdiff(end - expected_end);
+        d->cancelPacket(packet);
         return false;
     }
 
-    return sendPacket(packet);
+    return true;
 }
 
 }
@@ -32,18 +32,25 @@
 
 #include "ChatChannel.h"
 #include "Channel_p.h"
+#include "ChannelTypeRegistry.h"
 #include "Connection.h"
 #include "utils/SecureRNG.h"
 #include "utils/Useful.h"
 
 using namespace Protocol;
 
+const int ChatChannel::TypeId = ChannelTypeRegistry::registerType<ChatChannel>("im.ricochet.chat");
+
 ChatChannel::ChatChannel(Direction direction, Connection *connection)
-    : Channel(QStringLiteral("im.ricochet.chat"), direction, connection)
+    : Channel(TypeId, direction, connection)
+    , batchAcknowledge(false)
+    , pendingAcknowledgements(0)
 {
     // The peer might use recent message IDs between connections to handle
     // re-send. Start at a random ID to reduce chance of collisions, then increment
     lastMessageId = SecureRNG::randomInt(UINT32_MAX);
+
+    connect(this, &Channel::channelOpened, this, &ChatChannel::earlyMessagesOpened);
 }
 
 bool ChatChannel::allowInboundChannelRequest(const Data::Control::OpenChannel *request, Data::Control::ChannelResult *result)
@@ -61,6 +68,31 @@ bool ChatChannel::allowInboundChannelRequest(const Data::Control::OpenChannel *r
         return false;
     }
 
+    // Messages sent with the request are acknowledged in the result, and
+    // delivered while the result is sent, once the channel is open; see
+    // earlyMessagesOpened. Any beyond the limit aren't acknowledged, so the
+    // peer sends them again.
+    int count = qMin(request->ExtensionSize(Data::Chat::early_message), int(MaxEarlyMessages));
+    for (int i = 0; i < count; i++) {
+        const Data::Chat::ChatMessage &message = request->GetExtension(Data::Chat::early_message, i);
+        EarlyMessage early{ QString(), QDateTime(), message.message_id(), false, false };
+        early.accepted = parseChatMessage(message, early.text, early.time);
+        if (early.accepted)
+            earlyMessages.append(early);
+
+        if (message.has_message_id()) {
+            // Early messages are always acknowledged individually in the result
+            Data::Chat::ChatAcknowledge *ack = result->AddExtension(Data::Chat::early_acknowledge);
+            ack->set_message_id(message.message_id());
+            ack->set_accepted(early.accepted);
+        }
+    }
+
+    if (request->GetExtension(Data::Chat::batch_acknowledge)) {
+        batchAcknowledge = true;
+        result->SetExtension(Data::Chat::batch_acknowledge_enabled, true);
+    }
+
     return true;
 }
 
@@ -78,21 +110,110 @@ bool ChatChannel::allowOutboundChannelRequest(Data::Control::OpenChannel *reques
         return false;
     }
 
+    foreach (const EarlyMessage &early, earlyMessages)
+        fillChatMessage(request->AddExtension(Data::Chat::early_message), early.text, early.time, early.id);
+
+    request->SetExtension(Data::Chat::batch_acknowledge, true);
+    return true;
+}
+
+bool ChatChannel::processChannelOpenResult(const Data::Control::ChannelResult *result)
+{
+    if (!result->opened())
+        return true;
+
+    batchAcknowledge = result->GetExtension(Data::Chat::batch_acknowledge_enabled);
+
+    int count = result->ExtensionSize(Data::Chat::early_acknowledge);
+    for (int i = 0; i < count; i++) {
+        const Data::Chat::ChatAcknowledge &ack = result->GetExtension(Data::Chat::early_acknowledge, i);
+        for (EarlyMessage &early : earlyMessages) {
+            if (early.id == ack.message_id() && !early.acknowledged) {
+                early.acknowledged = true;
+                early.accepted = ack.accepted();
+                break;
+            }
+        }
+    }
+
     return true;
 }
 
+void ChatChannel::earlyMessagesOpened()
+{
+    if (earlyMessages.isEmpty())
+        return;
+
+    if (direction() == Outbound) {
+        // Peers that don't support early messages ignore them; send those
+        // again now, before any later messages
+        for (auto it = earlyMessages.begin(); it != earlyMessages.end(); ) {
+            if (it->acknowledged) {
+                it++;
+                continue;
+            }
+
+            qDebug() << "Sending early chat message again after it wasn't acknowledged";
+            pendingMessages.remove(it->id);
+            if (!sendChatMessageWithId(it->text, it->time, it->id)) {
+                // Reported as rejected along with the acknowledged messages
+                qWarning() << "Failed to send early chat message again";
+                pendingMessages.insert(it->id);
+                it->acknowledged = true;
+                it->accepted = false;
+                it++;
+                continue;
+            }
+            it = earlyMessages.erase(it);
+        }
+
+        if (earlyMessages.isEmpty())
+            return;
+    }
+
+    // Handlers attach to the channel at Connection::channelOpened, which is
+    // emitted right after this. Deliver there, in the same call: the peer
+    // has the acknowledgements, so nothing may close the channel first.
+    connect(connection(), &Connection::channelOpened, this, &ChatChannel::connectionChannelOpened);
+}
+
+void ChatChannel::connectionChannelOpened(Channel *channel)
+{
+    if (channel != this)
+        return;
+
+    disconnect(connection(), &Connection::channelOpened, this, &ChatChannel::connectionChannelOpened);
+    emitEarlyMessages();
+}
+
+void ChatChannel::emitEarlyMessages()
+{
+    QList<EarlyMessage> messages;
+    messages.swap(earlyMessages);
+
+    foreach (const EarlyMessage &early, messages) {
+        if (direction() == Inbound) {
+            emit messageReceived(early.text, early.time, early.id);
+        } else if (pendingMessages.remove(early.id)) {
+            emit messageAcknowledged(early.id, early.accepted);
+        }
+    }
+}
+
 void ChatChannel::receivePacket(const QByteArray &packet)
 {
-    Data::Chat::Packet message;
-    if (!message.ParseFromArray(packet.constData(), packet.size())) {
+    // Parsing into the same message keeps its submessages and string capacity
+    if (!inboundPacket.ParseFromArray(packet.constData(), packet.size())) {
         closeChannel();
         return;
     }
 
-    if (message.has_chat_message()) {
-        handleChatMessage(message.chat_message());
-    } else if (message.has_chat_acknowledge()) {
-        handleChatAcknowledge(message.chat_acknowledge());
+    if (inboundPacket.has_chat_message()) {
+        handleChatMessage(inboundPacket.chat_message());
+    } else if (inboundPacket.has_chat_acknowledge()) {
+        handleChatAcknowledge(inboundPacket.chat_acknowledge());
+    } else if (inboundPacket.has_chat_acknowledge_batch()) {
+        handleChatAcknowledgeBatch(inboundPacket.chat_acknowledge_batch());
     } else {
         qWarning() << "Unrecognized message on" << type();
         closeChannel();
@@ -112,9 +233,6 @@ bool ChatChannel::sendChatMessageWithId(QString text, QDateTime time, MessageId
         return false;
     }
 
-    QScopedPointer<Data::Chat::ChatMessage> message(new Data::Chat::ChatMessage);
-    message->set_message_id(id);
-
     if (text.isEmpty()) {
         BUG() << "Chat message is empty, and it should've been discarded";
         return false;
@@ -123,53 +241,197 @@ bool ChatChannel::sendChatMessageWithId(QString text, QDateTime time, MessageId
         text.truncate(MessageMaxCharacters);
     }
 
-    // Also converts to UTF-8
-    message->set_message_text(text.toStdString());
+    outboundPacket.Clear();
+    fillChatMessage(outboundPacket.mutable_chat_message(), text, time, id);
 
-    if (!time.isNull())
-        message->set_time_delta(qMin(QDateTime::currentDateTime().secsTo(time), qint64(0)));
+    if (!Channel::sendMessage(outboundPacket))
+        return false;
+
+    pendingMessages.insert(id);
+    return true;
+}
+
+bool ChatChannel::attachChatMessage(QString text, QDateTime time, MessageId &id)
+{
+    id = ++lastMessageId;
+    return attachChatMessageWithId(text, time, id);
+}
+
+bool ChatChannel::attachChatMessageWithId(QString text, QDateTime time, MessageId id)
+{
+    if (direction() != Outbound || isOpened() || identifier() >= 0) {
+        BUG() << "Chat messages can only be attached to an outbound channel before it's opened";
+        return false;
+    }
 
-    Data::Chat::Packet packet;
-    packet.set_allocated_chat_message(message.take());
-    if (!Channel::sendMessage(packet))
+    if (earlyMessages.size() >= MaxEarlyMessages)
         return false;
 
+    if (text.isEmpty()) {
+        BUG() << "Chat message is empty, and it should've been discarded";
+        return false;
+    } else if (text.size() > MessageMaxCharacters) {
+        BUG() << "Chat message is too long (" << text.size() << "characters), and it should've been limited already. Truncated.";
+        text.truncate(MessageMaxCharacters);
+    }
+
+    earlyMessages.append(EarlyMessage{ text, time, id, false, false });
     pendingMessages.insert(id);
     return true;
 }
 
-void ChatChannel::handleChatMessage(const Data::Chat::ChatMessage &message)
+bool ChatChannel::isDrained() const
 {
-    QScopedPointer<Data::Chat::ChatAcknowledge> response(new Data::Chat::ChatAcknowledge);
+    return pendingMessages.isEmpty() && earlyMessages.isEmpty() && !pendingAcknowledgements;
+}
+
+/* Encode text as UTF-8 into out, reusing its capacity
+ *
+ * QString::toUtf8 always allocates a new QByteArray. Like it, this writes '?'
+ * for unpaired surrogates.
+ */
+static void encodeUtf8(const QString &text, std::string *out)
+{
+    // At most 3 bytes per UTF-16 unit; a surrogate pair takes 4 bytes for 2
+    out->resize(size_t(text.size()) * 3);
+    char *p = &(*out)[0];
+
+    const ushort *src = text.utf16();
+    const ushort *end = src + text.size();
+    while (src < end) {
+        uint c = *src++;
+        if (c < 0x80) {
+            *p++ = char(c);
+        } else if (c < 0x800) {
+            *p++ = char(0xc0 | (c >> 6));
+            *p++ = char(0x80 | (c & 0x3f));
+        } else if (!QChar::isSurrogate(c)) {
+            *p++ = char(0xe0 | (c >> 12));
+            *p++ = char(0x80 | ((c >> 6) & 0x3f));
+            *p++ = char(0x80 | (c & 0x3f));
+        } else if (QChar::isHighSurrogate(c) && src < end && QChar::isLowSurrogate(*src)) {
+            c = QChar::surrogateToUcs4(ushort(c), *src++);
+            *p++ = char(0xf0 | (c >> 18));
+            *p++ = char(0x80 | ((c >> 12) & 0x3f));
+            *p++ = char(0x80 | ((c >> 6) & 0x3f));
+            *p++ = char(0x80 | (c & 0x3f));
+        } else {
+            *p++ = '?';
+        }
+    }
+
+    out->resize(size_t(p - out->data()));
+}
+
+void ChatChannel::fillChatMessage(Data::Chat::ChatMessage *message, const QString &text, const QDateTime &time, MessageId id)
+{
+    message->set_message_id(id);
+
+    // Encode in place to reuse the string's capacity from earlier messages
+    encodeUtf8(text, message->mutable_message_text());
+
+    if (!time.isNull())
+        message->set_time_delta(qMin(QDateTime::currentDateTime().secsTo(time), qint64(0)));
+}
 
+/* Check an inbound message, and decode its text and time
+ *
+ * Returns false if the message should be rejected.
+ */
+bool ChatChannel::parseChatMessage(const Data::Chat::ChatMessage &message, QString &text, QDateTime &time)
+{
     // QString::fromStdString decodes the string as UTF-8, replacing all invalid sequences and
     // codepoints with the unicode replacement character.
-    QString text = QString::fromStdString(message.message_text());
+    text = QString::fromStdString(message.message_text());
 
     if (direction() != Inbound) {
         qWarning() << "Rejected inbound message on an outbound chat channel";
-        response->set_accepted(false);
+        return false;
     } else if (text.isEmpty()) {
         qWarning() << "Rejected empty chat message";
-        response->set_accepted(false);
+        return false;
     } else if (text.size() > MessageMaxCharacters) {
         qWarning() << "Rejected oversize chat message of" << text.size() << "characters";
-        response->set_accepted(false);
-    } else {
-        QDateTime time = QDateTime::currentDateTime();
-        if (message.has_time_delta() && message.time_delta() <= 0)
-            time = time.addSecs(message.time_delta());
+        return false;
+    }
 
+    time = QDateTime::currentDateTime();
+    if (message.has_time_delta() && message.time_delta() <= 0)
+        time = time.addSecs(message.time_delta());
+    return true;
+}
+
+void ChatChannel::handleChatMessage(const Data::Chat::ChatMessage &message)
+{
+    QString text;
+    QDateTime time;
+    bool accepted = parseChatMessage(message, text, time);
+    if (accepted)
         emit messageReceived(text, time, message.message_id());
-        response->set_accepted(true);
+
+    if (!message.has_message_id())
+        return;
+
+    if (batchAcknowledge) {
+        queueAcknowledgement(message.message_id(), accepted);
+        return;
     }
 
-    if (message.has_message_id()) {
-        response->set_message_id(message.message_id());
-        Data::Chat::Packet packet;
-        packet.set_allocated_chat_acknowledge(response.take());
-        Channel::sendMessage(packet);
+    outboundPacket.Clear();
+    Data::Chat::ChatAcknowledge *response = outboundPacket.mutable_chat_acknowledge();
+    response->set_message_id(message.message_id());
+    response->set_accepted(accepted);
+    Channel::sendMessage(outboundPacket);
+}
+
+/* Add a message to the next batch of acknowledgements
+ *
+ * Consecutive accepted IDs are merged into one range, which covers the usual
+ * case of a sender incrementing from lastMessageId. The batch is sent once
+ * control returns to the event loop, so all messages read from the socket
+ * together are acknowledged together, or when it reaches
+ * MaxPendingAcknowledgements.
+ */
+void ChatChannel::queueAcknowledgement(MessageId id, bool accepted)
+{
+    Data::Chat::ChatAcknowledgeBatch *batch = acknowledgePacket.mutable_chat_acknowledge_batch();
+
+    if (!accepted) {
+        batch->add_rejected_id(id);
+    } else {
+        int ranges = batch->accepted_size();
+        Data::Chat::AcknowledgeRange *last = ranges ? batch->mutable_accepted(ranges - 1) : nullptr;
+        if (last && MessageId(last->first_id() + last->count()) == id) {
+            last->set_count(last->count() + 1);
+        } else {
+            last = batch->add_accepted();
+            last->set_first_id(id);
+        }
+    }
+
+    if (pendingAcknowledgements++ == 0)
+        metaObject()->invokeMethod(this, "flushAcknowledgements", Qt::QueuedConnection);
+    if (pendingAcknowledgements >= MaxPendingAcknowledgements)
+        flushAcknowledgements();
+}
+
+void ChatChannel::flushAcknowledgements()
+{
+    if (!pendingAcknowledgements)
+        return;
+
+    // A closed channel can't send them; the peer sends its unacknowledged
+    // messages again on the next channel. Drop the batch, so the channel
+    // doesn't look undrained forever.
+    if (!isOpened()) {
+        acknowledgePacket.Clear();
+        pendingAcknowledgements = 0;
+        return;
     }
+
+    Channel::sendMessage(acknowledgePacket);
+    acknowledgePacket.Clear();
+    pendingAcknowledgements = 0;
 }
 
 void ChatChannel::handleChatAcknowledge(const Data::Chat::ChatAcknowledge &message)
@@ -194,3 +456,38 @@ void ChatChannel::handleChatAcknowledge(const Data::Chat::ChatAcknowledge &messa
     }
 }
 
+void ChatChannel::handleChatAcknowledgeBatch(const Data::Chat::ChatAcknowledgeBatch &message)
+{
+    if (direction() != Outbound || !batchAcknowledge) {
+        qWarning() << "Rejected unexpected batch acknowledgement on chat channel";
+        closeChannel();
+        return;
+    }
+
+    for (const Data::Chat::AcknowledgeRange &range : message.accepted()) {
+        // Ranges can only cover IDs we've sent, and there can't be more of those pending
+        if (range.count() > quint32(pendingMessages.size())) {
+            qWarning() << "Rejected chat acknowledgement for a range of" << range.count() << "messages with only"
+                       << pendingMessages.size() << "pending";
+            closeChannel();
+            return;
+        }
+
+        for (quint32 i = 0; i < range.count(); i++) {
+            MessageId id = range.first_id() + i;
+            if (pendingMessages.remove(id)) {
+                emit messageAcknowledged(id, true);
+            } else {
+                qDebug() << "Received chat acknowledgement for unknown message" << id;
+            }
+        }
+    }
+
+    for (MessageId id : message.rejected_id()) {
+        if (pendingMessages.remove(id)) {
+            emit messageAcknowledged(id, false);
+        } else {
+            qDebug() << "Received chat acknowledgement for unknown message" << id;
+        }
+    }
+}
@@ -47,12 +47,34 @@ class ChatChannel : public Channel
 public:
     typedef quint32 MessageId;
     static const int MessageMaxCharacters = 2000;
+    static const int MaxEarlyMessages = 4;
+    // Acknowledgements are sent in one batch after this many messages; see flushAcknowledgements
+    static const int MaxPendingAcknowledgements = 128;
+    static const int TypeId;
 
     explicit ChatChannel(Direction direction, Connection *connection);
 
     bool sendChatMessage(QString text, QDateTime time, MessageId &id);
     bool sendChatMessageWithId(QString text, QDateTime time, MessageId id);
 
+    /* Attach a message to the OpenChannel request of an outbound channel
+     *
+     * Only valid before openChannel. Peers that support it deliver attached
+     * messages with the request and acknowledge them in the ChannelResult,
+     * which saves a round trip after connecting. Other peers ignore them, and
+     * they are sent again once the channel is open. Either way, they are
+     * acknowledged with messageAcknowledged like any other message.
+     *
+     * Up to MaxEarlyMessages can be attached. Returns false if the message
+     * can't be attached; it should be sent after the channel opens instead.
+     */
+    bool attachChatMessage(QString text, QDateTime time, MessageId &id);
+    bool attachChatMessageWithId(QString text, QDateTime time, MessageId id);
+
+    /* Drained once every sent message is acknowledged, and every received
+     * message is delivered and acknowledged */
+    bool isDrained() const override;
+
 signals:
     void messageAcknowledged(MessageId id, bool accepted);
     void messageReceived(const QString &text, const QDateTime &time, MessageId id);
@@ -60,14 +82,44 @@ signals:
 protected:
     virtual bool allowInboundChannelRequest(const Data::Control::OpenChannel *request, Data::Control::ChannelResult *result);
     virtual bool allowOutboundChannelRequest(Data::Control::OpenChannel *request);
+    virtual bool processChannelOpenResult(const Data::Control::ChannelResult *result);
     virtual void receivePacket(const QByteArray &packet);
 
+private slots:
+    void earlyMessagesOpened();
+    void connectionChannelOpened(Protocol::Channel *channel);
+    void emitEarlyMessages();
+    void flushAcknowledgements();
+
 private:
+    // Messages attached to the OpenChannel request; see attachChatMessage
+    struct EarlyMessage {
+        QString text;
+        QDateTime time;
+        MessageId id;
+        bool acknowledged;
+        bool accepted;
+    };
+
     QSet<MessageId> pendingMessages;
+    QList<EarlyMessage> earlyMessages;
     MessageId lastMessageId;
+    // The peer acknowledges (or we acknowledge) with ChatAcknowledgeBatch
+    bool batchAcknowledge;
+    int pendingAcknowledgements;
+
+    // Reused for every packet, so steady-state traffic doesn't allocate messages
+    Data::Chat::Packet inboundPacket;
+    Data::Chat::Packet outboundPacket;
+    // Acknowledgements not yet sent, when batchAcknowledge is set
+    Data::Chat::Packet acknowledgePacket;
 
+    void fillChatMessage(Data::Chat::ChatMessage *message, const QString &text, const QDateTime &time, MessageId id);
+    bool parseChatMessage(const Data::Chat::ChatMessage &message, QString &text, QDateTime &time);
     void handleChatMessage(const Data::Chat::ChatMessage &message);
     void handleChatAcknowledge(const Data::Chat::ChatAcknowledge &message);
+    void handleChatAcknowledgeBatch(const Data::Chat::ChatAcknowledgeBatch &message);
+    void queueAcknowledgement(MessageId id, bool accepted);
 };
 
 }
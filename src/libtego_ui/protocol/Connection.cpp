@@ -31,11 +31,17 @@
  */
 
 #include "Connection_p.h"
+#include "Channel_p.h"
 #include "ControlChannel.h"
+#include "NetworkThread.h"
+#include "utils/SecureRNG.h"
 #include "utils/Useful.h"
 
 using namespace Protocol;
 
+int ConnectionPrivate::defaultAggregationWindow = 0;
+quint8 ConnectionPrivate::maximumProtocolVersion = ConnectionPrivate::ProtocolVersion2;
+
 Connection::Connection(QTcpSocket *socket, Direction direction)
     : QObject()
     , d(new ConnectionPrivate(this))
@@ -47,18 +53,52 @@ ConnectionPrivate::ConnectionPrivate(Connection *qq)
     : QObject(qq)
     , q(qq)
     , socket(0)
+    , ioWorker(0)
+    , ioClosing(false)
+    , ioWorkerPending(false)
     , direction(Connection::ClientSide)
     , purpose(Connection::Purpose::Unknown)
     , wasClosed(false)
     , handshakeDone(false)
+    , maxVersion(maximumProtocolVersion)
+    , version(0)
+    , inboundFraming(ProtocolVersion)
+    , outboundFraming(ProtocolVersion)
+    , maxOutboundDataSize(PacketMaxDataSize)
+    , readBufferStart(0)
+    , readBufferEnd(0)
+    , pendingPacketQueue(0)
+    , pendingPacketOffset(-1)
+    , writeScheduled(false)
+    , queuedBytes(0)
+    , highWaterMark(DefaultConnectionHighWaterMark)
+    , lowWaterMark(DefaultConnectionLowWaterMark)
+    , compressOutbound(false)
+    , decompressInbound(false)
+    , aggregationWindow(defaultAggregationWindow)
+    , aggregationTimer(0)
+    , keepAliveTimer(0)
+    , keepAliveInterval(DefaultKeepAliveInterval)
+    , keepAliveIdleInterval(DefaultKeepAliveInterval * KeepAliveIdleFactor)
+    , keepAliveSentAt(-1)
+    , lastReceivedAt(0)
+    , sentSinceKeepAlive(false)
+    , smoothedRtt(-1)
+    , rttVariance(-1)
+    , peerTimeoutMin(DefaultPeerTimeoutMin)
+    , peerTimeoutMax(DefaultPeerTimeoutMax)
+    , drainTimer(0)
+    , drainDeadline(-1)
     , nextOutboundChannelId(-1)
 {
+    memset(typeSlots, 0, sizeof(typeSlots));
+    memset(typeCounts, 0, sizeof(typeCounts));
     ageTimer.start();
 
-    QTimer *timeout = new QTimer(this);
+    WheelTimer *timeout = new WheelTimer(this);
     timeout->setSingleShot(true);
     timeout->setInterval(UnknownPurposeTimeout * 1000);
-    connect(timeout, &QTimer::timeout, this,
+    connect(timeout, &WheelTimer::timeout, this,
         [this,timeout]() {
             if (purpose == Connection::Purpose::Unknown) {
                 qDebug() << "Closing connection" << q << "with unknown purpose after timeout";
@@ -79,7 +119,7 @@ Connection::~Connection()
     // next event loop. Since the connection is being destructed immediately,
     // and we want to be certain that channels don't outlive it, copy the
     // list before it's cleared and delete them immediately afterwards.
-    auto channels = d->channels;
+    QList<Channel*> channels = d->channels.values();
     d->closeImmediately();
 
     // These would be deleted by QObject ownership as well, but we want to
@@ -96,6 +136,10 @@ ConnectionPrivate::~ConnectionPrivate()
 {
     // Reset q pointer, for the same reason as above
     q = 0;
+
+    // The worker belongs to the network thread, and is deleted there
+    if (ioWorker)
+        ioWorker->deleteLater();
 }
 
 Connection::Direction Connection::direction() const
@@ -105,7 +149,7 @@ Connection::Direction Connection::direction() const
 
 bool Connection::isConnected() const
 {
-    bool re = d->socket && d->socket->state() == QAbstractSocket::ConnectedState;
+    bool re = d->isSocketConnected();
     if (d->wasClosed) {
         Q_ASSERT(!re);
     }
@@ -114,12 +158,7 @@ bool Connection::isConnected() const
 
 QString Connection::serverHostname() const
 {
-    QString hostname;
-    if (direction() == ClientSide)
-        hostname = d->socket->peerName();
-    else if (direction() == ServerSide)
-        hostname = d->socket->property("localHostname").toString();
-
+    const QString &hostname = d->hostname;
     if (!hostname.endsWith(QStringLiteral(".onion"))) {
         BUG() << "Connection does not have a valid server hostname:" << hostname;
         return QString();
@@ -142,8 +181,16 @@ void ConnectionPrivate::setSocket(QTcpSocket *s, Connection::Direction d)
 
     socket = s;
     direction = d;
+
+    // Kept here, because the socket may later move to the network thread
+    if (direction == Connection::ClientSide)
+        hostname = socket->peerName();
+    else
+        hostname = socket->property("localHostname").toString();
+
     connect(socket, &QAbstractSocket::disconnected, this, &ConnectionPrivate::socketDisconnected);
     connect(socket, &QIODevice::readyRead, this, &ConnectionPrivate::socketReadable);
+    connect(socket, &QIODevice::bytesWritten, this, &ConnectionPrivate::socketBytesWritten);
 
     socket->setParent(q);
 
@@ -154,6 +201,7 @@ void ConnectionPrivate::setSocket(QTcpSocket *s, Connection::Direction d)
     Channel *control = new ControlChannel(direction == Connection::ClientSide ? Channel::Outbound : Channel::Inbound, q);
     // Closing the control channel must also close the connection
     connect(control, &Channel::invalidated, q, &Connection::close);
+    connect(static_cast<ControlChannel*>(control), &ControlChannel::keepAliveResponse, this, &ConnectionPrivate::keepAliveResponse);
     insertChannel(control);
 
     if (!control->isOpened() || control->identifier() != 0 || q->channel(0) != control) {
@@ -173,9 +221,15 @@ void ConnectionPrivate::setSocket(QTcpSocket *s, Connection::Direction d)
 
         q->grantAuthentication(Connection::HiddenServiceAuth, serverName);
 
-        // Send the introduction version handshake message
-        char intro[] = { 0x49, 0x4D, 0x02, ProtocolVersion, 0 };
-        if (socket->write(intro, sizeof(intro)) < (int)sizeof(intro)) {
+        // Send the introduction version handshake message, newest version first
+        char intro[6] = { 0x49, 0x4D, 0 };
+        int introSize = 3;
+        if (maxVersion >= ProtocolVersion2)
+            intro[introSize++] = ProtocolVersion2;
+        intro[introSize++] = ProtocolVersion;
+        intro[introSize++] = 0;
+        intro[2] = char(introSize - 3);
+        if (socket->write(intro, introSize) < introSize) {
             qDebug() << "Failed writing introduction message to socket";
             q->close();
             return;
@@ -188,20 +242,82 @@ void Connection::close()
     if (isConnected()) {
         Q_ASSERT(!d->wasClosed);
         qDebug() << "Disconnecting socket for connection" << this;
-        d->socket->disconnectFromHost();
+        if (d->keepAliveTimer)
+            d->keepAliveTimer->stop();
+        // Hand all queued packets to the socket, so they are sent before it closes
+        d->writePackets(true);
+        if (d->ioWorker) {
+            d->ioClosing = true;
+            d->ioWorker->metaObject()->invokeMethod(d->ioWorker, "disconnectFromHost", Qt::QueuedConnection);
+        } else {
+            d->socket->disconnectFromHost();
+        }
 
         // If not fully closed in 5 seconds, abort
-        QTimer *timeout = new QTimer(this);
+        WheelTimer *timeout = new WheelTimer(this);
         timeout->setSingleShot(true);
-        connect(timeout, &QTimer::timeout, d, &ConnectionPrivate::closeImmediately);
+        connect(timeout, &WheelTimer::timeout, d, &ConnectionPrivate::closeImmediately);
         timeout->start(5000);
     }
 }
 
+void Connection::closeWhenDrained(int timeout)
+{
+    if (!isConnected() || d->drainTimer)
+        return;
+
+    qDebug() << "Draining connection" << this << "before closing";
+    d->drainDeadline = d->ageTimer.elapsed() + timeout;
+    d->drainTimer = new WheelTimer(d);
+    d->drainTimer->setInterval(ConnectionPrivate::DrainCheckInterval);
+    connect(d->drainTimer, &WheelTimer::timeout, d, &ConnectionPrivate::checkDrained);
+    d->drainTimer->start();
+}
+
+bool Connection::isDraining() const
+{
+    return d->drainTimer != 0;
+}
+
+void ConnectionPrivate::checkDrained()
+{
+    if (!q->isConnected()) {
+        drainTimer->stop();
+        return;
+    }
+
+    // The peer may still be sending on this connection, and its messages
+    // are acknowledged here; wait until it has been quiet for a while
+    qint64 now = ageTimer.elapsed();
+    bool drained = now - lastReceivedAt >= DrainQuietPeriod;
+    if (drained) {
+        foreach (Channel *channel, channels.values()) {
+            if (!channel->isDrained()) {
+                drained = false;
+                break;
+            }
+        }
+    }
+
+    if (!drained) {
+        if (now < drainDeadline)
+            return;
+        qDebug() << "Connection" << q << "did not drain in time; closing it anyway";
+    }
+
+    drainTimer->stop();
+    q->close();
+}
+
 void ConnectionPrivate::closeImmediately()
 {
-    if (socket)
-        socket->abort();
+    discardQueuedPackets();
+    abortSocket();
+
+    // The worker aborts its socket later, on the network thread. Close the
+    // channels now, as the disconnected signal from a socket here would.
+    if (ioWorker)
+        socketDisconnected();
 
     if (!wasClosed) {
         BUG() << "Socket was forcefully closed but never emitted closed signal";
@@ -210,7 +326,7 @@ void ConnectionPrivate::closeImmediately()
     }
 
     if (!channels.isEmpty()) {
-        foreach (Channel *c, channels)
+        foreach (Channel *c, channels.values())
             qDebug() << "Open channel:" << c << c->type() << c->connection();
         BUG() << "Channels remain open after forcefully closing connection socket";
     }
@@ -219,6 +335,8 @@ void ConnectionPrivate::closeImmediately()
 void ConnectionPrivate::socketDisconnected()
 {
     qDebug() << "Connection" << this << "disconnected";
+    if (keepAliveTimer)
+        keepAliveTimer->stop();
     closeAllChannels();
 
     if (!wasClosed) {
@@ -234,26 +352,39 @@ void ConnectionPrivate::socketReadable()
 
         if (direction == Connection::ClientSide && available >= 1) {
             // Expecting a single byte in response with the chosen version
-            uchar version = ProtocolVersionFailed;
-            if (socket->read(reinterpret_cast<char*>(&version), 1) < 1) {
+            uchar selectedVersion = ProtocolVersionFailed;
+            if (socket->read(reinterpret_cast<char*>(&selectedVersion), 1) < 1) {
                 qDebug() << "Connection socket error" << socket->error() << "during read:" << socket->errorString();
                 socket->abort();
                 return;
             }
 
             handshakeDone = true;
-            if (version == 0) {
+            if (selectedVersion == 0) {
                 qDebug() << "Server in outbound connection is using the version 1.0 protocol";
                 emit q->oldVersionNegotiated(socket);
                 q->close();
                 return;
-            } else if (version != ProtocolVersion) {
+            } else if (selectedVersion != ProtocolVersion &&
+                       (selectedVersion != ProtocolVersion2 || maxVersion < ProtocolVersion2))
+            {
                 qDebug() << "Version negotiation failed on outbound connection";
                 emit q->versionNegotiationFailed();
                 socket->abort();
                 return;
-            } else
+            } else {
+                version = selectedVersion;
+                if (version >= ProtocolVersion2) {
+                    inboundFraming = version;
+                    if (!switchOutboundFraming())
+                        return;
+                }
+                // Peers that don't recognize a feature leave it out of their reply
+                if (ControlChannel *control = q->findChannel<ControlChannel>())
+                    control->sendEnableFeatures();
+                startKeepAlive();
                 emit q->ready();
+            }
         } else if (direction == Connection::ServerSide && available >= 3) {
             // Expecting at least 3 bytes
             uchar intro[3] = { 0 };
@@ -285,11 +416,13 @@ void ConnectionPrivate::socketReadable()
                 return;
             }
 
+            // Choose the newest version that both peers support
             quint8 selectedVersion = ProtocolVersionFailed;
             foreach (quint8 v, versions) {
-                if (v == ProtocolVersion) {
+                if (v >= ProtocolVersion && v <= maxVersion &&
+                    (selectedVersion == ProtocolVersionFailed || v > selectedVersion))
+                {
                     selectedVersion = v;
-                    break;
                 }
             }
 
@@ -301,105 +434,392 @@ void ConnectionPrivate::socketReadable()
             }
 
             handshakeDone = true;
-            if (selectedVersion != ProtocolVersion) {
+            if (selectedVersion == ProtocolVersionFailed) {
                 qDebug() << "Version negotiation failed on inbound connection";
                 emit q->versionNegotiationFailed();
                 // Close gracefully to allow the response to write
                 q->close();
                 return;
-            } else
+            } else {
+                // Inbound packets switch to the new framing at the client's marker
+                version = selectedVersion;
+                outboundFraming = selectedVersion;
+                startKeepAlive();
                 emit q->ready();
+            }
         } else {
             return;
         }
     }
 
-    qint64 available;
-    while ((available = socket->bytesAvailable()) >= PacketHeaderSize) {
-        uchar header[PacketHeaderSize];
-        // Peek at the header first, to read the size of the packet and make sure
-        // the entire thing is available within the buffer.
-        qint64 re = socket->peek(reinterpret_cast<char*>(header), PacketHeaderSize);
-        if (re < 0) {
-            qDebug() << "Connection socket error" << socket->error() << "during read:" << socket->errorString();
-            socket->abort();
-            return;
-        } else if (re < PacketHeaderSize) {
-            BUG() << "Socket had" << available << "bytes available but peek only returned" << re;
-            return;
-        }
+    // After negotiation, socket I/O optionally moves to the network thread.
+    // A server reads here until the client has switched framing, and any
+    // partial packet left in the buffer moves with the socket. This is the
+    // socket's own readyRead, so the move waits until the socket has returned
+    // to the event loop.
+    bool moveToWorker = NetworkThread::isEnabled() && inboundFraming == version;
+    if (!moveToWorker && !readPackets())
+        return;
+
+    moveToWorker = NetworkThread::isEnabled() && inboundFraming == version;
+    if (moveToWorker && isSocketConnected() && !ioWorker && !ioWorkerPending) {
+        ioWorkerPending = true;
+        metaObject()->invokeMethod(this, "startIoWorker", Qt::QueuedConnection);
+    }
+}
+
+/* Begin sending version 2 packet headers, on the client side
+ *
+ * Packets queued before the version response have version 1 headers, and
+ * some may already be written. They are all handed to the socket first,
+ * followed by a version 1 packet closing the control channel. No peer sends
+ * that otherwise, since it would end the connection, so the server uses it
+ * to find where the new headers begin.
+ *
+ * Returns false if the connection was aborted due to an error.
+ */
+bool ConnectionPrivate::switchOutboundFraming()
+{
+    writePackets(true);
 
+    char marker[PacketHeaderSize];
+    writePacketHeader(ProtocolVersion, marker, 0, 0);
+    if (!writeToSocket(marker, sizeof(marker))) {
+        abortSocket();
+        return false;
+    }
+
+    outboundFraming = version;
+    return true;
+}
+
+/* Use the largest packet size announced by a version 2 peer
+ *
+ * The limit never falls below what version 1 allows, and never grows beyond
+ * what we would accept ourselves.
+ */
+void ConnectionPrivate::setPeerMaxDataSize(quint32 size)
+{
+    if (version < ProtocolVersion2)
+        return;
+    maxOutboundDataSize = int(qBound(quint32(PacketMaxDataSize), size, quint32(LargePacketMaxDataSize)));
+}
+
+static inline int varintSize(quint32 value)
+{
+    int size = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        size++;
+    }
+    return size;
+}
+
+static inline char *writeVarint(char *p, quint32 value)
+{
+    while (value >= 0x80) {
+        *p++ = char((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    *p++ = char(value);
+    return p;
+}
+
+/* Read a varint of at most 'maxBytes' bytes
+ *
+ * Returns the number of bytes read, 0 if more than 'available' are needed, or
+ * -1 if the varint is too long.
+ */
+static inline int readVarint(const uchar *p, int available, int maxBytes, quint32 &value)
+{
+    value = 0;
+    for (int i = 0; i < maxBytes; i++) {
+        if (i >= available)
+            return 0;
+        value |= quint32(p[i] & 0x7f) << (7 * i);
+        if (!(p[i] & 0x80))
+            return i + 1;
+    }
+    return -1;
+}
+
+int ConnectionPrivate::packetHeaderSize(quint8 framing, int channelId, int dataSize)
+{
+    if (framing < ProtocolVersion2)
+        return PacketHeaderSize;
+    return varintSize(quint32(dataSize)) + varintSize(quint32(channelId));
+}
+
+void ConnectionPrivate::writePacketHeader(quint8 framing, char *header, int channelId, int dataSize)
+{
+    if (framing < ProtocolVersion2) {
+        Q_STATIC_ASSERT(PacketHeaderSize + PacketMaxDataSize <= UINT16_MAX);
         Q_STATIC_ASSERT(PacketHeaderSize == 4);
+        uchar *p = reinterpret_cast<uchar*>(header);
+        qToBigEndian(static_cast<quint16>(PacketHeaderSize + dataSize), p);
+        qToBigEndian(static_cast<quint16>(channelId), &p[2]);
+        return;
+    }
+
+    header = writeVarint(header, quint32(dataSize));
+    writeVarint(header, quint32(channelId));
+}
+
+int ConnectionPrivate::readPacketHeader(quint8 framing, const char *data, int available, int maxDataSize, int &dataSize, int &channelId)
+{
+    const uchar *header = reinterpret_cast<const uchar*>(data);
+
+    if (framing < ProtocolVersion2) {
+        if (available < PacketHeaderSize)
+            return 0;
         quint16 packetSize = qFromBigEndian<quint16>(header);
-        quint16 channelId = qFromBigEndian<quint16>(&header[2]);
+        if (packetSize < PacketHeaderSize)
+            return -1;
+        dataSize = packetSize - PacketHeaderSize;
+        channelId = qFromBigEndian<quint16>(&header[2]);
+        return PacketHeaderSize;
+    }
 
-        if (packetSize < PacketHeaderSize) {
-            qWarning() << "Corrupted data from connection (packet size is too small); disconnecting";
-            socket->abort();
-            return;
-        }
+    // Sizes up to 2^28 and identifiers up to 2^21 can be encoded, but only
+    // smaller values are valid
+    quint32 size, channel;
+    int sizeBytes = readVarint(header, available, 4, size);
+    if (sizeBytes <= 0)
+        return sizeBytes;
+    if (size > quint32(maxDataSize))
+        return -1;
 
-        if (packetSize > available)
-            break;
+    int channelBytes = readVarint(header + sizeBytes, available - sizeBytes, 3, channel);
+    if (channelBytes <= 0)
+        return channelBytes;
+    if (channel > UINT16_MAX)
+        return -1;
 
-        // Read header out of the buffer and discard
-        re = socket->read(reinterpret_cast<char*>(header), PacketHeaderSize);
-        if (re != PacketHeaderSize) {
-            if (re < 0) {
-                qDebug() << "Connection socket error" << socket->error() << "during read:" << socket->errorString();
-            } else {
-                // Because of QTcpSocket buffering, we can expect that up to 'available' bytes
-                // will read. Treat anything less as an error condition.
-                BUG() << "Socket read was unexpectedly small;" << available << "bytes should've been available but we read" << re;
-            }
+    dataSize = int(size);
+    channelId = int(channel);
+    return sizeBytes + channelBytes;
+}
+
+/* Move all available socket data into the receive buffer, and dispatch each
+ * complete packet to its channel.
+ *
+ * The socket is drained with one read per pass instead of separate reads for
+ * each header and packet, and packet data is handed to channels as slices of
+ * the buffer without copying or allocating.
+ *
+ * Returns false if the connection was aborted due to an error, or was closed
+ * by a channel while handling a packet; the rest of the data is discarded.
+ */
+bool ConnectionPrivate::readPackets()
+{
+    lastReceivedAt = ageTimer.elapsed();
+    qint64 available;
+    while ((available = socket->bytesAvailable()) > 0) {
+        if (readBuffer.isEmpty())
+            readBuffer.resize(ReadBufferSize);
+
+        // Move any partial packet to the front of the buffer to make room
+        if (readBufferStart > 0) {
+            int pending = readBufferEnd - readBufferStart;
+            if (pending > 0)
+                memmove(readBuffer.data(), readBuffer.constData() + readBufferStart, pending);
+            readBufferStart = 0;
+            readBufferEnd = pending;
+        }
+
+        qint64 space = readBuffer.size() - readBufferEnd;
+        qint64 re = socket->read(readBuffer.data() + readBufferEnd, qMin(available, space));
+        if (re < 0) {
+            qDebug() << "Connection socket error" << socket->error() << "during read:" << socket->errorString();
             socket->abort();
-            return;
+            return false;
+        } else if (re == 0) {
+            BUG() << "Socket had" << available << "bytes available but read returned nothing";
+            return true;
         }
+        readBufferEnd += re;
+
+        while (readBufferStart < readBufferEnd) {
+            int dataSize, channelId;
+            int headerSize = readPacketHeader(inboundFraming, readBuffer.constData() + readBufferStart,
+                                              readBufferEnd - readBufferStart, maxInboundDataSize(),
+                                              dataSize, channelId);
+            if (headerSize < 0) {
+                qWarning() << "Corrupted data from connection (invalid packet header); disconnecting";
+                socket->abort();
+                return false;
+            } else if (headerSize == 0) {
+                break;
+            }
 
-        // Read data
-        QByteArray data(packetSize - PacketHeaderSize, 0);
-        re = (data.size() == 0) ? 0 : socket->read(data.data(), data.size());
-        if (re != data.size()) {
-            if (re < 0) {
-                qDebug() << "Connection socket error" << socket->error() << "during read:" << socket->errorString();
-            } else {
-                // As above
-                BUG() << "Socket read was unexpectedly small;" << available << "bytes should've been available but we read" << re;
+            int packetSize = headerSize + dataSize;
+            if (packetSize > readBufferEnd - readBufferStart) {
+                // Make sure the entire packet will fit once the buffer is compacted
+                if (packetSize > readBuffer.size())
+                    readBuffer.resize(packetSize);
+                break;
             }
-            socket->abort();
-            return;
+
+            // Packet data is valid only until the buffer is next modified, which
+            // cannot happen before the channel is finished with it.
+            QByteArray data = QByteArray::fromRawData(readBuffer.constData() + readBufferStart + headerSize, dataSize);
+            readBufferStart += packetSize;
+
+            // A version 1 close of the control channel marks the client's switch
+            if (inboundFraming < version && channelId == 0 && dataSize == 0) {
+                inboundFraming = version;
+                continue;
+            }
+
+            dispatchPacket(channelId, data);
+            if (wasClosed || !isSocketConnected())
+                return false;
         }
 
-        Channel *channel = q->channel(channelId);
-        if (!channel) {
-            // XXX We should sanity-check and rate limit these responses better
-            if (data.isEmpty()) {
-                qDebug() << "Ignoring channel close message for non-existent channel" << channelId;
-            } else {
-                qDebug() << "Ignoring" << data.size() << "byte packet for non-existent channel" << channelId;
-                // Send channel close message
-                writePacket(channelId, QByteArray());
+        if (readBufferStart == readBufferEnd) {
+            readBufferStart = readBufferEnd = 0;
+            // Release memory from an unusually large packet
+            if (readBuffer.size() > ReadBufferSize) {
+                readBuffer.resize(ReadBufferSize);
+                readBuffer.squeeze();
             }
-            continue;
         }
+    }
+
+    return true;
+}
+
+/* Hand the socket to a SocketWorker on the network thread
+ *
+ * The worker reads and splits packets, and they are dispatched here by
+ * readQueuedPackets. Any partial packet in readBuffer and any data already
+ * buffered by the socket move with it.
+ */
+void ConnectionPrivate::startIoWorker()
+{
+    ioWorkerPending = false;
+    // The connection may have closed while the handover was queued
+    if (ioWorker || !socket || wasClosed || !isSocketConnected())
+        return;
+
+    disconnect(socket, 0, this, 0);
+    socket->setParent(0);
+
+    QByteArray buffered;
+    if (readBufferStart < readBufferEnd)
+        buffered = QByteArray(readBuffer.constData() + readBufferStart, readBufferEnd - readBufferStart);
+    readBuffer.clear();
+    readBufferStart = readBufferEnd = 0;
+
+    ioWorker = new SocketWorker(socket, inboundFraming, maxInboundDataSize(), buffered);
+    socket = 0;
+
+    connect(ioWorker, &SocketWorker::readable, this, &ConnectionPrivate::readQueuedPackets);
+    connect(ioWorker, &SocketWorker::bytesWritten, this, &ConnectionPrivate::socketBytesWritten);
+    connect(ioWorker, &SocketWorker::disconnected, this, &ConnectionPrivate::socketDisconnected);
 
-        if (channel->connection() != q) {
-            // If this fails, something is extremely broken. It may be dangerous to continue
-            // processing any data at all. Crash gracefully.
-            BUG() << "Channel" << channelId << "found on connection" << this << "but its connection is"
-                  << channel->connection();
-            qFatal("Connection mismatch while handling packet");
+    ioWorker->moveToThread(NetworkThread::thread());
+    ioWorker->metaObject()->invokeMethod(ioWorker, "start", Qt::QueuedConnection);
+}
+
+/* Dispatch all batches of packets queued by the network thread */
+void ConnectionPrivate::readQueuedPackets()
+{
+    if (!ioWorker)
+        return;
+
+    // Reset first, so packets queued while dispatching signal again
+    ioWorker->resetReadable();
+
+    QByteArray packets;
+    while (!wasClosed && ioWorker->takePackets(packets))
+        dispatchPackets(packets);
+}
+
+/* Dispatch a run of complete packets, which was split by SocketWorker */
+void ConnectionPrivate::dispatchPackets(const QByteArray &packets)
+{
+    lastReceivedAt = ageTimer.elapsed();
+    int offset = 0;
+    while (offset < packets.size()) {
+        int dataSize, channelId;
+        int headerSize = readPacketHeader(inboundFraming, packets.constData() + offset, packets.size() - offset,
+                                          maxInboundDataSize(), dataSize, channelId);
+        if (headerSize <= 0 || dataSize > packets.size() - offset - headerSize) {
+            BUG() << "Network thread queued an incomplete packet";
             return;
         }
 
+        QByteArray data = QByteArray::fromRawData(packets.constData() + offset + headerSize, dataSize);
+        offset += headerSize + dataSize;
+        dispatchPacket(channelId, data);
+        if (wasClosed || !isSocketConnected())
+            return;
+    }
+}
+
+void ConnectionPrivate::dispatchPacket(quint16 channelId, const QByteArray &data)
+{
+    Channel *channel = channels.value(channelId);
+    if (!channel) {
+        // XXX We should sanity-check and rate limit these responses better
         if (data.isEmpty()) {
-            channel->closeChannel();
+            qDebug() << "Ignoring channel close message for non-existent channel" << channelId;
         } else {
-            channel->receivePacket(data);
+            qDebug() << "Ignoring" << data.size() << "byte packet for non-existent channel" << channelId;
+            // Send channel close message
+            writePacket(channelId, QByteArray());
+        }
+        return;
+    }
+
+    if (channel->connection() != q) {
+        // If this fails, something is extremely broken. It may be dangerous to continue
+        // processing any data at all. Crash gracefully.
+        BUG() << "Channel" << channelId << "found on connection" << this << "but its connection is"
+              << channel->connection();
+        qFatal("Connection mismatch while handling packet");
+        return;
+    }
+
+    if (data.isEmpty()) {
+        channel->closeChannel();
+    } else if (decompressInbound && data.at(0) == CompressedPacketMarker) {
+        QByteArray payload = decompressPacket(data);
+        if (payload.isEmpty()) {
+            qWarning() << "Invalid compressed packet on channel" << channelId << "; closing channel";
+            channel->closeChannel();
+            return;
         }
+        channel->receivePacket(payload);
+    } else {
+        channel->receivePacket(data);
     }
 }
 
+/* Decompress a payload starting with CompressedPacketMarker
+ *
+ * The marker is followed by qCompress data, which begins with the
+ * uncompressed size. That size must fit in a packet, so a small packet can't
+ * declare a huge buffer, and the result must match it exactly. Returns an
+ * empty array if the payload is invalid.
+ */
+QByteArray ConnectionPrivate::decompressPacket(const QByteArray &data)
+{
+    if (data.size() < 6)
+        return QByteArray();
+
+    const uchar *compressed = reinterpret_cast<const uchar*>(data.constData()) + 1;
+    quint32 size = qFromBigEndian<quint32>(compressed);
+    if (size < 1 || size > quint32(maxInboundDataSize()))
+        return QByteArray();
+
+    QByteArray payload = qUncompress(compressed, data.size() - 1);
+    if (payload.size() != int(size))
+        return QByteArray();
+    return payload;
+}
+
 bool ConnectionPrivate::writePacket(Channel *channel, const QByteArray &data)
 {
     if (channel->connection() != q) {
@@ -410,88 +830,565 @@ bool ConnectionPrivate::writePacket(Channel *channel, const QByteArray &data)
         return false;
     }
 
-    return writePacket(channel->identifier(), data);
+    return writePacket(channel->identifier(), data, channel->d_ptr->isPriority);
+}
+
+bool ConnectionPrivate::writePacket(int channelId, const QByteArray &data, bool priority)
+{
+    char *packet = beginPacket(channelId, data.size(), priority);
+    if (!packet)
+        return false;
+
+    if (!data.isEmpty())
+        memcpy(packet, data.constData(), data.size());
+    return true;
 }
 
-bool ConnectionPrivate::writePacket(int channelId, const QByteArray &data)
+/* Reserve space for an outbound packet in the channel's queue
+ *
+ * The packet header is written immediately, and a pointer to 'size' bytes
+ * for the packet data is returned. The caller must fill the data before
+ * queueing any other packet, which allows messages to be serialized in place
+ * without an intermediate copy.
+ *
+ * Queued packets are written to the socket by writeQueuedPackets, at the
+ * next event loop turn or once the socket has room for them.
+ *
+ * Returns null if the packet cannot be sent.
+ */
+char *ConnectionPrivate::beginPacket(int channelId, int size, bool priority)
 {
     if (channelId < 0 || channelId > UINT16_MAX) {
         BUG() << "Cannot write packet for channel with invalid identifier" << channelId;
-        return false;
+        return 0;
     }
 
-    if (data.size() > PacketMaxDataSize) {
-        BUG() << "Cannot write oversized packet of" << data.size() << "bytes to channel" << channelId;
-        return false;
+    if (size < 0 || size > maxOutboundDataSize) {
+        BUG() << "Cannot write oversized packet of" << size << "bytes to channel" << channelId;
+        return 0;
     }
 
     if (!q->isConnected()) {
         qDebug() << "Cannot write packet to closed connection";
-        return false;
+        return 0;
+    }
+
+    int queueId = channels.contains(channelId) ? channelId : 0;
+    OutboundQueue &queue = outboundQueues[queueId];
+    if (priority || queueId == 0)
+        queue.isPriority = true;
+
+    // A peer we're sending to is checked sooner than an idle one
+    if (!queue.isPriority && !sentSinceKeepAlive) {
+        sentSinceKeepAlive = true;
+        if (keepAliveSentAt < 0 && keepAliveTimer && keepAliveTimer->remainingTime() > keepAliveInterval)
+            scheduleKeepAlive(keepAliveInterval);
+    }
+
+    if (queue.data.capacity() < WriteBufferSize)
+        queue.data.reserve(WriteBufferSize);
+
+    int offset = queue.data.size();
+    int headerSize = packetHeaderSize(outboundFraming, channelId, size);
+    queue.data.resize(offset + headerSize + size);
+    queue.enqueueTimes.append(ageTimer.nsecsElapsed() / 1000);
+    queuedBytes += headerSize + size;
+    writePacketHeader(outboundFraming, queue.data.data() + offset, channelId, size);
+
+    if (!queue.isActive) {
+        queue.isActive = true;
+        if (queue.isPriority)
+            priorityQueues.enqueue(queueId);
+        else
+            activeQueues.enqueue(queueId);
     }
 
-    Q_STATIC_ASSERT(PacketHeaderSize + PacketMaxDataSize <= UINT16_MAX);
-    Q_STATIC_ASSERT(PacketHeaderSize == 4);
-    uchar header[PacketHeaderSize] = { 0 };
-    qToBigEndian(static_cast<quint16>(PacketHeaderSize + data.size()), header);
-    qToBigEndian(static_cast<quint16>(channelId), &header[2]);
+    pendingPacketQueue = &queue;
+    pendingPacketOffset = offset;
+    scheduleWrite(queue.isPriority);
+    return queue.data.data() + offset + headerSize;
+}
 
-    qint64 re = socket->write(reinterpret_cast<char*>(header), PacketHeaderSize);
-    if (re != PacketHeaderSize) {
+char *ConnectionPrivate::beginPacket(Channel *channel, int size)
+{
+    if (channel->connection() != q) {
+        // As with writePacket, dangerously broken, crash the process to avoid damage
+        BUG() << "Writing packet for channel" << channel->identifier() << "on connection" << this
+              << "but its connection is" << channel->connection();
+        qFatal("Connection mismatch while writing packet");
+        return 0;
+    }
+
+    return beginPacket(channel->identifier(), size, channel->d_ptr->isPriority);
+}
+
+/* Remove the most recent packet from beginPacket, if it couldn't be completed */
+void ConnectionPrivate::cancelPacket(char *data)
+{
+    OutboundQueue *queue = pendingPacketQueue;
+    int offset = pendingPacketOffset;
+    int dataOffset = queue ? int(data - queue->data.constData()) : -1;
+    if (!queue || offset < queue->head || dataOffset <= offset || dataOffset > queue->data.size()) {
+        BUG() << "Cancelled packet isn't in an outbound queue";
+        return;
+    }
+
+    queuedBytes -= queue->data.size() - offset;
+    queue->data.resize(offset);
+    queue->enqueueTimes.removeLast();
+    pendingPacketQueue = 0;
+}
+
+/* Arrange for queued packets to be written
+ *
+ * Packets are normally written at the next event loop turn. With an
+ * aggregation window, non-priority packets wait for the window to pass,
+ * unless at least a cell's worth of data is queued.
+ */
+void ConnectionPrivate::scheduleWrite(bool priority)
+{
+    if (writeScheduled)
+        return;
+
+    if (!priority && aggregationWindow > 0 && queuedBytes < CellPayloadSize) {
+        if (!aggregationTimer) {
+            aggregationTimer = new QTimer(this);
+            aggregationTimer->setSingleShot(true);
+            aggregationTimer->setTimerType(Qt::PreciseTimer);
+            connect(aggregationTimer, &QTimer::timeout, this, &ConnectionPrivate::writeQueuedPackets);
+        }
+        // The window starts with the oldest held packet, so it bounds latency
+        if (!aggregationTimer->isActive())
+            aggregationTimer->start(aggregationWindow);
+        return;
+    }
+
+    writeScheduled = true;
+    metaObject()->invokeMethod(this, "writeQueuedPackets", Qt::QueuedConnection);
+}
+
+void ConnectionPrivate::writeQueuedPackets()
+{
+    writeScheduled = false;
+    writePackets(false);
+}
+
+void ConnectionPrivate::socketBytesWritten()
+{
+    if (!activeQueues.isEmpty() || !priorityQueues.isEmpty())
+        writePackets(false);
+    else if (!blockedChannels.isEmpty())
+        updateWritableChannels();
+}
+
+/* Move queued packets from the outbound queues to the socket
+ *
+ * Priority queues are written completely, in the order they became active.
+ * The remaining queues are served by deficit round robin: each turn a queue
+ * is given SchedulerQuantum more bytes of allowance and writes whole packets
+ * until the next one doesn't fit. This shares the connection between channels
+ * by bytes rather than by packets, so one channel sending large packets can't
+ * delay small interactive packets by more than a round.
+ *
+ * Round robin stops once the socket holds SocketWriteBudget bytes, and resumes
+ * when it reports bytesWritten, so the queues (and not the socket's buffer)
+ * decide the order of packets. With 'ignoreBudget', everything is written.
+ */
+void ConnectionPrivate::writePackets(bool ignoreBudget)
+{
+    pendingPacketQueue = 0;
+    if (aggregationTimer)
+        aggregationTimer->stop();
+    if (activeQueues.isEmpty() && priorityQueues.isEmpty())
+        return;
+
+    if (!isSocketConnected()) {
+        qDebug() << "Discarding packets queued for closed connection";
+        discardQueuedPackets();
+        return;
+    }
+
+    bool ok = true;
+    const qint64 unlimited = LLONG_MAX;
+    const qint64 startQueuedBytes = queuedBytes;
+
+    while (ok && !priorityQueues.isEmpty()) {
+        auto it = outboundQueues.find(priorityQueues.dequeue());
+        if (it == outboundQueues.end())
+            continue;
+
+        qint64 deficit = unlimited, budget = unlimited;
+        it->isActive = false;
+        ok = writeFromQueue(*it, deficit, budget);
+    }
+
+    qint64 budget = ignoreBudget ? unlimited : SocketWriteBudget - socketBytesToWrite();
+    while (ok && budget > 0 && !activeQueues.isEmpty()) {
+        int id = activeQueues.dequeue();
+        auto it = outboundQueues.find(id);
+        if (it == outboundQueues.end())
+            continue;
+
+        it->deficit += SchedulerQuantum;
+        ok = writeFromQueue(*it, it->deficit, budget);
+
+        if (it->isEmpty()) {
+            it->isActive = false;
+            it->deficit = 0;
+        } else {
+            activeQueues.enqueue(id);
+        }
+    }
+
+    if (!ok) {
+        discardQueuedPackets();
+        abortSocket();
+        return;
+    }
+
+    if (qint64 written = startQueuedBytes - queuedBytes) {
+        cellStats.writes++;
+        cellStats.cells += (written + CellPayloadSize - 1) / CellPayloadSize;
+    }
+
+    if (ioWorker && !ioWriteBuffer.isEmpty())
+        ioWorker->write(std::move(ioWriteBuffer));
+
+    if (!blockedChannels.isEmpty())
+        updateWritableChannels();
+}
+
+/* Write whole packets from the front of a queue to the socket
+ *
+ * Packets are written while they fit within 'deficit' and 'budget' remains,
+ * and both are reduced by the bytes written. Returns false on socket error.
+ */
+bool ConnectionPrivate::writeFromQueue(OutboundQueue &queue, qint64 &deficit, qint64 &budget)
+{
+    qint64 now = ageTimer.nsecsElapsed() / 1000;
+    int start = queue.head;
+
+    while (queue.head < queue.data.size() && budget > 0) {
+        int dataSize, channelId;
+        int headerSize = readPacketHeader(outboundFraming, queue.data.constData() + queue.head,
+                                          queue.data.size() - queue.head, maxOutboundDataSize,
+                                          dataSize, channelId);
+        if (headerSize <= 0) {
+            BUG() << "Invalid packet header in outbound queue";
+            return false;
+        }
+
+        int size = headerSize + dataSize;
+        if (size > deficit)
+            break;
+
+        qint64 wait = now - queue.enqueueTimes.at(queue.timesHead++);
+        queue.stats.sentPackets++;
+        queue.stats.sentBytes += size;
+        queue.stats.totalWaitUsecs += wait;
+        queue.stats.maxWaitUsecs = qMax(queue.stats.maxWaitUsecs, wait);
+        cellStats.packets++;
+        cellStats.headerBytes += headerSize;
+        cellStats.unaggregatedCells += (size + CellPayloadSize - 1) / CellPayloadSize;
+
+        queue.head += size;
+        deficit -= size;
+        budget -= size;
+    }
+
+    if (queue.head > start) {
+        qint64 length = queue.head - start;
+        queuedBytes -= length;
+        if (!writeToSocket(queue.data.constData() + start, length))
+            return false;
+    }
+
+    if (queue.isEmpty()) {
+        // Keep the reserved capacity, unless a burst made it unusually large
+        if (queue.data.capacity() > WriteBufferSize * 16)
+            queue.data.clear();
+        else
+            queue.data.resize(0);
+        queue.enqueueTimes.resize(0);
+        queue.head = queue.timesHead = 0;
+    } else if (queue.head >= WriteBufferSize && queue.head > queue.data.size() / 2) {
+        queue.data.remove(0, queue.head);
+        queue.enqueueTimes.remove(0, queue.timesHead);
+        queue.head = queue.timesHead = 0;
+    }
+
+    return true;
+}
+
+void ConnectionPrivate::discardQueuedPackets()
+{
+    for (auto it = outboundQueues.begin(); it != outboundQueues.end(); it++) {
+        it->data.clear();
+        it->enqueueTimes.clear();
+        it->head = it->timesHead = 0;
+        it->deficit = 0;
+        it->isActive = false;
+    }
+
+    priorityQueues.clear();
+    activeQueues.clear();
+    pendingPacketQueue = 0;
+    queuedBytes = 0;
+    blockedChannels.clear();
+}
+
+/* Remove the outbound queue of a channel that was removed from the connection
+ *
+ * Packets still waiting in the queue, including the channel close message,
+ * move to the end of queue 0. They will be written before any later control
+ * message, so the identifier can be reused safely.
+ */
+void ConnectionPrivate::releaseOutboundQueue(int channelId)
+{
+    if (channelId <= 0 || !outboundQueues.contains(channelId))
+        return;
+
+    OutboundQueue &control = outboundQueues[0];
+    auto it = outboundQueues.find(channelId);
+
+    if (!it->isEmpty()) {
+        control.isPriority = true;
+        control.data.append(it->data.constData() + it->head, it->data.size() - it->head);
+        control.enqueueTimes += it->enqueueTimes.mid(it->timesHead);
+        if (!control.isActive) {
+            control.isActive = true;
+            priorityQueues.enqueue(0);
+        }
+        scheduleWrite();
+    }
+
+    if (it->isActive) {
+        if (it->isPriority)
+            priorityQueues.removeAll(channelId);
+        else
+            activeQueues.removeAll(channelId);
+    }
+
+    if (pendingPacketQueue == &it.value())
+        pendingPacketQueue = 0;
+    outboundQueues.erase(it);
+}
+
+/* Bytes waiting to be sent on the connection, queued or in the socket */
+qint64 ConnectionPrivate::pendingBytes() const
+{
+    return queuedBytes + socketBytesToWrite();
+}
+
+bool ConnectionPrivate::isSocketConnected() const
+{
+    if (ioWorker)
+        return !ioClosing && ioWorker->isConnected();
+    return socket && socket->state() == QAbstractSocket::ConnectedState;
+}
+
+qint64 ConnectionPrivate::socketBytesToWrite() const
+{
+    if (ioWorker)
+        return ioWorker->bytesToWrite() + ioWriteBuffer.size();
+    return socket ? socket->bytesToWrite() : 0;
+}
+
+/* Write to the socket, or collect data to hand to the network thread */
+bool ConnectionPrivate::writeToSocket(const char *data, qint64 length)
+{
+    if (ioWorker) {
+        ioWriteBuffer.append(data, int(length));
+        return true;
+    }
+
+    if (socket->write(data, length) != length) {
         qDebug() << "Connection socket error" << socket->error() << "during write:" << socket->errorString();
-        socket->abort();
         return false;
     }
+    return true;
+}
 
-    re = socket->write(data);
-    if (re != data.size()) {
-        qDebug() << "Connection socket error" << socket->error() << "during write:" << socket->errorString();
+void ConnectionPrivate::abortSocket()
+{
+    if (ioWorker) {
+        ioClosing = true;
+        ioWorker->metaObject()->invokeMethod(ioWorker, "abort", Qt::QueuedConnection);
+    } else if (socket) {
         socket->abort();
-        return false;
     }
+}
+
+int ConnectionPrivate::channelQueuedBytes(int channelId) const
+{
+    auto it = outboundQueues.constFind(channelId);
+    if (it == outboundQueues.constEnd())
+        return 0;
+    return it->data.size() - it->head;
+}
 
+/* Check whether a channel should stop writing, and block it if so
+ *
+ * Once blocked, a channel stays blocked until updateWritableChannels finds
+ * both the connection and the channel below their low water marks.
+ */
+bool ConnectionPrivate::isAboveWaterMark(Channel *channel)
+{
+    ChannelPrivate *cd = channel->d_ptr.data();
+    if (cd->isWriteBlocked)
+        return true;
+
+    if (pendingBytes() <= highWaterMark && channelQueuedBytes(cd->identifier) <= cd->highWaterMark)
+        return false;
+
+    cd->isWriteBlocked = true;
+    blockedChannels.append(cd->identifier);
     return true;
 }
 
-int ConnectionPrivate::availableOutboundChannelId()
+/* Unblock channels that have drained below their low water marks
+ *
+ * Channels are unblocked (and emit writable) in the order they were blocked.
+ * Handlers may queue more packets, so the connection's mark is checked again
+ * before each channel.
+ */
+void ConnectionPrivate::updateWritableChannels()
 {
-    // Server opens even-nubmered channels, client opens odd-numbered
-    bool evenNumbered = (direction == Connection::ServerSide);
-    const int minId = evenNumbered ? 2 : 1;
-    const int maxId = evenNumbered ? (UINT16_MAX-1) : UINT16_MAX;
+    for (int i = 0; i < blockedChannels.size(); ) {
+        if (pendingBytes() > lowWaterMark)
+            return;
 
-    if (nextOutboundChannelId < minId || nextOutboundChannelId > maxId)
-        nextOutboundChannelId = minId;
+        Channel *channel = channels.value(blockedChannels[i]);
+        if (channel && channelQueuedBytes(blockedChannels[i]) > channel->d_ptr->lowWaterMark) {
+            i++;
+            continue;
+        }
 
-    // Find an unused id, trying a maximum of 100 times, using a random step to avoid collision
-    for (int i = 0; i < 100 && channels.contains(nextOutboundChannelId); i++) {
-        nextOutboundChannelId += 1 + (QRandomGenerator::global()->bounded(200));
-        if (evenNumbered)
-            nextOutboundChannelId += nextOutboundChannelId % 2;
-        if (nextOutboundChannelId > maxId)
-            nextOutboundChannelId = minId;
+        blockedChannels.remove(i);
+        if (channel) {
+            channel->d_ptr->isWriteBlocked = false;
+            emit channel->writable();
+            // Handlers can close channels and change the list; start over
+            i = 0;
+        }
     }
+}
 
-    if (channels.contains(nextOutboundChannelId)) {
-        // Abort the connection if we still couldn't find an id, because it's probably a nasty bug
-        BUG() << "Can't find an available outbound channel ID for connection; aborting connection";
-        socket->abort();
-        return -1;
+void ConnectionPrivate::startKeepAlive()
+{
+    if (keepAliveInterval <= 0)
+        return;
+
+    if (!keepAliveTimer) {
+        keepAliveTimer = new WheelTimer(this);
+        keepAliveTimer->setSingleShot(true);
+        connect(keepAliveTimer, &WheelTimer::timeout, this, &ConnectionPrivate::keepAliveTimeout);
+    }
+
+    lastReceivedAt = ageTimer.elapsed();
+    scheduleKeepAlive(keepAliveInterval);
+}
+
+void ConnectionPrivate::scheduleKeepAlive(int msecs)
+{
+    if (keepAliveTimer)
+        keepAliveTimer->start(msecs);
+}
+
+/* Time to wait for the peer after sending a KeepAlive
+ *
+ * This is four times the retransmission timeout that TCP would use
+ * (srtt + 4 * rttvar), because onion circuits often stall for a few seconds
+ * without failing.
+ */
+int ConnectionPrivate::peerTimeout() const
+{
+    if (smoothedRtt < 0)
+        return peerTimeoutMax / 2;
+    return qBound(peerTimeoutMin, 4 * (smoothedRtt + 4 * rttVariance), peerTimeoutMax);
+}
+
+void ConnectionPrivate::keepAliveTimeout()
+{
+    if (!q->isConnected() || keepAliveInterval <= 0)
+        return;
+
+    qint64 now = ageTimer.elapsed();
+    if (keepAliveSentAt < 0) {
+        ControlChannel *control = q->findChannel<ControlChannel>();
+        if (!control)
+            return;
+        control->keepAlive();
+        keepAliveSentAt = now;
+        scheduleKeepAlive(peerTimeout());
+        return;
+    }
+
+    // Any packet from the peer shows it is still there
+    qint64 silence = now - qMax(keepAliveSentAt, lastReceivedAt);
+    if (silence < peerTimeout()) {
+        scheduleKeepAlive(int(peerTimeout() - silence));
+        return;
     }
 
-    if (nextOutboundChannelId < minId || nextOutboundChannelId > maxId) {
-        BUG() << "Selected a channel id that isn't within range";
+    qDebug() << "Peer on connection" << q << "hasn't responded for" << silence << "ms; aborting connection";
+    keepAliveSentAt = -1;
+    discardQueuedPackets();
+    abortSocket();
+}
+
+void ConnectionPrivate::keepAliveResponse()
+{
+    // Responses to KeepAlive messages sent by others aren't timed
+    if (keepAliveSentAt < 0)
+        return;
+
+    int sample = int(ageTimer.elapsed() - keepAliveSentAt);
+    keepAliveSentAt = -1;
+    if (smoothedRtt < 0) {
+        smoothedRtt = sample;
+        rttVariance = sample / 2;
+    } else {
+        rttVariance = (3 * rttVariance + qAbs(smoothedRtt - sample)) / 4;
+        smoothedRtt = (7 * smoothedRtt + sample) / 8;
+    }
+
+    // Back off while idle, with some jitter so idle connections don't synchronize
+    int interval;
+    if (sentSinceKeepAlive) {
+        interval = keepAliveInterval;
+        keepAliveIdleInterval = keepAliveInterval * KeepAliveIdleFactor;
+    } else {
+        interval = keepAliveIdleInterval;
+        keepAliveIdleInterval = qMin(keepAliveIdleInterval * 2, keepAliveInterval * KeepAliveMaxFactor);
+    }
+    interval -= int(SecureRNG::randomInt(unsigned(interval / 8) + 1));
+    sentSinceKeepAlive = false;
+    scheduleKeepAlive(interval);
+
+    emit q->roundTripTimeChanged(smoothedRtt);
+}
+
+int ConnectionPrivate::availableOutboundChannelId()
+{
+    // Server opens even-numbered channels, client opens odd-numbered
+    bool evenNumbered = (direction == Connection::ServerSide);
+
+    // Search onwards from the last identifier used, so that recently closed
+    // identifiers aren't reused while the peer might still refer to them.
+    int id = channels.nextAvailable(evenNumbered, nextOutboundChannelId);
+    if (id < 0) {
+        qWarning() << "All outbound channel identifiers are in use on connection" << this;
         return -1;
     }
 
-    if (evenNumbered == bool(nextOutboundChannelId % 2)) {
-        BUG() << "Selected a channel id that isn't valid for this side of the connection";
+    if (id < 1 || id > UINT16_MAX || evenNumbered == bool(id % 2)) {
+        BUG() << "Selected a channel id that isn't valid for this side of the connection:" << id;
         return -1;
     }
 
-    int re = nextOutboundChannelId;
-    nextOutboundChannelId += 2;
-    return re;
+    nextOutboundChannelId = id + 2;
+    return id;
 }
 
 bool ConnectionPrivate::isValidAvailableChannelId(int id, Connection::Direction side)
@@ -533,6 +1430,7 @@ bool ConnectionPrivate::insertChannel(Channel *channel)
     }
 
     channels.insert(channel->identifier(), channel);
+    addTypeSlot(channel);
     return true;
 }
 
@@ -543,29 +1441,70 @@ void ConnectionPrivate::removeChannel(Channel *channel)
         return;
     }
 
-    // Out of caution, find the channel by pointer instead of identifier. This will make sure
-    // it's always removed from the list, even if the identifier was somehow reset or lost.
-    for (auto it = channels.begin(); it != channels.end(); ) {
-        if (*it == channel)
-            it = channels.erase(it);
-        else
-            it++;
+    // Out of caution, make sure the channel is removed by pointer, even if the
+    // identifier was somehow reset or lost.
+    bool removed;
+    if (channels.value(channel->identifier()) == channel)
+        removed = channels.take(channel->identifier()) != 0;
+    else
+        removed = channels.remove(channel);
+
+    if (removed) {
+        removeTypeSlot(channel);
+        releaseOutboundQueue(channel->identifier());
+        blockedChannels.removeAll(channel->identifier());
+    }
+}
+
+void ConnectionPrivate::addTypeSlot(Channel *channel)
+{
+    int type = channel->typeId();
+    int dir = channel->direction();
+    if (type < 0 || type >= ChannelTypeRegistry::MaxTypes || (dir != Channel::Inbound && dir != Channel::Outbound)) {
+        BUG() << "Inserted channel with unregistered type or invalid direction" << type << dir;
+        return;
+    }
+
+    if (!typeSlots[type][dir])
+        typeSlots[type][dir] = channel;
+    typeCounts[type][dir]++;
+}
+
+void ConnectionPrivate::removeTypeSlot(Channel *channel)
+{
+    int type = channel->typeId();
+    int dir = channel->direction();
+    if (type < 0 || type >= ChannelTypeRegistry::MaxTypes || (dir != Channel::Inbound && dir != Channel::Outbound))
+        return;
+
+    typeCounts[type][dir]--;
+    if (typeSlots[type][dir] != channel)
+        return;
+
+    typeSlots[type][dir] = 0;
+    if (typeCounts[type][dir] > 0) {
+        foreach (Channel *c, channels.values()) {
+            if (c->typeId() == type && c->direction() == dir) {
+                typeSlots[type][dir] = c;
+                break;
+            }
+        }
     }
 }
 
 void ConnectionPrivate::closeAllChannels()
 {
     // Takes a copy, won't be broken by removeChannel calls
-    foreach (Channel *channel, channels)
+    foreach (Channel *channel, channels.values())
         channel->closeChannel();
 
     if (!channels.isEmpty())
         BUG() << "Channels remain open on connection after calling closeAllChannels";
 }
 
-QHash<int,Channel*> Connection::channels()
+QList<Channel*> Connection::channels()
 {
-    return d->channels;
+    return d->channels.values();
 }
 
 Channel *Connection::channel(int identifier)
@@ -573,6 +1512,125 @@ Channel *Connection::channel(int identifier)
     return d->channels.value(identifier);
 }
 
+void Connection::setWriteWaterMarks(int high, int low)
+{
+    if (low < 0 || high < low) {
+        BUG() << "Invalid water marks for connection:" << high << low;
+        return;
+    }
+
+    d->highWaterMark = high;
+    d->lowWaterMark = low;
+    if (!d->blockedChannels.isEmpty())
+        d->updateWritableChannels();
+}
+
+qint64 Connection::bytesToWrite() const
+{
+    return d->pendingBytes();
+}
+
+void Connection::setAggregationWindow(int msecs)
+{
+    d->aggregationWindow = qMax(0, msecs);
+    if (d->aggregationWindow == 0 && d->aggregationTimer && d->aggregationTimer->isActive())
+        d->scheduleWrite();
+}
+
+int Connection::aggregationWindow() const
+{
+    return d->aggregationWindow;
+}
+
+void Connection::setDefaultAggregationWindow(int msecs)
+{
+    ConnectionPrivate::defaultAggregationWindow = qMax(0, msecs);
+}
+
+int Connection::roundTripTime() const
+{
+    return d->smoothedRtt;
+}
+
+int Connection::roundTripTimeVariance() const
+{
+    return d->rttVariance;
+}
+
+void Connection::setKeepAliveInterval(int msecs)
+{
+    d->keepAliveInterval = qMax(0, msecs);
+    d->keepAliveIdleInterval = d->keepAliveInterval * ConnectionPrivate::KeepAliveIdleFactor;
+    d->keepAliveSentAt = -1;
+
+    if (d->keepAliveInterval == 0) {
+        if (d->keepAliveTimer)
+            d->keepAliveTimer->stop();
+    } else if (d->handshakeDone && isConnected()) {
+        d->startKeepAlive();
+    }
+}
+
+void Connection::setPeerTimeout(int minMsecs, int maxMsecs)
+{
+    d->peerTimeoutMin = qMax(1, minMsecs);
+    d->peerTimeoutMax = qMax(d->peerTimeoutMin, maxMsecs);
+}
+
+Connection::CellStats Connection::cellStats() const
+{
+    return d->cellStats;
+}
+
+int Connection::protocolVersion() const
+{
+    return d->version;
+}
+
+int Connection::maxPacketSize() const
+{
+    return d->maxOutboundDataSize;
+}
+
+void Connection::setMaximumProtocolVersion(int version)
+{
+    ConnectionPrivate::maximumProtocolVersion = quint8(qBound(int(ConnectionPrivate::ProtocolVersion), version,
+                                                              int(ConnectionPrivate::ProtocolVersion2)));
+}
+
+bool Connection::isCompressionEnabled() const
+{
+    return d->compressOutbound;
+}
+
+Connection::QueueStats Connection::queueStats(int identifier) const
+{
+    auto it = d->outboundQueues.constFind(identifier);
+    if (it == d->outboundQueues.constEnd())
+        return QueueStats();
+
+    QueueStats stats = it->stats;
+    stats.queuedBytes = it->data.size() - it->head;
+    stats.queuedPackets = it->enqueueTimes.size() - it->timesHead;
+    return stats;
+}
+
+Channel *Connection::channelOfType(int typeId, Channel::Direction direction)
+{
+    if (typeId < 0 || typeId >= ChannelTypeRegistry::MaxTypes)
+        return 0;
+
+    if (direction == Channel::Invalid) {
+        if (Channel *c = d->typeSlots[typeId][Channel::Inbound])
+            return c;
+        return d->typeSlots[typeId][Channel::Outbound];
+    }
+
+    if (direction != Channel::Inbound && direction != Channel::Outbound)
+        return 0;
+    return d->typeSlots[typeId][direction];
+}
+
 Connection::Purpose Connection::purpose() const
 {
     return d->purpose;
@@ -131,11 +131,129 @@ public:
     Purpose purpose() const;
     bool setPurpose(Purpose purpose);
 
-    QHash<int,Channel*> channels();
+    /* All channels on this connection, ordered by identifier */
+    QList<Channel*> channels();
     Channel *channel(int identifier);
     template<typename T> T *findChannel(Channel::Direction direction = Channel::Invalid);
     template<typename T> QList<T*> findChannels(Channel::Direction direction = Channel::Invalid);
 
+    /* Statistics for the outbound queue of a channel
+     *
+     * Outbound packets are queued per channel and written to the socket by a
+     * scheduler, which sends control and authentication traffic first and
+     * shares the rest fairly between channels. Wait time is measured from
+     * queueing a packet until it is handed to the socket.
+     */
+    struct QueueStats
+    {
+        int queuedPackets = 0;
+        int queuedBytes = 0;
+        quint64 sentPackets = 0;
+        quint64 sentBytes = 0;
+        qint64 totalWaitUsecs = 0;
+        qint64 maxWaitUsecs = 0;
+    };
+
+    /* Queue statistics for the channel with 'identifier'
+     *
+     * Statistics are reset when the channel is removed from the connection.
+     */
+    QueueStats queueStats(int identifier) const;
+
+    /* Bytes waiting to be sent, in the outbound queues or the socket */
+    qint64 bytesToWrite() const;
+
+    /* Set the water marks for bytes waiting to be sent on this connection
+     *
+     * Channels stop being writable when more than 'high' bytes are waiting to
+     * be sent, and resume when it is at or below 'low'. Each channel also has
+     * its own marks for its queue; see Channel::canWrite.
+     */
+    void setWriteWaterMarks(int high, int low);
+
+    /* Hold small outbound packets to share Tor cells
+     *
+     * Onion streams send data in cells of about 500 bytes, so many small
+     * packets written separately waste most of each cell. With a window of
+     * 'msecs', packets on ordinary channels wait up to that long for more to
+     * be written with them. They are sent early when a cell is full, or when
+     * a control or authentication packet is sent.
+     *
+     * The window is 0 (disabled) unless set by setDefaultAggregationWindow.
+     */
+    void setAggregationWindow(int msecs);
+    int aggregationWindow() const;
+    static void setDefaultAggregationWindow(int msecs);
+
+    /* Smoothed round trip time to the peer, in milliseconds
+     *
+     * This is measured with KeepAlive messages, which are sent periodically
+     * once the connection is ready. Returns -1 until the first response.
+     */
+    int roundTripTime() const;
+    int roundTripTimeVariance() const;
+
+    /* Set the interval for KeepAlive messages while sending, in milliseconds
+     *
+     * Idle connections use longer intervals, which back off up to 90 times
+     * this. An interval of 0 disables KeepAlive messages, and with them
+     * round trip time measurement and dead peer detection.
+     */
+    void setKeepAliveInterval(int msecs);
+
+    /* Set the bounds of the time to wait for a response from the peer
+     *
+     * When nothing is received for this long after sending a KeepAlive, the
+     * peer is considered dead and the connection is aborted. The timeout is
+     * derived from the round trip time, and limited to these bounds.
+     */
+    void setPeerTimeout(int minMsecs, int maxMsecs);
+
+    /* Estimated Tor cells used for outbound data
+     *
+     * 'cells' assumes each write to the socket is packed into its own cells,
+     * and 'unaggregatedCells' that each packet is. The difference is an
+     * estimate of the cells saved by writing packets together.
+     */
+    struct CellStats
+    {
+        quint64 packets = 0;
+        // Bytes of packet headers, which depend on the protocol version
+        quint64 headerBytes = 0;
+        quint64 writes = 0;
+        quint64 cells = 0;
+        quint64 unaggregatedCells = 0;
+
+        quint64 cellsSaved() const { return unaggregatedCells - cells; }
+    };
+
+    CellStats cellStats() const;
+
+    /* Protocol version negotiated with the peer, or 0 until negotiation has finished
+     *
+     * Version 2 uses varint packet headers, which are 2 bytes for most small
+     * packets, and allows packets larger than 64 KiB once the peer has
+     * announced the size it accepts. Peers with version 1 still interoperate.
+     */
+    int protocolVersion() const;
+
+    /* Largest packet data that can currently be sent on this connection */
+    int maxPacketSize() const;
+
+    /* Newest protocol version offered or accepted by new connections
+     *
+     * The default is 2. Setting 1 turns off version 2 for later connections.
+     */
+    static void setMaximumProtocolVersion(int version);
+
+    /* Whether larger payloads sent on this connection are compressed
+     *
+     * Compression is offered by the client side after version negotiation,
+     * and enabled once the peer accepts it. Peers that don't support it
+     * continue to use uncompressed payloads.
+     */
+    bool isCompressionEnabled() const;
+
     enum AuthenticationType {
         HiddenServiceAuth,
         KnownToPeer // For outbound connections, set when the peer indicates we are a known contact
@@ -146,6 +264,18 @@ public:
     QString authenticatedIdentity(AuthenticationType type) const;
     void grantAuthentication(AuthenticationType type, const QString &identity = QString());
 
+    /* Close this connection once it has finished its work with the peer
+     *
+     * Used for a connection that was replaced by another to the same peer.
+     * Nothing new should be sent on it, but traffic that is in flight in
+     * either direction is still delivered and acknowledged. The connection
+     * closes once every channel is drained (see Channel::isDrained) and
+     * nothing has been received for a moment, or after 'timeout'
+     * milliseconds at most.
+     */
+    void closeWhenDrained(int timeout);
+    bool isDraining() const;
+
 public slots:
     /* Close this connection and the underlying socket
      *
@@ -167,6 +297,10 @@ signals:
     /* Emitted once, after version negotiation has finished and the connection
      * is ready to use. If negotiation fails, the versionNegotiationFailed
      * signal is emitted instead, and the socket is closed.
+     *
+     * A ClientSide connection may open channels before this; their packets
+     * are sent right after the introduction, and a peer using the current
+     * version handles them once it has answered. See OutboundConnector::setPipelined.
      */
     void ready();
     /* Emitted once when version negotiation has failed; meaning, there is no
@@ -177,6 +311,8 @@ signals:
      * XXX: Remove this once enough time has passed for most clients to be upgraded.
      */
     void oldVersionNegotiated(QTcpSocket *socket);
+    /* Emitted when a new round trip time sample has been measured */
+    void roundTripTimeChanged(int msecs);
 
     void authenticated(AuthenticationType type, const QString &identity);
     void purposeChanged(Purpose after, Purpose before);
@@ -209,29 +345,24 @@ signals:
 
 private:
     ConnectionPrivate *d;
+
+    Channel *channelOfType(int typeId, Channel::Direction direction);
 };
 
 template<typename T> T *Connection::findChannel(Channel::Direction direction)
 {
-    T *re = 0;
-    foreach (Channel *c, channels()) {
-        if (direction != Channel::Invalid && c->direction() != direction)
-            continue;
-        if ((re = qobject_cast<T*>(c)))
-            return re;
-    }
-    return 0;
+    return static_cast<T*>(channelOfType(T::TypeId, direction));
 }
 
 template<typename T> QList<T*> Connection::findChannels(Channel::Direction direction)
 {
     QList<T*> re;
-    T *tmp = 0;
     foreach (Channel *c, channels()) {
+        if (c->typeId() != T::TypeId)
+            continue;
         if (direction != Channel::Invalid && c->direction() != direction)
             continue;
-        if ((tmp = qobject_cast<T*>(c)))
-            re.append(tmp);
+        re.append(static_cast<T*>(c));
     }
     return re;
 }
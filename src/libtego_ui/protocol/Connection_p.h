@@ -34,10 +34,15 @@
 #define PROTOCOL_CONNECTION_P_H
 
 #include "Connection.h"
+#include "ChannelTable.h"
+#include "ChannelTypeRegistry.h"
+#include "utils/TimerWheel.h"
 
 namespace Protocol
 {
 
+class SocketWorker;
+
 class ConnectionPrivate : public QObject
 {
     Q_OBJECT
@@ -45,18 +50,79 @@ class ConnectionPrivate : public QObject
 
 public:
     static const quint8 ProtocolVersion = 1;
+    // Varint packet headers and larger packets; see readPacketHeader
+    static const quint8 ProtocolVersion2 = 2;
     static const quint8 ProtocolVersionFailed = 0xff;
+    // Version 1 packet header, and the largest data in a version 1 packet
     static const int PacketHeaderSize = 4;
     static const int PacketMaxDataSize = UINT16_MAX - PacketHeaderSize;
+    // Largest packet data accepted with version 2, announced to the peer by ControlChannel
+    static const int LargePacketMaxDataSize = 1048576;
     // Time in seconds before a connection with a purpose of Unknown is killed
     static const int UnknownPurposeTimeout = 15;
+    // Initial capacity of the receive buffer; grows as needed for larger packets
+    static const int ReadBufferSize = 16384;
+    // Capacity reserved for each channel's queue of outbound packets
+    static const int WriteBufferSize = 4096;
+    // Bytes added to a channel's allowance in each round of the outbound scheduler
+    static const int SchedulerQuantum = 4096;
+    // Queued packets are moved to the socket only while it buffers less than this
+    static const int SocketWriteBudget = 65536;
+    // Default water marks for queued outbound bytes; see Channel::canWrite
+    static const int DefaultConnectionHighWaterMark = 262144;
+    static const int DefaultConnectionLowWaterMark = 65536;
+    static const int DefaultChannelHighWaterMark = 65536;
+    static const int DefaultChannelLowWaterMark = 16384;
+    // Default interval for KeepAlive messages while sending, in milliseconds
+    static const int DefaultKeepAliveInterval = 10000;
+    // Idle KeepAlive intervals, as multiples of the interval while sending
+    static const int KeepAliveIdleFactor = 6;
+    static const int KeepAliveMaxFactor = 90;
+    // Default bounds for the peer timeout, in milliseconds; see peerTimeout
+    static const int DefaultPeerTimeoutMin = 15000;
+    static const int DefaultPeerTimeoutMax = 120000;
+    // A draining connection is checked this often, and closes once nothing
+    // has been received for DrainQuietPeriod; both in milliseconds
+    static const int DrainCheckInterval = 250;
+    static const int DrainQuietPeriod = 1000;
+    // Data in a Tor RELAY_DATA cell; used to estimate cells for aggregation
+    static const int CellPayloadSize = 498;
+    // Smallest payload that is compressed, when compression is negotiated
+    static const int CompressionThreshold = 256;
+    /* First byte of a compressed payload
+     *
+     * Payloads are protobuf messages, which can't begin with a zero byte, so
+     * a compressed payload is marked by a zero followed by qCompress data.
+     */
+    static const char CompressedPacketMarker = 0;
 
     explicit ConnectionPrivate(Connection *q);
     virtual ~ConnectionPrivate();
 
     Connection *q;
     QTcpSocket *socket;
-    QHash<int,Channel*> channels;
+    /* Owns the socket once it has moved to the network thread
+     *
+     * After version negotiation, the socket may be handed to a SocketWorker
+     * (see NetworkThread). From then on, 'socket' must not be used; the
+     * socket helpers below go through the worker instead.
+     */
+    SocketWorker *ioWorker;
+    // Set by close() while the worker is disconnecting the socket
+    bool ioClosing;
+    // Set while the handover to a SocketWorker is queued
+    bool ioWorkerPending;
+    QString hostname;
+    ChannelTable channels;
+
+    /* Channels by type and direction, for Connection::findChannel
+     *
+     * Each slot holds one of the channels in the table with that type and
+     * direction, and typeCounts holds how many there are, so a replacement
+     * is only searched for when the slotted channel is removed.
+     */
+    Channel *typeSlots[ChannelTypeRegistry::MaxTypes][2];
+    int typeCounts[ChannelTypeRegistry::MaxTypes][2];
     QMap<Connection::AuthenticationType,QString> authentication;
     QElapsedTimer ageTimer;
     Connection::Direction direction;
@@ -64,6 +130,162 @@ public:
     bool wasClosed;
     bool handshakeDone;
 
+    /* Protocol version and packet framing
+     *
+     * 'version' is 0 until negotiation has finished. Packets sent before the
+     * client receives the version response use version 1 headers, so with
+     * version 2 the client switches its framing by sending a marker once it
+     * has the response (see switchOutboundFraming), and the server reads
+     * version 1 headers until that marker arrives. The server uses version 2
+     * headers right after its response.
+     *
+     * Packets up to PacketMaxDataSize can always be sent. With version 2,
+     * maxOutboundDataSize grows to the limit announced by the peer.
+     */
+    quint8 maxVersion;
+    quint8 version;
+    quint8 inboundFraming;
+    quint8 outboundFraming;
+    int maxOutboundDataSize;
+    static quint8 maximumProtocolVersion;
+
+    int maxInboundDataSize() const { return inboundFraming >= ProtocolVersion2 ? LargePacketMaxDataSize : PacketMaxDataSize; }
+    void setPeerMaxDataSize(quint32 size);
+    bool switchOutboundFraming();
+
+    /* Encode and decode packet headers for a framing version
+     *
+     * Version 1 headers are a 16-bit size, including the header, and a 16-bit
+     * channel identifier, both big endian. Version 2 headers are a varint
+     * size of the data, followed by a varint channel identifier.
+     *
+     * readPacketHeader returns the size of the header at 'data', and sets
+     * 'dataSize' and 'channelId'. It returns 0 if more than 'available' bytes
+     * are needed, and -1 if the header is invalid or the data is larger than
+     * 'maxDataSize'.
+     */
+    static int packetHeaderSize(quint8 framing, int channelId, int dataSize);
+    static void writePacketHeader(quint8 framing, char *header, int channelId, int dataSize);
+    static int readPacketHeader(quint8 framing, const char *data, int available, int maxDataSize, int &dataSize, int &channelId);
+
+    /* Receive buffer for packet data
+     *
+     * Bytes in [readBufferStart, readBufferEnd) have been read from the socket
+     * but not yet parsed as complete packets. Packets are handed to channels
+     * as non-owning slices of this buffer, so it must not be modified while
+     * a packet is being dispatched.
+     */
+    QByteArray readBuffer;
+    int readBufferStart;
+    int readBufferEnd;
+
+    /* Outbound packets for one channel, waiting to be written to the socket
+     *
+     * 'data' holds complete packets, including headers, from 'head' onwards.
+     * Packets are serialized directly into it by beginPacket, and the time each
+     * was queued is kept in enqueueTimes (from timesHead onwards).
+     */
+    struct OutboundQueue
+    {
+        QByteArray data;
+        int head = 0;
+        QVector<qint64> enqueueTimes;
+        int timesHead = 0;
+        // Bytes this queue may still send in the current scheduler round
+        qint64 deficit = 0;
+        bool isPriority = false;
+        bool isActive = false;
+        Connection::QueueStats stats;
+
+        bool isEmpty() const { return head >= data.size(); }
+    };
+
+    /* Outbound queues by channel identifier
+     *
+     * Channels marked as priority (control and authentication) are always
+     * written first, in the order they were queued. Other channels share the
+     * socket by deficit round robin: see writePackets. Queue 0 also
+     * carries packets for channels that are not (or no longer) open, so they
+     * stay ordered with the control messages that refer to them.
+     */
+    QHash<int,OutboundQueue> outboundQueues;
+    QQueue<int> priorityQueues;
+    QQueue<int> activeQueues;
+    // Data for ioWorker from the current writePackets, handed over at the end
+    QByteArray ioWriteBuffer;
+    // Queue and offset of the packet from the last beginPacket, for cancelPacket
+    OutboundQueue *pendingPacketQueue;
+    int pendingPacketOffset;
+    bool writeScheduled;
+    // Total bytes in all outbound queues, not including the socket's buffer
+    qint64 queuedBytes;
+
+    /* Flow control for producers of outbound packets
+     *
+     * A channel stops being writable when the connection's queued bytes
+     * (including the socket's buffer) or its own queued bytes exceed the high
+     * water mark. Blocked channels are listed by identifier, and each emits
+     * writable once both have drained below the low water marks.
+     */
+    int highWaterMark;
+    int lowWaterMark;
+    QVector<int> blockedChannels;
+
+    /* Aggregation of small packets into Tor cells
+     *
+     * With a window, packets for non-priority queues are held for up to that
+     * many milliseconds, so several small packets share a cell. They are
+     * written early once a cell's worth is queued or a priority packet
+     * arrives. cellStats estimates the cells used with and without this.
+     */
+    int aggregationWindow;
+    QTimer *aggregationTimer;
+    Connection::CellStats cellStats;
+    static int defaultAggregationWindow;
+
+    /* KeepAlive messages, for round trip time and dead peer detection
+     *
+     * A KeepAlive is sent every keepAliveInterval while channels are sending
+     * packets. While idle, the interval starts at KeepAliveIdleFactor times
+     * that and doubles after each response, up to KeepAliveMaxFactor times.
+     *
+     * Responses update the smoothed round trip time and its variance, as
+     * TCP does (RFC 6298). The peer is considered dead when nothing has been
+     * received for peerTimeout after sending a KeepAlive, and the connection
+     * is aborted, so higher layers can reconnect.
+     */
+    WheelTimer *keepAliveTimer;
+    int keepAliveInterval;
+    int keepAliveIdleInterval;
+    // Time of the outstanding KeepAlive, or -1; times are from ageTimer, in msecs
+    qint64 keepAliveSentAt;
+    qint64 lastReceivedAt;
+    // Set once a non-priority packet is queued after the last KeepAlive
+    bool sentSinceKeepAlive;
+    int smoothedRtt;
+    int rttVariance;
+    int peerTimeoutMin;
+    int peerTimeoutMax;
+
+    void startKeepAlive();
+    void scheduleKeepAlive(int msecs);
+    int peerTimeout() const;
+
+    // Set by closeWhenDrained; the deadline is from ageTimer, in msecs
+    WheelTimer *drainTimer;
+    qint64 drainDeadline;
+
+    /* Payload compression, negotiated by ControlChannel
+     *
+     * We accept compressed payloads once we have offered or accepted the
+     * compression feature, and compress our own once the peer has accepted it.
+     */
+    bool compressOutbound;
+    bool decompressInbound;
+
+    bool shouldCompress(int size) const { return compressOutbound && size >= CompressionThreshold; }
+    QByteArray decompressPacket(const QByteArray &data);
+
     void setSocket(QTcpSocket *socket, Connection::Direction direction);
 
     int availableOutboundChannelId();
@@ -71,18 +293,51 @@ public:
 
     bool insertChannel(Channel *channel);
     void removeChannel(Channel *channel);
+    void addTypeSlot(Channel *channel);
+    void removeTypeSlot(Channel *channel);
 
     void closeAllChannels();
 
+    bool readPackets();
+    void dispatchPackets(const QByteArray &packets);
+    void dispatchPacket(quint16 channelId, const QByteArray &data);
+
     bool writePacket(Channel *channel, const QByteArray &data);
-    bool writePacket(int channelId, const QByteArray &data);
+    bool writePacket(int channelId, const QByteArray &data, bool priority = false);
+
+    char *beginPacket(int channelId, int size, bool priority = false);
+    char *beginPacket(Channel *channel, int size);
+    void cancelPacket(char *data);
+
+    void scheduleWrite(bool priority = true);
+    bool writeFromQueue(OutboundQueue &queue, qint64 &deficit, qint64 &budget);
+    void writePackets(bool ignoreBudget);
+    void discardQueuedPackets();
+    void releaseOutboundQueue(int channelId);
+
+    bool isSocketConnected() const;
+    qint64 socketBytesToWrite() const;
+    bool writeToSocket(const char *data, qint64 length);
+    void abortSocket();
+
+    qint64 pendingBytes() const;
+    int channelQueuedBytes(int channelId) const;
+    bool isAboveWaterMark(Channel *channel);
+    void updateWritableChannels();
 
 public slots:
     void closeImmediately();
+    void writeQueuedPackets();
 
 private slots:
     void socketReadable();
     void socketDisconnected();
+    void socketBytesWritten();
+    void startIoWorker();
+    void readQueuedPackets();
+    void keepAliveTimeout();
+    void keepAliveResponse();
+    void checkDrained();
 
 private:
     int nextOutboundChannelId;
@@ -32,9 +32,12 @@
 
 #include "ContactRequestChannel.h"
 #include "Channel_p.h"
+#include "ChannelTypeRegistry.h"
 
 using namespace Protocol;
 
+const int ContactRequestChannel::TypeId = ChannelTypeRegistry::registerType<ContactRequestChannel>("im.ricochet.contact.request");
+
 /* Regarding message and nickname limitations:
  *
  * For messages, we should use limits the same as those of chat, including limits on the
@@ -49,7 +52,7 @@ using namespace Protocol;
  */
 
 ContactRequestChannel::ContactRequestChannel(Direction direction, Connection *connection)
-    : Channel(QStringLiteral("im.ricochet.contact.request"), direction, connection)
+    : Channel(TypeId, direction, connection)
     , m_responseStatus(Data::ContactRequest::Response::Undefined)
 {
 }
@@ -46,6 +46,7 @@ class ContactRequestChannel : public Channel
 
 public:
     typedef Data::ContactRequest::Response::Status Status;
+    static const int TypeId;
 
     explicit ContactRequestChannel(Direction direction, Connection *connection);
 
@@ -33,12 +33,18 @@
 #include "ControlChannel.h"
 #include "Channel_p.h"
 #include "Connection_p.h"
+#include "ChannelTypeRegistry.h"
 #include "utils/Useful.h"
 
 using namespace Protocol;
 
+// Exists implicitly on every connection, so it can't be created by request
+const int ControlChannel::TypeId = ChannelTypeRegistry::registerType("control", 0);
+const char ControlChannel::CompressionFeature[] = "im.ricochet.compression.zlib";
+
 ControlChannel::ControlChannel(Direction direction, Connection *connection)
-    : Channel(QStringLiteral("control"), direction, connection)
+    : Channel(TypeId, direction, connection)
+    , featuresRequested(false)
 {
     if (connection->channel(0))
         BUG() << "Created ControlChannel for connection which already has a channel 0";
@@ -46,6 +52,7 @@ ControlChannel::ControlChannel(Direction direction, Connection *connection)
     Q_D(Channel);
     d->isOpened = true;
     d->identifier = 0;
+    d->isPriority = true;
 }
 
 bool ControlChannel::sendOpenChannel(Channel *channel)
@@ -95,12 +102,9 @@ bool ControlChannel::sendOpenChannel(Channel *channel)
 
 void ControlChannel::keepAlive()
 {
-    Data::Control::KeepAlive *request = new Data::Control::KeepAlive;
-    request->set_response_requested(true);
-
-    Data::Control::Packet packet;
-    packet.set_allocated_keep_alive(request);
-    sendMessage(packet);
+    outboundPacket.Clear();
+    outboundPacket.mutable_keep_alive()->set_response_requested(true);
+    sendMessage(outboundPacket);
 }
 
 bool ControlChannel::allowInboundChannelRequest(const Data::Control::OpenChannel *request, Data::Control::ChannelResult *result)
@@ -127,28 +131,34 @@ bool ControlChannel::processChannelOpenResult(const Data::Control::ChannelResult
 
 void ControlChannel::receivePacket(const QByteArray &packet)
 {
-    Data::Control::Packet message;
-    if (!message.ParseFromArray(packet.constData(), packet.size())) {
+    // Parsing into the same message keeps its submessages and string capacity
+    if (!inboundPacket.ParseFromArray(packet.constData(), packet.size())) {
         qWarning() << "Control channel failed parsing packet; connection will be killed";
         closeChannel();
         return;
     }
 
-    if (message.has_open_channel()) {
-        handleOpenChannel(message.open_channel());
-    } else if (message.has_channel_result()) {
-        handleChannelResult(message.channel_result());
-    } else if (message.has_keep_alive()) {
-        handleKeepAlive(message.keep_alive());
-    } else if (message.has_enable_features()) {
-        handleEnableFeatures(message.enable_features());
-    } else if (message.has_features_enabled()) {
-        handleFeaturesEnabled(message.features_enabled());
+    if (inboundPacket.has_open_channel()) {
+        handleOpenChannel(inboundPacket.open_channel());
+    } else if (inboundPacket.has_channel_result()) {
+        handleChannelResult(inboundPacket.channel_result());
+    } else if (inboundPacket.has_keep_alive()) {
+        handleKeepAlive(inboundPacket.keep_alive());
+    } else if (inboundPacket.has_enable_features()) {
+        handleEnableFeatures(inboundPacket.enable_features());
+    } else if (inboundPacket.has_features_enabled()) {
+        handleFeaturesEnabled(inboundPacket.features_enabled());
     } else {
         qWarning() << "Unrecognized message on control channel; connection will be killed";
         closeChannel();
         return;
     }
+
+    // Don't hold on to the memory of an unusually large packet
+    if (packet.size() > RetainedPacketSize) {
+        Data::Control::Packet empty;
+        inboundPacket.Swap(&empty);
+    }
 }
 
 void ControlChannel::handleOpenChannel(const Data::Control::OpenChannel &message)
@@ -166,7 +176,7 @@ void ControlChannel::handleOpenChannel(const Data::Control::OpenChannel &message
     Data::Control::ChannelResult *response = new Data::Control::ChannelResult;
     response->set_channel_identifier(id);
 
-    Channel *channel = Channel::create(QString::fromStdString(message.channel_type()), Inbound, connection());
+    Channel *channel = Channel::create(ChannelTypeRegistry::typeId(message.channel_type()), Inbound, connection());
     if (!channel) {
         qDebug() << "Received OpenChannel for unknown channel type:" << QString::fromStdString(message.channel_type());
         response->set_opened(false);
@@ -255,30 +265,78 @@ void ControlChannel::handleChannelResult(const Data::Control::ChannelResult &mes
 void ControlChannel::handleKeepAlive(const Data::Control::KeepAlive &message)
 {
     if (message.response_requested()) {
-        Data::Control::KeepAlive *pong = new Data::Control::KeepAlive;
-        pong->set_response_requested(false);
-        Data::Control::Packet response;
-        response.set_allocated_keep_alive(pong);
-        sendMessage(response);
+        outboundPacket.Clear();
+        outboundPacket.mutable_keep_alive()->set_response_requested(false);
+        sendMessage(outboundPacket);
     } else {
         emit keepAliveResponse();
     }
 }
 
+void ControlChannel::sendEnableFeatures()
+{
+    if (featuresRequested) {
+        BUG() << "EnableFeatures was already sent on this connection";
+        return;
+    }
+
+    outboundPacket.Clear();
+    Data::Control::EnableFeatures *request = outboundPacket.mutable_enable_features();
+    request->add_feature(CompressionFeature);
+    if (connection()->protocolVersion() >= ConnectionPrivate::ProtocolVersion2)
+        request->set_max_packet_size(ConnectionPrivate::LargePacketMaxDataSize);
+    if (!sendMessage(outboundPacket))
+        return;
+
+    featuresRequested = true;
+    // The peer may compress as soon as it has accepted
+    connection()->d->decompressInbound = true;
+}
+
 void ControlChannel::handleEnableFeatures(const Data::Control::EnableFeatures &message)
 {
-    Q_UNUSED(message);
-    // This version does not support any features.
-    Data::Control::Packet responseMessage;
-    responseMessage.mutable_features_enabled();
-    sendMessage(responseMessage);
+    bool compression = false;
+    for (const std::string &feature : message.feature()) {
+        if (feature == CompressionFeature)
+            compression = true;
+    }
+
+    outboundPacket.Clear();
+    Data::Control::FeaturesEnabled *response = outboundPacket.mutable_features_enabled();
+    if (compression)
+        response->add_feature(CompressionFeature);
+    if (connection()->protocolVersion() >= ConnectionPrivate::ProtocolVersion2)
+        response->set_max_packet_size(ConnectionPrivate::LargePacketMaxDataSize);
+    if (!sendMessage(outboundPacket))
+        return;
+
+    if (message.has_max_packet_size())
+        connection()->d->setPeerMaxDataSize(message.max_packet_size());
+
+    if (compression) {
+        connection()->d->decompressInbound = true;
+        connection()->d->compressOutbound = true;
+    }
 }
 
 void ControlChannel::handleFeaturesEnabled(const Data::Control::FeaturesEnabled &message)
 {
-    Q_UNUSED(message);
-    // This version does not generate EnableFeatures messages, so receiving this is an error.
-    qDebug() << "Unexpectedly received FeaturesEnabled message from peer, but we never send EnableFeatures";
-    closeChannel();
+    if (!featuresRequested) {
+        qDebug() << "Unexpectedly received FeaturesEnabled message from peer, but we never sent EnableFeatures";
+        closeChannel();
+        return;
+    }
+    featuresRequested = false;
+
+    if (message.has_max_packet_size())
+        connection()->d->setPeerMaxDataSize(message.max_packet_size());
+
+    for (const std::string &feature : message.feature()) {
+        if (feature == CompressionFeature) {
+            connection()->d->compressOutbound = true;
+        } else {
+            qDebug() << "Peer enabled feature" << QString::fromStdString(feature) << "which we didn't request";
+        }
+    }
 }
 
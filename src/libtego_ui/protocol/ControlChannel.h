@@ -47,6 +47,10 @@ class ControlChannel : public Channel
     friend class ConnectionPrivate;
 
 public:
+    static const int TypeId;
+    // Feature string for payload compression; see ConnectionPrivate::CompressedPacketMarker
+    static const char CompressionFeature[];
+
     bool sendOpenChannel(Channel *channel);
     void keepAlive();
 
@@ -63,6 +67,18 @@ protected:
     virtual void receivePacket(const QByteArray &packet);
 
 private:
+    // Inbound packets larger than this don't keep their parsed memory around
+    static const int RetainedPacketSize = 4096;
+
+    // Reused for every packet, so steady-state traffic doesn't allocate messages
+    Data::Control::Packet inboundPacket;
+    Data::Control::Packet outboundPacket;
+    // Set while waiting for FeaturesEnabled in reply to our EnableFeatures
+    bool featuresRequested;
+
+    // Offer the optional features we support; called for ClientSide connections
+    void sendEnableFeatures();
+
     void handleOpenChannel(const Data::Control::OpenChannel &message);
     void handleChannelResult(const Data::Control::ChannelResult &message);
     void handleKeepAlive(const Data::Control::KeepAlive &message);
@@ -0,0 +1,156 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "DirectTransport.h"
+#include "utils/Useful.h"
+
+#ifdef Q_OS_UNIX
+#include <sys/socket.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+using namespace Protocol;
+
+static bool directTransportEnabled = false;
+static QHash<QString,DirectTransport::Endpoint> directRoutes;
+
+bool DirectTransport::isEnabled()
+{
+    return directTransportEnabled;
+}
+
+void DirectTransport::setEnabled(bool enabled)
+{
+    directTransportEnabled = enabled;
+}
+
+QString DirectTransport::normalizedHostname(const QString &hostname)
+{
+    QString re = hostname.toLower();
+    if (!re.endsWith(QLatin1String(".onion")))
+        re.append(QLatin1String(".onion"));
+    return re;
+}
+
+void DirectTransport::addRoute(const QString &hostname, const Endpoint &endpoint)
+{
+    if (!endpoint.isValid()) {
+        BUG() << "Invalid direct route for" << hostname;
+        return;
+    }
+
+    directRoutes.insert(normalizedHostname(hostname), endpoint);
+}
+
+void DirectTransport::removeRoute(const QString &hostname)
+{
+    directRoutes.remove(normalizedHostname(hostname));
+}
+
+DirectTransport::Endpoint DirectTransport::route(const QString &hostname)
+{
+    return directRoutes.value(normalizedHostname(hostname));
+}
+
+bool DirectTransport::loadRoutes(const QString &path)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        qWarning() << "Cannot open direct routes file" << path << ":" << file.errorString();
+        return false;
+    }
+
+    setEnabled(true);
+
+    int lineNumber = 0;
+    while (!file.atEnd()) {
+        QString line = QString::fromUtf8(file.readLine());
+        lineNumber++;
+
+        int comment = line.indexOf(QLatin1Char('#'));
+        if (comment >= 0)
+            line.truncate(comment);
+        line = line.simplified();
+        if (line.isEmpty())
+            continue;
+        QStringList fields = line.split(QLatin1Char(' '));
+
+        Endpoint endpoint;
+        bool portOk = false;
+        if (fields.size() == 3) {
+            endpoint.address = QHostAddress(fields[1]);
+            endpoint.port = quint16(fields[2].toUInt(&portOk));
+        }
+        if (!portOk || !endpoint.isValid()) {
+            qWarning() << "Invalid direct route on line" << lineNumber << "of" << path;
+            return false;
+        }
+
+        addRoute(fields[0], endpoint);
+    }
+
+    qDebug() << "Direct mode enabled with" << directRoutes.size() << "routes";
+    return true;
+}
+
+bool DirectTransport::createSocketPair(QTcpSocket *first, QTcpSocket *second)
+{
+#ifdef Q_OS_UNIX
+    int fds[2];
+    if (::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        qWarning() << "Cannot create socket pair:" << qt_error_string(errno);
+        return false;
+    }
+
+    // Each socket owns its descriptor once it's set
+    if (!first->setSocketDescriptor(fds[0])) {
+        qWarning() << "Cannot use socket pair:" << first->errorString();
+        ::close(fds[0]);
+        ::close(fds[1]);
+        return false;
+    }
+    if (!second->setSocketDescriptor(fds[1])) {
+        qWarning() << "Cannot use socket pair:" << second->errorString();
+        first->abort();
+        ::close(fds[1]);
+        return false;
+    }
+
+    return true;
+#else
+    Q_UNUSED(first);
+    Q_UNUSED(second);
+    qWarning() << "Socket pairs are not supported on this platform";
+    return false;
+#endif
+}
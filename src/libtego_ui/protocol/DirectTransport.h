@@ -0,0 +1,105 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PROTOCOL_DIRECTTRANSPORT_H
+#define PROTOCOL_DIRECTTRANSPORT_H
+
+class QTcpSocket;
+
+namespace Protocol
+{
+
+/* Reach peers directly on this machine, instead of through Tor
+ *
+ * Normally, outbound connections go through Tor's SOCKS proxy, and inbound
+ * connections arrive from the hidden service. That needs a running tor and
+ * a network, and adds seconds of latency, which makes load tests and
+ * profiling slow and noisy. In direct mode, onion hostnames are resolved
+ * with a table of local endpoints instead: Tor::TorSocket connects straight
+ * to the endpoint for its host, and UserIdentity listens on the endpoint
+ * for its own hostname. Several instances on one machine can then exchange
+ * real protocol traffic, with the same Connection code on top.
+ *
+ * Direct mode is enabled by adding routes, usually with loadRoutes from the
+ * file named by TEGO_DIRECT_ROUTES. Each line of the file is an onion
+ * hostname followed by an address and port; '#' starts a comment:
+ *
+ *   ockeilzymnguehc4brf4dpcsc634wtei75wa5edslx6yuwfaw3pje6id.onion 127.0.0.1 9001
+ *
+ * createSocketPair connects two sockets in this process without any
+ * listener, for tests and benchmarks.
+ *
+ * Routes are meant to be set up before connections are made, from the
+ * main thread.
+ */
+class DirectTransport
+{
+public:
+    struct Endpoint
+    {
+        QHostAddress address;
+        quint16 port = 0;
+
+        bool isValid() const { return !address.isNull() && port; }
+    };
+
+    static bool isEnabled();
+    static void setEnabled(bool enabled);
+
+    /* Hostnames are in the onion hostname format; the .onion suffix is optional */
+    static void addRoute(const QString &hostname, const Endpoint &endpoint);
+    static void removeRoute(const QString &hostname);
+    /* The endpoint for 'hostname', which is invalid if there is no route */
+    static Endpoint route(const QString &hostname);
+
+    /* Add the routes listed in a file, and enable direct mode
+     *
+     * Returns false if the file can't be read or has an invalid line; the
+     * routes before that line are still added.
+     */
+    static bool loadRoutes(const QString &path);
+
+    /* Connect two new sockets to each other
+     *
+     * Both sockets are in the connected state on return, with a Unix domain
+     * socket pair underneath. Returns false on failure, or on platforms
+     * without Unix domain sockets.
+     */
+    static bool createSocketPair(QTcpSocket *first, QTcpSocket *second);
+
+private:
+    static QString normalizedHostname(const QString &hostname);
+};
+
+}
+
+#endif
@@ -0,0 +1,586 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "FileTransferChannel.h"
+#include "Channel_p.h"
+#include "ChannelTypeRegistry.h"
+#include "Connection.h"
+#include "Connection_p.h"
+#include "utils/SecureRNG.h"
+#include "utils/Useful.h"
+
+using namespace Protocol;
+
+namespace Protocol {
+
+class FileTransferChannelPrivate : public ChannelPrivate
+{
+public:
+    // Chunks from an earlier attempt hashed in each step, between other events
+    static const int ResumeHashChunks = 16;
+
+    // Inbound: the partial file until it's complete, then the destination
+    QFile file;
+    QString destination;
+    QByteArray transferId;
+    QString fileName;
+    qint64 fileSize;
+    int chunkSize;
+    int windowSize;
+    // Outbound: the end of the data sent. Inbound: the end of the data stored.
+    qint64 transferOffset;
+    qint64 acknowledgedOffset;
+    // Data before this offset was transferred by an earlier channel
+    qint64 resumeOffset;
+
+    // The file hash is SHA-256 over the hash of each chunk, in order, and
+    // covers the chunks before hashedOffset. After resuming, chunks from the
+    // earlier attempt are hashed from the file.
+    QCryptographicHash fileHash;
+    qint64 hashedOffset;
+    // Inbound: hashes of new chunks, while earlier chunks are still being hashed
+    QByteArray laterHashes;
+
+    bool sentComplete;
+    bool finished;
+    // Inbound: set during requestInboundApproval, when setDestination is allowed
+    bool approvalRequested;
+
+    // Reused for every packet, so chunks don't allocate new buffers
+    Data::FileTransfer::Packet inboundPacket;
+    Data::FileTransfer::Packet outboundPacket;
+    // Used for chunks of files that can't be mapped
+    QByteArray readBuffer;
+
+    FileTransferChannelPrivate(Channel *q, Channel::Direction direction, Connection *conn)
+        : ChannelPrivate(q, FileTransferChannel::TypeId, direction, conn)
+        , fileSize(0)
+        , chunkSize(FileTransferChannel::ChunkSize)
+        , windowSize(FileTransferChannel::DefaultWindowSize)
+        , transferOffset(0)
+        , acknowledgedOffset(0)
+        , resumeOffset(0)
+        , fileHash(QCryptographicHash::Sha256)
+        , hashedOffset(0)
+        , sentComplete(false)
+        , finished(false)
+        , approvalRequested(false)
+    {
+        // File data is often compressed already, and is too much to compress cheaply
+        isCompressible = false;
+    }
+
+    int chunkSizeAt(qint64 offset) const { return int(qMin(qint64(chunkSize), fileSize - offset)); }
+
+    template<typename F> bool readChunk(qint64 offset, int size, F use);
+    bool hashEarlierChunks(int maxChunks);
+};
+
+}
+
+const int FileTransferChannel::TypeId = ChannelTypeRegistry::registerType<FileTransferChannel>("im.ricochet.file-transfer");
+
+static QByteArray chunkHash(const char *data, int size)
+{
+    return QCryptographicHash::hash(QByteArray::fromRawData(data, size), QCryptographicHash::Sha256);
+}
+
+FileTransferChannel::FileTransferChannel(Direction direction, Connection *connection)
+    : Channel(new FileTransferChannelPrivate(this, direction, connection))
+{
+    connect(this, &Channel::channelOpened, this, &FileTransferChannel::hashResumedChunks);
+    connect(this, &Channel::writable, this, &FileTransferChannel::sendChunks);
+    connect(this, &Channel::invalidated, this, [this]() { finish(false); });
+}
+
+QByteArray FileTransferChannel::transferId() const
+{
+    Q_D(const FileTransferChannel);
+    return d->transferId;
+}
+
+QString FileTransferChannel::fileName() const
+{
+    Q_D(const FileTransferChannel);
+    return d->fileName;
+}
+
+qint64 FileTransferChannel::fileSize() const
+{
+    Q_D(const FileTransferChannel);
+    return d->fileSize;
+}
+
+qint64 FileTransferChannel::bytesTransferred() const
+{
+    Q_D(const FileTransferChannel);
+    return d->acknowledgedOffset;
+}
+
+bool FileTransferChannel::setFile(const QString &path, const QByteArray &transferId)
+{
+    Q_D(FileTransferChannel);
+    if (direction() != Outbound || identifier() >= 0 || d->file.isOpen()) {
+        BUG() << "A file can only be set once on an outbound" << type() << "channel before it's opened";
+        return false;
+    }
+
+    if (!transferId.isEmpty() && transferId.size() != TransferIdSize) {
+        BUG() << "Invalid transfer id for" << type();
+        return false;
+    }
+
+    d->file.setFileName(path);
+    if (!d->file.open(QIODevice::ReadOnly | QIODevice::Unbuffered)) {
+        qWarning() << "Cannot open file to send:" << d->file.errorString();
+        return false;
+    }
+
+    d->fileName = QFileInfo(path).fileName().left(FileNameMaxCharacters);
+    d->fileSize = d->file.size();
+    d->transferId = transferId.isEmpty() ? SecureRNG::random(TransferIdSize) : transferId;
+    return true;
+}
+
+void FileTransferChannel::setWindowSize(int chunks)
+{
+    Q_D(FileTransferChannel);
+    d->windowSize = qMax(1, chunks);
+    sendChunks();
+}
+
+bool FileTransferChannel::setChunkSize(int bytes)
+{
+    Q_D(FileTransferChannel);
+    if (direction() != Outbound || isOpened() || bytes < 1 || bytes > MaxLargeChunkSize) {
+        BUG() << "Invalid chunk size for" << type() << "channel:" << bytes;
+        return false;
+    }
+
+    d->chunkSize = bytes;
+    return true;
+}
+
+bool FileTransferChannel::setDestination(const QString &path)
+{
+    Q_D(FileTransferChannel);
+    if (direction() != Inbound || !d->approvalRequested || d->file.isOpen()) {
+        BUG() << "Destination for" << type() << "can only be set once while approving an inbound request";
+        return false;
+    }
+
+    // Files that this transfer didn't create are never written
+    if (QFileInfo::exists(path)) {
+        qWarning() << "Destination for file transfer already exists";
+        return false;
+    }
+
+    d->file.setFileName(partialPath(path, d->transferId));
+    if (!d->file.open(QIODevice::ReadWrite | QIODevice::Unbuffered)) {
+        qWarning() << "Cannot open destination for file transfer:" << d->file.errorString();
+        return false;
+    }
+    d->destination = path;
+    return true;
+}
+
+QString FileTransferChannel::partialPath(const QString &destination, const QByteArray &transferId)
+{
+    return destination + QLatin1Char('.') + QString::fromLatin1(transferId.toHex()) + QLatin1String(".part");
+}
+
+bool FileTransferChannel::allowInboundChannelRequest(const Data::Control::OpenChannel *request, Data::Control::ChannelResult *result)
+{
+    Q_D(FileTransferChannel);
+
+    if (connection()->purpose() != Connection::Purpose::KnownContact) {
+        qDebug() << "Rejecting request for" << type() << "channel from connection with purpose" << int(connection()->purpose());
+        result->set_common_error(Data::Control::ChannelResult::UnauthorizedError);
+        return false;
+    }
+
+    if (!request->HasExtension(Data::FileTransfer::file_header)) {
+        qDebug() << "Rejecting request for" << type() << "channel without a file header";
+        result->set_common_error(Data::Control::ChannelResult::BadUsageError);
+        return false;
+    }
+
+    const Data::FileTransfer::FileHeader &header = request->GetExtension(Data::FileTransfer::file_header);
+    // Version 2 peers accept large packets, whether or not they've announced it yet
+    const int maxChunkSize = connection()->protocolVersion() >= ConnectionPrivate::ProtocolVersion2 ? MaxLargeChunkSize : MaxChunkSize;
+    d->transferId = QByteArray::fromStdString(header.transfer_id());
+    d->fileName = QString::fromStdString(header.name());
+    d->fileSize = qint64(header.size());
+
+    if (d->transferId.size() != TransferIdSize || d->fileSize < 0 ||
+        header.chunk_size() < 1 || header.chunk_size() > quint32(maxChunkSize) ||
+        d->fileName.isEmpty() || d->fileName.size() > FileNameMaxCharacters ||
+        d->fileName.contains(QLatin1Char('/')) || d->fileName.contains(QLatin1Char('\\')) ||
+        d->fileName == QLatin1String(".") || d->fileName == QLatin1String(".."))
+    {
+        qDebug() << "Rejecting request for" << type() << "channel with an invalid file header";
+        result->set_common_error(Data::Control::ChannelResult::BadUsageError);
+        return false;
+    }
+    d->chunkSize = int(header.chunk_size());
+
+    // Handlers call setDestination to accept the file
+    d->approvalRequested = true;
+    requestInboundApproval();
+    d->approvalRequested = false;
+
+    if (!d->file.isOpen()) {
+        qDebug() << "Rejecting request for" << type() << "channel without a destination";
+        result->set_common_error(Data::Control::ChannelResult::FailedError);
+        return false;
+    }
+
+    // The partial file is named for the transferId, so anything in it is from
+    // an earlier attempt at this transfer. Resume after its last complete chunk.
+    qint64 offset = qMin(d->file.size(), d->fileSize);
+    if (offset < d->fileSize)
+        offset -= offset % d->chunkSize;
+    if (d->file.size() != offset && !d->file.resize(offset)) {
+        qWarning() << "Cannot resize destination for file transfer:" << d->file.errorString();
+        result->set_common_error(Data::Control::ChannelResult::FailedError);
+        return false;
+    }
+
+    if (offset > 0)
+        qDebug() << "Resuming inbound file transfer at" << offset << "of" << d->fileSize << "bytes";
+    d->resumeOffset = d->transferOffset = d->acknowledgedOffset = offset;
+    result->SetExtension(Data::FileTransfer::resume_offset, quint64(offset));
+    return true;
+}
+
+bool FileTransferChannel::allowOutboundChannelRequest(Data::Control::OpenChannel *request)
+{
+    Q_D(FileTransferChannel);
+
+    if (!d->file.isOpen()) {
+        BUG() << "Outbound" << type() << "channel has no file to send";
+        return false;
+    }
+
+    if (connection()->purpose() != Connection::Purpose::KnownContact) {
+        BUG() << "Rejecting outbound request for" << type() << "channel for connection with unexpected purpose" << int(connection()->purpose());
+        return false;
+    }
+
+    // Chunk messages add less than a kilobyte to the data
+    if (d->chunkSize > MaxChunkSize && d->chunkSize + 1024 > connection()->maxPacketSize()) {
+        qWarning() << "Chunks of" << d->chunkSize << "bytes for" << type() << "channel are too large for this connection";
+        return false;
+    }
+
+    Data::FileTransfer::FileHeader *header = request->MutableExtension(Data::FileTransfer::file_header);
+    header->set_transfer_id(d->transferId.constData(), d->transferId.size());
+    header->set_name(d->fileName.toStdString());
+    header->set_size(quint64(d->fileSize));
+    header->set_chunk_size(quint32(d->chunkSize));
+    return true;
+}
+
+bool FileTransferChannel::processChannelOpenResult(const Data::Control::ChannelResult *result)
+{
+    Q_D(FileTransferChannel);
+    if (!result->opened())
+        return true;
+
+    // Offsets after the end, or in the middle of a chunk, aren't valid
+    quint64 offset = result->GetExtension(Data::FileTransfer::resume_offset);
+    if (offset > quint64(d->fileSize) || (offset % d->chunkSize != 0 && offset != quint64(d->fileSize))) {
+        qWarning() << "Invalid resume offset for" << type() << "channel:" << offset;
+        return false;
+    }
+
+    if (offset > 0)
+        qDebug() << "Resuming outbound file transfer at" << offset << "of" << d->fileSize << "bytes";
+    d->resumeOffset = d->transferOffset = d->acknowledgedOffset = qint64(offset);
+    return true;
+}
+
+/* Call 'use' with the data of a chunk, mapped from the file if possible */
+template<typename F> bool FileTransferChannelPrivate::readChunk(qint64 offset, int size, F use)
+{
+    if (uchar *data = file.map(offset, size)) {
+        use(reinterpret_cast<const char*>(data));
+        file.unmap(data);
+        return true;
+    }
+
+    readBuffer.resize(size);
+    if (!file.seek(offset) || file.read(readBuffer.data(), size) != size) {
+        qWarning() << "Cannot read file for transfer:" << file.errorString();
+        return false;
+    }
+    use(readBuffer.constData());
+    return true;
+}
+
+/* Hash up to 'maxChunks' of the chunks transferred by an earlier channel
+ *
+ * When all of those are hashed, any hashes of newer chunks are added as well.
+ * Returns false if the file can't be read.
+ */
+bool FileTransferChannelPrivate::hashEarlierChunks(int maxChunks)
+{
+    for (int i = 0; i < maxChunks && hashedOffset < resumeOffset; i++) {
+        int size = chunkSizeAt(hashedOffset);
+        if (!readChunk(hashedOffset, size, [this,size](const char *data) { fileHash.addData(chunkHash(data, size)); }))
+            return false;
+        hashedOffset += size;
+    }
+
+    if (hashedOffset == resumeOffset && !laterHashes.isEmpty()) {
+        fileHash.addData(laterHashes);
+        laterHashes.clear();
+        hashedOffset = transferOffset;
+    }
+    return true;
+}
+
+void FileTransferChannel::hashResumedChunks()
+{
+    Q_D(FileTransferChannel);
+    if (!isOpened() || d->finished)
+        return;
+
+    if (!d->hashEarlierChunks(FileTransferChannelPrivate::ResumeHashChunks)) {
+        closeChannel();
+        return;
+    }
+
+    // Hash a few chunks at a time, so other events aren't delayed by a large file
+    if (d->hashedOffset < d->resumeOffset) {
+        metaObject()->invokeMethod(this, "hashResumedChunks", Qt::QueuedConnection);
+        return;
+    }
+
+    if (direction() == Outbound)
+        sendChunks();
+}
+
+void FileTransferChannel::sendChunks()
+{
+    Q_D(FileTransferChannel);
+    if (direction() != Outbound || !isOpened() || d->sentComplete)
+        return;
+
+    // Chunks are hashed in order, including those sent by an earlier channel
+    if (d->hashedOffset < d->resumeOffset)
+        return;
+
+    const qint64 window = qint64(d->windowSize) * d->chunkSize;
+    while (d->transferOffset < d->fileSize && d->transferOffset - d->acknowledgedOffset < window && canWrite()) {
+        qint64 offset = d->transferOffset;
+        int size = d->chunkSizeAt(offset);
+
+        d->outboundPacket.Clear();
+        Data::FileTransfer::Chunk *chunk = d->outboundPacket.mutable_chunk();
+        chunk->set_offset(quint64(offset));
+        bool ok = d->readChunk(offset, size,
+            [d,chunk,size](const char *data) {
+                // Assign in place to reuse the string's capacity from earlier chunks
+                chunk->mutable_data()->assign(data, size_t(size));
+                QByteArray hash = chunkHash(data, size);
+                chunk->set_sha256(hash.constData(), hash.size());
+                d->fileHash.addData(hash);
+            }
+        );
+
+        if (!ok || !sendMessage(d->outboundPacket)) {
+            closeChannel();
+            return;
+        }
+        d->transferOffset += size;
+        d->hashedOffset += size;
+    }
+
+    if (d->transferOffset == d->fileSize) {
+        QByteArray hash = d->fileHash.result();
+        d->outboundPacket.Clear();
+        d->outboundPacket.mutable_file_complete()->set_sha256(hash.constData(), hash.size());
+        if (!sendMessage(d->outboundPacket)) {
+            closeChannel();
+            return;
+        }
+        d->sentComplete = true;
+    }
+}
+
+void FileTransferChannel::receivePacket(const QByteArray &packet)
+{
+    Q_D(FileTransferChannel);
+
+    // Parsing into the same message keeps the capacity of its chunk data
+    if (!d->inboundPacket.ParseFromArray(packet.constData(), packet.size())) {
+        closeChannel();
+        return;
+    }
+
+    if (d->inboundPacket.has_chunk()) {
+        handleChunk(d->inboundPacket.chunk());
+    } else if (d->inboundPacket.has_chunk_acknowledge()) {
+        handleChunkAcknowledge(d->inboundPacket.chunk_acknowledge());
+    } else if (d->inboundPacket.has_file_complete()) {
+        handleFileComplete(d->inboundPacket.file_complete());
+    } else if (d->inboundPacket.has_result()) {
+        handleResult(d->inboundPacket.result());
+    } else {
+        qWarning() << "Unrecognized message on" << type();
+        closeChannel();
+    }
+}
+
+void FileTransferChannel::handleChunk(const Data::FileTransfer::Chunk &message)
+{
+    Q_D(FileTransferChannel);
+
+    const std::string &data = message.data();
+    if (direction() != Inbound || d->transferOffset >= d->fileSize ||
+        message.offset() != quint64(d->transferOffset) || data.size() != size_t(d->chunkSizeAt(d->transferOffset)))
+    {
+        qWarning() << "Received unexpected chunk on" << type() << "channel";
+        closeChannel();
+        return;
+    }
+
+    int size = int(data.size());
+    QByteArray hash = chunkHash(data.data(), size);
+    if (QByteArray::fromStdString(message.sha256()) != hash) {
+        qWarning() << "Received chunk with an invalid hash on" << type() << "channel";
+        closeChannel();
+        return;
+    }
+
+    if (!d->file.seek(d->transferOffset) || d->file.write(data.data(), size) != size) {
+        qWarning() << "Cannot write received file:" << d->file.errorString();
+        closeChannel();
+        return;
+    }
+
+    if (d->hashedOffset == d->transferOffset) {
+        d->fileHash.addData(hash);
+        d->hashedOffset += size;
+    } else {
+        d->laterHashes.append(hash);
+    }
+    d->transferOffset += size;
+    d->acknowledgedOffset = d->transferOffset;
+
+    d->outboundPacket.Clear();
+    d->outboundPacket.mutable_chunk_acknowledge()->set_offset(quint64(d->transferOffset));
+    sendMessage(d->outboundPacket);
+
+    emit progress(d->transferOffset, d->fileSize);
+}
+
+void FileTransferChannel::handleChunkAcknowledge(const Data::FileTransfer::ChunkAcknowledge &message)
+{
+    Q_D(FileTransferChannel);
+
+    if (direction() != Outbound || message.offset() <= quint64(d->acknowledgedOffset) ||
+        message.offset() > quint64(d->transferOffset))
+    {
+        qWarning() << "Received unexpected acknowledgement on" << type() << "channel";
+        closeChannel();
+        return;
+    }
+
+    d->acknowledgedOffset = qint64(message.offset());
+    emit progress(d->acknowledgedOffset, d->fileSize);
+    sendChunks();
+}
+
+void FileTransferChannel::handleFileComplete(const Data::FileTransfer::FileComplete &message)
+{
+    Q_D(FileTransferChannel);
+
+    if (direction() != Inbound || d->transferOffset != d->fileSize || d->finished) {
+        qWarning() << "Received unexpected completion on" << type() << "channel";
+        closeChannel();
+        return;
+    }
+
+    // Finish hashing chunks from an earlier attempt, if that's still running
+    if (!d->hashEarlierChunks(INT_MAX)) {
+        closeChannel();
+        return;
+    }
+
+    bool accepted = QByteArray::fromStdString(message.sha256()) == d->fileHash.result();
+    if (accepted) {
+        d->file.close();
+        if (!d->file.rename(d->destination)) {
+            qWarning() << "Cannot move received file to its destination:" << d->file.errorString();
+            accepted = false;
+        }
+    } else {
+        // Don't resume from data that's wrong
+        qWarning() << "Received file failed verification; removing it";
+        d->file.remove();
+    }
+
+    d->outboundPacket.Clear();
+    d->outboundPacket.mutable_result()->set_accepted(accepted);
+    sendMessage(d->outboundPacket);
+
+    finish(accepted);
+    closeChannel();
+}
+
+void FileTransferChannel::handleResult(const Data::FileTransfer::TransferResult &message)
+{
+    Q_D(FileTransferChannel);
+
+    if (direction() != Outbound || !d->sentComplete) {
+        qWarning() << "Received unexpected result on" << type() << "channel";
+        closeChannel();
+        return;
+    }
+
+    if (!message.accepted())
+        qWarning() << "File transfer was rejected by the recipient";
+    finish(message.accepted());
+    closeChannel();
+}
+
+void FileTransferChannel::finish(bool completed)
+{
+    Q_D(FileTransferChannel);
+    if (d->finished)
+        return;
+
+    d->finished = true;
+    emit transferFinished(completed);
+}
@@ -0,0 +1,145 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PROTOCOL_FILETRANSFERCHANNEL_H
+#define PROTOCOL_FILETRANSFERCHANNEL_H
+
+#include "Channel.h"
+#include "FileTransferChannel.pb.h"
+
+namespace Protocol
+{
+
+class FileTransferChannelPrivate;
+
+/* Sends one file from the peer that opens the channel
+ *
+ * The sender attaches the file's name and size to the OpenChannel request.
+ * The file is sent in chunks (ChunkSize bytes by default), each with a
+ * SHA-256 hash, and the recipient acknowledges each chunk once it's stored.
+ * Only a window of unacknowledged chunks is sent at once. After the last
+ * chunk, the sender sends a hash of all chunk hashes, and the recipient
+ * checks the whole file before accepting it.
+ *
+ * Inbound requests use Channel::requestInboundApproval. A handler of
+ * Connection::channelRequestingInboundApproval must call setDestination to
+ * accept the file; otherwise, the request is rejected. Data is stored in a
+ * partial file named for the transferId (see partialPath), which is moved to
+ * the destination once the file is verified. If an earlier attempt with the
+ * same transferId left a partial file, the transfer resumes after its last
+ * complete chunk.
+ *
+ * Chunks are read with a memory map of each chunk, so memory use doesn't
+ * depend on the size of the file.
+ */
+class FileTransferChannel : public Channel
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(FileTransferChannel)
+    Q_DECLARE_PRIVATE(FileTransferChannel)
+
+public:
+    static const int TypeId;
+    // Default chunk size; larger chunks don't fit a version 1 packet
+    static const int ChunkSize = 60 * 1024;
+    static const int MaxChunkSize = 63 * 1024;
+    // Largest chunks, with protocol version 2 and a peer that accepts large packets
+    static const int MaxLargeChunkSize = 1023 * 1024;
+    static const int DefaultWindowSize = 16;
+    static const int TransferIdSize = 16;
+    static const int FileNameMaxCharacters = 255;
+
+    explicit FileTransferChannel(Direction direction, Connection *connection);
+
+    QByteArray transferId() const;
+    QString fileName() const;
+    qint64 fileSize() const;
+    // Bytes acknowledged by the recipient, including any from earlier attempts
+    qint64 bytesTransferred() const;
+
+    // Outbound
+    /* Send the file at 'path', before openChannel
+     *
+     * Pass the transferId of an earlier attempt to resume it. Returns false
+     * if the file can't be opened.
+     */
+    bool setFile(const QString &path, const QByteArray &transferId = QByteArray());
+    // Maximum unacknowledged chunks; the default is DefaultWindowSize
+    void setWindowSize(int chunks);
+    /* Size of each chunk, before openChannel; the default is ChunkSize
+     *
+     * Chunks larger than MaxChunkSize need a connection that can send them
+     * (see Connection::maxPacketSize), or the channel isn't opened.
+     */
+    bool setChunkSize(int bytes);
+
+    // Inbound
+    /* Accept the file, storing it at 'path'
+     *
+     * Only valid from a Connection::channelRequestingInboundApproval handler.
+     * Returns false if 'path' already exists or the partial file can't be
+     * opened. The partial file is removed if the complete file fails
+     * verification.
+     */
+    bool setDestination(const QString &path);
+    // Where data for 'transferId' is stored until it's moved to 'destination'
+    static QString partialPath(const QString &destination, const QByteArray &transferId);
+
+signals:
+    void progress(qint64 bytes, qint64 total);
+    /* Emitted once, when the recipient has accepted or rejected the complete
+     * file, or the channel closes before that. A transfer that didn't
+     * complete can be resumed on a new channel with the same transferId.
+     */
+    void transferFinished(bool completed);
+
+protected:
+    virtual bool allowInboundChannelRequest(const Data::Control::OpenChannel *request, Data::Control::ChannelResult *result);
+    virtual bool allowOutboundChannelRequest(Data::Control::OpenChannel *request);
+    virtual bool processChannelOpenResult(const Data::Control::ChannelResult *result);
+    virtual void receivePacket(const QByteArray &packet);
+
+private slots:
+    void sendChunks();
+    void hashResumedChunks();
+
+private:
+    void handleChunk(const Data::FileTransfer::Chunk &message);
+    void handleChunkAcknowledge(const Data::FileTransfer::ChunkAcknowledge &message);
+    void handleFileComplete(const Data::FileTransfer::FileComplete &message);
+    void handleResult(const Data::FileTransfer::TransferResult &message);
+    void finish(bool completed);
+};
+
+}
+
+#endif
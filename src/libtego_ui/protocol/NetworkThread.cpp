@@ -0,0 +1,247 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "NetworkThread.h"
+#include "Connection_p.h"
+#include "utils/Useful.h"
+
+using namespace Protocol;
+
+static bool networkThreadEnabled = false;
+static QThread *networkThread = 0;
+
+bool NetworkThread::isEnabled()
+{
+    return networkThreadEnabled;
+}
+
+void NetworkThread::setEnabled(bool enabled)
+{
+    networkThreadEnabled = enabled;
+}
+
+QThread *NetworkThread::thread()
+{
+    if (!networkThread) {
+        networkThread = new QThread;
+        networkThread->setObjectName(QStringLiteral("network"));
+        networkThread->start();
+        // Workers pending deletion are destroyed as the thread finishes
+        qAddPostRoutine(NetworkThread::stop);
+    }
+
+    return networkThread;
+}
+
+void NetworkThread::stop()
+{
+    if (!networkThread)
+        return;
+
+    networkThread->quit();
+    networkThread->wait();
+    delete networkThread;
+    networkThread = 0;
+}
+
+SocketWorker::SocketWorker(QTcpSocket *s, quint8 f, int m, const QByteArray &buffered)
+    : socket(s)
+    , framing(f)
+    , maxDataSize(m)
+    , readBuffer(buffered)
+    , readBufferEnd(buffered.size())
+    , connected(s->state() == QAbstractSocket::ConnectedState)
+    , unwritten(s->bytesToWrite())
+    , readableSignalled(false)
+    , writeSignalled(false)
+{
+    socket->setParent(this);
+
+    // Make sure the partial packet will fit
+    if (readBufferEnd > 0)
+        readBuffer.resize(qMax(packetSizeAt(0), ConnectionPrivate::ReadBufferSize));
+}
+
+SocketWorker::~SocketWorker()
+{
+}
+
+/* Begin handling the socket, once moved to the network thread
+ *
+ * Data may already be buffered from before the move, so it's read
+ * immediately rather than waiting for the next readyRead.
+ */
+void SocketWorker::start()
+{
+    connect(socket, &QAbstractSocket::disconnected, this, &SocketWorker::socketDisconnected);
+    connect(socket, &QIODevice::readyRead, this, &SocketWorker::socketReadable);
+    connect(socket, &QIODevice::bytesWritten, this, &SocketWorker::socketBytesWritten);
+
+    if (socket->state() != QAbstractSocket::ConnectedState) {
+        socketDisconnected();
+        return;
+    }
+
+    writeQueued();
+    socketReadable();
+}
+
+void SocketWorker::write(QByteArray &&data)
+{
+    if (data.isEmpty())
+        return;
+
+    unwritten.fetch_add(data.size(), std::memory_order_acq_rel);
+    outbound.push(std::move(data));
+    if (!writeSignalled.exchange(true, std::memory_order_acq_rel))
+        metaObject()->invokeMethod(this, "writeQueued", Qt::QueuedConnection);
+}
+
+bool SocketWorker::takePackets(QByteArray &packets)
+{
+    return inbound.pop(packets);
+}
+
+void SocketWorker::writeQueued()
+{
+    writeSignalled.store(false, std::memory_order_release);
+
+    QByteArray data;
+    while (outbound.pop(data)) {
+        if (socket->state() != QAbstractSocket::ConnectedState)
+            continue;
+
+        if (socket->write(data) != data.size()) {
+            qDebug() << "Connection socket error" << socket->error() << "during write:" << socket->errorString();
+            socket->abort();
+        }
+    }
+}
+
+void SocketWorker::disconnectFromHost()
+{
+    // Data queued before the disconnect is written first
+    writeQueued();
+    socket->disconnectFromHost();
+}
+
+void SocketWorker::abort()
+{
+    socket->abort();
+}
+
+void SocketWorker::socketBytesWritten(qint64 bytes)
+{
+    unwritten.fetch_sub(bytes, std::memory_order_acq_rel);
+    emit bytesWritten();
+}
+
+void SocketWorker::socketDisconnected()
+{
+    connected.store(false, std::memory_order_release);
+    emit disconnected();
+}
+
+/* Read all available socket data, and queue each run of complete packets
+ *
+ * Packets are only split at their boundaries here; they are checked and
+ * dispatched by ConnectionPrivate::readQueuedPackets. Partial packets stay
+ * at the front of the read buffer until the rest arrives.
+ */
+int SocketWorker::packetSizeAt(int offset) const
+{
+    int dataSize, channelId;
+    int headerSize = ConnectionPrivate::readPacketHeader(framing, readBuffer.constData() + offset, readBufferEnd - offset,
+                                                         maxDataSize, dataSize, channelId);
+    return headerSize > 0 ? headerSize + dataSize : headerSize;
+}
+
+void SocketWorker::socketReadable()
+{
+    qint64 available;
+    while ((available = socket->bytesAvailable()) > 0) {
+        if (readBuffer.isEmpty())
+            readBuffer.resize(ConnectionPrivate::ReadBufferSize);
+
+        qint64 space = readBuffer.size() - readBufferEnd;
+        qint64 re = socket->read(readBuffer.data() + readBufferEnd, qMin(available, space));
+        if (re < 0) {
+            qDebug() << "Connection socket error" << socket->error() << "during read:" << socket->errorString();
+            socket->abort();
+            return;
+        } else if (re == 0) {
+            BUG() << "Socket had" << available << "bytes available but read returned nothing";
+            return;
+        }
+        readBufferEnd += re;
+
+        int complete = 0;
+        while (complete < readBufferEnd) {
+            int packetSize = packetSizeAt(complete);
+            if (packetSize < 0) {
+                qWarning() << "Corrupted data from connection (invalid packet header); disconnecting";
+                socket->abort();
+                return;
+            }
+
+            if (packetSize == 0 || packetSize > readBufferEnd - complete)
+                break;
+            complete += packetSize;
+        }
+
+        if (complete > 0) {
+            QByteArray packets;
+            int pending = readBufferEnd - complete;
+            if (pending == 0) {
+                // Hand over the whole buffer; a new one is allocated for the next read
+                readBuffer.resize(complete);
+                packets.swap(readBuffer);
+            } else {
+                packets = QByteArray(readBuffer.constData(), complete);
+                memmove(readBuffer.data(), readBuffer.constData() + complete, pending);
+            }
+            readBufferEnd = pending;
+
+            inbound.push(std::move(packets));
+            if (!readableSignalled.exchange(true, std::memory_order_acq_rel))
+                emit readable();
+        }
+
+        // Make sure the partial packet at the front will fit
+        if (readBufferEnd > 0) {
+            int packetSize = packetSizeAt(0);
+            if (packetSize > readBuffer.size())
+                readBuffer.resize(packetSize);
+        }
+    }
+}
@@ -0,0 +1,142 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef PROTOCOL_NETWORKTHREAD_H
+#define PROTOCOL_NETWORKTHREAD_H
+
+#include "utils/SpscQueue.h"
+
+class QTcpSocket;
+class QThread;
+
+namespace Protocol
+{
+
+/* Shared worker thread for connection socket I/O
+ *
+ * By default, connections read and write their sockets on the thread that
+ * owns them, which is usually the GUI thread. When the network thread is
+ * enabled, each connection hands its socket to a SocketWorker on this thread
+ * after version negotiation. The worker reads from the socket and splits the
+ * data into packets; the connection receives them in batches and dispatches
+ * them to channels on its own thread.
+ *
+ * Enabling the thread only affects connections that finish negotiation
+ * afterwards. The thread is started on first use and stopped when the
+ * application exits.
+ */
+class NetworkThread
+{
+public:
+    static bool isEnabled();
+    static void setEnabled(bool enabled);
+
+    static QThread *thread();
+
+private:
+    static void stop();
+};
+
+/* Socket owned by the network thread on behalf of a Connection
+ *
+ * Methods marked below are called from the connection's thread; everything
+ * else runs on the network thread. Data passes between the threads through
+ * lock-free queues, and each side is woken by at most one queued call until
+ * it has drained its queue.
+ */
+class SocketWorker : public QObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(SocketWorker)
+
+public:
+    /* Takes ownership of 'socket'; call before moving to the network thread
+     *
+     * Packets are split using the connection's inbound 'framing' version, and
+     * packets with more than 'maxDataSize' bytes of data abort the socket.
+     * 'buffered' is the start of a partial packet already read from the socket.
+     */
+    explicit SocketWorker(QTcpSocket *socket, quint8 framing, int maxDataSize,
+                          const QByteArray &buffered = QByteArray());
+    virtual ~SocketWorker();
+
+    // Connection's thread: state of the socket, as last seen by the worker
+    bool isConnected() const { return connected.load(std::memory_order_acquire); }
+    // Connection's thread: bytes handed to write() that the socket hasn't sent
+    qint64 bytesToWrite() const { return unwritten.load(std::memory_order_acquire); }
+
+    // Connection's thread: queue data to be written to the socket
+    void write(QByteArray &&data);
+    // Connection's thread: take the next batch of complete packets
+    bool takePackets(QByteArray &packets);
+    // Connection's thread: call before draining takePackets
+    void resetReadable() { readableSignalled.store(false, std::memory_order_release); }
+
+public slots:
+    void start();
+    void disconnectFromHost();
+    void abort();
+
+signals:
+    // Emitted once when packets are available, and again only after resetReadable
+    void readable();
+    void bytesWritten();
+    void disconnected();
+
+private slots:
+    void socketReadable();
+    void socketBytesWritten(qint64 bytes);
+    void socketDisconnected();
+    void writeQueued();
+
+private:
+    QTcpSocket *socket;
+    quint8 framing;
+    int maxDataSize;
+    QByteArray readBuffer;
+    int readBufferEnd;
+
+    // Size of the packet at 'offset' in readBuffer, 0 if its header is incomplete, or -1 if invalid
+    int packetSizeAt(int offset) const;
+
+    SpscQueue<QByteArray> inbound;
+    SpscQueue<QByteArray> outbound;
+    std::atomic<bool> connected;
+    std::atomic<qint64> unwritten;
+    std::atomic<bool> readableSignalled;
+    std::atomic<bool> writeSignalled;
+};
+
+}
+
+#endif
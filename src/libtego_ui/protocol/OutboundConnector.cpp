@@ -32,6 +32,7 @@
 
 #include "OutboundConnector.h"
 #include "utils/Useful.h"
+#include "utils/TimerWheel.h"
 #include "tor/TorSocket.h"
 #include "ControlChannel.h"
 #include "AuthHiddenServiceChannel.h"
@@ -54,8 +55,13 @@ public:
     OutboundConnector::Status status;
     CryptoKey authPrivateKey;
     QString errorMessage;
-    QTimer errorRetryTimer;
+    WheelTimer errorRetryTimer;
     int errorRetryCount;
+    bool pipelined;
+    // Set after a peer turned out not to support pipelining
+    bool pipelineFailed;
+    QDateTime lastSeen;
+    bool pendingMessages;
 
     OutboundConnectorPrivate(OutboundConnector *q)
         : QObject(q)
@@ -64,8 +70,11 @@ public:
         , port(0)
         , status(OutboundConnector::Inactive)
         , errorRetryCount(0)
+        , pipelined(false)
+        , pipelineFailed(false)
+        , pendingMessages(false)
     {
-        connect(&errorRetryTimer, &QTimer::timeout, this, &OutboundConnectorPrivate::retryAfterError);
+        connect(&errorRetryTimer, &WheelTimer::timeout, this, &OutboundConnectorPrivate::retryAfterError);
     }
 
     void setStatus(OutboundConnector::Status status);
@@ -76,6 +85,7 @@ public slots:
     void startAuthentication();
     void abort();
     void retryAfterError();
+    void retryWithoutPipelining();
 };
 
 }
@@ -131,6 +141,7 @@ bool OutboundConnector::connectToHost(const QString &hostname, quint16 port)
 
     d->socket = new Tor::TorSocket(this);
     connect(d->socket, &Tor::TorSocket::connected, d, &OutboundConnectorPrivate::onConnected);
+    d->socket->setConnectPriority(d->lastSeen, d->pendingMessages);
     d->setStatus(Connecting);
     d->socket->connectToHost(d->hostname, d->port);
     return true;
@@ -161,6 +172,24 @@ void OutboundConnectorPrivate::abort()
     }
 }
 
+void OutboundConnector::setPipelined(bool pipelined)
+{
+    d->pipelined = pipelined;
+}
+
+bool OutboundConnector::isPipelined() const
+{
+    return d->pipelined && !d->pipelineFailed;
+}
+
+void OutboundConnector::setConnectPriority(const QDateTime &lastSeen, bool pendingMessages)
+{
+    d->lastSeen = lastSeen;
+    d->pendingMessages = pendingMessages;
+    if (d->socket)
+        d->socket->setConnectPriority(lastSeen, pendingMessages);
+}
+
 OutboundConnector::Status OutboundConnector::status() const
 {
     return d->status;
@@ -252,15 +281,39 @@ void OutboundConnectorPrivate::onConnected()
     socket->setReconnectEnabled(false);
     socket = 0;
 
-    connect(connection.data(), &Connection::ready, this, &OutboundConnectorPrivate::startAuthentication);
     // XXX Needs special treatment in UI (along with some other error types here)
     connect(connection.data(), &Connection::versionNegotiationFailed, this,
         [this]() {
             setError(QStringLiteral("Protocol version negotiation failed with peer"));
         }
     );
-    connect(connection.data(), &Connection::oldVersionNegotiated, q, &OutboundConnector::oldVersionNegotiated);
     setStatus(OutboundConnector::Initializing);
+
+    if (q->isPipelined() && authPrivateKey.isLoaded()) {
+        // The old protocol can't skip our packets, so try again without them
+        connect(connection.data(), &Connection::oldVersionNegotiated, this,
+            [this]() {
+                qDebug() << "Peer uses an old protocol version; retrying connection without pipelining";
+                pipelineFailed = true;
+                metaObject()->invokeMethod(this, "retryWithoutPipelining", Qt::QueuedConnection);
+            }
+        );
+        startAuthentication();
+    } else {
+        connect(connection.data(), &Connection::ready, this, &OutboundConnectorPrivate::startAuthentication);
+        connect(connection.data(), &Connection::oldVersionNegotiated, q, &OutboundConnector::oldVersionNegotiated);
+    }
+}
+
+void OutboundConnectorPrivate::retryWithoutPipelining()
+{
+    if (status != OutboundConnector::Initializing && status != OutboundConnector::Authenticating)
+        return;
+
+    QString host = hostname;
+    quint16 hostPort = port;
+    q->abort();
+    q->connectToHost(host, hostPort);
 }
 
 void OutboundConnectorPrivate::startAuthentication()
@@ -77,6 +77,26 @@ public:
     bool connectToHost(const QString &hostname, quint16 port);
     void setAuthPrivateKey(const CryptoKey &key);
 
+    /* Open the authentication channel without waiting for version negotiation
+     *
+     * The OpenChannel request is sent right after the introduction, which
+     * saves a round trip. Peers using the current version read it as soon as
+     * they have answered the introduction. A peer using an older version
+     * can't, so if one is found the connection is retried without pipelining.
+     *
+     * Pipelining needs an authentication key; it has no effect without one.
+     */
+    void setPipelined(bool pipelined);
+    bool isPipelined() const;
+
+    /* Hints for when to make connection attempts, relative to other peers
+     *
+     * Attempts for all peers share a limited number of slots; see
+     * Tor::ConnectScheduler. Peers that were seen recently, or that have
+     * messages waiting, are tried earlier.
+     */
+    void setConnectPriority(const QDateTime &lastSeen, bool pendingMessages);
+
     /* Take ownership of the Connection object when Ready
      *
      * This function is only valid in the Ready state.
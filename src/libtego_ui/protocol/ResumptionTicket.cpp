@@ -0,0 +1,209 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "ResumptionTicket.h"
+#include "utils/SecureRNG.h"
+#include "utils/Useful.h"
+#include <openssl/evp.h>
+
+using namespace Protocol;
+
+namespace {
+
+/* Sealed ticket layout:
+ *
+ *   nonce       12 bytes
+ *   ciphertext  of: version (1 byte), expiry (8 bytes, big endian), client service id
+ *   tag         16 bytes
+ */
+const quint8 TicketVersion = 1;
+const int KeySize = 32;
+const int NonceSize = 12;
+const int TagSize = 16;
+const int HeaderSize = 1 + 8;
+
+struct CipherContextDeleter
+{
+    void operator()(EVP_CIPHER_CTX *ctx) const { EVP_CIPHER_CTX_free(ctx); }
+};
+typedef std::unique_ptr<EVP_CIPHER_CTX, CipherContextDeleter> CipherContext;
+
+// Created on first use; tickets don't outlive the process that issued them
+const QByteArray &ticketKey()
+{
+    static const QByteArray key = SecureRNG::random(KeySize);
+    return key;
+}
+
+struct StoredTicket
+{
+    QByteArray ticket;
+    qint64 expiry;
+};
+
+QHash<QString,StoredTicket> &storedTickets()
+{
+    static QHash<QString,StoredTicket> tickets;
+    return tickets;
+}
+
+QString storageKey(const QString &clientServiceId, const QString &serverServiceId)
+{
+    return clientServiceId + QLatin1Char(':') + serverServiceId;
+}
+
+}
+
+QByteArray ResumptionTicket::issue(const QString &clientServiceId, const QString &serverServiceId, qint64 expiry)
+{
+    QByteArray client = clientServiceId.toLatin1();
+    QByteArray server = serverServiceId.toLatin1();
+    if (client.size() != TEGO_V3_ONION_SERVICE_ID_LENGTH || server.size() != TEGO_V3_ONION_SERVICE_ID_LENGTH) {
+        BUG() << "Cannot issue resumption ticket with invalid service ids";
+        return QByteArray();
+    }
+
+    if (expiry == 0)
+        expiry = QDateTime::currentSecsSinceEpoch() + Lifetime;
+
+    QByteArray plaintext(HeaderSize, 0);
+    plaintext[0] = char(TicketVersion);
+    qToBigEndian(quint64(expiry), reinterpret_cast<uchar*>(plaintext.data() + 1));
+    plaintext.append(client);
+
+    QByteArray ticket = SecureRNG::random(NonceSize);
+    ticket.resize(NonceSize + plaintext.size() + TagSize);
+    uchar *nonce = reinterpret_cast<uchar*>(ticket.data());
+    uchar *ciphertext = nonce + NonceSize;
+    uchar *tag = ciphertext + plaintext.size();
+
+    CipherContext ctx(EVP_CIPHER_CTX_new());
+    int length = 0;
+    if (!ctx ||
+        !EVP_EncryptInit_ex(ctx.get(), EVP_aes_256_gcm(), nullptr, nullptr, nullptr) ||
+        !EVP_CIPHER_CTX_ctrl(ctx.get(), EVP_CTRL_GCM_SET_IVLEN, NonceSize, nullptr) ||
+        !EVP_EncryptInit_ex(ctx.get(), nullptr, nullptr, reinterpret_cast<const uchar*>(ticketKey().constData()), nonce) ||
+        !EVP_EncryptUpdate(ctx.get(), nullptr, &length, reinterpret_cast<const uchar*>(server.constData()), server.size()) ||
+        !EVP_EncryptUpdate(ctx.get(), ciphertext, &length, reinterpret_cast<const uchar*>(plaintext.constData()), plaintext.size()) ||
+        !EVP_EncryptFinal_ex(ctx.get(), ciphertext + length, &length) ||
+        !EVP_CIPHER_CTX_ctrl(ctx.get(), EVP_CTRL_GCM_GET_TAG, TagSize, tag))
+    {
+        qWarning() << "Failed sealing resumption ticket";
+        return QByteArray();
+    }
+
+    return ticket;
+}
+
+QString ResumptionTicket::redeem(const QByteArray &ticket, const QString &serverServiceId)
+{
+    const int plaintextSize = HeaderSize + TEGO_V3_ONION_SERVICE_ID_LENGTH;
+    if (ticket.size() != NonceSize + plaintextSize + TagSize)
+        return QString();
+
+    QByteArray server = serverServiceId.toLatin1();
+    const uchar *nonce = reinterpret_cast<const uchar*>(ticket.constData());
+    const uchar *ciphertext = nonce + NonceSize;
+    const uchar *tag = ciphertext + plaintextSize;
+
+    QByteArray plaintext(plaintextSize, 0);
+    uchar *output = reinterpret_cast<uchar*>(plaintext.data());
+
+    // OpenSSL takes a non-const pointer to the expected tag
+    uchar expectedTag[TagSize];
+    memcpy(expectedTag, tag, TagSize);
+
+    CipherContext ctx(EVP_CIPHER_CTX_new());
+    int length = 0;
+    if (!ctx ||
+        !EVP_DecryptInit_ex(ctx.get(), EVP_aes_256_gcm(), nullptr, nullptr, nullptr) ||
+        !EVP_CIPHER_CTX_ctrl(ctx.get(), EVP_CTRL_GCM_SET_IVLEN, NonceSize, nullptr) ||
+        !EVP_DecryptInit_ex(ctx.get(), nullptr, nullptr, reinterpret_cast<const uchar*>(ticketKey().constData()), nonce) ||
+        !EVP_DecryptUpdate(ctx.get(), nullptr, &length, reinterpret_cast<const uchar*>(server.constData()), server.size()) ||
+        !EVP_DecryptUpdate(ctx.get(), output, &length, ciphertext, plaintextSize) ||
+        !EVP_CIPHER_CTX_ctrl(ctx.get(), EVP_CTRL_GCM_SET_TAG, TagSize, expectedTag) ||
+        EVP_DecryptFinal_ex(ctx.get(), output + length, &length) <= 0)
+    {
+        qDebug() << "Rejecting resumption ticket that fails authentication";
+        return QString();
+    }
+
+    if (quint8(plaintext.at(0)) != TicketVersion)
+        return QString();
+
+    qint64 expiry = qint64(qFromBigEndian<quint64>(output + 1));
+    if (expiry <= QDateTime::currentSecsSinceEpoch()) {
+        qDebug() << "Rejecting expired resumption ticket";
+        return QString();
+    }
+
+    return QString::fromLatin1(plaintext.mid(HeaderSize));
+}
+
+void ResumptionTicket::store(const QString &clientServiceId, const QString &serverServiceId, const QByteArray &ticket, int lifetime)
+{
+    if (ticket.isEmpty() || ticket.size() > MaxSize || lifetime <= 0) {
+        discard(clientServiceId, serverServiceId);
+        return;
+    }
+
+    // Drop expired tickets while we're here, so the storage can't grow without bound
+    qint64 now = QDateTime::currentSecsSinceEpoch();
+    QHash<QString,StoredTicket> &tickets = storedTickets();
+    for (auto it = tickets.begin(); it != tickets.end(); ) {
+        if (it->expiry <= now)
+            it = tickets.erase(it);
+        else
+            it++;
+    }
+
+    tickets.insert(storageKey(clientServiceId, serverServiceId), StoredTicket{ ticket, now + qMin(lifetime, int(Lifetime)) });
+}
+
+QByteArray ResumptionTicket::find(const QString &clientServiceId, const QString &serverServiceId)
+{
+    QHash<QString,StoredTicket> &tickets = storedTickets();
+    auto it = tickets.find(storageKey(clientServiceId, serverServiceId));
+    if (it == tickets.end())
+        return QByteArray();
+
+    if (it->expiry <= QDateTime::currentSecsSinceEpoch()) {
+        tickets.erase(it);
+        return QByteArray();
+    }
+    return it->ticket;
+}
+
+void ResumptionTicket::discard(const QString &clientServiceId, const QString &serverServiceId)
+{
+    storedTickets().remove(storageKey(clientServiceId, serverServiceId));
+}
@@ -0,0 +1,90 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PROTOCOL_RESUMPTIONTICKET_H
+#define PROTOCOL_RESUMPTIONTICKET_H
+
+namespace Protocol
+{
+
+/* Tickets for resuming AuthHiddenServiceChannel authentication
+ *
+ * After a successful authentication, the server issues a ticket to the
+ * client. The ticket holds the client's service id and an expiry, sealed with
+ * AES-256-GCM under a random key that only exists in the server's memory, and
+ * bound to the server's service id as associated data. The client presents it
+ * when it next opens an authentication channel to that server, which can then
+ * authenticate the client without a signature or public key operations.
+ *
+ * A ticket is a bearer token. Clients only keep tickets in memory and only
+ * send them to the service that issued them, which the onion service
+ * protocol authenticates. Tickets expire after Lifetime seconds, and all of a
+ * server's tickets become invalid when it restarts; clients then fall back
+ * to a full authentication.
+ *
+ * All functions must be called from the main thread.
+ */
+class ResumptionTicket
+{
+public:
+    // Seconds that a ticket is valid after it is issued
+    static const int Lifetime = 6 * 60 * 60;
+    // Tickets larger than this are never valid
+    static const int MaxSize = 128;
+
+    /* Issue a ticket authenticating 'clientServiceId' to 'serverServiceId'
+     *
+     * The ticket expires at 'expiry', in seconds since the epoch, or after
+     * Lifetime if 'expiry' is 0. Returns an empty array on failure.
+     */
+    static QByteArray issue(const QString &clientServiceId, const QString &serverServiceId, qint64 expiry = 0);
+
+    /* Open a ticket presented to 'serverServiceId'
+     *
+     * Returns the authenticated client service id, or an empty string if
+     * the ticket is invalid, expired, or issued by a different service.
+     */
+    static QString redeem(const QByteArray &ticket, const QString &serverServiceId);
+
+    /* Client side storage of tickets, by client and server service id
+     *
+     * A stored ticket is kept until 'lifetime' seconds have passed, or until
+     * it's replaced or discarded.
+     */
+    static void store(const QString &clientServiceId, const QString &serverServiceId, const QByteArray &ticket, int lifetime);
+    static QByteArray find(const QString &clientServiceId, const QString &serverServiceId);
+    static void discard(const QString &clientServiceId, const QString &serverServiceId);
+};
+
+}
+
+#endif
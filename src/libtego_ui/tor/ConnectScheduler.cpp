@@ -0,0 +1,308 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "ConnectScheduler.h"
+#include "TorControl.h"
+#include "protocol/DirectTransport.h"
+#include "utils/SecureRNG.h"
+
+using namespace Tor;
+
+ConnectScheduler *ConnectScheduler::instance()
+{
+    // Never deleted; sockets can outlive the application object
+    static ConnectScheduler *scheduler = 0;
+    if (!scheduler) {
+        scheduler = new ConnectScheduler;
+        if (torControl) {
+            // Direct connections don't need Tor; see Protocol::DirectTransport
+            auto update = []() {
+                scheduler->setPaused(!torControl->hasConnectivity() && !Protocol::DirectTransport::isEnabled());
+            };
+            connect(torControl, &TorControl::connectivityChanged, scheduler, update);
+            update();
+        }
+    }
+    return scheduler;
+}
+
+ConnectScheduler::ConnectScheduler(QObject *parent)
+    : QObject(parent)
+    , m_sequence(0)
+    , m_maxConcurrent(DefaultMaxConcurrent)
+    , m_paused(false)
+    , m_wakeup(-1)
+{
+    m_clock.start();
+    m_timer.setSingleShot(true);
+    connect(&m_timer, &WheelTimer::timeout, this, &ConnectScheduler::process);
+}
+
+ConnectScheduler::~ConnectScheduler()
+{
+}
+
+qint64 ConnectScheduler::now() const
+{
+    return m_clock.elapsed();
+}
+
+void ConnectScheduler::setMaxConcurrent(int max)
+{
+    m_maxConcurrent = qMax(1, max);
+    scheduleWakeup();
+}
+
+void ConnectScheduler::setPaused(bool paused)
+{
+    if (m_paused == paused)
+        return;
+
+    m_paused = paused;
+    scheduleWakeup();
+}
+
+void ConnectScheduler::request(Client *client)
+{
+    auto it = insertClient(client);
+
+    if (it->state != Idle)
+        return;
+
+    qint64 time = now();
+    if (it->failures)
+        time += retryDelay(*it);
+    enqueue(client, *it, time);
+    scheduleWakeup();
+}
+
+void ConnectScheduler::attemptFinished(Client *client, bool succeeded)
+{
+    auto it = m_clients.find(client);
+    if (it == m_clients.end() || it->state == Waiting || it->state == Ready)
+        return;
+
+    if (it->state == Active) {
+        m_active.remove(client);
+        it->state = Idle;
+    }
+
+    if (!succeeded) {
+        it->failures++;
+        enqueue(client, *it, now() + retryDelay(*it));
+    }
+    scheduleWakeup();
+}
+
+void ConnectScheduler::cancel(Client *client)
+{
+    auto it = m_clients.find(client);
+    if (it == m_clients.end())
+        return;
+
+    if (it->state == Active)
+        m_active.remove(client);
+    unqueue(*it);
+    scheduleWakeup();
+}
+
+void ConnectScheduler::remove(Client *client)
+{
+    cancel(client);
+    m_clients.remove(client);
+}
+
+void ConnectScheduler::resetAttempts(Client *client)
+{
+    auto it = m_clients.find(client);
+    if (it == m_clients.end())
+        return;
+
+    it->failures = 0;
+    if (it->state == Waiting) {
+        unqueue(*it);
+        enqueue(client, *it, now() + retryDelay(*it));
+        scheduleWakeup();
+    }
+}
+
+int ConnectScheduler::failureCount(Client *client) const
+{
+    auto it = m_clients.constFind(client);
+    return it != m_clients.constEnd() ? it->failures : 0;
+}
+
+void ConnectScheduler::setMaxRetryDelay(Client *client, int delay)
+{
+    auto it = insertClient(client);
+    it->maxRetryDelay = delay;
+}
+
+void ConnectScheduler::setPriority(Client *client, const QDateTime &lastSeen, bool pendingMessages)
+{
+    auto it = insertClient(client);
+
+    it->lastSeen = lastSeen.isValid() ? lastSeen.toMSecsSinceEpoch() : 0;
+    it->pendingMessages = pendingMessages;
+
+    // Only the order of attempts that are due depends on priority
+    if (it->state == Ready) {
+        unqueue(*it);
+        enqueue(client, *it, it->time);
+    }
+}
+
+void ConnectScheduler::process()
+{
+    qint64 time = now();
+
+    // Release slots of attempts that never reported a result
+    foreach (Client *client, m_active.values()) {
+        Entry &entry = m_clients[client];
+        if (entry.time + AttemptTimeout <= time) {
+            qDebug() << "Connection attempt didn't finish in" << AttemptTimeout / 1000 << "seconds; releasing its slot";
+            m_active.remove(client);
+            entry.state = Idle;
+        }
+    }
+
+    while (!m_waiting.isEmpty() && m_waiting.firstKey().time <= time) {
+        Client *client = m_waiting.first();
+        Entry &entry = m_clients[client];
+        unqueue(entry);
+        enqueue(client, entry, entry.time);
+    }
+
+    while (!m_paused && m_active.size() < m_maxConcurrent && !m_ready.isEmpty()) {
+        auto next = m_ready.begin();
+        Client *client = next.value();
+        m_ready.erase(next);
+
+        Entry &entry = m_clients[client];
+        entry.state = Active;
+        entry.time = time;
+        m_active.insert(client);
+
+        // The client may call back into the scheduler, so 'entry' isn't used after this
+        client->startConnectAttempt();
+    }
+
+    scheduleWakeup();
+}
+
+void ConnectScheduler::enqueue(Client *client, Entry &entry, qint64 time)
+{
+    entry.time = time;
+    if (time <= now()) {
+        entry.state = Ready;
+        entry.key = Key{ time - bonus(entry), ++m_sequence };
+        m_ready.insert(entry.key, client);
+    } else {
+        entry.state = Waiting;
+        entry.key = Key{ time, ++m_sequence };
+        m_waiting.insert(entry.key, client);
+    }
+}
+
+void ConnectScheduler::unqueue(Entry &entry)
+{
+    if (entry.state == Waiting)
+        m_waiting.remove(entry.key);
+    else if (entry.state == Ready)
+        m_ready.remove(entry.key);
+    entry.state = Idle;
+}
+
+QHash<ConnectScheduler::Client*,ConnectScheduler::Entry>::iterator ConnectScheduler::insertClient(Client *client)
+{
+    auto it = m_clients.find(client);
+    if (it == m_clients.end()) {
+        Entry entry = { Idle, 0, DefaultMaxRetryDelay, 0, false, 0, Key{ 0, 0 } };
+        it = m_clients.insert(client, entry);
+    }
+    return it;
+}
+
+qint64 ConnectScheduler::bonus(const Entry &entry) const
+{
+    qint64 bonus = entry.pendingMessages ? PendingMessagesBonus : 0;
+
+    // Contacts seen recently are more likely to be online; the bonus halves
+    // for a contact last seen a week ago, and keeps decreasing after that
+    if (entry.lastSeen) {
+        const qint64 week = qint64(7) * 24 * 60 * 60 * 1000;
+        qint64 age = qMax(qint64(0), QDateTime::currentMSecsSinceEpoch() - entry.lastSeen);
+        bonus += qint64(RecentlySeenBonus) * week / (week + age);
+    }
+
+    return bonus;
+}
+
+int ConnectScheduler::retryDelay(const Entry &entry) const
+{
+    int shift = qBound(0, entry.failures - 1, 16);
+    qint64 delay = qMin(qint64(InitialRetryDelay) << shift, qint64(entry.maxRetryDelay));
+    delay = qMax(delay, qint64(2));
+
+    // Between half and all of the delay
+    return int(delay / 2 + SecureRNG::randomInt(unsigned(delay - delay / 2) + 1));
+}
+
+void ConnectScheduler::scheduleWakeup()
+{
+    qint64 next = -1;
+    if (!m_paused && m_active.size() < m_maxConcurrent) {
+        if (!m_ready.isEmpty())
+            next = now();
+        else if (!m_waiting.isEmpty())
+            next = m_waiting.firstKey().time;
+    }
+
+    foreach (Client *client, m_active) {
+        qint64 timeout = m_clients.value(client).time + AttemptTimeout;
+        if (next < 0 || timeout < next)
+            next = timeout;
+    }
+
+    wakeupAt(next);
+}
+
+void ConnectScheduler::wakeupAt(qint64 time)
+{
+    m_wakeup = time;
+    if (time < 0) {
+        m_timer.stop();
+        return;
+    }
+
+    m_timer.start(int(qBound(qint64(0), time - now(), qint64(INT_MAX))));
+}
@@ -0,0 +1,200 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CONNECTSCHEDULER_H
+#define CONNECTSCHEDULER_H
+
+#include "utils/TimerWheel.h"
+
+namespace Tor {
+
+/* Schedules outbound connection attempts for the whole process
+ *
+ * Every TorSocket asks the scheduler before connecting, instead of keeping
+ * its own retry timer. At most maxConcurrent() attempts run at once, so
+ * gaining connectivity with hundreds of offline contacts doesn't open
+ * hundreds of SOCKS connections and circuits at the same moment.
+ *
+ * After a failure, the next attempt waits for an exponential backoff,
+ * starting at InitialRetryDelay and limited by each client's maximum, and
+ * randomized to between half and all of that delay so failures don't stay
+ * synchronized.
+ *
+ * Attempts that are due start in order of the time they became due, less
+ * a bonus for clients with messages waiting to be sent and for clients
+ * that were recently seen. The bonus is limited, so clients without it
+ * wait longer but are never starved.
+ *
+ * All scheduling runs from a single timer on the TimerWheel. Subclasses can replace now()
+ * and drive process() themselves to simulate time.
+ */
+class ConnectScheduler : public QObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(ConnectScheduler)
+
+public:
+    class Client
+    {
+    public:
+        virtual ~Client() { }
+
+        /* Start a connection attempt
+         *
+         * The client must call attemptFinished when the attempt succeeds or
+         * fails. If it doesn't within AttemptTimeout, its slot is released.
+         */
+        virtual void startConnectAttempt() = 0;
+    };
+
+    // All times are in milliseconds
+    static const int DefaultMaxConcurrent = 8;
+    static const int InitialRetryDelay = 30 * 1000;
+    static const int DefaultMaxRetryDelay = 900 * 1000;
+    static const int AttemptTimeout = 120 * 1000;
+    static const int PendingMessagesBonus = 600 * 1000;
+    static const int RecentlySeenBonus = 300 * 1000;
+
+    /* The scheduler used by TorSocket */
+    static ConnectScheduler *instance();
+
+    explicit ConnectScheduler(QObject *parent = 0);
+    virtual ~ConnectScheduler();
+
+    int maxConcurrent() const { return m_maxConcurrent; }
+    void setMaxConcurrent(int max);
+
+    /* No attempts are started while paused, e.g. without connectivity */
+    bool isPaused() const { return m_paused; }
+    void setPaused(bool paused);
+
+    /* Ask for a connection attempt
+     *
+     * The attempt starts once control returns to the event loop if a slot is
+     * free, unless the client has failed since resetAttempts; then it waits
+     * for the backoff. Does nothing if the client is already waiting or has
+     * an attempt running.
+     */
+    void request(Client *client);
+
+    /* Report the end of an attempt, and release its slot
+     *
+     * After a failure, another attempt is scheduled. This may also be called
+     * for a connection that was lost, without an attempt running.
+     */
+    void attemptFinished(Client *client, bool succeeded);
+
+    /* Stop waiting for, or release the slot of, a client's attempt */
+    void cancel(Client *client);
+    /* Forget a client entirely; it must be called before a client is destroyed */
+    void remove(Client *client);
+
+    /* Start the backoff over, after the client has connected successfully */
+    void resetAttempts(Client *client);
+    int failureCount(Client *client) const;
+    void setMaxRetryDelay(Client *client, int delay);
+    void setPriority(Client *client, const QDateTime &lastSeen, bool pendingMessages);
+
+    int activeCount() const { return m_active.size(); }
+    /* Attempts that are due, but waiting for a free slot */
+    int readyCount() const { return m_ready.size(); }
+    /* Attempts that wait for their backoff */
+    int waitingCount() const { return m_waiting.size(); }
+
+    /* The time when process() next needs to run, or -1 */
+    qint64 nextWakeup() const { return m_wakeup; }
+
+public slots:
+    /* Start attempts that are due, as far as slots allow */
+    void process();
+
+protected:
+    /* Current time, in milliseconds */
+    virtual qint64 now() const;
+
+private:
+    enum State {
+        Idle,
+        Waiting,
+        Ready,
+        Active
+    };
+
+    // Sort key for m_waiting and m_ready; the sequence number keeps keys unique
+    struct Key {
+        qint64 time;
+        quint64 sequence;
+
+        bool operator<(const Key &other) const
+        {
+            return time < other.time || (time == other.time && sequence < other.sequence);
+        }
+    };
+
+    struct Entry {
+        State state;
+        int failures;
+        int maxRetryDelay;
+        qint64 lastSeen;
+        bool pendingMessages;
+        // When the attempt is due, or started while Active
+        qint64 time;
+        // Position in m_waiting or m_ready
+        Key key;
+    };
+
+    QHash<Client*,Entry> m_clients;
+    // Keyed by the time each attempt is due
+    QMap<Key,Client*> m_waiting;
+    // Keyed by the time each attempt became due, less its bonus
+    QMap<Key,Client*> m_ready;
+    QSet<Client*> m_active;
+    quint64 m_sequence;
+    int m_maxConcurrent;
+    bool m_paused;
+
+    WheelTimer m_timer;
+    QElapsedTimer m_clock;
+    qint64 m_wakeup;
+
+    QHash<Client*,Entry>::iterator insertClient(Client *client);
+    void enqueue(Client *client, Entry &entry, qint64 time);
+    void unqueue(Entry &entry);
+    qint64 bonus(const Entry &entry) const;
+    int retryDelay(const Entry &entry) const;
+    void scheduleWakeup();
+    void wakeupAt(qint64 time);
+};
+
+}
+
+#endif
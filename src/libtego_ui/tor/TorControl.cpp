@@ -40,6 +40,7 @@
 #include "AddOnionCommand.h"
 #include "utils/StringUtil.h"
 #include "utils/Settings.h"
+#include "utils/Useful.h"
 #include "utils/PendingOperation.h"
 
 Tor::TorControl *torControl = 0;
@@ -67,6 +68,8 @@ public:
     TorControl::TorStatus torStatus;
     QVariantMap bootstrapStatus;
     bool hasOwnership;
+    // Set by setStandaloneProxy; there is no control connection
+    bool standalone;
 
     TorControlPrivate(TorControl *parent);
 
@@ -75,6 +78,7 @@ public:
 
     void getTorInfo();
     void publishServices();
+    void publishStandalone(HiddenService *service);
 
 public slots:
     void socketConnected();
@@ -100,7 +104,7 @@ TorControl::TorControl(QObject *parent)
 TorControlPrivate::TorControlPrivate(TorControl *parent)
     : QObject(parent), q(parent), controlPort(0), socksPort(0),
       status(TorControl::NotConnected), torStatus(TorControl::TorUnknown),
-      hasOwnership(false)
+      hasOwnership(false), standalone(false)
 {
     socket = new TorControlSocket(this);
     QObject::connect(socket, SIGNAL(connected()), this, SLOT(socketConnected()));
@@ -114,6 +118,31 @@ QNetworkProxy TorControl::connectionProxy()
     return QNetworkProxy(QNetworkProxy::Socks5Proxy, d->socksAddress.toString(), d->socksPort);
 }
 
+void TorControl::setStandaloneProxy(const QHostAddress &address, quint16 port)
+{
+    if (isConnected()) {
+        BUG() << "Cannot use a standalone SOCKS proxy with a control connection";
+        return;
+    }
+
+    qDebug().nospace() << "torctrl: Using standalone SOCKS proxy at " << address.toString() << ":" << port;
+    d->standalone = true;
+    d->socksAddress = address;
+    d->socksPort = port;
+    foreach (HiddenService *service, d->services)
+        d->publishStandalone(service);
+
+    if (d->torStatus == TorReady)
+        emit connectivityChanged();
+    else
+        d->setTorStatus(TorReady);
+}
+
+void TorControlPrivate::publishStandalone(HiddenService *service)
+{
+    service->servicePublished();
+}
+
 void TorControlPrivate::setStatus(TorControl::Status n)
 {
     if (n == status)
@@ -456,6 +485,8 @@ void TorControl::addHiddenService(HiddenService *service)
         return;
 
     d->services.append(service);
+    if (d->standalone)
+        d->publishStandalone(service);
 }
 
 void TorControlPrivate::publishServices()
@@ -90,6 +90,14 @@ public:
     quint16 socksPort() const;
     QNetworkProxy connectionProxy();
 
+    /* Use a SOCKS proxy without a control connection
+     *
+     * Connectivity is assumed, and hidden services are taken as published
+     * elsewhere, as with the neverPublishServices setting. This is for
+     * emulated networks in tests and benchmarks.
+     */
+    void setStandaloneProxy(const QHostAddress &address, quint16 port);
+
     /* Authentication */
     void setAuthPassword(const QByteArray &password);
 
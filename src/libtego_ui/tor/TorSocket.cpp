@@ -32,27 +32,30 @@
 
 #include "TorSocket.h"
 #include "TorControl.h"
+#include "protocol/DirectTransport.h"
 
 using namespace Tor;
 
 TorSocket::TorSocket(QObject *parent)
     : QTcpSocket(parent)
     , m_port(0)
+    , m_openMode(ReadWrite)
+    , m_protocol(AnyIPProtocol)
     , m_reconnectEnabled(true)
     , m_maxInterval(900)
-    , m_connectAttempts(0)
 {
     connect(torControl, SIGNAL(connectivityChanged()), SLOT(connectivityChanged()));
-    connect(&m_connectTimer, SIGNAL(timeout()), SLOT(reconnect()));
+    connect(this, SIGNAL(connected()), SLOT(onConnected()));
     connect(this, SIGNAL(disconnected()), SLOT(onFailed()));
     connect(this, SIGNAL(error(QAbstractSocket::SocketError)), SLOT(onFailed()));
 
-    m_connectTimer.setSingleShot(true);
+    ConnectScheduler::instance()->setMaxRetryDelay(this, m_maxInterval * 1000);
     connectivityChanged();
 }
 
 TorSocket::~TorSocket()
 {
+    ConnectScheduler::instance()->remove(this);
 }
 
 void TorSocket::setReconnectEnabled(bool enabled)
@@ -62,61 +65,55 @@ void TorSocket::setReconnectEnabled(bool enabled)
 
     m_reconnectEnabled = enabled;
     if (m_reconnectEnabled) {
-        m_connectAttempts = 0;
+        ConnectScheduler::instance()->resetAttempts(this);
         reconnect();
-    } else {
-        m_connectTimer.stop();
+    } else if (state() == QAbstractSocket::UnconnectedState) {
+        ConnectScheduler::instance()->cancel(this);
     }
 }
 
 void TorSocket::setMaxAttemptInterval(int interval)
 {
     m_maxInterval = interval;
+    ConnectScheduler::instance()->setMaxRetryDelay(this, interval * 1000);
 }
 
 void TorSocket::resetAttempts()
 {
-    m_connectAttempts = 0;
-    if (m_connectTimer.isActive()) {
-        m_connectTimer.stop();
-        m_connectTimer.start(reconnectInterval() * 1000);
-    }
+    ConnectScheduler::instance()->resetAttempts(this);
+}
+
+void TorSocket::setConnectPriority(const QDateTime &lastSeen, bool pendingMessages)
+{
+    ConnectScheduler::instance()->setPriority(this, lastSeen, pendingMessages);
 }
 
-int TorSocket::reconnectInterval()
+bool TorSocket::hasConnectivity() const
 {
-    int delay = 0;
-    if (m_connectAttempts <= 4)
-        delay = 30;
-    else if (m_connectAttempts <= 6)
-        delay = 120;
-    else
-        delay = m_maxInterval;
-
-    return qMin(delay, m_maxInterval);
+    // In direct mode, peers are reached without Tor
+    return Protocol::DirectTransport::isEnabled() || torControl->hasConnectivity();
 }
 
 void TorSocket::reconnect()
 {
-    if (!torControl->hasConnectivity() || !reconnectEnabled())
+    if (!hasConnectivity() || !reconnectEnabled())
         return;
 
-    m_connectTimer.stop();
-    if (!m_host.isEmpty() && m_port) {
-        qDebug() << "Attempting reconnection of socket to" << m_host << m_port;
-        connectToHost(m_host, m_port);
-    }
+    if (!m_host.isEmpty() && m_port)
+        ConnectScheduler::instance()->request(this);
 }
 
 void TorSocket::connectivityChanged()
 {
-    if (torControl->hasConnectivity()) {
-        setProxy(torControl->connectionProxy());
+    if (hasConnectivity()) {
+        if (!Protocol::DirectTransport::isEnabled())
+            setProxy(torControl->connectionProxy());
         if (state() == QAbstractSocket::UnconnectedState)
             reconnect();
     } else {
-        m_connectTimer.stop();
-        m_connectAttempts = 0;
+        // Attempts start over, with no backoff, when connectivity returns
+        ConnectScheduler::instance()->cancel(this);
+        ConnectScheduler::instance()->resetAttempts(this);
     }
 }
 
@@ -125,19 +122,56 @@ void TorSocket::connectToHost(const QString &hostName, quint16 port, OpenMode op
 {
     m_host = hostName;
     m_port = port;
+    m_openMode = openMode;
+    m_protocol = protocol;
+
+    if (!hasConnectivity())
+        return;
+
+    ConnectScheduler::instance()->request(this);
+}
+
+void TorSocket::connectToHost(const QHostAddress &address, quint16 port, OpenMode openMode)
+{
+    TorSocket::connectToHost(address.toString(), port, openMode);
+}
+
+void TorSocket::startConnectAttempt()
+{
+    if (!hasConnectivity() || m_host.isEmpty() || !m_port
+        || state() != QAbstractSocket::UnconnectedState)
+    {
+        ConnectScheduler::instance()->cancel(this);
+        return;
+    }
 
-    if (!torControl->hasConnectivity())
+    if (Protocol::DirectTransport::isEnabled()) {
+        Protocol::DirectTransport::Endpoint endpoint = Protocol::DirectTransport::route(m_host);
+        if (!endpoint.isValid()) {
+            qDebug() << "No direct route for" << m_host;
+            metaObject()->invokeMethod(this, "onFailed", Qt::QueuedConnection);
+            return;
+        }
+
+        setProxy(QNetworkProxy::NoProxy);
+        qDebug() << "Attempting direct connection of socket to" << m_host << "at" << endpoint.address << endpoint.port;
+        QAbstractSocket::connectToHost(endpoint.address, endpoint.port, m_openMode);
         return;
+    }
 
     if (proxy() != torControl->connectionProxy())
         setProxy(torControl->connectionProxy());
 
-    QAbstractSocket::connectToHost(hostName, port, openMode, protocol);
+    qDebug() << "Attempting connection of socket to" << m_host << m_port;
+    QAbstractSocket::connectToHost(m_host, m_port, m_openMode, m_protocol);
 }
 
-void TorSocket::connectToHost(const QHostAddress &address, quint16 port, OpenMode openMode)
+void TorSocket::onConnected()
 {
-    TorSocket::connectToHost(address.toString(), port, openMode);
+    // Through the proxy, the peer name is already the onion hostname
+    if (Protocol::DirectTransport::isEnabled())
+        setPeerName(m_host);
+    ConnectScheduler::instance()->attemptFinished(this, true);
 }
 
 void TorSocket::onFailed()
@@ -146,9 +180,9 @@ void TorSocket::onFailed()
     // Otherwise reconnect attempts will fail (#295)
     close();
 
-    if (reconnectEnabled() && !m_connectTimer.isActive()) {
-        m_connectAttempts++;
-        m_connectTimer.start(reconnectInterval() * 1000);
-        qDebug() << "Reconnecting socket to" << m_host << m_port << "in" << m_connectTimer.interval() / 1000 << "seconds";
+    if (reconnectEnabled()) {
+        ConnectScheduler::instance()->attemptFinished(this, false);
+    } else {
+        ConnectScheduler::instance()->cancel(this);
     }
 }
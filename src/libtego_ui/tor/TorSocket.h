@@ -33,6 +33,8 @@
 #ifndef TORSOCKET_H
 #define TORSOCKET_H
 
+#include "ConnectScheduler.h"
+
 namespace Tor {
 
 /* Specialized QTcpSocket which makes connections over the SOCKS proxy
@@ -41,7 +43,8 @@ namespace Tor {
  *
  * Use normal QTcpSocket/QAbstractSocket API. When a connection fails, it
  * will be retried automatically after the correct interval and when
- * connectivity is available.
+ * connectivity is available. Every attempt, including the first, is
+ * scheduled by ConnectScheduler, so it may not start immediately.
  *
  * To fully disconnect, destroy the object, or call
  * setReconnectEnabled(false) and disconnect the socket with
@@ -49,8 +52,11 @@ namespace Tor {
  *
  * The caller is responsible for resetting the attempt counter if a
  * connection was successful and reconnection will be used again.
+ *
+ * In direct mode, the socket connects to the local endpoint for its host
+ * without Tor; see Protocol::DirectTransport.
  */
-class TorSocket : public QTcpSocket
+class TorSocket : public QTcpSocket, private ConnectScheduler::Client
 {
     Q_OBJECT
 
@@ -64,27 +70,31 @@ public:
     void setMaxAttemptInterval(int interval);
     void resetAttempts();
 
+    /* Hints for the order of attempts; see ConnectScheduler */
+    void setConnectPriority(const QDateTime &lastSeen, bool pendingMessages);
+
     virtual void connectToHost(const QString &hostName, quint16 port, OpenMode openMode = ReadWrite, NetworkLayerProtocol protocol = AnyIPProtocol);
     virtual void connectToHost(const QHostAddress &address, quint16 port, OpenMode openMode = ReadWrite);
 
     QString hostName() const { return m_host; }
     quint16 port() const { return m_port; }
 
-protected:
-    virtual int reconnectInterval();
-
 private slots:
     void reconnect();
     void connectivityChanged();
+    void onConnected();
     void onFailed();
 
 private:
     QString m_host;
     quint16 m_port;
-    QTimer m_connectTimer;
+    OpenMode m_openMode;
+    NetworkLayerProtocol m_protocol;
     bool m_reconnectEnabled;
     int m_maxInterval;
-    int m_connectAttempts;
+
+    bool hasConnectivity() const;
+    virtual void startConnectAttempt();
 
     using QAbstractSocket::connectToHost;
 };
@@ -16,6 +16,15 @@ FocusScope {
 
     onVisibleChanged: if (visible) forceActiveFocus()
 
+    // Contacts are kept connected while their conversation is shown
+    Binding {
+        target: conversationModel
+        property: "visible"
+        value: chatPage.visible
+        when: conversationModel !== null
+    }
+    Component.onDestruction: if (conversationModel !== null) conversationModel.visible = false
+
     property bool active: visible && activeFocusItem !== null
     onActiveChanged: {
         if (active)
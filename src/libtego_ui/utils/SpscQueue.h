@@ -0,0 +1,113 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef UTILS_SPSCQUEUE_H
+#define UTILS_SPSCQUEUE_H
+
+#include <atomic>
+#include <utility>
+
+/* Lock-free queue for passing values from one thread to another
+ *
+ * Exactly one thread may call push, and exactly one (usually different)
+ * thread may call pop. Neither call blocks or takes a lock; each push
+ * allocates one node, which is freed by the pop that passes it.
+ *
+ * The queue is a linked list with a dummy node at the head. The producer
+ * publishes a node by storing it in the tail's next pointer with release
+ * semantics, and the consumer only follows next pointers, so the two threads
+ * never write to the same node.
+ */
+template<typename T> class SpscQueue
+{
+public:
+    SpscQueue()
+        : head(new Node)
+        , tail(head)
+    {
+    }
+
+    ~SpscQueue()
+    {
+        while (head) {
+            Node *next = head->next.load(std::memory_order_relaxed);
+            delete head;
+            head = next;
+        }
+    }
+
+    SpscQueue(const SpscQueue &) = delete;
+    SpscQueue &operator=(const SpscQueue &) = delete;
+
+    // Producer thread only
+    void push(T &&value)
+    {
+        Node *node = new Node;
+        node->value = std::move(value);
+        tail->next.store(node, std::memory_order_release);
+        tail = node;
+    }
+
+    // Consumer thread only. Returns false if the queue is empty.
+    bool pop(T &value)
+    {
+        Node *next = head->next.load(std::memory_order_acquire);
+        if (!next)
+            return false;
+
+        value = std::move(next->value);
+        delete head;
+        head = next;
+        return true;
+    }
+
+    // Consumer thread only
+    bool isEmpty() const
+    {
+        return !head->next.load(std::memory_order_acquire);
+    }
+
+private:
+    struct Node
+    {
+        T value;
+        std::atomic<Node*> next { nullptr };
+    };
+
+    // Owned by the consumer
+    Node *head;
+    // Owned by the producer
+    Node *tail;
+};
+
+#endif
@@ -0,0 +1,360 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "TimerWheel.h"
+#include "utils/Useful.h"
+
+TimerWheel *TimerWheel::instance()
+{
+    // One for each thread, deleted when the thread exits. Timers that outlive
+    // it are detached, and stopping or deleting them does nothing.
+    static QThreadStorage<TimerWheel*> wheels;
+    if (!wheels.hasLocalData())
+        wheels.setLocalData(new TimerWheel);
+    return wheels.localData();
+}
+
+TimerWheel::TimerWheel(QObject *parent)
+    : QObject(parent)
+    , m_expired(0)
+    , m_time(0)
+    , m_timerCount(0)
+    , m_wakeups(0)
+    , m_processing(false)
+    , m_wakeup(-1)
+{
+    memset(m_slots, 0, sizeof(m_slots));
+    memset(m_occupied, 0, sizeof(m_occupied));
+    m_clock.start();
+
+    // Expirations are already coalesced by the slots
+    m_timer.setSingleShot(true);
+    m_timer.setTimerType(Qt::PreciseTimer);
+    connect(&m_timer, &QTimer::timeout, this, &TimerWheel::process);
+}
+
+TimerWheel::~TimerWheel()
+{
+    if (m_timerCount)
+        qWarning() << "Destroying a TimerWheel with" << m_timerCount << "active timers";
+
+    for (int level = 0; level < Levels; level++) {
+        for (int slot = 0; slot < Slots; slot++) {
+            while (WheelTimer *timer = m_slots[level][slot]) {
+                unlink(timer);
+                timer->m_active = false;
+                timer->m_wheel = 0;
+            }
+        }
+    }
+
+    while (WheelTimer *timer = m_expired) {
+        unlink(timer);
+        timer->m_active = false;
+        timer->m_wheel = 0;
+    }
+}
+
+qint64 TimerWheel::now() const
+{
+    return m_clock.elapsed();
+}
+
+qint64 TimerWheel::granularity(int level)
+{
+    qint64 value = Granularity;
+    for (int i = 0; i < level; i++)
+        value *= LevelFactor;
+    return value;
+}
+
+qint64 TimerWheel::nextWakeup() const
+{
+    qint64 first = -1;
+    for (int level = 0; level < Levels; level++) {
+        quint64 occupied = m_occupied[level];
+        if (!occupied)
+            continue;
+
+        // Slots are searched from the one after the current time, in order
+        qint64 g = granularity(level);
+        qint64 next = m_time / g + 1;
+        int shift = int(next % Slots);
+        if (shift)
+            occupied = (occupied >> shift) | (occupied << (Slots - shift));
+        qint64 time = (next + qCountTrailingZeroBits(occupied)) * g;
+        if (first < 0 || time < first)
+            first = time;
+    }
+    return first;
+}
+
+void TimerWheel::schedule(WheelTimer *timer)
+{
+    if (timer->m_active) {
+        unlink(timer);
+    } else {
+        timer->m_active = true;
+        m_timerCount++;
+    }
+
+    updateTime();
+    timer->m_deadline = now() + timer->m_interval;
+    insert(timer);
+    scheduleWakeup();
+}
+
+void TimerWheel::cancel(WheelTimer *timer)
+{
+    if (!timer->m_active)
+        return;
+
+    unlink(timer);
+    timer->m_active = false;
+    m_timerCount--;
+    scheduleWakeup();
+}
+
+void TimerWheel::insert(WheelTimer *timer)
+{
+    qint64 deadline = timer->m_deadline;
+    qint64 tolerance = timer->tolerance();
+
+    // The coarsest level that keeps the timer within its tolerance, with the
+    // timer in the first slot at or after its deadline
+    int level = 0;
+    while (level + 1 < Levels && granularity(level + 1) <= tolerance)
+        level++;
+    qint64 g = granularity(level);
+    qint64 tick = (deadline + g - 1) / g;
+
+    // If the deadline is beyond that level's slots, use the first level that
+    // reaches it, with the timer in the slot before its deadline. It will be
+    // moved down when that slot expires.
+    if (tick - m_time / g > Slots) {
+        while (level + 1 < Levels) {
+            level++;
+            g = granularity(level);
+            if (deadline / g - m_time / g <= Slots)
+                break;
+        }
+        tick = qMin(deadline / g, m_time / g + Slots);
+    }
+
+    // Slots up to the current time have expired already
+    tick = qMax(tick, m_time / g + 1);
+
+    int slot = int(tick % Slots);
+    link(timer, &m_slots[level][slot]);
+    timer->m_level = level;
+    timer->m_slot = slot;
+    m_occupied[level] |= Q_UINT64_C(1) << slot;
+}
+
+void TimerWheel::link(WheelTimer *timer, WheelTimer **list)
+{
+    timer->m_next = *list;
+    if (timer->m_next)
+        timer->m_next->m_prevNext = &timer->m_next;
+    timer->m_prevNext = list;
+    timer->m_level = -1;
+    *list = timer;
+}
+
+void TimerWheel::unlink(WheelTimer *timer)
+{
+    *timer->m_prevNext = timer->m_next;
+    if (timer->m_next)
+        timer->m_next->m_prevNext = timer->m_prevNext;
+
+    if (timer->m_level >= 0 && !m_slots[timer->m_level][timer->m_slot])
+        m_occupied[timer->m_level] &= ~(Q_UINT64_C(1) << timer->m_slot);
+
+    timer->m_next = 0;
+    timer->m_prevNext = 0;
+    timer->m_level = -1;
+}
+
+void TimerWheel::updateTime()
+{
+    // Move up to the current time, but not past a slot that hasn't expired
+    qint64 time = now();
+    qint64 first = nextWakeup();
+    if (first >= 0 && first <= time)
+        time = first - 1;
+    if (time > m_time)
+        m_time = time;
+}
+
+void TimerWheel::process()
+{
+    // Timeout handlers that run a nested event loop can't expire timers again
+    if (m_processing)
+        return;
+    m_processing = true;
+    m_wakeups++;
+
+    qint64 time = now();
+    for (;;) {
+        qint64 expiry = nextWakeup();
+        if (expiry < 0 || expiry > time)
+            break;
+        m_time = expiry;
+
+        // Take every slot that expires now, on any level. Slots are in the
+        // reverse of the order timers were inserted, so this puts them back.
+        WheelTimer *due = 0;
+        for (int level = 0; level < Levels; level++) {
+            qint64 g = granularity(level);
+            if (expiry % g)
+                break;
+            WheelTimer **slot = &m_slots[level][(expiry / g) % Slots];
+            while (WheelTimer *timer = *slot) {
+                unlink(timer);
+                link(timer, &due);
+            }
+        }
+
+        WheelTimer **expiredTail = &m_expired;
+        while (WheelTimer *timer = due) {
+            unlink(timer);
+            if (timer->m_deadline <= expiry) {
+                link(timer, expiredTail);
+                expiredTail = &timer->m_next;
+            } else {
+                insert(timer);
+            }
+        }
+
+        // Handlers may start, stop or delete any timer
+        while (WheelTimer *timer = m_expired) {
+            unlink(timer);
+            timer->m_active = false;
+            m_timerCount--;
+            if (!timer->m_singleShot)
+                schedule(timer);
+            emit timer->timeout();
+        }
+    }
+
+    m_time = qMax(m_time, time);
+    m_processing = false;
+    scheduleWakeup();
+}
+
+void TimerWheel::scheduleWakeup()
+{
+    if (m_processing)
+        return;
+
+    qint64 next = nextWakeup();
+    if (next == m_wakeup && (next < 0 || m_timer.isActive()))
+        return;
+
+    m_wakeup = next;
+    if (next < 0) {
+        m_timer.stop();
+        return;
+    }
+
+    m_timer.start(int(qBound(qint64(0), next - now(), qint64(INT_MAX))));
+}
+
+WheelTimer::WheelTimer(QObject *parent)
+    : WheelTimer(TimerWheel::instance(), parent)
+{
+}
+
+WheelTimer::WheelTimer(TimerWheel *wheel, QObject *parent)
+    : QObject(parent)
+    , m_wheel(wheel)
+    , m_next(0)
+    , m_prevNext(0)
+    , m_level(-1)
+    , m_slot(0)
+    , m_deadline(0)
+    , m_interval(0)
+    , m_tolerance(-1)
+    , m_singleShot(false)
+    , m_active(false)
+{
+}
+
+WheelTimer::~WheelTimer()
+{
+    stop();
+}
+
+void WheelTimer::setInterval(int msecs)
+{
+    m_interval = qMax(0, msecs);
+    if (m_active)
+        start();
+}
+
+int WheelTimer::tolerance() const
+{
+    return m_tolerance >= 0 ? m_tolerance : m_interval / 8;
+}
+
+void WheelTimer::setTolerance(int msecs)
+{
+    m_tolerance = qMax(0, msecs);
+}
+
+int WheelTimer::remainingTime() const
+{
+    if (!m_active)
+        return -1;
+    return int(qBound(qint64(0), m_deadline - m_wheel->now(), qint64(INT_MAX)));
+}
+
+void WheelTimer::start()
+{
+    if (!m_wheel) {
+        BUG() << "WheelTimer started after its TimerWheel was destroyed";
+        return;
+    }
+    m_wheel->schedule(this);
+}
+
+void WheelTimer::start(int msecs)
+{
+    m_interval = qMax(0, msecs);
+    start();
+}
+
+void WheelTimer::stop()
+{
+    if (m_wheel)
+        m_wheel->cancel(this);
+}
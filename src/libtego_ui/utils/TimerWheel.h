@@ -0,0 +1,184 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+class WheelTimer;
+
+/* Shared hierarchical timing wheel
+ *
+ * Long timeouts that are kept per contact or per connection would each need
+ * a QTimer, and thousands of them mean thousands of timer registrations and
+ * a wakeup for every expiration. A TimerWheel keeps any number of
+ * WheelTimers and runs them all from one QTimer.
+ *
+ * The wheel has Levels levels of Slots slots each. Slots on the first level
+ * are Granularity milliseconds apart, and each level is LevelFactor times
+ * coarser than the one below. A timer is put into the coarsest slot that
+ * still expires within its tolerance after its deadline, so timers that
+ * are due at about the same time expire together, in one wakeup. Timers
+ * with a tolerance that is too small for the level their deadline falls in
+ * are put into the slot before the deadline, and moved down a level when
+ * that slot expires. Starting and stopping a timer is O(1), and finding the
+ * next slot to expire is O(Levels).
+ *
+ * Timers never expire before their deadline. The default tolerance is an
+ * eighth of the interval, which is always enough for the timer to expire
+ * without being moved between levels.
+ *
+ * Subclasses can replace now() and drive process() themselves to simulate
+ * time.
+ */
+class TimerWheel : public QObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(TimerWheel)
+
+public:
+    static const int Levels = 8;
+    static const int Slots = 64;
+    static const int LevelFactor = 8;
+    // Milliseconds between slots on the first level
+    static const int Granularity = 8;
+
+    /* The wheel for the current thread, used by default for WheelTimers */
+    static TimerWheel *instance();
+
+    explicit TimerWheel(QObject *parent = 0);
+    virtual ~TimerWheel();
+
+    int timerCount() const { return m_timerCount; }
+    /* The number of times process() has run */
+    quint64 wakeups() const { return m_wakeups; }
+    /* The time when process() next needs to run, or -1 */
+    qint64 nextWakeup() const;
+
+public slots:
+    /* Expire every timer that is due, and schedule the next wakeup */
+    void process();
+
+protected:
+    /* Current time, in milliseconds */
+    virtual qint64 now() const;
+
+private:
+    friend class WheelTimer;
+
+    // Timers in each slot, as intrusive lists
+    WheelTimer *m_slots[Levels][Slots];
+    // One bit for each slot that isn't empty
+    quint64 m_occupied[Levels];
+    // Expired timers that haven't emitted timeout yet, while processing
+    WheelTimer *m_expired;
+    // Slots are filled relative to this time, and every slot up to it has expired
+    qint64 m_time;
+    int m_timerCount;
+    quint64 m_wakeups;
+    bool m_processing;
+
+    QTimer m_timer;
+    QElapsedTimer m_clock;
+    qint64 m_wakeup;
+
+    static qint64 granularity(int level);
+    void schedule(WheelTimer *timer);
+    void cancel(WheelTimer *timer);
+    void insert(WheelTimer *timer);
+    void link(WheelTimer *timer, WheelTimer **list);
+    void unlink(WheelTimer *timer);
+    void updateTime();
+    void scheduleWakeup();
+};
+
+/* A timer that runs on a TimerWheel
+ *
+ * WheelTimer has the same interface as QTimer, and is used in the same way
+ * for timeouts that don't need to be precise. It expires at or after its
+ * interval, and no later than tolerance() after it. WheelTimers belong to
+ * the thread of their wheel, and must not outlive it.
+ */
+class WheelTimer : public QObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(WheelTimer)
+
+public:
+    explicit WheelTimer(QObject *parent = 0);
+    WheelTimer(TimerWheel *wheel, QObject *parent = 0);
+    virtual ~WheelTimer();
+
+    TimerWheel *wheel() const { return m_wheel; }
+
+    int interval() const { return m_interval; }
+    void setInterval(int msecs);
+    bool isSingleShot() const { return m_singleShot; }
+    void setSingleShot(bool singleShot) { m_singleShot = singleShot; }
+
+    /* How late the timer may expire, in milliseconds
+     *
+     * By default, this is an eighth of the interval. The timer may also
+     * expire up to TimerWheel::Granularity late if the tolerance is smaller.
+     */
+    int tolerance() const;
+    void setTolerance(int msecs);
+
+    bool isActive() const { return m_active; }
+    /* Milliseconds until the deadline, or -1 if the timer isn't active */
+    int remainingTime() const;
+
+public slots:
+    void start();
+    void start(int msecs);
+    void stop();
+
+signals:
+    void timeout();
+
+private:
+    friend class TimerWheel;
+
+    // Cleared if the wheel is destroyed first
+    QPointer<TimerWheel> m_wheel;
+    // Position in one of the wheel's lists
+    WheelTimer *m_next;
+    WheelTimer **m_prevNext;
+    int m_level;
+    int m_slot;
+    qint64 m_deadline;
+    int m_interval;
+    int m_tolerance;
+    bool m_singleShot;
+    bool m_active;
+};
+
+#endif // TIMERWHEEL_H
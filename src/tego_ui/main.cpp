@@ -33,6 +33,9 @@
 
 #include "ui/MainWindow.h"
 #include "core/IdentityManager.h"
+#include "protocol/Connection.h"
+#include "protocol/DirectTransport.h"
+#include "protocol/NetworkThread.h"
 #include "tor/TorManager.h"
 #include "tor/TorControl.h"
 #include "utils/CryptoKey.h"
@@ -112,6 +115,21 @@ int main(int argc, char *argv[]) try
     torControl = torManager->control();
     torManager->start();
 
+    /* Optionally move connection socket I/O off of the GUI thread */
+    if (!qEnvironmentVariableIsEmpty("TEGO_NETWORK_THREAD"))
+        Protocol::NetworkThread::setEnabled(true);
+
+    /* Optionally hold small packets for a few milliseconds to share Tor cells */
+    if (!qEnvironmentVariableIsEmpty("TEGO_AGGREGATION_WINDOW"))
+        Protocol::Connection::setDefaultAggregationWindow(qEnvironmentVariableIntValue("TEGO_AGGREGATION_WINDOW"));
+
+    /* Optionally reach peers on this machine directly instead of through Tor */
+    if (!qEnvironmentVariableIsEmpty("TEGO_DIRECT_ROUTES")
+        && !Protocol::DirectTransport::loadRoutes(QString::fromLocal8Bit(qgetenv("TEGO_DIRECT_ROUTES"))))
+    {
+        qWarning() << "Failed to load direct routes";
+    }
+
     /* Identities */
     identityManager = new IdentityManager;
     QScopedPointer<IdentityManager> scopedIdentityManager(identityManager);
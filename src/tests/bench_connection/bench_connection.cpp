@@ -0,0 +1,527 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// C
+#include <stdio.h>
+// C++
+#include <algorithm>
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QQueue>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QTimer>
+#ifdef Q_OS_UNIX
+#include <sys/resource.h>
+#endif
+
+// libtego_ui
+#include <protocol/Connection.h>
+#include <protocol/AuthHiddenServiceChannel.h>
+#include <protocol/ChatChannel.h>
+#include <protocol/NetworkThread.h>
+#include <utils/CryptoKey.h>
+
+// tests
+#include <AllocationCounter.h>
+#include <OnionSocket.h>
+#include <TestIdentities.h>
+
+using namespace Protocol;
+
+/* Relays one TCP connection to the server, delaying data in each direction
+ * by 'delay' milliseconds, to simulate the latency of an onion circuit.
+ */
+class DelayProxy : public QObject
+{
+public:
+    int delay = 0;
+
+    bool listen(const QHostAddress &address, quint16 port)
+    {
+        target = address;
+        targetPort = port;
+        clock.start();
+        timer.setSingleShot(true);
+        timer.setTimerType(Qt::PreciseTimer);
+        connect(&timer, &QTimer::timeout, this, &DelayProxy::flush);
+        connect(&server, &QTcpServer::newConnection, this, &DelayProxy::accepted);
+        return server.listen(QHostAddress::LocalHost);
+    }
+
+    QHostAddress address() const { return server.serverAddress(); }
+    quint16 port() const { return server.serverPort(); }
+
+private:
+    // Data to write to 'to' once due; a null 'data' disconnects it instead
+    struct Pending
+    {
+        qint64 due;
+        QTcpSocket *to;
+        QByteArray data;
+    };
+
+    QTcpServer server;
+    QHostAddress target;
+    quint16 targetPort = 0;
+    QTcpSocket *inbound = nullptr;
+    QTcpSocket *outbound = nullptr;
+    QQueue<Pending> pending;
+    QElapsedTimer clock;
+    QTimer timer;
+
+    void accepted()
+    {
+        inbound = server.nextPendingConnection();
+        outbound = new QTcpSocket(this);
+        outbound->connectToHost(target, targetPort);
+        relay(inbound, outbound);
+        relay(outbound, inbound);
+    }
+
+    void relay(QTcpSocket *from, QTcpSocket *to)
+    {
+        connect(from, &QIODevice::readyRead, this,
+            [this,from,to]() { enqueue(to, from->readAll()); }
+        );
+        connect(from, &QAbstractSocket::disconnected, this,
+            [this,to]() { enqueue(to, QByteArray()); }
+        );
+    }
+
+    // The delay is constant, so items become due in the order they're queued
+    void enqueue(QTcpSocket *to, const QByteArray &data)
+    {
+        pending.enqueue(Pending{ clock.elapsed() + delay, to, data });
+        if (!timer.isActive())
+            flush();
+    }
+
+    void flush()
+    {
+        qint64 now = clock.elapsed();
+        while (!pending.isEmpty() && pending.head().due <= now) {
+            Pending item = pending.dequeue();
+            if (item.data.isNull())
+                item.to->disconnectFromHost();
+            else
+                item.to->write(item.data);
+        }
+        if (!pending.isEmpty())
+            timer.start(int(pending.head().due - now));
+    }
+};
+
+static qint64 cpuUsecs()
+{
+#ifdef Q_OS_UNIX
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return -1;
+    return qint64(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000
+           + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+#else
+    return -1;
+#endif
+}
+
+/* Pairs a ClientSide and ServerSide Connection over loopback, with the real
+ * version negotiation and AuthHiddenServiceChannel authentication, then sends
+ * chat messages with a fixed number outstanding and measures each one's time
+ * from send to acknowledgement.
+ */
+class ConnectionBenchmark : public QObject
+{
+    Q_OBJECT
+
+public:
+    virtual ~ConnectionBenchmark();
+
+    int messageCount = 20000;
+    int messageSize = 64;
+    int window = 64;
+    int aggregationWindow = 0;
+    int cellCostUsecs = 0;
+    // One-way delay added by a proxy between the peers, in milliseconds
+    int latency = 0;
+    // Open the authentication channel without waiting for version negotiation
+    bool pipelined = false;
+
+    void start();
+    QJsonObject results() const;
+
+signals:
+    void finished(bool ok);
+
+private:
+    QTcpServer server;
+    DelayProxy proxy;
+    OnionSocket *clientSocket = nullptr;
+    Connection *client = nullptr;
+    Connection *serverConnection = nullptr;
+    ChatChannel *chat = nullptr;
+
+    QElapsedTimer clock;
+    qint64 connectStart = 0;
+    qint64 handshakeUsecs = 0;
+    qint64 authUsecs = 0;
+    qint64 channelUsecs = 0;
+    qint64 setupUsecs = 0;
+    qint64 sendStart = 0;
+    qint64 sendUsecs = 0;
+    qint64 cpuStart = 0;
+    qint64 cpuTotal = 0;
+    quint64 allocations = 0;
+
+    QString text;
+    int sent = 0;
+    int acknowledged = 0;
+    QHash<ChatChannel::MessageId,qint64> sendTimes;
+    QVector<qint64> latencies;
+    int closedCount = 0;
+
+    qint64 now() const { return clock.nsecsElapsed() / 1000; }
+    void fail(const char *message);
+    void clientConnected();
+    void serverAccepted();
+    void startAuthentication();
+    void openChat();
+    void sendMessages();
+    void messageAcknowledged(ChatChannel::MessageId id, bool accepted);
+    void shutdown();
+};
+
+ConnectionBenchmark::~ConnectionBenchmark()
+{
+    // Connections that didn't close cleanly are left for process exit
+    if (closedCount == 2) {
+        delete client;
+        delete serverConnection;
+    }
+}
+
+void ConnectionBenchmark::fail(const char *message)
+{
+    qWarning() << "Benchmark failed:" << message;
+    emit finished(false);
+}
+
+void ConnectionBenchmark::start()
+{
+    clock.start();
+    text = QString(messageSize, QLatin1Char('x'));
+    latencies.reserve(messageCount);
+    sendTimes.reserve(window * 2);
+
+    if (!server.listen(QHostAddress::LocalHost)) {
+        fail("cannot listen on loopback");
+        return;
+    }
+    connect(&server, &QTcpServer::newConnection, this, &ConnectionBenchmark::serverAccepted);
+
+    connectStart = now();
+    clientSocket = new OnionSocket;
+    connect(clientSocket, &QAbstractSocket::connected, this, &ConnectionBenchmark::clientConnected);
+    if (latency > 0) {
+        proxy.delay = latency;
+        if (!proxy.listen(server.serverAddress(), server.serverPort())) {
+            fail("cannot listen for proxy on loopback");
+            return;
+        }
+        clientSocket->connectToHost(proxy.address(), proxy.port());
+    } else {
+        clientSocket->connectToHost(server.serverAddress(), server.serverPort());
+    }
+}
+
+void ConnectionBenchmark::serverAccepted()
+{
+    QTcpSocket *socket = server.nextPendingConnection();
+    socket->setProperty("localHostname", QString::fromLatin1(serverHostname));
+    serverConnection = new Connection(socket, Connection::ServerSide);
+    serverConnection->setAggregationWindow(aggregationWindow);
+
+    // As UserIdentity does for contacts, once the client has authenticated
+    connect(serverConnection, &Connection::authenticated, this,
+        [this](Connection::AuthenticationType type) {
+            if (type == Connection::HiddenServiceAuth)
+                serverConnection->setPurpose(Connection::Purpose::KnownContact);
+        }
+    );
+}
+
+void ConnectionBenchmark::clientConnected()
+{
+    disconnect(clientSocket, &QAbstractSocket::connected, this, 0);
+    clientSocket->setOnionPeerName(QString::fromLatin1(serverHostname));
+    client = new Connection(clientSocket, Connection::ClientSide);
+    client->setAggregationWindow(aggregationWindow);
+    connect(client, &Connection::versionNegotiationFailed, this, [this]() { fail("version negotiation failed"); });
+
+    // As OutboundConnector does, when pipelined
+    if (pipelined) {
+        connect(client, &Connection::ready, this, [this]() { handshakeUsecs = now() - connectStart; });
+        startAuthentication();
+    } else {
+        connect(client, &Connection::ready, this,
+            [this]() {
+                handshakeUsecs = now() - connectStart;
+                startAuthentication();
+            }
+        );
+    }
+}
+
+void ConnectionBenchmark::startAuthentication()
+{
+    qint64 authStart = now();
+
+    // The client authenticates as the service the server claims to be
+    CryptoKey key;
+    if (!key.loadFromKeyBlob(QByteArray(keyBlob))) {
+        fail("cannot load key");
+        return;
+    }
+
+    AuthHiddenServiceChannel *auth = new AuthHiddenServiceChannel(Channel::Outbound, client);
+    connect(auth, &AuthHiddenServiceChannel::authSuccessful, this,
+        [this,authStart]() {
+            authUsecs = now() - authStart;
+            setupUsecs = now() - connectStart;
+            openChat();
+        }
+    );
+    connect(auth, &AuthHiddenServiceChannel::authFailed, this, [this]() { fail("authentication failed"); });
+    auth->setPrivateKey(key);
+    if (!auth->openChannel())
+        fail("cannot open authentication channel");
+}
+
+void ConnectionBenchmark::openChat()
+{
+    if (!client->setPurpose(Connection::Purpose::KnownContact)) {
+        fail("cannot set client purpose");
+        return;
+    }
+
+    qint64 channelStart = now();
+    chat = new ChatChannel(Channel::Outbound, client);
+    connect(chat, &ChatChannel::messageAcknowledged, this, &ConnectionBenchmark::messageAcknowledged);
+    connect(chat, &Channel::channelOpened, this,
+        [this,channelStart]() {
+            channelUsecs = now() - channelStart;
+            cpuStart = cpuUsecs();
+            sendStart = now();
+            AllocationCounter::reset();
+            AllocationCounter::setCountingAllThreads(true);
+            sendMessages();
+        }
+    );
+    if (!chat->openChannel())
+        fail("cannot open chat channel");
+}
+
+void ConnectionBenchmark::sendMessages()
+{
+    while (sent < messageCount && sent - acknowledged < window) {
+        ChatChannel::MessageId id = 0;
+        qint64 time = now();
+        if (!chat->sendChatMessage(text, QDateTime(), id)) {
+            fail("sending message failed");
+            return;
+        }
+        sendTimes.insert(id, time);
+        sent++;
+    }
+}
+
+void ConnectionBenchmark::messageAcknowledged(ChatChannel::MessageId id, bool accepted)
+{
+    auto it = sendTimes.find(id);
+    if (!accepted || it == sendTimes.end()) {
+        fail("message was not accepted");
+        return;
+    }
+
+    latencies.append(now() - it.value());
+    sendTimes.erase(it);
+    acknowledged++;
+
+    if (acknowledged < messageCount) {
+        sendMessages();
+        return;
+    }
+
+    AllocationCounter::setCountingAllThreads(false);
+    allocations = AllocationCounter::count();
+    sendUsecs = now() - sendStart;
+    cpuTotal = cpuStart >= 0 ? cpuUsecs() - cpuStart : -1;
+    shutdown();
+}
+
+void ConnectionBenchmark::shutdown()
+{
+    auto closed = [this]() {
+        if (++closedCount == 2)
+            emit finished(true);
+    };
+    connect(client, &Connection::closed, this, closed);
+    connect(serverConnection, &Connection::closed, this, closed);
+    client->close();
+}
+
+QJsonObject ConnectionBenchmark::results() const
+{
+    QVector<qint64> sorted = latencies;
+    std::sort(sorted.begin(), sorted.end());
+    auto percentile = [&sorted](int p) -> qint64 {
+        return sorted.isEmpty() ? 0 : sorted.at(qMin(sorted.size() - 1, sorted.size() * p / 100));
+    };
+
+    // Both peers run in this process, so allocations and CPU time cover
+    // sending and receiving. Only chat text counts towards megabytes.
+    double megabytes = double(messageCount) * messageSize / (1024 * 1024);
+    double seconds = qMax(sendUsecs, qint64(1)) / 1000000.0;
+
+    QJsonObject latency;
+    latency[QStringLiteral("p50_us")] = percentile(50);
+    latency[QStringLiteral("p99_us")] = percentile(99);
+    latency[QStringLiteral("max_us")] = sorted.isEmpty() ? 0 : sorted.last();
+
+    QJsonObject setup;
+    setup[QStringLiteral("handshake_us")] = handshakeUsecs;
+    setup[QStringLiteral("auth_us")] = authUsecs;
+    setup[QStringLiteral("open_channel_us")] = channelUsecs;
+    setup[QStringLiteral("connect_to_auth_us")] = setupUsecs;
+    setup[QStringLiteral("pipelined")] = pipelined;
+    setup[QStringLiteral("latency_ms")] = latency;
+
+    // Cells written by both peers, with a simulated cost for sending each
+    Connection::CellStats clientCells = client->cellStats();
+    Connection::CellStats serverCells = serverConnection->cellStats();
+    quint64 cellCount = clientCells.cells + serverCells.cells;
+    QJsonObject cells;
+    cells[QStringLiteral("aggregation_window_ms")] = aggregationWindow;
+    cells[QStringLiteral("packets")] = double(clientCells.packets + serverCells.packets);
+    cells[QStringLiteral("header_bytes")] = double(clientCells.headerBytes + serverCells.headerBytes);
+    cells[QStringLiteral("cells")] = double(cellCount);
+    cells[QStringLiteral("cells_saved")] = double(clientCells.cellsSaved() + serverCells.cellsSaved());
+    cells[QStringLiteral("cells_per_message")] = double(cellCount) / messageCount;
+    cells[QStringLiteral("simulated_cost_ms")] = double(cellCount) * cellCostUsecs / 1000;
+
+    QJsonObject re;
+    re[QStringLiteral("benchmark")] = QStringLiteral("connection");
+    re[QStringLiteral("messages")] = messageCount;
+    re[QStringLiteral("message_bytes")] = messageSize;
+    re[QStringLiteral("window")] = window;
+    re[QStringLiteral("network_thread")] = NetworkThread::isEnabled();
+    re[QStringLiteral("protocol_version")] = client->protocolVersion();
+    re[QStringLiteral("setup")] = setup;
+    re[QStringLiteral("messages_per_second")] = qRound64(messageCount / seconds);
+    re[QStringLiteral("latency")] = latency;
+    re[QStringLiteral("cells")] = cells;
+    re[QStringLiteral("allocations_per_message")] =
+        AllocationCounter::isSupported() ? double(allocations) / messageCount : -1.0;
+    re[QStringLiteral("cpu_ms_per_mb")] = cpuTotal < 0 ? -1.0 : cpuTotal / 1000.0 / megabytes;
+    return re;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(QStringLiteral("Protocol::Connection throughput and latency benchmark"));
+    parser.addHelpOption();
+    QCommandLineOption countOption(QStringLiteral("messages"), QStringLiteral("Number of chat messages to send."), QStringLiteral("count"), QStringLiteral("20000"));
+    QCommandLineOption sizeOption(QStringLiteral("size"), QStringLiteral("Characters in each message."), QStringLiteral("chars"), QStringLiteral("64"));
+    QCommandLineOption windowOption(QStringLiteral("window"), QStringLiteral("Unacknowledged messages allowed at once."), QStringLiteral("count"), QStringLiteral("64"));
+    QCommandLineOption threadOption(QStringLiteral("network-thread"), QStringLiteral("Use the network I/O thread."));
+    QCommandLineOption aggregationOption(QStringLiteral("aggregation-window"), QStringLiteral("Milliseconds to hold small packets to share Tor cells."), QStringLiteral("ms"), QStringLiteral("0"));
+    QCommandLineOption cellCostOption(QStringLiteral("cell-cost"), QStringLiteral("Simulated cost of sending one Tor cell."), QStringLiteral("us"), QStringLiteral("0"));
+    QCommandLineOption latencyOption(QStringLiteral("latency"), QStringLiteral("One-way delay added between the peers."), QStringLiteral("ms"), QStringLiteral("0"));
+    QCommandLineOption pipelinedOption(QStringLiteral("pipelined"), QStringLiteral("Authenticate without waiting for version negotiation."));
+    QCommandLineOption versionOption(QStringLiteral("protocol-version"), QStringLiteral("Newest protocol version to negotiate."), QStringLiteral("version"), QStringLiteral("2"));
+    QCommandLineOption outputOption(QStringLiteral("output"), QStringLiteral("Write JSON results to a file instead of stdout."), QStringLiteral("file"));
+    parser.addOptions({ countOption, sizeOption, windowOption, threadOption, aggregationOption, cellCostOption, latencyOption, pipelinedOption, versionOption, outputOption });
+    parser.process(app);
+
+    ConnectionBenchmark benchmark;
+    benchmark.messageCount = qMax(1, parser.value(countOption).toInt());
+    benchmark.messageSize = qBound(1, parser.value(sizeOption).toInt(), int(ChatChannel::MessageMaxCharacters));
+    benchmark.window = qMax(1, parser.value(windowOption).toInt());
+    benchmark.aggregationWindow = qMax(0, parser.value(aggregationOption).toInt());
+    benchmark.cellCostUsecs = qMax(0, parser.value(cellCostOption).toInt());
+    benchmark.latency = qMax(0, parser.value(latencyOption).toInt());
+    benchmark.pipelined = parser.isSet(pipelinedOption);
+    Connection::setMaximumProtocolVersion(parser.value(versionOption).toInt());
+    NetworkThread::setEnabled(parser.isSet(threadOption));
+
+    bool ok = false;
+    QObject::connect(&benchmark, &ConnectionBenchmark::finished, &app,
+        [&](bool result) {
+            ok = result;
+            app.quit();
+        }
+    );
+
+    QTimer::singleShot(120000, &app, [&]() {
+        qWarning() << "Benchmark timed out";
+        app.quit();
+    });
+
+    QTimer::singleShot(0, &benchmark, [&]() { benchmark.start(); });
+    app.exec();
+
+    if (!ok)
+        return 1;
+
+    QByteArray json = QJsonDocument(benchmark.results()).toJson();
+    if (parser.isSet(outputOption)) {
+        QFile file(parser.value(outputOption));
+        if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate) || file.write(json) != json.size()) {
+            qWarning() << "Cannot write results to" << file.fileName();
+            return 1;
+        }
+    } else {
+        fputs(json.constData(), stdout);
+    }
+
+    return 0;
+}
+
+#include "bench_connection.moc"
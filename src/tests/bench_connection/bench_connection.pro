@@ -0,0 +1,8 @@
+include(../tests.pri)
+CONFIG += count_allocations
+include(../support/support.pri)
+
+# A benchmark, not a test; run it directly rather than from make check
+CONFIG -= testcase
+
+SOURCES += bench_connection.cpp
@@ -0,0 +1,373 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// C
+#include <stdio.h>
+// C++
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QTemporaryDir>
+#include <QTimer>
+#ifdef Q_OS_UNIX
+#include <sys/resource.h>
+#endif
+
+// libtego_ui
+#include <protocol/Connection.h>
+#include <protocol/FileTransferChannel.h>
+#include <protocol/NetworkThread.h>
+
+// tests
+#include <OnionSocket.h>
+#include <TestIdentities.h>
+
+using namespace Protocol;
+
+static qint64 cpuUsecs()
+{
+#ifdef Q_OS_UNIX
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return -1;
+    return qint64(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000
+           + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+#else
+    return -1;
+#endif
+}
+
+// Peak resident set size of the process in kilobytes, or -1
+static qint64 peakRssKb()
+{
+#ifdef Q_OS_UNIX
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return -1;
+#ifdef Q_OS_MACOS
+    return qint64(usage.ru_maxrss) / 1024;
+#else
+    return qint64(usage.ru_maxrss);
+#endif
+#else
+    return -1;
+#endif
+}
+
+/* Pairs a ClientSide and ServerSide Connection over loopback and sends one
+ * file on a FileTransferChannel, from the client to a file next to it.
+ * Authentication is granted directly; bench_connection measures it.
+ */
+class FileTransferBenchmark : public QObject
+{
+    Q_OBJECT
+
+public:
+    virtual ~FileTransferBenchmark();
+
+    QString sourcePath;
+    QString destinationPath;
+    int window = FileTransferChannel::DefaultWindowSize;
+    int chunkSize = FileTransferChannel::ChunkSize;
+
+    void start();
+    QJsonObject results() const;
+
+signals:
+    void finished(bool ok);
+
+private:
+    QTcpServer server;
+    OnionSocket *clientSocket = nullptr;
+    Connection *client = nullptr;
+    Connection *serverConnection = nullptr;
+
+    QElapsedTimer clock;
+    qint64 fileSize = 0;
+    qint64 sendStart = 0;
+    qint64 sendUsecs = 0;
+    qint64 cpuStart = 0;
+    qint64 cpuTotal = 0;
+    qint64 rssBefore = 0;
+    int closedCount = 0;
+
+    qint64 now() const { return clock.nsecsElapsed() / 1000; }
+    void fail(const char *message);
+    void clientReady();
+    void serverAccepted();
+    void shutdown();
+};
+
+FileTransferBenchmark::~FileTransferBenchmark()
+{
+    // Connections that didn't close cleanly are left for process exit
+    if (closedCount == 2) {
+        delete client;
+        delete serverConnection;
+    }
+}
+
+void FileTransferBenchmark::fail(const char *message)
+{
+    qWarning() << "Benchmark failed:" << message;
+    emit finished(false);
+}
+
+void FileTransferBenchmark::start()
+{
+    clock.start();
+    rssBefore = peakRssKb();
+
+    if (!server.listen(QHostAddress::LocalHost)) {
+        fail("cannot listen on loopback");
+        return;
+    }
+    connect(&server, &QTcpServer::newConnection, this, &FileTransferBenchmark::serverAccepted);
+
+    clientSocket = new OnionSocket;
+    connect(clientSocket, &QAbstractSocket::connected, this,
+        [this]() {
+            clientSocket->setOnionPeerName(QString::fromLatin1(serverHostname));
+            client = new Connection(clientSocket, Connection::ClientSide);
+            connect(client, &Connection::ready, this, &FileTransferBenchmark::clientReady);
+        }
+    );
+    clientSocket->connectToHost(server.serverAddress(), server.serverPort());
+}
+
+void FileTransferBenchmark::serverAccepted()
+{
+    QTcpSocket *socket = server.nextPendingConnection();
+    socket->setProperty("localHostname", QString::fromLatin1(serverHostname));
+    serverConnection = new Connection(socket, Connection::ServerSide);
+
+    connect(serverConnection, &Connection::channelRequestingInboundApproval, this,
+        [this](Channel *channel) {
+            if (FileTransferChannel *transfer = qobject_cast<FileTransferChannel*>(channel))
+                transfer->setDestination(destinationPath);
+        }
+    );
+}
+
+void FileTransferBenchmark::clientReady()
+{
+    if (!serverConnection) {
+        fail("server connection is missing");
+        return;
+    }
+
+    // Large chunks wait until the server has announced the packets it accepts
+    if (chunkSize > FileTransferChannel::MaxChunkSize && client->maxPacketSize() < chunkSize + 1024) {
+        if (client->protocolVersion() < 2) {
+            fail("chunk size needs protocol version 2");
+            return;
+        }
+        QTimer::singleShot(10, this, &FileTransferBenchmark::clientReady);
+        return;
+    }
+
+    serverConnection->grantAuthentication(Connection::HiddenServiceAuth, QString::fromLatin1(clientHostname));
+    if (!serverConnection->setPurpose(Connection::Purpose::KnownContact) ||
+        !client->setPurpose(Connection::Purpose::KnownContact))
+    {
+        fail("cannot set connection purpose");
+        return;
+    }
+
+    FileTransferChannel *transfer = new FileTransferChannel(Channel::Outbound, client);
+    if (!transfer->setFile(sourcePath)) {
+        fail("cannot open file to send");
+        return;
+    }
+    transfer->setWindowSize(window);
+    if (!transfer->setChunkSize(chunkSize)) {
+        fail("invalid chunk size");
+        return;
+    }
+    fileSize = transfer->fileSize();
+
+    connect(transfer, &FileTransferChannel::transferFinished, this,
+        [this](bool completed) {
+            sendUsecs = now() - sendStart;
+            cpuTotal = cpuStart >= 0 ? cpuUsecs() - cpuStart : -1;
+            if (!completed) {
+                fail("transfer did not complete");
+                return;
+            }
+            shutdown();
+        }
+    );
+
+    sendStart = now();
+    cpuStart = cpuUsecs();
+    if (!transfer->openChannel())
+        fail("cannot open file transfer channel");
+}
+
+void FileTransferBenchmark::shutdown()
+{
+    auto closed = [this]() {
+        if (++closedCount == 2)
+            emit finished(true);
+    };
+    connect(client, &Connection::closed, this, closed);
+    connect(serverConnection, &Connection::closed, this, closed);
+    client->close();
+}
+
+QJsonObject FileTransferBenchmark::results() const
+{
+    // Both peers run in this process, so CPU time and memory cover sending
+    // and receiving
+    double megabytes = double(fileSize) / (1024 * 1024);
+    double seconds = qMax(sendUsecs, qint64(1)) / 1000000.0;
+    Connection::CellStats clientCells = client->cellStats();
+    Connection::CellStats serverCells = serverConnection->cellStats();
+
+    QJsonObject re;
+    re[QStringLiteral("benchmark")] = QStringLiteral("file_transfer");
+    re[QStringLiteral("bytes")] = double(fileSize);
+    re[QStringLiteral("chunk_bytes")] = chunkSize;
+    re[QStringLiteral("window")] = window;
+    re[QStringLiteral("network_thread")] = NetworkThread::isEnabled();
+    re[QStringLiteral("protocol_version")] = client->protocolVersion();
+    re[QStringLiteral("packets")] = double(clientCells.packets + serverCells.packets);
+    re[QStringLiteral("header_bytes")] = double(clientCells.headerBytes + serverCells.headerBytes);
+    re[QStringLiteral("seconds")] = seconds;
+    re[QStringLiteral("mb_per_second")] = megabytes / seconds;
+    re[QStringLiteral("cpu_ms_per_mb")] = cpuTotal < 0 || megabytes <= 0 ? -1.0 : cpuTotal / 1000.0 / megabytes;
+    re[QStringLiteral("peak_rss_kb")] = double(peakRssKb());
+    re[QStringLiteral("peak_rss_before_kb")] = double(rssBefore);
+    return re;
+}
+
+/* Write 'megabytes' of data that doesn't compress trivially to 'path' */
+static bool writeSourceFile(const QString &path, int megabytes)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        return false;
+
+    QByteArray block(1024 * 1024, Qt::Uninitialized);
+    quint32 state = 2463534242u;
+    for (int i = 0; i < megabytes; i++) {
+        for (int j = 0; j < block.size(); j += 4) {
+            // xorshift32
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            memcpy(block.data() + j, &state, 4);
+        }
+        if (file.write(block) != block.size())
+            return false;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(QStringLiteral("Protocol::FileTransferChannel throughput benchmark"));
+    parser.addHelpOption();
+    QCommandLineOption sizeOption(QStringLiteral("size"), QStringLiteral("Size of the generated file."), QStringLiteral("MB"), QStringLiteral("1024"));
+    QCommandLineOption fileOption(QStringLiteral("file"), QStringLiteral("Send this file instead of a generated one."), QStringLiteral("path"));
+    QCommandLineOption windowOption(QStringLiteral("window"), QStringLiteral("Unacknowledged chunks allowed at once."), QStringLiteral("chunks"), QString::number(FileTransferChannel::DefaultWindowSize));
+    QCommandLineOption chunkOption(QStringLiteral("chunk"), QStringLiteral("Size of each chunk; above 63 needs protocol version 2."), QStringLiteral("KiB"), QString::number(FileTransferChannel::ChunkSize / 1024));
+    QCommandLineOption versionOption(QStringLiteral("protocol-version"), QStringLiteral("Newest protocol version to negotiate."), QStringLiteral("version"), QStringLiteral("2"));
+    QCommandLineOption threadOption(QStringLiteral("network-thread"), QStringLiteral("Use the network I/O thread."));
+    QCommandLineOption outputOption(QStringLiteral("output"), QStringLiteral("Write JSON results to a file instead of stdout."), QStringLiteral("file"));
+    parser.addOptions({ sizeOption, fileOption, windowOption, chunkOption, versionOption, threadOption, outputOption });
+    parser.process(app);
+
+    QTemporaryDir dir;
+    if (!dir.isValid()) {
+        qWarning() << "Cannot create temporary directory";
+        return 1;
+    }
+
+    FileTransferBenchmark benchmark;
+    benchmark.window = qMax(1, parser.value(windowOption).toInt());
+    benchmark.chunkSize = qBound(1, parser.value(chunkOption).toInt(), FileTransferChannel::MaxLargeChunkSize / 1024) * 1024;
+    Connection::setMaximumProtocolVersion(parser.value(versionOption).toInt());
+    benchmark.destinationPath = dir.filePath(QStringLiteral("received"));
+    if (parser.isSet(fileOption)) {
+        benchmark.sourcePath = parser.value(fileOption);
+    } else {
+        benchmark.sourcePath = dir.filePath(QStringLiteral("source"));
+        if (!writeSourceFile(benchmark.sourcePath, qMax(1, parser.value(sizeOption).toInt()))) {
+            qWarning() << "Cannot write" << benchmark.sourcePath;
+            return 1;
+        }
+    }
+    NetworkThread::setEnabled(parser.isSet(threadOption));
+
+    bool ok = false;
+    QObject::connect(&benchmark, &FileTransferBenchmark::finished, &app,
+        [&](bool result) {
+            ok = result;
+            app.quit();
+        }
+    );
+
+    QTimer::singleShot(600000, &app, [&]() {
+        qWarning() << "Benchmark timed out";
+        app.quit();
+    });
+
+    QTimer::singleShot(0, &benchmark, [&]() { benchmark.start(); });
+    app.exec();
+
+    if (!ok)
+        return 1;
+
+    QByteArray json = QJsonDocument(benchmark.results()).toJson();
+    if (parser.isSet(outputOption)) {
+        QFile file(parser.value(outputOption));
+        if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate) || file.write(json) != json.size()) {
+            qWarning() << "Cannot write results to" << file.fileName();
+            return 1;
+        }
+    } else {
+        fputs(json.constData(), stdout);
+    }
+
+    return 0;
+}
+
+#include "bench_filetransfer.moc"
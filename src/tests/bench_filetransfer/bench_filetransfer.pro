@@ -0,0 +1,7 @@
+include(../tests.pri)
+include(../support/support.pri)
+
+# A benchmark, not a test; run it directly rather than from make check
+CONFIG -= testcase
+
+SOURCES += bench_filetransfer.cpp
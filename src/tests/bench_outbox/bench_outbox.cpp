@@ -0,0 +1,168 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// C
+#include <stdio.h>
+// C++
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QQueue>
+#include <QTimer>
+
+// libtego_ui
+#include <core/ChatOutbox.h>
+
+typedef ChatOutbox::MessageId MessageId;
+
+/* Nanoseconds per message for each outbox operation, with 'history'
+ * undelivered messages at once. Every operation should be O(1) per message,
+ * so these shouldn't grow with the history.
+ */
+struct OutboxTimes
+{
+    double enqueue = 0;
+    double send = 0;
+    double requeue = 0;
+    double acknowledge = 0;
+    // The same acknowledgements, found by scanning the history as
+    // ConversationModel::indexOfIdentifier did before the outbox
+    double linearAcknowledge = 0;
+
+    QJsonObject toJson() const
+    {
+        QJsonObject json;
+        json[QStringLiteral("enqueue_ns")] = enqueue;
+        json[QStringLiteral("send_ns")] = send;
+        json[QStringLiteral("requeue_ns")] = requeue;
+        json[QStringLiteral("acknowledge_ns")] = acknowledge;
+        json[QStringLiteral("linear_acknowledge_ns")] = linearAcknowledge;
+        return json;
+    }
+};
+
+static OutboxTimes measure(int history, int rounds)
+{
+    ChatOutbox outbox;
+    QElapsedTimer timer;
+    qint64 enqueueNs = 0, sendNs = 0, requeueNs = 0, ackNs = 0, linearNs = 0;
+    QVector<MessageId> ids(history);
+    volatile int found = 0;
+
+    for (int round = 0; round < rounds; round++) {
+        timer.start();
+        for (int i = 0; i < history; i++)
+            ids[i] = outbox.enqueue();
+        enqueueNs += timer.nsecsElapsed();
+
+        // Sent, lost with the channel, and sent again
+        timer.start();
+        while (MessageId id = outbox.firstQueued())
+            outbox.markSent(id);
+        sendNs += timer.nsecsElapsed();
+
+        timer.start();
+        outbox.requeueInFlight();
+        requeueNs += timer.nsecsElapsed();
+
+        while (MessageId id = outbox.firstQueued())
+            outbox.markSent(id);
+
+        // Newest first, as the model stores them
+        timer.start();
+        for (int i = 0; i < history; i++) {
+            MessageId id = ids[i];
+            for (int row = history - 1; row >= 0; row--) {
+                if (ids[row] == id) {
+                    found = found + row;
+                    break;
+                }
+            }
+        }
+        linearNs += timer.nsecsElapsed();
+
+        timer.start();
+        for (int i = 0; i < history; i++)
+            outbox.acknowledge(ids[i]);
+        ackNs += timer.nsecsElapsed();
+    }
+
+    double count = double(history) * rounds;
+    OutboxTimes times;
+    times.enqueue = enqueueNs / count;
+    times.send = sendNs / count;
+    times.requeue = requeueNs / count;
+    times.acknowledge = ackNs / count;
+    times.linearAcknowledge = linearNs / count;
+    return times;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(QStringLiteral("ChatOutbox per-message cost benchmark"));
+    parser.addHelpOption();
+    QCommandLineOption historyOption(QStringLiteral("history"), QStringLiteral("Undelivered messages at once."), QStringLiteral("count"), QStringLiteral("1000"));
+    QCommandLineOption roundsOption(QStringLiteral("rounds"), QStringLiteral("Times to send and acknowledge the history."), QStringLiteral("count"), QStringLiteral("200"));
+    QCommandLineOption outputOption(QStringLiteral("output"), QStringLiteral("Write JSON results to a file instead of stdout."), QStringLiteral("file"));
+    parser.addOptions({ historyOption, roundsOption, outputOption });
+    parser.process(app);
+
+    int history = qMax(1, parser.value(historyOption).toInt());
+    int rounds = qMax(1, parser.value(roundsOption).toInt());
+
+    // Ten times the history in a tenth of the rounds, for the same total
+    // work; per-message times should stay about the same
+    QJsonObject results;
+    results[QStringLiteral("history")] = history;
+    results[QStringLiteral("rounds")] = rounds;
+    results[QStringLiteral("per_message")] = measure(history, rounds).toJson();
+    results[QStringLiteral("per_message_10x_history")] = measure(history * 10, qMax(1, rounds / 10)).toJson();
+
+    QByteArray json = QJsonDocument(results).toJson();
+    if (parser.isSet(outputOption)) {
+        QFile file(parser.value(outputOption));
+        if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate) || file.write(json) != json.size()) {
+            qWarning() << "Cannot write results to" << file.fileName();
+            return 1;
+        }
+    } else {
+        fputs(json.constData(), stdout);
+    }
+
+    return 0;
+}
@@ -0,0 +1,6 @@
+include(../tests.pri)
+
+# A benchmark, not a test; run it directly rather than from make check
+CONFIG -= testcase
+
+SOURCES += bench_outbox.cpp
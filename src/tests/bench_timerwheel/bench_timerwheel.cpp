@@ -0,0 +1,209 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// C
+#include <stdio.h>
+// C++
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QFile>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QSet>
+
+// libtego_ui
+#include <utils/TimerWheel.h>
+
+/* Idle wakeups for the timers kept per contact
+ *
+ * Simulates a client with many contacts and nothing to do. Online contacts
+ * have a connection sending KeepAlives at the idle interval, which doubles
+ * up to its maximum; offline contacts retry connecting with a jittered
+ * exponential backoff; a few contacts have a message waiting to be
+ * acknowledged. Each of these is a timer per object.
+ *
+ * With a QTimer per object, every expiration is a wakeup; 'before' counts
+ * the distinct expiration times, which only merges timers that are due in
+ * the same millisecond. 'after' counts the wakeups of a TimerWheel running
+ * the same timers.
+ */
+
+class SimulatedWheel : public TimerWheel
+{
+public:
+    qint64 time = 0;
+
+protected:
+    qint64 now() const override { return time; }
+};
+
+static quint32 seed = 12345;
+static quint32 nextRandom(quint32 max)
+{
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 8) % max;
+}
+
+class ContactTimer : public QObject
+{
+public:
+    enum Kind {
+        KeepAlive,
+        Reconnect,
+        StallCheck
+    };
+
+    SimulatedWheel *wheel;
+    QSet<qint64> *deadlines;
+    WheelTimer timer;
+    Kind kind;
+    int step = 0;
+    int expirations = 0;
+    qint64 deadline = 0;
+    qint64 maxLate = 0;
+
+    ContactTimer(SimulatedWheel *wheel, QSet<qint64> *deadlines, Kind kind)
+        : wheel(wheel), deadlines(deadlines), timer(wheel), kind(kind)
+    {
+        timer.setSingleShot(true);
+        connect(&timer, &WheelTimer::timeout, this, &ContactTimer::expired);
+        // Offline contacts were last tried at different times
+        startNext(kind == Reconnect ? int(nextRandom(900 * 1000)) : -1);
+    }
+
+    void startNext(int interval = -1)
+    {
+        if (interval < 0) {
+            qint64 base;
+            switch (kind) {
+            case KeepAlive:
+                // As ConnectionPrivate: 60s while idle, doubling up to 900s, less up to an eighth
+                base = qMin(qint64(60 * 1000) << qMin(step, 4), qint64(900 * 1000));
+                interval = int(base - nextRandom(unsigned(base / 8) + 1));
+                break;
+            case Reconnect:
+                // As ConnectScheduler: 30s doubling up to 900s, between half and all of it,
+                // after an attempt that took 20 to 90 seconds
+                base = qMin(qint64(30 * 1000) << qMin(step, 5), qint64(900 * 1000));
+                interval = int(base / 2 + nextRandom(unsigned(base - base / 2) + 1) + (20 + nextRandom(71)) * 1000);
+                break;
+            case StallCheck:
+                // As ChatOutbox: a stall check at four 30s timeouts, for each of 5 routes
+                if (step >= 5)
+                    return;
+                interval = 4 * 30 * 1000;
+                break;
+            }
+            step++;
+        }
+
+        deadline = wheel->time + interval;
+        timer.start(interval);
+    }
+
+    void expired()
+    {
+        deadlines->insert(deadline);
+        expirations++;
+        maxLate = qMax(maxLate, wheel->time - deadline);
+        startNext();
+    }
+};
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(QStringLiteral("Idle timer wakeups with many contacts"));
+    parser.addHelpOption();
+    QCommandLineOption contactsOption(QStringLiteral("contacts"), QStringLiteral("Number of contacts."), QStringLiteral("count"), QStringLiteral("2000"));
+    QCommandLineOption onlineOption(QStringLiteral("online"), QStringLiteral("Percent of contacts that are online."), QStringLiteral("percent"), QStringLiteral("10"));
+    QCommandLineOption hoursOption(QStringLiteral("hours"), QStringLiteral("Simulated time."), QStringLiteral("hours"), QStringLiteral("4"));
+    QCommandLineOption outputOption(QStringLiteral("output"), QStringLiteral("Write JSON results to a file instead of stdout."), QStringLiteral("file"));
+    parser.addOptions({ contactsOption, onlineOption, hoursOption, outputOption });
+    parser.process(app);
+
+    int contacts = qMax(1, parser.value(contactsOption).toInt());
+    int online = qBound(0, parser.value(onlineOption).toInt(), 100);
+    int hours = qMax(1, parser.value(hoursOption).toInt());
+
+    SimulatedWheel wheel;
+    QSet<qint64> deadlines;
+    QList<ContactTimer*> timers;
+    for (int i = 0; i < contacts; i++) {
+        bool isOnline = int(nextRandom(100)) < online;
+        timers.append(new ContactTimer(&wheel, &deadlines, isOnline ? ContactTimer::KeepAlive : ContactTimer::Reconnect));
+        if (nextRandom(100) == 0)
+            timers.append(new ContactTimer(&wheel, &deadlines, ContactTimer::StallCheck));
+    }
+
+    qint64 end = qint64(hours) * 3600 * 1000;
+    quint64 startWakeups = wheel.wakeups();
+    for (qint64 next = wheel.nextWakeup(); next >= 0 && next <= end; next = wheel.nextWakeup()) {
+        wheel.time = next;
+        wheel.process();
+    }
+
+    qint64 expirations = 0, maxLate = 0;
+    for (ContactTimer *timer : timers) {
+        expirations += timer->expirations;
+        maxLate = qMax(maxLate, timer->maxLate);
+    }
+    quint64 wakeups = wheel.wakeups() - startWakeups;
+
+    QJsonObject results;
+    results[QStringLiteral("contacts")] = contacts;
+    results[QStringLiteral("online_percent")] = online;
+    results[QStringLiteral("hours")] = hours;
+    results[QStringLiteral("timers")] = timers.size();
+    results[QStringLiteral("expirations")] = double(expirations);
+    results[QStringLiteral("wakeups_before")] = deadlines.size();
+    results[QStringLiteral("wakeups_before_per_hour")] = double(deadlines.size()) / hours;
+    results[QStringLiteral("wakeups_after")] = double(wakeups);
+    results[QStringLiteral("wakeups_after_per_hour")] = double(wakeups) / hours;
+    results[QStringLiteral("max_late_ms")] = double(maxLate);
+    qDeleteAll(timers);
+
+    QByteArray json = QJsonDocument(results).toJson();
+    if (parser.isSet(outputOption)) {
+        QFile file(parser.value(outputOption));
+        if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate) || file.write(json) != json.size()) {
+            qWarning() << "Cannot write results to" << file.fileName();
+            return 1;
+        }
+    } else {
+        fputs(json.constData(), stdout);
+    }
+
+    return 0;
+}
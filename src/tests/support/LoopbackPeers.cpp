@@ -0,0 +1,91 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "LoopbackPeers.h"
+#include "OnionSocket.h"
+#include "protocol/Connection.h"
+
+using namespace Protocol;
+
+bool LoopbackPeers::connect(const QString &hostname)
+{
+    if (client || !listener.listen(QHostAddress::LocalHost))
+        return false;
+
+    OnionSocket *socket = new OnionSocket;
+    socket->connectToHost(listener.serverAddress(), listener.serverPort());
+    if (!socket->waitForConnected(5000) || !listener.waitForNewConnection(5000)) {
+        delete socket;
+        return false;
+    }
+    socket->setOnionPeerName(hostname);
+
+    QTcpSocket *serverSocket = listener.nextPendingConnection();
+    serverSocket->setProperty("localHostname", hostname);
+    listener.close();
+
+    server.reset(new Connection(serverSocket, Connection::ServerSide));
+    client.reset(new Connection(socket, Connection::ClientSide));
+    server->setKeepAliveInterval(0);
+    client->setKeepAliveInterval(0);
+    readySpy.reset(new QSignalSpy(client.data(), &Connection::ready));
+    return true;
+}
+
+bool LoopbackPeers::waitForReady(int timeout)
+{
+    return readySpy && (readySpy->count() > 0 || readySpy->wait(timeout));
+}
+
+bool LoopbackPeers::makeContacts(const QString &clientHostname)
+{
+    if (!server || !client)
+        return false;
+    server->grantAuthentication(Connection::HiddenServiceAuth, clientHostname);
+    return server->setPurpose(Connection::Purpose::KnownContact) &&
+           client->setPurpose(Connection::Purpose::KnownContact);
+}
+
+bool LoopbackPeers::close(int timeout)
+{
+    if (!client || !server)
+        return true;
+
+    bool clientOpen = client->isConnected();
+    bool serverOpen = server->isConnected();
+    QSignalSpy clientClosed(client.data(), &Connection::closed);
+    QSignalSpy serverClosed(server.data(), &Connection::closed);
+    client->close();
+
+    return (!clientOpen || clientClosed.count() > 0 || clientClosed.wait(timeout)) &&
+           (!serverOpen || serverClosed.count() > 0 || serverClosed.wait(timeout));
+}
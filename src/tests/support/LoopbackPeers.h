@@ -0,0 +1,80 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LOOPBACKPEERS_H
+#define LOOPBACKPEERS_H
+
+#include <QScopedPointer>
+#include <QSharedPointer>
+#include <QSignalSpy>
+#include <QTcpServer>
+
+namespace Protocol
+{
+    class Connection;
+}
+
+/* A ClientSide and a ServerSide Connection joined over loopback
+ *
+ * The client connects as it would through TorSocket, to a server that
+ * claims 'hostname'. Keepalives are disabled on both. Nothing is
+ * authenticated until makeContacts(), so tests of authentication can
+ * drive it themselves. The peers hold a reference to both connections,
+ * which can be shared, e.g. with a ContactUser.
+ */
+class LoopbackPeers
+{
+    Q_DISABLE_COPY(LoopbackPeers)
+
+public:
+    QSharedPointer<Protocol::Connection> client;
+    QSharedPointer<Protocol::Connection> server;
+
+    LoopbackPeers() { }
+
+    /* Connect the sockets and create both connections; false if they can't
+     * connect */
+    bool connect(const QString &hostname);
+    /* Wait until the client has negotiated a version */
+    bool waitForReady(int timeout = 5000);
+    /* Authenticate the client as 'clientHostname', as if it had proven it,
+     * and make both connections known contacts */
+    bool makeContacts(const QString &clientHostname);
+    /* Close the client, and wait until both connections have closed */
+    bool close(int timeout = 5000);
+
+private:
+    QTcpServer listener;
+    QScopedPointer<QSignalSpy> readySpy;
+};
+
+#endif // LOOPBACKPEERS_H
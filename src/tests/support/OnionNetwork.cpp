@@ -0,0 +1,463 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "OnionNetwork.h"
+#include "tor/HiddenService.h"
+#include "tor/TorControl.h"
+
+#include <QQueue>
+#include <QTcpSocket>
+#include <QTimer>
+
+/* One SOCKS connection, and the stream it's relayed to once it's open */
+class OnionCircuit : public QObject
+{
+public:
+    OnionNetwork * const network;
+    QString hostname;
+
+    OnionCircuit(OnionNetwork *network, QTcpSocket *client);
+
+    /* Reset both ends; a circuit that isn't open yet fails */
+    void collapse();
+
+private:
+    enum State
+    {
+        Greeting,
+        Request,
+        Opening,
+        Open,
+        Closed
+    };
+
+    // SOCKS5 reply codes
+    enum Reply : char
+    {
+        Succeeded = 0x00,
+        GeneralFailure = 0x01,
+        HostUnreachable = 0x04,
+        ConnectionRefused = 0x05,
+        CommandNotSupported = 0x07,
+        AddressTypeNotSupported = 0x08
+    };
+
+    /* Cells in flight in one direction of the stream */
+    struct Direction
+    {
+        QTcpSocket *from = 0;
+        QTcpSocket *to = 0;
+        // Cells and the time they arrive, in order
+        QQueue<QPair<qint64,QByteArray>> cells;
+        QTimer timer;
+        // When the last cell has been sent, at the circuit's bandwidth
+        qint64 busyUntil = 0;
+        qint64 lastArrival = 0;
+        // The sending end has closed
+        bool ended = false;
+    };
+
+    QTcpSocket * const client;
+    QTcpSocket *service;
+    quint16 port;
+    State state;
+    bool finished;
+    OnionNetwork::Shaping shaping;
+    Direction upstream;
+    Direction downstream;
+
+    void readClient();
+    void open();
+    void startRelay();
+    void reply(Reply code);
+    void fail(Reply code);
+    void relay(Direction &direction);
+    void schedule(Direction &direction);
+    void deliver(Direction &direction);
+    void endIfDrained(Direction &direction);
+    void checkFinished();
+};
+
+OnionCircuit::OnionCircuit(OnionNetwork *network, QTcpSocket *client)
+    : QObject(network)
+    , network(network)
+    , client(client)
+    , service(0)
+    , port(0)
+    , state(Greeting)
+    , finished(false)
+    , shaping(network->shaping())
+{
+    network->m_circuits.append(this);
+    client->setParent(this);
+    // Without a limit, Qt would read everything the peer sends regardless of the window
+    client->setReadBufferSize(qint64(qMax(shaping.window, 1)) * OnionNetwork::CellPayloadSize);
+    connect(client, &QTcpSocket::readyRead, this, [this]() { readClient(); });
+    connect(client, &QTcpSocket::disconnected, this,
+        [this]() {
+            if (state == Open) {
+                upstream.ended = true;
+                endIfDrained(upstream);
+            } else {
+                // The client gave up before the stream was open
+                state = Closed;
+                if (service)
+                    service->abort();
+            }
+            checkFinished();
+        }
+    );
+
+    foreach (Direction *direction, QList<Direction*>() << &upstream << &downstream) {
+        direction->timer.setSingleShot(true);
+        direction->timer.setTimerType(Qt::PreciseTimer);
+        connect(&direction->timer, &QTimer::timeout, this, [this,direction]() { deliver(*direction); });
+    }
+
+    readClient();
+}
+
+void OnionCircuit::readClient()
+{
+    if (state == Greeting) {
+        QByteArray head = client->peek(2);
+        if (head.size() < 2 || client->bytesAvailable() < 2 + quint8(head.at(1)))
+            return;
+
+        QByteArray greeting = client->read(2 + quint8(head.at(1)));
+        if (greeting.at(0) != 5 || !greeting.mid(2).contains('\0')) {
+            // No acceptable authentication method
+            client->write(QByteArray("\x05\xff", 2));
+            state = Closed;
+            client->disconnectFromHost();
+            return;
+        }
+
+        client->write(QByteArray("\x05\x00", 2));
+        state = Request;
+    }
+
+    if (state == Request) {
+        QByteArray head = client->peek(5);
+        if (head.size() < 5)
+            return;
+
+        int length;
+        switch (head.at(3)) {
+        case 0x01: length = 4 + 4 + 2; break;
+        case 0x03: length = 4 + 1 + quint8(head.at(4)) + 2; break;
+        case 0x04: length = 4 + 16 + 2; break;
+        default:
+            fail(AddressTypeNotSupported);
+            return;
+        }
+        if (client->bytesAvailable() < length)
+            return;
+
+        QByteArray request = client->read(length);
+        if (request.at(0) != 5 || request.at(1) != 0x01) {
+            fail(CommandNotSupported);
+            return;
+        }
+
+        // Addresses other than hostnames can't be reached without exits
+        if (request.at(3) == 0x03)
+            hostname = QString::fromLatin1(request.mid(5, quint8(request.at(4)))).toLower();
+        port = quint16((quint8(request.at(length - 2)) << 8) | quint8(request.at(length - 1)));
+
+        state = Opening;
+        network->m_attempts++;
+        QTimer::singleShot(shaping.circuitDelay, this, [this]() { open(); });
+        return;
+    }
+
+    // Data sent before the stream is open waits in the socket
+    if (state == Open)
+        relay(upstream);
+}
+
+void OnionCircuit::open()
+{
+    if (state != Opening)
+        return;
+
+    OnionNetwork::Target target = network->m_services.value(hostname).value(port);
+    if (target.address.isNull() || network->random() < shaping.failureRate) {
+        fail(HostUnreachable);
+        return;
+    }
+
+    service = new QTcpSocket(this);
+    service->setReadBufferSize(qint64(qMax(shaping.window, 1)) * OnionNetwork::CellPayloadSize);
+    connect(service, &QTcpSocket::connected, this, [this]() { startRelay(); });
+    connect(service, (void (QAbstractSocket::*)(QAbstractSocket::SocketError))&QAbstractSocket::error, this,
+        [this]() {
+            if (state == Opening)
+                fail(ConnectionRefused);
+        }
+    );
+    connect(service, &QTcpSocket::disconnected, this,
+        [this]() {
+            if (state == Open) {
+                downstream.ended = true;
+                endIfDrained(downstream);
+            }
+            checkFinished();
+        }
+    );
+    service->connectToHost(target.address, target.port);
+}
+
+void OnionCircuit::startRelay()
+{
+    if (state != Opening)
+        return;
+
+    state = Open;
+    reply(Succeeded);
+
+    upstream.from = client;
+    upstream.to = service;
+    downstream.from = service;
+    downstream.to = client;
+    connect(service, &QTcpSocket::readyRead, this, [this]() { relay(downstream); });
+
+    emit network->circuitOpened(hostname);
+    relay(upstream);
+}
+
+void OnionCircuit::reply(Reply code)
+{
+    // The bound address isn't meaningful for onion services, as with tor
+    QByteArray response("\x05\x00\x00\x01\x00\x00\x00\x00\x00\x00", 10);
+    response[1] = code;
+    client->write(response);
+}
+
+void OnionCircuit::fail(Reply code)
+{
+    if (state == Opening) {
+        network->m_failures++;
+        emit network->circuitFailed(hostname);
+    }
+
+    state = Closed;
+    reply(code);
+    client->disconnectFromHost();
+    if (service)
+        service->abort();
+    checkFinished();
+}
+
+void OnionCircuit::collapse()
+{
+    if (state == Opening) {
+        fail(GeneralFailure);
+        return;
+    }
+    if (state == Closed)
+        return;
+
+    state = Closed;
+    upstream.cells.clear();
+    downstream.cells.clear();
+    client->abort();
+    if (service)
+        service->abort();
+    checkFinished();
+}
+
+void OnionCircuit::relay(Direction &direction)
+{
+    while (state == Open && direction.cells.size() < shaping.window && direction.from->bytesAvailable() > 0) {
+        QByteArray payload = direction.from->read(OnionNetwork::CellPayloadSize);
+        network->m_cells++;
+
+        if (shaping.dropRate > 0 && network->random() < shaping.dropRate) {
+            collapse();
+            return;
+        }
+
+        // Cells are sent one at a time at the circuit's bandwidth, and arrive in order
+        qint64 sendAt = qMax(network->now(), direction.busyUntil);
+        if (shaping.bandwidth > 0)
+            sendAt += qint64(OnionNetwork::CellSize) * 1000000 / shaping.bandwidth;
+        direction.busyUntil = sendAt;
+
+        qint64 arrival = sendAt + qint64(shaping.roundTripTime) * 500;
+        if (shaping.jitter > 0)
+            arrival += qint64(network->random() * shaping.jitter * 1000);
+        direction.lastArrival = qMax(direction.lastArrival, arrival);
+        direction.cells.enqueue(qMakePair(direction.lastArrival, payload));
+    }
+
+    schedule(direction);
+}
+
+void OnionCircuit::schedule(Direction &direction)
+{
+    if (direction.cells.isEmpty() || direction.timer.isActive())
+        return;
+
+    // Round up, so the first cell has always arrived when the timer fires
+    qint64 wait = direction.cells.head().first - network->now();
+    direction.timer.start(int(qMax(qint64(0), (wait + 999) / 1000)));
+}
+
+void OnionCircuit::deliver(Direction &direction)
+{
+    if (state != Open)
+        return;
+
+    qint64 now = network->now();
+    while (!direction.cells.isEmpty() && direction.cells.head().first <= now) {
+        QByteArray cell = direction.cells.dequeue().second;
+        // Cells for an end that has closed are lost, as with tor
+        if (direction.to->state() == QAbstractSocket::ConnectedState)
+            direction.to->write(cell);
+    }
+
+    // Reading resumes as the window opens
+    relay(direction);
+    endIfDrained(direction);
+}
+
+void OnionCircuit::endIfDrained(Direction &direction)
+{
+    if (state == Open && direction.ended && direction.cells.isEmpty() && !direction.from->bytesAvailable())
+        direction.to->disconnectFromHost();
+}
+
+void OnionCircuit::checkFinished()
+{
+    if (finished || client->state() != QAbstractSocket::UnconnectedState)
+        return;
+    if (service && service->state() != QAbstractSocket::UnconnectedState)
+        return;
+
+    bool wasOpen = upstream.from != 0;
+    finished = true;
+    state = Closed;
+    network->m_circuits.removeOne(this);
+    if (wasOpen)
+        emit network->circuitClosed(hostname);
+    deleteLater();
+}
+
+OnionNetwork::OnionNetwork(QObject *parent)
+    : QObject(parent)
+    , m_attempts(0)
+    , m_failures(0)
+    , m_cells(0)
+{
+    m_clock.start();
+    setSeed(0);
+    connect(&m_server, &QTcpServer::newConnection, this, &OnionNetwork::acceptConnections);
+}
+
+bool OnionNetwork::listen()
+{
+    if (!m_server.listen(QHostAddress::LocalHost)) {
+        qWarning() << "Cannot listen for emulated SOCKS connections:" << m_server.errorString();
+        return false;
+    }
+    return true;
+}
+
+QNetworkProxy OnionNetwork::proxy() const
+{
+    return QNetworkProxy(QNetworkProxy::Socks5Proxy, m_server.serverAddress().toString(), m_server.serverPort());
+}
+
+void OnionNetwork::attach(Tor::TorControl *control)
+{
+    if (!m_server.isListening() && !listen())
+        return;
+
+    foreach (Tor::HiddenService *service, control->hiddenServices())
+        addHiddenService(service);
+    control->setStandaloneProxy(m_server.serverAddress(), m_server.serverPort());
+}
+
+void OnionNetwork::addService(const QString &hostname, quint16 servicePort, const QHostAddress &targetAddress, quint16 targetPort)
+{
+    Target target = { targetAddress, targetPort };
+    m_services[hostname.toLower()].insert(servicePort, target);
+}
+
+void OnionNetwork::addHiddenService(Tor::HiddenService *service)
+{
+    if (service->hostname().isEmpty()) {
+        qWarning() << "Cannot add a hidden service without a key to the emulated network";
+        return;
+    }
+
+    foreach (const Tor::HiddenService::Target &target, service->targets())
+        addService(service->hostname(), target.servicePort, target.targetAddress, target.targetPort);
+}
+
+void OnionNetwork::removeService(const QString &hostname)
+{
+    m_services.remove(hostname.toLower());
+}
+
+void OnionNetwork::setSeed(quint64 seed)
+{
+    // xorshift needs a state that isn't zero
+    m_random = seed ^ Q_UINT64_C(0x9e3779b97f4a7c15);
+    if (!m_random)
+        m_random = 1;
+}
+
+double OnionNetwork::random()
+{
+    // xorshift64*; only the upper 53 bits are used
+    m_random ^= m_random >> 12;
+    m_random ^= m_random << 25;
+    m_random ^= m_random >> 27;
+    return double((m_random * Q_UINT64_C(2685821657736338717)) >> 11) / double(Q_UINT64_C(1) << 53);
+}
+
+void OnionNetwork::dropCircuits(const QString &hostname)
+{
+    foreach (OnionCircuit *circuit, m_circuits) {
+        if (hostname.isEmpty() || circuit->hostname == hostname.toLower())
+            circuit->collapse();
+    }
+}
+
+void OnionNetwork::acceptConnections()
+{
+    // Circuits add themselves to m_circuits, and remove themselves when finished
+    while (m_server.hasPendingConnections())
+        new OnionCircuit(this, m_server.nextPendingConnection());
+}
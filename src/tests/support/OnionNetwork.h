@@ -0,0 +1,160 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef ONIONNETWORK_H
+#define ONIONNETWORK_H
+
+#include <QElapsedTimer>
+#include <QHash>
+#include <QHostAddress>
+#include <QNetworkProxy>
+#include <QTcpServer>
+
+namespace Tor
+{
+    class TorControl;
+    class HiddenService;
+}
+
+class OnionCircuit;
+
+/* An emulated onion network, for tests and benchmarks
+ *
+ * OnionNetwork is a SOCKS5 proxy on the loopback interface that stands in
+ * for tor. Onion hostnames resolve to services registered on the network,
+ * usually the HiddenService of a UserIdentity, and each stream is relayed
+ * over an emulated circuit with the delays, bandwidth and failures set by
+ * Shaping. Attached to a TorControl, it's used by TorSocket, and so by
+ * OutboundConnector, as tor would be, without any network access.
+ *
+ * Streams are relayed in cells, like tor does: each read of up to
+ * CellPayloadSize bytes becomes a cell, which costs CellSize bytes of
+ * bandwidth. At most 'window' cells are buffered in each direction before
+ * reading stops, which stands for tor's stream flow control, so senders
+ * see backpressure. Streams are reliable, so loss shows as circuits that
+ * collapse, and both ends are reset.
+ */
+class OnionNetwork : public QObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(OnionNetwork)
+
+    friend class OnionCircuit;
+
+public:
+    // Bytes of stream data in a relay cell, and bytes of a cell on the wire
+    static const int CellPayloadSize = 498;
+    static const int CellSize = 514;
+
+    struct Shaping
+    {
+        // Milliseconds to build a circuit and reach the service, before the SOCKS reply
+        int circuitDelay = 0;
+        // Milliseconds for a cell to go to the other end and back, without queueing
+        int roundTripTime = 0;
+        // Up to this many milliseconds are added at random to the delay of each cell
+        int jitter = 0;
+        // Bytes per second in each direction of a circuit, or 0 for no limit
+        int bandwidth = 0;
+        // Cells buffered in each direction of a circuit before reading stops
+        int window = 500;
+        // Chance that an attempt to open a circuit fails
+        double failureRate = 0;
+        // Chance that the circuit collapses with each cell that's relayed
+        double dropRate = 0;
+    };
+
+    explicit OnionNetwork(QObject *parent = 0);
+
+    /* Start the SOCKS proxy on the loopback interface */
+    bool listen();
+    QNetworkProxy proxy() const;
+
+    /* Make connections through 'control' use this network
+     *
+     * Hidden services that were added to 'control' are registered; those
+     * added afterwards need addHiddenService.
+     */
+    void attach(Tor::TorControl *control);
+
+    /* Hostnames are in the onion hostname format, i.e. they end with .onion */
+    void addService(const QString &hostname, quint16 servicePort, const QHostAddress &targetAddress, quint16 targetPort);
+    void addHiddenService(Tor::HiddenService *service);
+    /* Later attempts to reach 'hostname' fail; open circuits are kept */
+    void removeService(const QString &hostname);
+
+    const Shaping &shaping() const { return m_shaping; }
+    /* Shaping applies to circuits that are opened afterwards */
+    void setShaping(const Shaping &shaping) { m_shaping = shaping; }
+    /* Seed for random delays and failures, to repeat a run */
+    void setSeed(quint64 seed);
+
+    int circuitCount() const { return m_circuits.size(); }
+    /* Collapse every circuit to 'hostname', or every circuit if it's empty */
+    void dropCircuits(const QString &hostname = QString());
+
+    /* Totals for the lifetime of the network */
+    int attemptCount() const { return m_attempts; }
+    int failureCount() const { return m_failures; }
+    qint64 cellCount() const { return m_cells; }
+
+signals:
+    void circuitOpened(const QString &hostname);
+    void circuitFailed(const QString &hostname);
+    void circuitClosed(const QString &hostname);
+
+private:
+    struct Target
+    {
+        QHostAddress address;
+        quint16 port;
+    };
+
+    QTcpServer m_server;
+    // Targets by hostname and service port
+    QHash<QString,QHash<quint16,Target>> m_services;
+    QList<OnionCircuit*> m_circuits;
+    Shaping m_shaping;
+    QElapsedTimer m_clock;
+    quint64 m_random;
+    int m_attempts;
+    int m_failures;
+    qint64 m_cells;
+
+    void acceptConnections();
+    // Microseconds since the network was created
+    qint64 now() const { return m_clock.nsecsElapsed() / 1000; }
+    // Uniformly distributed in [0, 1)
+    double random();
+};
+
+#endif
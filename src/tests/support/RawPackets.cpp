@@ -0,0 +1,99 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "RawPackets.h"
+#include "protocol/ControlChannel.pb.h"
+
+#include <QtEndian>
+
+QByteArray makePacket(int channelId, const google::protobuf::Message &message)
+{
+    std::string data = message.SerializeAsString();
+
+    uchar header[4];
+    qToBigEndian(quint16(data.size() + sizeof(header)), header);
+    qToBigEndian(quint16(channelId), &header[2]);
+
+    QByteArray packet(reinterpret_cast<const char*>(header), sizeof(header));
+    packet.append(data.data(), int(data.size()));
+    return packet;
+}
+
+void appendVarint(QByteArray &out, quint32 value)
+{
+    while (value >= 0x80) {
+        out.append(char((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    out.append(char(value));
+}
+
+QByteArray makePacketV2(int channelId, const google::protobuf::Message &message)
+{
+    std::string data = message.SerializeAsString();
+
+    QByteArray packet;
+    appendVarint(packet, quint32(data.size()));
+    appendVarint(packet, quint32(channelId));
+    packet.append(data.data(), int(data.size()));
+    return packet;
+}
+
+bool takePacketV2(QByteArray &buffer, int &channelId, QByteArray &data)
+{
+    quint32 values[2] = { 0, 0 };
+    int offset = 0;
+    for (int field = 0; field < 2; field++) {
+        for (int shift = 0; ; shift += 7) {
+            if (offset >= buffer.size())
+                return false;
+            uchar byte = uchar(buffer.at(offset++));
+            values[field] |= quint32(byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+                break;
+        }
+    }
+
+    if (buffer.size() - offset < int(values[0]))
+        return false;
+    channelId = int(values[1]);
+    data = buffer.mid(offset, int(values[0]));
+    buffer.remove(0, offset + int(values[0]));
+    return true;
+}
+
+QByteArray makeKeepAlive()
+{
+    Protocol::Data::Control::Packet message;
+    message.mutable_keep_alive()->set_response_requested(true);
+    return makePacket(0, message);
+}
@@ -0,0 +1,58 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef RAWPACKETS_H
+#define RAWPACKETS_H
+
+#include <QByteArray>
+
+namespace google {
+namespace protobuf {
+    class Message;
+}
+}
+
+/* Packets written and parsed by hand, for peers that speak raw protocol data
+ * to a Connection rather than through one
+ */
+
+// A version 1 packet: big-endian 16-bit size and channel, then the message
+QByteArray makePacket(int channelId, const google::protobuf::Message &message);
+// A version 2 packet: varint size and channel, then the message
+QByteArray makePacketV2(int channelId, const google::protobuf::Message &message);
+void appendVarint(QByteArray &out, quint32 value);
+// Remove a complete version 2 packet from the front of 'buffer'
+bool takePacketV2(QByteArray &buffer, int &channelId, QByteArray &data);
+// A version 1 keepalive on the control channel, which requests a response
+QByteArray makeKeepAlive();
+
+#endif // RAWPACKETS_H
@@ -0,0 +1,20 @@
+# Shared code for tests and benchmarks; include after tests.pri
+INCLUDEPATH += $${PWD}
+
+HEADERS += \
+    $${PWD}/OnionNetwork.h \
+    $${PWD}/OnionSocket.h \
+    $${PWD}/TestIdentities.h \
+    $${PWD}/RawPackets.h \
+    $${PWD}/LoopbackPeers.h
+
+SOURCES += \
+    $${PWD}/OnionNetwork.cpp \
+    $${PWD}/RawPackets.cpp \
+    $${PWD}/LoopbackPeers.cpp
+
+# Replaces malloc for the whole program; set before including this file
+count_allocations {
+    HEADERS += $${PWD}/AllocationCounter.h
+    SOURCES += $${PWD}/AllocationCounter.cpp
+}
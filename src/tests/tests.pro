@@ -6,3 +6,19 @@ CONFIG += ordered
 SUBDIRS = \
     tst_cryptokey \
     tst_contactidvalidator \
+    tst_connection \
+    tst_authentication \
+    tst_filetransfer \
+    tst_allocations \
+    tst_networkthread \
+    tst_chatoutbox \
+    tst_connectscheduler \
+    tst_timerwheel \
+    tst_connectionpolicy \
+    tst_handover \
+    tst_directtransport \
+    tst_onionnetwork \
+    bench_connection \
+    bench_filetransfer \
+    bench_outbox \
+    bench_timerwheel \
@@ -0,0 +1,374 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// C++
+#include <QtTest>
+#include <QTcpServer>
+#include <QTcpSocket>
+
+// libtego_ui
+#include <protocol/Connection.h>
+#include <protocol/ChatChannel.h>
+#include <protocol/ControlChannel.pb.h>
+#include <protocol/ChatChannel.pb.h>
+
+// tests
+#include <AllocationCounter.h>
+#include <RawPackets.h>
+#include <TestIdentities.h>
+
+using namespace Protocol;
+
+constexpr int chatChannelId = 1;
+
+/* Bounds the allocations made by steady-state traffic on the protocol hot
+ * path. The server end is a real Connection; the client end is a plain
+ * QTcpSocket speaking raw protocol data.
+ *
+ * Allocations are counted only while the Connection handles readyRead, which
+ * is bracketed by slots connected before and after its own. Each of those
+ * reads may schedule one write for the event loop turn, which allocates an
+ * event. Protobuf messages, packet buffers and queue bookkeeping reuse memory
+ * from the warm-up round. Chat messages still make the allocations below,
+ * which have to be made for each message.
+ */
+class TestAllocations : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void init();
+    void cleanup();
+
+    void keepAlive();
+    void inboundChat();
+    void outboundChat();
+
+private:
+    QTcpServer *server = nullptr;
+    QTcpSocket *client = nullptr;
+    Connection *connection = nullptr;
+    QByteArray clientBuffer;
+    bool measuring = false;
+    int readCount = 0;
+    int keepAliveResponses = 0;
+    int chatAcknowledgements = 0;
+    QList<quint32> receivedMessages;
+
+    static QByteArray makeChatMessage(quint32 id);
+    static QByteArray makeChatAcknowledge(int channelId, quint32 id);
+
+    void beginRead();
+    void endRead();
+    void startMeasuring();
+    void stopMeasuring();
+    void readResponses();
+    bool withinBudget(int messages, int perMessage, int extra = 0) const;
+};
+
+// Allocations for the write that each read may schedule
+static const int PerReadAllocations = 1;
+// The QString for an inbound message's text. It's handed to messageReceived,
+// and receivers keep it, so it can't reuse a buffer.
+static const int InboundChatAllocations = 1;
+// The entry in pendingMessages for an outbound message. Its text is encoded
+// into the reused packet, but QSet allocates a node for each entry.
+static const int OutboundChatAllocations = 1;
+// pendingMessages also resizes its buckets by powers of two, as it grows to
+// a round's messages and shrinks as they're acknowledged
+static const int PendingResizeAllocations = 32;
+
+QByteArray TestAllocations::makeChatMessage(quint32 id)
+{
+    // Long enough that the text doesn't fit in std::string's inline storage
+    Data::Chat::Packet message;
+    message.mutable_chat_message()->set_message_text(std::string(200, 'x'));
+    message.mutable_chat_message()->set_message_id(id);
+    return makePacket(chatChannelId, message);
+}
+
+QByteArray TestAllocations::makeChatAcknowledge(int channelId, quint32 id)
+{
+    Data::Chat::Packet message;
+    message.mutable_chat_acknowledge()->set_message_id(id);
+    message.mutable_chat_acknowledge()->set_accepted(true);
+    return makePacket(channelId, message);
+}
+
+void TestAllocations::beginRead()
+{
+    if (measuring) {
+        readCount++;
+        AllocationCounter::setCounting(true);
+    }
+}
+
+void TestAllocations::endRead()
+{
+    AllocationCounter::setCounting(false);
+}
+
+void TestAllocations::startMeasuring()
+{
+    AllocationCounter::reset();
+    readCount = 0;
+    measuring = true;
+}
+
+void TestAllocations::stopMeasuring()
+{
+    measuring = false;
+    AllocationCounter::setCounting(false);
+    qDebug() << AllocationCounter::count() << "allocations during" << readCount << "reads";
+}
+
+bool TestAllocations::withinBudget(int messages, int perMessage, int extra) const
+{
+    return AllocationCounter::count() <= quint64(readCount * PerReadAllocations + messages * perMessage + extra);
+}
+
+void TestAllocations::readResponses()
+{
+    clientBuffer.append(client->readAll());
+
+    while (clientBuffer.size() >= 4) {
+        quint16 size = qFromBigEndian<quint16>(reinterpret_cast<const uchar*>(clientBuffer.constData()));
+        quint16 channelId = qFromBigEndian<quint16>(reinterpret_cast<const uchar*>(clientBuffer.constData() + 2));
+        QVERIFY(size >= 4);
+        if (clientBuffer.size() < size)
+            break;
+
+        if (channelId == 0) {
+            Data::Control::Packet message;
+            QVERIFY(message.ParseFromArray(clientBuffer.constData() + 4, size - 4));
+            if (message.has_keep_alive()) {
+                keepAliveResponses++;
+            } else if (message.has_open_channel()) {
+                // Accept every channel the server opens
+                Data::Control::Packet response;
+                response.mutable_channel_result()->set_channel_identifier(message.open_channel().channel_identifier());
+                response.mutable_channel_result()->set_opened(true);
+                client->write(makePacket(0, response));
+            } else if (message.has_channel_result()) {
+                QVERIFY(message.channel_result().opened());
+            }
+        } else {
+            Data::Chat::Packet message;
+            QVERIFY(message.ParseFromArray(clientBuffer.constData() + 4, size - 4));
+            if (message.has_chat_acknowledge()) {
+                QVERIFY(message.chat_acknowledge().accepted());
+                chatAcknowledgements++;
+            } else if (message.has_chat_message()) {
+                receivedMessages.append(message.chat_message().message_id());
+            }
+        }
+
+        clientBuffer.remove(0, size);
+    }
+}
+
+void TestAllocations::initTestCase()
+{
+    if (!AllocationCounter::isSupported())
+        QSKIP("Counting allocations needs glibc");
+}
+
+void TestAllocations::init()
+{
+    server = new QTcpServer;
+    QVERIFY(server->listen(QHostAddress::LocalHost));
+
+    client = new QTcpSocket;
+    client->connectToHost(server->serverAddress(), server->serverPort());
+    QVERIFY(client->waitForConnected(5000));
+    QVERIFY(server->waitForNewConnection(5000));
+
+    QTcpSocket *socket = server->nextPendingConnection();
+    QVERIFY(socket);
+    socket->setProperty("localHostname", QString::fromLatin1(serverHostname));
+
+    // Bracket the Connection's own readyRead handler
+    connect(socket, &QIODevice::readyRead, this, &TestAllocations::beginRead);
+    connection = new Connection(socket, Connection::ServerSide);
+    connect(socket, &QIODevice::readyRead, this, &TestAllocations::endRead);
+
+    QSignalSpy readySpy(connection, &Connection::ready);
+    const char intro[] = { 0x49, 0x4D, 0x01, 0x01 };
+    client->write(intro, sizeof(intro));
+    QTRY_COMPARE(readySpy.count(), 1);
+    QTRY_VERIFY(client->bytesAvailable() >= 1);
+
+    char version = 0;
+    QCOMPARE(client->read(&version, 1), qint64(1));
+    QCOMPARE(version, char(1));
+
+    connection->grantAuthentication(Connection::HiddenServiceAuth, QString::fromLatin1(serverHostname));
+    QVERIFY(connection->setPurpose(Connection::Purpose::KnownContact));
+
+    clientBuffer.clear();
+    keepAliveResponses = 0;
+    chatAcknowledgements = 0;
+    receivedMessages.clear();
+    connect(client, &QIODevice::readyRead, this, &TestAllocations::readResponses);
+}
+
+void TestAllocations::cleanup()
+{
+    measuring = false;
+    AllocationCounter::setCounting(false);
+
+    if (connection) {
+        QSignalSpy closedSpy(connection, &Connection::closed);
+        connection->close();
+        QTRY_COMPARE(closedSpy.count(), 1);
+    }
+
+    delete connection;
+    connection = nullptr;
+    delete client;
+    client = nullptr;
+    delete server;
+    server = nullptr;
+}
+
+void TestAllocations::keepAlive()
+{
+    const int count = 1000;
+    QByteArray burst;
+    for (int i = 0; i < count; i++)
+        burst.append(makeKeepAlive());
+
+    // Warm up
+    client->write(burst);
+    QTRY_COMPARE(keepAliveResponses, count);
+
+    startMeasuring();
+    client->write(burst);
+    QTRY_COMPARE(keepAliveResponses, count * 2);
+    stopMeasuring();
+
+    QVERIFY(readCount > 0);
+    QVERIFY2(withinBudget(count, 0), "Keep-alive handling allocated per packet");
+}
+
+void TestAllocations::inboundChat()
+{
+    Data::Control::Packet open;
+    open.mutable_open_channel()->set_channel_identifier(chatChannelId);
+    open.mutable_open_channel()->set_channel_type("im.ricochet.chat");
+
+    QSignalSpy openedSpy(connection, &Connection::channelOpened);
+    client->write(makePacket(0, open));
+    QTRY_COMPARE(openedSpy.count(), 1);
+
+    ChatChannel *channel = connection->findChannel<ChatChannel>(Channel::Inbound);
+    QVERIFY(channel);
+    int received = 0;
+    connect(channel, &ChatChannel::messageReceived, [&received]() { received++; });
+
+    const int count = 1000;
+    QByteArray burst;
+    for (int i = 0; i < count; i++)
+        burst.append(makeChatMessage(quint32(i)));
+
+    // Warm up
+    client->write(burst);
+    QTRY_COMPARE(chatAcknowledgements, count);
+
+    startMeasuring();
+    client->write(burst);
+    QTRY_COMPARE(chatAcknowledgements, count * 2);
+    stopMeasuring();
+
+    QCOMPARE(received, count * 2);
+    QVERIFY(readCount > 0);
+    QVERIFY2(withinBudget(count, InboundChatAllocations), "Chat message handling allocated more than expected");
+}
+
+void TestAllocations::outboundChat()
+{
+    ChatChannel *channel = new ChatChannel(Channel::Outbound, connection);
+    QSignalSpy openedSpy(channel, &Channel::channelOpened);
+    QVERIFY(channel->openChannel());
+    QTRY_COMPARE(openedSpy.count(), 1);
+
+    int acknowledged = 0;
+    connect(channel, &ChatChannel::messageAcknowledged, [&acknowledged]() { acknowledged++; });
+
+    const int count = 1000;
+    const QString text(200, QLatin1Char('x'));
+
+    auto round = [&](bool measure) {
+        receivedMessages.clear();
+        if (measure)
+            startMeasuring();
+
+        // Sending happens in one event loop turn, so it may schedule one write
+        AllocationCounter::setCounting(measure);
+        for (int i = 0; i < count; i++) {
+            ChatChannel::MessageId id;
+            QVERIFY(channel->sendChatMessage(text, QDateTime(), id));
+        }
+        AllocationCounter::setCounting(false);
+        if (measure)
+            readCount++;
+
+        QTRY_COMPARE(receivedMessages.size(), count);
+
+        QByteArray acks;
+        for (quint32 id : receivedMessages)
+            acks.append(makeChatAcknowledge(channel->identifier(), id));
+        int expected = acknowledged + count;
+        client->write(acks);
+        QTRY_COMPARE(acknowledged, expected);
+
+        if (measure)
+            stopMeasuring();
+    };
+
+    // Warm up
+    round(false);
+    if (QTest::currentTestFailed())
+        return;
+
+    round(true);
+    if (QTest::currentTestFailed())
+        return;
+
+    QVERIFY2(withinBudget(count, OutboundChatAllocations, PendingResizeAllocations),
+             "Chat sending or acknowledgement handling allocated more than expected");
+}
+
+QTEST_MAIN(TestAllocations)
+#include "tst_allocations.moc"
@@ -0,0 +1,5 @@
+include(../tests.pri)
+CONFIG += count_allocations
+include(../support/support.pri)
+
+SOURCES += tst_allocations.cpp
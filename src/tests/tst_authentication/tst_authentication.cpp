@@ -0,0 +1,309 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// C++
+#include <QtTest>
+
+// libtego
+#include <tego/tego.hpp>
+
+// libtego_ui
+#include <protocol/Connection.h>
+#include <protocol/AuthHiddenServiceChannel.h>
+#include <protocol/ResumptionTicket.h>
+#include <utils/CryptoKey.h>
+
+// tests
+#include <LoopbackPeers.h>
+#include <TestIdentities.h>
+
+using namespace Protocol;
+
+/* Covers resumption tickets, and AuthHiddenServiceChannel with and without
+ * them over loopback connections. The same key is used for both peers.
+ */
+class TestAuthentication : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void init();
+
+    void issueAndRedeem();
+    void redeemWrongServer();
+    void redeemExpired();
+    void redeemTampered();
+    void ticketStorage();
+    void fullAuthentication();
+    void resumedAuthentication();
+    void invalidTicketFallsBack();
+    void benchmarkProof();
+    void benchmarkTicket();
+    void benchmarkReconnect_data();
+    void benchmarkReconnect();
+
+private:
+    CryptoKey key;
+    QString clientServiceId;
+    QString serverServiceId;
+
+    void authenticate(bool expectResumed);
+};
+
+void TestAuthentication::initTestCase()
+{
+    QVERIFY(key.loadFromKeyBlob(QByteArray(keyBlob)));
+    clientServiceId = key.torServiceID();
+    serverServiceId = QString::fromLatin1(serverHostname).left(TEGO_V3_ONION_SERVICE_ID_LENGTH);
+}
+
+void TestAuthentication::init()
+{
+    ResumptionTicket::discard(clientServiceId, serverServiceId);
+}
+
+/* Connect a client and server, and authenticate the client with
+ * AuthHiddenServiceChannel, using a stored ticket if there is one */
+void TestAuthentication::authenticate(bool expectResumed)
+{
+    LoopbackPeers peers;
+    QVERIFY(peers.connect(QString::fromLatin1(serverHostname)));
+    Connection *clientConnection = peers.client.data();
+
+    // As UserIdentity does for contacts, once the client has authenticated
+    QString authenticatedAs;
+    bool serverResumed = false;
+    Connection *serverPtr = peers.server.data();
+    connect(serverPtr, &Connection::authenticated, this,
+        [&authenticatedAs,serverPtr](Connection::AuthenticationType type, const QString &identity) {
+            if (type != Connection::HiddenServiceAuth)
+                return;
+            authenticatedAs = identity;
+            serverPtr->setPurpose(Connection::Purpose::KnownContact);
+        }
+    );
+    connect(serverPtr, &Connection::channelCreated, this,
+        [this,&serverResumed](Channel *channel) {
+            if (channel->typeId() != AuthHiddenServiceChannel::TypeId)
+                return;
+            AuthHiddenServiceChannel *auth = static_cast<AuthHiddenServiceChannel*>(channel);
+            connect(auth, &AuthHiddenServiceChannel::authSuccessful, this,
+                [auth,&serverResumed]() { serverResumed = auth->isResumed(); });
+        }
+    );
+
+    QVERIFY(peers.waitForReady());
+
+    AuthHiddenServiceChannel *auth = new AuthHiddenServiceChannel(Channel::Outbound, clientConnection);
+    auth->setPrivateKey(key);
+    bool clientResumed = false;
+    connect(auth, &AuthHiddenServiceChannel::authSuccessful, this,
+        [auth,&clientResumed]() { clientResumed = auth->isResumed(); });
+    QSignalSpy successSpy(auth, &AuthHiddenServiceChannel::authSuccessful);
+    QSignalSpy failedSpy(auth, &AuthHiddenServiceChannel::authFailed);
+    QVERIFY(auth->openChannel());
+
+    QTRY_COMPARE(successSpy.count() + failedSpy.count(), 1);
+    QCOMPARE(successSpy.count(), 1);
+    QCOMPARE(authenticatedAs, clientServiceId + QStringLiteral(".onion"));
+    QVERIFY(clientConnection->hasAuthenticated(Connection::KnownToPeer));
+    QCOMPARE(clientResumed, expectResumed);
+    QCOMPARE(serverResumed, expectResumed);
+
+    // Every successful authentication leaves a ticket for the next one
+    QVERIFY(!ResumptionTicket::find(clientServiceId, serverServiceId).isEmpty());
+
+    QVERIFY(peers.close());
+}
+
+void TestAuthentication::issueAndRedeem()
+{
+    QByteArray ticket = ResumptionTicket::issue(clientServiceId, serverServiceId);
+    QVERIFY(!ticket.isEmpty());
+    QVERIFY(ticket.size() <= ResumptionTicket::MaxSize);
+    QCOMPARE(ResumptionTicket::redeem(ticket, serverServiceId), clientServiceId);
+
+    // Tickets don't reveal the client, and aren't repeated
+    QVERIFY(!ticket.contains(clientServiceId.toLatin1()));
+    QVERIFY(ResumptionTicket::issue(clientServiceId, serverServiceId) != ticket);
+}
+
+void TestAuthentication::redeemWrongServer()
+{
+    QByteArray ticket = ResumptionTicket::issue(clientServiceId, serverServiceId);
+    QVERIFY(!ticket.isEmpty());
+    QVERIFY(ResumptionTicket::redeem(ticket, clientServiceId).isEmpty());
+}
+
+void TestAuthentication::redeemExpired()
+{
+    qint64 now = QDateTime::currentSecsSinceEpoch();
+    QByteArray expired = ResumptionTicket::issue(clientServiceId, serverServiceId, now - 1);
+    QVERIFY(!expired.isEmpty());
+    QVERIFY(ResumptionTicket::redeem(expired, serverServiceId).isEmpty());
+
+    QByteArray valid = ResumptionTicket::issue(clientServiceId, serverServiceId, now + 60);
+    QCOMPARE(ResumptionTicket::redeem(valid, serverServiceId), clientServiceId);
+}
+
+void TestAuthentication::redeemTampered()
+{
+    QByteArray ticket = ResumptionTicket::issue(clientServiceId, serverServiceId);
+    QVERIFY(!ticket.isEmpty());
+
+    for (int i = 0; i < ticket.size(); i++) {
+        QByteArray tampered = ticket;
+        tampered[i] = char(tampered[i] ^ 0x01);
+        QVERIFY2(ResumptionTicket::redeem(tampered, serverServiceId).isEmpty(), qPrintable(QString::number(i)));
+    }
+
+    QVERIFY(ResumptionTicket::redeem(ticket.left(ticket.size() - 1), serverServiceId).isEmpty());
+    QVERIFY(ResumptionTicket::redeem(ticket + QByteArray(1, 0), serverServiceId).isEmpty());
+    QVERIFY(ResumptionTicket::redeem(QByteArray(), serverServiceId).isEmpty());
+}
+
+void TestAuthentication::ticketStorage()
+{
+    QVERIFY(ResumptionTicket::find(clientServiceId, serverServiceId).isEmpty());
+
+    QByteArray ticket = ResumptionTicket::issue(clientServiceId, serverServiceId);
+    ResumptionTicket::store(clientServiceId, serverServiceId, ticket, ResumptionTicket::Lifetime);
+    QCOMPARE(ResumptionTicket::find(clientServiceId, serverServiceId), ticket);
+    QVERIFY(ResumptionTicket::find(serverServiceId, clientServiceId).isEmpty());
+
+    // Storing nothing, or a ticket that has already expired, removes the old one
+    ResumptionTicket::store(clientServiceId, serverServiceId, QByteArray(), ResumptionTicket::Lifetime);
+    QVERIFY(ResumptionTicket::find(clientServiceId, serverServiceId).isEmpty());
+
+    ResumptionTicket::store(clientServiceId, serverServiceId, ticket, ResumptionTicket::Lifetime);
+    ResumptionTicket::store(clientServiceId, serverServiceId, ticket, 0);
+    QVERIFY(ResumptionTicket::find(clientServiceId, serverServiceId).isEmpty());
+
+    ResumptionTicket::store(clientServiceId, serverServiceId, QByteArray(ResumptionTicket::MaxSize + 1, 'x'), ResumptionTicket::Lifetime);
+    QVERIFY(ResumptionTicket::find(clientServiceId, serverServiceId).isEmpty());
+
+    ResumptionTicket::store(clientServiceId, serverServiceId, ticket, ResumptionTicket::Lifetime);
+    ResumptionTicket::discard(clientServiceId, serverServiceId);
+    QVERIFY(ResumptionTicket::find(clientServiceId, serverServiceId).isEmpty());
+}
+
+void TestAuthentication::fullAuthentication()
+{
+    authenticate(false);
+}
+
+void TestAuthentication::resumedAuthentication()
+{
+    authenticate(false);
+    if (QTest::currentTestFailed())
+        return;
+    QByteArray first = ResumptionTicket::find(clientServiceId, serverServiceId);
+
+    authenticate(true);
+    if (QTest::currentTestFailed())
+        return;
+
+    // The resumed authentication issues a fresh ticket
+    QByteArray second = ResumptionTicket::find(clientServiceId, serverServiceId);
+    QVERIFY(!second.isEmpty());
+    QVERIFY(second != first);
+
+    authenticate(true);
+}
+
+void TestAuthentication::invalidTicketFallsBack()
+{
+    // A ticket of the right size that the server can't open, as after a restart
+    QByteArray stale = ResumptionTicket::issue(clientServiceId, serverServiceId);
+    stale[0] = char(stale[0] ^ 0x01);
+    ResumptionTicket::store(clientServiceId, serverServiceId, stale, ResumptionTicket::Lifetime);
+
+    authenticate(false);
+    if (QTest::currentTestFailed())
+        return;
+    QVERIFY(ResumptionTicket::find(clientServiceId, serverServiceId) != stale);
+}
+
+/* The public key work for each full authentication: signing by the client,
+ * and decoding the key and verifying by the server */
+void TestAuthentication::benchmarkProof()
+{
+    QByteArray proofData(32, 'p');
+    QBENCHMARK {
+        QByteArray signature = key.signData(proofData);
+        CryptoKey publicKey;
+        QVERIFY(publicKey.loadFromServiceId(clientServiceId.toLatin1()));
+        QVERIFY(publicKey.verifyData(proofData, signature));
+    }
+}
+
+/* The work for each resumed authentication: opening the presented ticket,
+ * and issuing the next */
+void TestAuthentication::benchmarkTicket()
+{
+    QByteArray ticket = ResumptionTicket::issue(clientServiceId, serverServiceId);
+    QBENCHMARK {
+        QCOMPARE(ResumptionTicket::redeem(ticket, serverServiceId), clientServiceId);
+        ticket = ResumptionTicket::issue(clientServiceId, serverServiceId);
+    }
+}
+
+void TestAuthentication::benchmarkReconnect_data()
+{
+    QTest::addColumn<bool>("resumed");
+    QTest::newRow("full") << false;
+    QTest::newRow("resumed") << true;
+}
+
+/* Connect and authenticate over loopback, with or without a ticket */
+void TestAuthentication::benchmarkReconnect()
+{
+    QFETCH(bool, resumed);
+
+    if (resumed) {
+        authenticate(false);
+        if (QTest::currentTestFailed())
+            return;
+    }
+
+    QBENCHMARK {
+        if (!resumed)
+            ResumptionTicket::discard(clientServiceId, serverServiceId);
+        authenticate(resumed);
+        if (QTest::currentTestFailed())
+            return;
+    }
+}
+
+QTEST_MAIN(TestAuthentication)
+#include "tst_authentication.moc"
@@ -0,0 +1,236 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// C++
+#include <QtTest>
+
+// libtego_ui
+#include <core/ChatOutbox.h>
+
+typedef ChatOutbox::MessageId MessageId;
+
+class TestChatOutbox : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void queueOrder();
+    void acknowledge();
+    void requeueInFlight();
+    void requeueRoute();
+    void stalledRoute();
+    void roundTripTimeout();
+};
+
+void TestChatOutbox::queueOrder()
+{
+    ChatOutbox outbox;
+    QCOMPARE(outbox.firstQueued(), MessageId(0));
+
+    MessageId first = outbox.enqueue();
+    MessageId second = outbox.enqueue();
+    MessageId third = outbox.enqueue();
+    QVERIFY(first && second && third);
+    QVERIFY(first != second && second != third);
+    QCOMPARE(outbox.queued(10), QList<MessageId>() << first << second << third);
+    QCOMPARE(outbox.queued(2), QList<MessageId>() << first << second);
+    QCOMPARE(outbox.queuedCount(), 3);
+
+    outbox.markSent(first);
+    QCOMPARE(outbox.firstQueued(), second);
+    QCOMPARE(outbox.queuedCount(), 2);
+    QCOMPARE(outbox.inFlightCount(), 1);
+    QVERIFY(!outbox.isQueued(first));
+    QCOMPARE(outbox.attemptCount(first), 1);
+
+    // Removed messages are skipped
+    outbox.remove(second);
+    QCOMPARE(outbox.firstQueued(), third);
+    QCOMPARE(outbox.queued(10), QList<MessageId>() << third);
+}
+
+void TestChatOutbox::acknowledge()
+{
+    ChatOutbox outbox;
+    QList<MessageId> ids;
+    for (int i = 0; i < 4; i++)
+        ids.append(outbox.enqueue());
+    outbox.markSent(ids[0]);
+    outbox.markSent(ids[1]);
+
+    // In flight, out of order, and still queued
+    QVERIFY(outbox.acknowledge(ids[1]));
+    QVERIFY(outbox.acknowledge(ids[0]));
+    QVERIFY(outbox.acknowledge(ids[3]));
+    QVERIFY(!outbox.acknowledge(ids[3]));
+    QVERIFY(!outbox.acknowledge(ids[3] + 1000));
+
+    QCOMPARE(outbox.inFlightCount(), 0);
+    QCOMPARE(outbox.queuedCount(), 1);
+    QCOMPARE(outbox.firstQueued(), ids[2]);
+}
+
+void TestChatOutbox::requeueInFlight()
+{
+    ChatOutbox outbox;
+    QSignalSpy requeuedSpy(&outbox, &ChatOutbox::messageRequeued);
+    QList<MessageId> ids;
+    for (int i = 0; i < 4; i++)
+        ids.append(outbox.enqueue());
+    outbox.markSent(ids[0]);
+    outbox.markSent(ids[1]);
+    outbox.markSent(ids[2]);
+    outbox.acknowledge(ids[1]);
+
+    // Messages in flight go back ahead of the queue, in order
+    outbox.requeueInFlight();
+    QCOMPARE(outbox.queued(10), QList<MessageId>() << ids[0] << ids[2] << ids[3]);
+    QCOMPARE(outbox.inFlightCount(), 0);
+    QCOMPARE(requeuedSpy.count(), 2);
+    QCOMPARE(requeuedSpy.at(0).at(0).toUInt(), ids[0]);
+    QCOMPARE(requeuedSpy.at(1).at(0).toUInt(), ids[2]);
+
+    outbox.markSent(ids[0]);
+    QCOMPARE(outbox.attemptCount(ids[0]), 2);
+
+    // Each message is in flight once, however often it was queued again
+    outbox.requeueInFlight();
+    outbox.markSent(ids[0]);
+    QCOMPARE(outbox.inFlightCount(), 1);
+    outbox.requeueInFlight();
+    QCOMPARE(outbox.queued(10), QList<MessageId>() << ids[0] << ids[2] << ids[3]);
+}
+
+void TestChatOutbox::requeueRoute()
+{
+    ChatOutbox outbox;
+    QSignalSpy failedSpy(&outbox, &ChatOutbox::messageFailed);
+    QList<MessageId> ids;
+    for (int i = 0; i < 4; i++)
+        ids.append(outbox.enqueue());
+    outbox.markSent(ids[0], 1);
+    outbox.markSent(ids[1], 2);
+    outbox.markSent(ids[2], 1);
+
+    // Only messages sent on the closed route go back in the queue
+    outbox.requeueRoute(1, false);
+    QCOMPARE(outbox.queued(10), QList<MessageId>() << ids[0] << ids[2] << ids[3]);
+    QCOMPARE(outbox.inFlightCount(), 1);
+    QVERIFY(!outbox.isQueued(ids[1]));
+
+    // A route that was handed over doesn't use up attempts
+    for (int i = 0; i < ChatOutbox::MaxAttempts; i++) {
+        outbox.markSent(ids[0], 3);
+        outbox.requeueRoute(3, true);
+    }
+    QCOMPARE(failedSpy.count(), 0);
+    outbox.markSent(ids[0], 3);
+    QCOMPARE(outbox.attemptCount(ids[0]), 2);
+
+    outbox.acknowledge(ids[1]);
+    outbox.requeueRoute(2, false);
+    QCOMPARE(outbox.inFlightCount(), 1);
+}
+
+void TestChatOutbox::stalledRoute()
+{
+    ChatOutbox outbox;
+    outbox.setTimeoutRange(10, 20);
+    QSignalSpy requeuedSpy(&outbox, &ChatOutbox::messageRequeued);
+    QSignalSpy failedSpy(&outbox, &ChatOutbox::messageFailed);
+    QList<ChatOutbox::Route> stalled;
+    connect(&outbox, &ChatOutbox::routeStalled, &outbox, [&stalled](ChatOutbox::Route route) {
+        stalled.append(route);
+    });
+
+    QList<MessageId> ids;
+    for (int i = 0; i < 3; i++)
+        ids.append(outbox.enqueue());
+    outbox.markSent(ids[0], 1);
+    outbox.markSent(ids[1], 1);
+    outbox.markSent(ids[2], 2);
+    outbox.acknowledge(ids[2]);
+
+    // An overdue route is reported once, and its messages stay in flight
+    QTRY_COMPARE(stalled.size(), 1);
+    QCOMPARE(stalled.at(0), ChatOutbox::Route(1));
+    QTest::qWait(200);
+    QCOMPARE(stalled.size(), 1);
+    QCOMPARE(outbox.inFlightCount(), 2);
+    QCOMPARE(requeuedSpy.count(), 0);
+
+    // They are queued again once the stalled route is closed, and fail
+    // only after losing MaxAttempts routes
+    for (int attempt = 1; attempt < ChatOutbox::MaxAttempts; attempt++) {
+        outbox.requeueRoute(1, false);
+        QCOMPARE(outbox.queued(10), QList<MessageId>() << ids[0] << ids[1]);
+        outbox.markSent(ids[0], 1);
+        outbox.markSent(ids[1], 1);
+    }
+    QCOMPARE(failedSpy.count(), 0);
+    outbox.requeueRoute(1, false);
+    QCOMPARE(failedSpy.count(), 2);
+    QVERIFY(!outbox.contains(ids[0]));
+    QVERIFY(!outbox.contains(ids[1]));
+}
+
+void TestChatOutbox::roundTripTimeout()
+{
+    ChatOutbox outbox;
+    outbox.setTimeoutRange(1, 60000);
+    QCOMPARE(outbox.timeout(), int(ChatOutbox::InitialTimeout));
+
+    MessageId id = outbox.enqueue();
+    outbox.markSent(id);
+    QTest::qWait(50);
+    QVERIFY(outbox.acknowledge(id));
+
+    // The first sample sets the variation to half of it
+    int timeout = outbox.timeout();
+    QVERIFY2(timeout >= 100 && timeout < 1000, qPrintable(QString::number(timeout)));
+
+    // Acknowledgements for messages that were sent again aren't sampled
+    id = outbox.enqueue();
+    outbox.markSent(id);
+    outbox.requeueInFlight();
+    outbox.markSent(id);
+    QTest::qWait(200);
+    QVERIFY(outbox.acknowledge(id));
+    QCOMPARE(outbox.timeout(), timeout);
+
+    // Limited to the range
+    outbox.setTimeoutRange(1, 10);
+    QCOMPARE(outbox.timeout(), 10);
+}
+
+QTEST_MAIN(TestChatOutbox)
+#include "tst_chatoutbox.moc"
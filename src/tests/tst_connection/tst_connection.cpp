@@ -0,0 +1,1155 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// C++
+#include <QtTest>
+#include <QTcpServer>
+#include <QTcpSocket>
+
+// libtego_ui
+#include <protocol/Connection.h>
+#include <protocol/ChannelTable.h>
+#include <protocol/ChannelTypeRegistry.h>
+#include <protocol/AuthHiddenServiceChannel.h>
+#include <protocol/AuthHiddenService.pb.h>
+#include <protocol/ChatChannel.h>
+#include <protocol/ContactRequestChannel.h>
+#include <protocol/ControlChannel.h>
+#include <protocol/ControlChannel.pb.h>
+
+// tests
+#include <OnionSocket.h>
+#include <RawPackets.h>
+#include <TestIdentities.h>
+
+using namespace Protocol;
+
+/* Channel that sends arbitrary packets, to generate bulk traffic */
+class BulkChannel : public Channel
+{
+public:
+    static const int TypeId;
+
+    explicit BulkChannel(Direction direction, Connection *connection)
+        : Channel(TypeId, direction, connection)
+    {
+    }
+
+    bool send(const QByteArray &packet) { return sendPacket(packet); }
+
+protected:
+    bool allowInboundChannelRequest(const Data::Control::OpenChannel *, Data::Control::ChannelResult *) override { return false; }
+    bool allowOutboundChannelRequest(Data::Control::OpenChannel *) override { return true; }
+    void receivePacket(const QByteArray &) override { }
+};
+
+const int BulkChannel::TypeId = ChannelTypeRegistry::registerType<BulkChannel>("test.bulk");
+
+/* Inbound channel that closes its connection on every packet it receives */
+class ClosingChannel : public Channel
+{
+public:
+    static const int TypeId;
+    static int received;
+
+    explicit ClosingChannel(Direction direction, Connection *connection)
+        : Channel(TypeId, direction, connection)
+    {
+    }
+
+protected:
+    bool allowInboundChannelRequest(const Data::Control::OpenChannel *, Data::Control::ChannelResult *) override { return true; }
+    bool allowOutboundChannelRequest(Data::Control::OpenChannel *) override { return false; }
+    void receivePacket(const QByteArray &) override
+    {
+        received++;
+        connection()->close();
+    }
+};
+
+const int ClosingChannel::TypeId = ChannelTypeRegistry::registerType<ClosingChannel>("test.closing");
+int ClosingChannel::received = 0;
+
+/* Exercises packet framing on a ServerSide Connection. The client end of the
+ * socket pair is a plain QTcpSocket that writes raw protocol data, so the
+ * exact boundaries of writes can be controlled.
+ */
+class TestConnection : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void init();
+    void cleanup();
+
+    void keepAliveBurst();
+    void fragmentedPackets();
+    void largePacket();
+    void closeWhileReading();
+    void benchmarkPacketBurst();
+    void channelTable();
+    void channelTableExhaustion();
+    void benchmarkChannelTable();
+    void benchmarkOpenCloseChannels();
+    void channelTypeRegistry();
+    void findChannelByType();
+    void outboundScheduling();
+    void writeWaterMarks();
+    void compression();
+    void aggregation();
+    void keepAlive();
+    void pipelinedIntroduction();
+    void earlyChatMessages();
+    void attachedChatMessages_data();
+    void attachedChatMessages();
+    void batchAcknowledgeInbound();
+    void batchAcknowledgeOutbound();
+    void versionTwoFraming();
+    void versionNegotiation_data();
+    void versionNegotiation();
+
+private:
+    QTcpServer *server = nullptr;
+    QTcpSocket *client = nullptr;
+    Connection *connection = nullptr;
+    QByteArray clientBuffer;
+    int keepAliveResponses = 0;
+    int keepAliveRequests = 0;
+    int featuresEnabledResponses = 0;
+    bool answerKeepAlives = false;
+    bool acknowledgeEarlyMessages = false;
+    bool batchAcknowledgeChat = false;
+    int channelResults = 0;
+    Data::Control::OpenChannel lastOpenChannel;
+    Data::Control::ChannelResult lastChannelResult;
+    QStringList enabledFeatures;
+    // Data of the last packet received by the client on a channel other than 0
+    QByteArray lastPayload;
+    // Data of every packet received by the client on channel 1
+    QList<QByteArray> channelOnePayloads;
+    // Channel identifier of every packet received by the client, in order
+    QList<quint16> receivedChannels;
+
+    void readResponses();
+};
+
+void TestConnection::readResponses()
+{
+    clientBuffer.append(client->readAll());
+
+    while (clientBuffer.size() >= 4) {
+        quint16 size = qFromBigEndian<quint16>(reinterpret_cast<const uchar*>(clientBuffer.constData()));
+        quint16 channelId = qFromBigEndian<quint16>(reinterpret_cast<const uchar*>(clientBuffer.constData() + 2));
+        QVERIFY(size >= 4);
+        if (clientBuffer.size() < size)
+            break;
+
+        // Only control channel responses are counted; other packets come from
+        // channels opened by the connection itself, and are ignored.
+        receivedChannels.append(channelId);
+        if (channelId == 0) {
+            Data::Control::Packet message;
+            QVERIFY(message.ParseFromArray(clientBuffer.constData() + 4, size - 4));
+            if (message.has_keep_alive()) {
+                if (message.keep_alive().response_requested()) {
+                    keepAliveRequests++;
+                    if (answerKeepAlives) {
+                        Data::Control::Packet response;
+                        response.mutable_keep_alive()->set_response_requested(false);
+                        client->write(makePacket(0, response));
+                    }
+                } else
+                    keepAliveResponses++;
+            } else if (message.has_features_enabled()) {
+                featuresEnabledResponses++;
+                enabledFeatures.clear();
+                for (const std::string &feature : message.features_enabled().feature())
+                    enabledFeatures.append(QString::fromStdString(feature));
+            } else if (message.has_open_channel()) {
+                // Accept every channel the connection opens
+                lastOpenChannel = message.open_channel();
+                Data::Control::Packet response;
+                response.mutable_channel_result()->set_channel_identifier(message.open_channel().channel_identifier());
+                response.mutable_channel_result()->set_opened(true);
+                if (acknowledgeEarlyMessages) {
+                    for (int i = 0; i < lastOpenChannel.ExtensionSize(Data::Chat::early_message); i++) {
+                        quint32 id = lastOpenChannel.GetExtension(Data::Chat::early_message, i).message_id();
+                        response.mutable_channel_result()->AddExtension(Data::Chat::early_acknowledge)->set_message_id(id);
+                    }
+                }
+                if (batchAcknowledgeChat && lastOpenChannel.GetExtension(Data::Chat::batch_acknowledge))
+                    response.mutable_channel_result()->SetExtension(Data::Chat::batch_acknowledge_enabled, true);
+                client->write(makePacket(0, response));
+            } else if (message.has_channel_result()) {
+                channelResults++;
+                lastChannelResult = message.channel_result();
+            }
+        } else {
+            lastPayload = clientBuffer.mid(4, size - 4);
+            if (channelId == 1)
+                channelOnePayloads.append(lastPayload);
+        }
+
+        clientBuffer.remove(0, size);
+    }
+}
+
+void TestConnection::init()
+{
+    server = new QTcpServer;
+    QVERIFY(server->listen(QHostAddress::LocalHost));
+
+    client = new QTcpSocket;
+    client->connectToHost(server->serverAddress(), server->serverPort());
+    QVERIFY(client->waitForConnected(5000));
+    QVERIFY(server->waitForNewConnection(5000));
+
+    QTcpSocket *socket = server->nextPendingConnection();
+    QVERIFY(socket);
+    socket->setProperty("localHostname", QString::fromLatin1(serverHostname));
+
+    connection = new Connection(socket, Connection::ServerSide);
+    // Tests count KeepAlive messages, so only keepAlive enables them
+    connection->setKeepAliveInterval(0);
+    QSignalSpy readySpy(connection, &Connection::ready);
+
+    // Introduction, offering only version 1
+    const char intro[] = { 0x49, 0x4D, 0x01, 0x01 };
+    client->write(intro, sizeof(intro));
+    QTRY_COMPARE(readySpy.count(), 1);
+    QTRY_VERIFY(client->bytesAvailable() >= 1);
+
+    char version = 0;
+    QCOMPARE(client->read(&version, 1), qint64(1));
+    QCOMPARE(version, char(1));
+
+    // Avoid the timeout for connections without a purpose
+    connection->grantAuthentication(Connection::HiddenServiceAuth, QString::fromLatin1(serverHostname));
+    QVERIFY(connection->setPurpose(Connection::Purpose::KnownContact));
+
+    clientBuffer.clear();
+    keepAliveResponses = 0;
+    keepAliveRequests = 0;
+    featuresEnabledResponses = 0;
+    answerKeepAlives = false;
+    acknowledgeEarlyMessages = false;
+    batchAcknowledgeChat = false;
+    channelResults = 0;
+    lastOpenChannel.Clear();
+    lastChannelResult.Clear();
+    enabledFeatures.clear();
+    lastPayload.clear();
+    channelOnePayloads.clear();
+    receivedChannels.clear();
+    connect(client, &QIODevice::readyRead, this, &TestConnection::readResponses);
+}
+
+void TestConnection::cleanup()
+{
+    Connection::setMaximumProtocolVersion(2);
+
+    if (connection) {
+        QSignalSpy closedSpy(connection, &Connection::closed);
+        connection->close();
+        QTRY_COMPARE(closedSpy.count(), 1);
+    }
+
+    delete connection;
+    connection = nullptr;
+    delete client;
+    client = nullptr;
+    delete server;
+    server = nullptr;
+}
+
+void TestConnection::keepAliveBurst()
+{
+    // Many packets arriving in a single read
+    const int count = 500;
+    QByteArray burst;
+    for (int i = 0; i < count; i++)
+        burst.append(makeKeepAlive());
+
+    client->write(burst);
+    QTRY_COMPARE(keepAliveResponses, count);
+    QVERIFY(connection->isConnected());
+}
+
+void TestConnection::fragmentedPackets()
+{
+    // Packets split across reads at arbitrary points, including inside the header
+    const int count = 20;
+    QByteArray data;
+    for (int i = 0; i < count; i++)
+        data.append(makeKeepAlive());
+
+    for (int i = 0; i < data.size(); i += 3) {
+        client->write(data.mid(i, 3));
+        client->flush();
+        QTest::qWait(1);
+    }
+
+    QTRY_COMPARE(keepAliveResponses, count);
+    QVERIFY(connection->isConnected());
+}
+
+void TestConnection::largePacket()
+{
+    // A packet much larger than the initial receive buffer, surrounded by small ones
+    Data::Control::Packet message;
+    auto features = message.mutable_enable_features();
+    for (int i = 0; i < 500; i++)
+        features->add_feature(std::string(100, char('a' + i % 26)));
+
+    QByteArray large = makePacket(0, message);
+    QVERIFY(large.size() > 50000 && large.size() <= UINT16_MAX);
+
+    client->write(makeKeepAlive() + large + makeKeepAlive());
+    QTRY_COMPARE(featuresEnabledResponses, 1);
+    QTRY_COMPARE(keepAliveResponses, 2);
+
+    // And again, to make sure the buffer is reusable after shrinking
+    client->write(large + makeKeepAlive());
+    QTRY_COMPARE(featuresEnabledResponses, 2);
+    QTRY_COMPARE(keepAliveResponses, 3);
+    QVERIFY(connection->isConnected());
+}
+
+void TestConnection::closeWhileReading()
+{
+    Data::Control::Packet open;
+    open.mutable_open_channel()->set_channel_identifier(1);
+    open.mutable_open_channel()->set_channel_type("test.closing");
+    QSignalSpy openedSpy(connection, &Connection::channelOpened);
+    client->write(makePacket(0, open));
+    QTRY_COMPARE(openedSpy.count(), 1);
+
+    // Packets after the one that closes the connection arrive in the same read
+    Data::Control::Packet packet;
+    packet.mutable_keep_alive()->set_response_requested(true);
+    ClosingChannel::received = 0;
+    QSignalSpy closedSpy(connection, &Connection::closed);
+    client->write(makePacket(1, packet) + makePacket(1, packet) + makeKeepAlive());
+    QTRY_COMPARE(closedSpy.count(), 1);
+    QCOMPARE(ClosingChannel::received, 1);
+    QCOMPARE(keepAliveResponses, 0);
+
+    delete connection;
+    connection = nullptr;
+}
+
+void TestConnection::benchmarkPacketBurst()
+{
+    const int count = 1000;
+    QByteArray burst;
+    for (int i = 0; i < count; i++)
+        burst.append(makeKeepAlive());
+
+    QBENCHMARK {
+        keepAliveResponses = 0;
+        client->write(burst);
+        QTRY_COMPARE(keepAliveResponses, count);
+    }
+}
+
+void TestConnection::channelTable()
+{
+    ChannelTable table;
+    Channel *a = reinterpret_cast<Channel*>(quintptr(0x1000));
+    Channel *b = reinterpret_cast<Channel*>(quintptr(0x2000));
+
+    QVERIFY(table.isEmpty());
+    QVERIFY(table.insert(0, a));
+    QVERIFY(!table.insert(0, b));
+    QCOMPARE(table.value(0), a);
+
+    // Identifier 0 is never handed out, and each side keeps its own parity
+    QCOMPARE(table.nextAvailable(true, 0), 2);
+    QCOMPARE(table.nextAvailable(false, 0), 1);
+    QCOMPARE(table.nextAvailable(true, UINT16_MAX - 1), UINT16_MAX - 1);
+    QCOMPARE(table.nextAvailable(false, UINT16_MAX), int(UINT16_MAX));
+
+    QVERIFY(table.insert(1, b));
+    QVERIFY(table.insert(3, b));
+    QCOMPARE(table.nextAvailable(false, 1), 5);
+    QCOMPARE(table.values(), QList<Channel*>() << a << b << b);
+
+    QCOMPARE(table.take(3), b);
+    QCOMPARE(table.take(3), static_cast<Channel*>(nullptr));
+    QCOMPARE(table.nextAvailable(false, 1), 3);
+
+    QVERIFY(table.remove(a));
+    QVERIFY(!table.remove(a));
+    QCOMPARE(table.count(), 1);
+    QVERIFY(!table.contains(0));
+    QVERIFY(table.contains(1));
+
+    QCOMPARE(table.value(-1), static_cast<Channel*>(nullptr));
+    QCOMPARE(table.value(UINT16_MAX + 1), static_cast<Channel*>(nullptr));
+}
+
+void TestConnection::channelTableExhaustion()
+{
+    ChannelTable table;
+    Channel *c = reinterpret_cast<Channel*>(quintptr(0x1000));
+
+    // Every odd identifier can be allocated, in order, and then allocation fails
+    int next = 1;
+    for (int i = 0; i < (UINT16_MAX + 1) / 2; i++) {
+        int id = table.nextAvailable(false, next);
+        QCOMPARE(id, 1 + i * 2);
+        QVERIFY(table.insert(id, c));
+        next = id + 2;
+    }
+    QCOMPARE(table.nextAvailable(false, 1), -1);
+
+    // A hole anywhere is found regardless of the starting point
+    QCOMPARE(table.take(40001), c);
+    QCOMPARE(table.nextAvailable(false, 50001), 40001);
+    QCOMPARE(table.nextAvailable(false, 1), 40001);
+
+    // The even side is unaffected
+    QCOMPARE(table.nextAvailable(true, 2), 2);
+}
+
+void TestConnection::benchmarkChannelTable()
+{
+    const int count = 5000;
+    Channel *c = reinterpret_cast<Channel*>(quintptr(0x1000));
+    ChannelTable table;
+    QVector<int> ids(count);
+    int next = 1;
+
+    QBENCHMARK {
+        for (int i = 0; i < count; i++) {
+            ids[i] = table.nextAvailable(false, next);
+            table.insert(ids[i], c);
+            next = ids[i] + 2;
+        }
+        for (int i = 0; i < count; i++) {
+            if (table.value(ids[i]) != c)
+                QFAIL("Channel missing from table");
+        }
+        for (int i = 0; i < count; i++)
+            table.take(ids[i]);
+    }
+
+    QVERIFY(table.isEmpty());
+}
+
+void TestConnection::benchmarkOpenCloseChannels()
+{
+    const int count = 2000;
+
+    QBENCHMARK {
+        for (int i = 0; i < count; i++) {
+            ChatChannel *channel = new ChatChannel(Channel::Outbound, connection);
+            QVERIFY(channel->openChannel());
+            QCOMPARE(connection->channel(channel->identifier()), static_cast<Channel*>(channel));
+            channel->closeChannel();
+            QVERIFY(!connection->channel(channel->identifier()));
+        }
+
+        // Invalidated channels are deleted later
+        QCoreApplication::sendPostedEvents(nullptr, QEvent::DeferredDelete);
+    }
+
+    QVERIFY(connection->isConnected());
+}
+
+void TestConnection::channelTypeRegistry()
+{
+    QVERIFY(ChatChannel::TypeId >= 0);
+    QCOMPARE(ChannelTypeRegistry::typeId(QStringLiteral("im.ricochet.chat")), ChatChannel::TypeId);
+    QCOMPARE(ChannelTypeRegistry::typeId(std::string("im.ricochet.chat")), ChatChannel::TypeId);
+    QCOMPARE(ChannelTypeRegistry::typeId(QStringLiteral("im.ricochet.contact.request")), ContactRequestChannel::TypeId);
+    QCOMPARE(ChannelTypeRegistry::typeId(QStringLiteral("im.ricochet.auth.hidden-service")), AuthHiddenServiceChannel::TypeId);
+    QCOMPARE(ChannelTypeRegistry::typeName(ChatChannel::TypeId), QStringLiteral("im.ricochet.chat"));
+    QCOMPARE(ChannelTypeRegistry::typeId(QStringLiteral("im.ricochet.chat2")), -1);
+    QCOMPARE(ChannelTypeRegistry::typeId(std::string("im.ricochet")), -1);
+    QVERIFY(ChannelTypeRegistry::typeName(-1).isNull());
+
+    Channel *channel = Channel::create(QStringLiteral("im.ricochet.chat"), Channel::Inbound, connection);
+    QVERIFY(qobject_cast<ChatChannel*>(channel));
+    QCOMPARE(channel->typeId(), ChatChannel::TypeId);
+    QCOMPARE(channel->type(), QStringLiteral("im.ricochet.chat"));
+    delete channel;
+
+    // The control channel is registered, but never created by request
+    QCOMPARE(ChannelTypeRegistry::typeId(QStringLiteral("control")), ControlChannel::TypeId);
+    QVERIFY(!Channel::create(QStringLiteral("control"), Channel::Inbound, connection));
+    QVERIFY(!Channel::create(QStringLiteral("unknown"), Channel::Inbound, connection));
+}
+
+void TestConnection::findChannelByType()
+{
+    QVERIFY(connection->findChannel<ControlChannel>());
+    QVERIFY(!connection->findChannel<ChatChannel>());
+
+    ChatChannel *outbound = new ChatChannel(Channel::Outbound, connection);
+    QVERIFY(outbound->openChannel());
+    QCOMPARE(connection->findChannel<ChatChannel>(), outbound);
+    QCOMPARE(connection->findChannel<ChatChannel>(Channel::Outbound), outbound);
+    QVERIFY(!connection->findChannel<ChatChannel>(Channel::Inbound));
+
+    // Inbound channels of the same type are tracked separately
+    Data::Control::Packet open;
+    open.mutable_open_channel()->set_channel_identifier(1);
+    open.mutable_open_channel()->set_channel_type("im.ricochet.chat");
+    QSignalSpy openedSpy(connection, &Connection::channelOpened);
+    client->write(makePacket(0, open));
+    QTRY_COMPARE(openedSpy.count(), 1);
+
+    ChatChannel *inbound = connection->findChannel<ChatChannel>(Channel::Inbound);
+    QVERIFY(inbound);
+    QCOMPARE(inbound->identifier(), 1);
+    QCOMPARE(connection->findChannel<ChatChannel>(Channel::Outbound), outbound);
+    QCOMPARE(connection->findChannels<ChatChannel>().size(), 2);
+
+    outbound->closeChannel();
+    QVERIFY(!connection->findChannel<ChatChannel>(Channel::Outbound));
+    QCOMPARE(connection->findChannel<ChatChannel>(), inbound);
+
+    inbound->closeChannel();
+    QVERIFY(!connection->findChannel<ChatChannel>());
+    QVERIFY(connection->findChannels<ChatChannel>().isEmpty());
+    QCOMPARE(connection->findChannels<ControlChannel>().size(), 1);
+}
+
+void TestConnection::outboundScheduling()
+{
+    BulkChannel *bulk = new BulkChannel(Channel::Outbound, connection);
+    QSignalSpy bulkOpenedSpy(bulk, &Channel::channelOpened);
+    QVERIFY(bulk->openChannel());
+    QTRY_COMPARE(bulkOpenedSpy.count(), 1);
+
+    ChatChannel *chat = new ChatChannel(Channel::Outbound, connection);
+    QSignalSpy chatOpenedSpy(chat, &Channel::channelOpened);
+    QVERIFY(chat->openChannel());
+    QTRY_COMPARE(chatOpenedSpy.count(), 1);
+
+    // Queue far more bulk data than the socket is given at once, then a chat
+    // message and a keep-alive
+    const int count = 100;
+    QByteArray data(60000, 'x');
+    for (int i = 0; i < count; i++)
+        QVERIFY(bulk->send(data));
+
+    Connection::QueueStats bulkStats = connection->queueStats(bulk->identifier());
+    QCOMPARE(bulkStats.queuedPackets, count);
+    QCOMPARE(bulkStats.queuedBytes, count * (data.size() + 4));
+
+    ChatChannel::MessageId id;
+    QVERIFY(chat->sendChatMessage(QStringLiteral("hello"), QDateTime(), id));
+    connection->findChannel<ControlChannel>()->keepAlive();
+
+    receivedChannels.clear();
+    QTRY_COMPARE(keepAliveRequests, 1);
+    QTRY_VERIFY(receivedChannels.contains(quint16(chat->identifier())));
+
+    // Control traffic goes first, and chat only shares a round with bulk
+    int bulkBeforeChat = receivedChannels.mid(0, receivedChannels.indexOf(quint16(chat->identifier()))).count(quint16(bulk->identifier()));
+    QCOMPARE(receivedChannels.first(), quint16(0));
+    QVERIFY2(bulkBeforeChat <= 1, qPrintable(QStringLiteral("%1 bulk packets were sent before chat").arg(bulkBeforeChat)));
+
+    QTRY_COMPARE_WITH_TIMEOUT(receivedChannels.count(quint16(bulk->identifier())), count, 30000);
+    bulkStats = connection->queueStats(bulk->identifier());
+    QCOMPARE(bulkStats.queuedPackets, 0);
+    QCOMPARE(bulkStats.queuedBytes, 0);
+    QCOMPARE(bulkStats.sentPackets, quint64(count));
+    QVERIFY(bulkStats.maxWaitUsecs > 0);
+    QVERIFY(bulkStats.totalWaitUsecs >= bulkStats.maxWaitUsecs);
+
+    Connection::QueueStats chatStats = connection->queueStats(chat->identifier());
+    QCOMPARE(chatStats.sentPackets, quint64(1));
+    QVERIFY(chatStats.maxWaitUsecs < bulkStats.maxWaitUsecs);
+}
+
+void TestConnection::writeWaterMarks()
+{
+    BulkChannel *bulk = new BulkChannel(Channel::Outbound, connection);
+    QSignalSpy openedSpy(bulk, &Channel::channelOpened);
+    QVERIFY(!bulk->canWrite());
+    QVERIFY(bulk->openChannel());
+    QTRY_COMPARE(openedSpy.count(), 1);
+
+    bulk->setWriteWaterMarks(100000, 20000);
+    QSignalSpy writableSpy(bulk, &Channel::writable);
+    QVERIFY(bulk->canWrite());
+
+    // Producer sends until the channel's high water mark is passed
+    QByteArray data(10000, 'x');
+    int sent = 0;
+    while (bulk->canWrite()) {
+        QVERIFY(bulk->send(data));
+        sent++;
+    }
+    QCOMPARE(sent, 10);
+    QVERIFY(connection->queueStats(bulk->identifier()).queuedBytes > 100000);
+
+    // Writes beyond the mark are still queued
+    QVERIFY(bulk->send(data));
+    sent++;
+    QVERIFY(!bulk->canWrite());
+
+    QTRY_COMPARE(writableSpy.count(), 1);
+    QVERIFY(bulk->canWrite());
+    QVERIFY(connection->queueStats(bulk->identifier()).queuedBytes <= 20000);
+    QTRY_COMPARE(receivedChannels.count(quint16(bulk->identifier())), sent);
+    QCOMPARE(writableSpy.count(), 1);
+
+    // The connection's mark applies to all of its channels
+    connection->setWriteWaterMarks(50000, 0);
+    for (int i = 0; i < 6; i++)
+        QVERIFY(bulk->send(data));
+    QVERIFY(connection->bytesToWrite() > 50000);
+    QVERIFY(!bulk->canWrite());
+
+    QTRY_COMPARE(writableSpy.count(), 2);
+    QCOMPARE(connection->bytesToWrite(), qint64(0));
+}
+
+void TestConnection::compression()
+{
+    BulkChannel *bulk = new BulkChannel(Channel::Outbound, connection);
+    QSignalSpy openedSpy(bulk, &Channel::channelOpened);
+    QVERIFY(bulk->openChannel());
+    QTRY_COMPARE(openedSpy.count(), 1);
+
+    // Without negotiation, payloads are sent as they are
+    QByteArray data = QByteArray("compressible ").repeated(300);
+    QVERIFY(bulk->send(data));
+    QTRY_COMPARE(lastPayload, data);
+    QVERIFY(!connection->isCompressionEnabled());
+
+    // Only recognized features are enabled
+    Data::Control::Packet request;
+    request.mutable_enable_features()->add_feature("test.unknown");
+    request.mutable_enable_features()->add_feature(ControlChannel::CompressionFeature);
+    client->write(makePacket(0, request));
+    QTRY_COMPARE(featuresEnabledResponses, 1);
+    QCOMPARE(enabledFeatures, QStringList() << QString::fromLatin1(ControlChannel::CompressionFeature));
+    QVERIFY(connection->isCompressionEnabled());
+
+    // Large payloads are compressed, small ones are not
+    lastPayload.clear();
+    QVERIFY(bulk->send(data));
+    QTRY_VERIFY(!lastPayload.isEmpty());
+    QCOMPARE(lastPayload.at(0), char(0));
+    QVERIFY(lastPayload.size() < data.size() / 4);
+    QCOMPARE(qUncompress(lastPayload.mid(1)), data);
+
+    QByteArray small(100, 'y');
+    lastPayload.clear();
+    QVERIFY(bulk->send(small));
+    QTRY_COMPARE(lastPayload, small);
+
+    // Compressed packets from the peer are accepted, even when they don't shrink
+    Data::Control::Packet keepAlive;
+    keepAlive.mutable_keep_alive()->set_response_requested(true);
+    std::string keepAliveData = keepAlive.SerializeAsString();
+    QByteArray compressed = char(0) + qCompress(QByteArray::fromStdString(keepAliveData));
+    QByteArray packet(4, 0);
+    qToBigEndian(quint16(compressed.size() + 4), reinterpret_cast<uchar*>(packet.data()));
+    client->write(packet + compressed);
+    QTRY_COMPARE(keepAliveResponses, 1);
+
+    // Declaring a size larger than any packet closes the channel
+    QPointer<BulkChannel> bulkPtr(bulk);
+    QByteArray invalid = char(0) + QByteArray::fromHex("00100000") + QByteArray(16, 'z');
+    qToBigEndian(quint16(invalid.size() + 4), reinterpret_cast<uchar*>(packet.data()));
+    qToBigEndian(quint16(bulk->identifier()), reinterpret_cast<uchar*>(packet.data()) + 2);
+    client->write(packet + invalid);
+    QTRY_VERIFY(!bulkPtr || !bulkPtr->isOpened());
+    QVERIFY(connection->isConnected());
+}
+
+void TestConnection::aggregation()
+{
+    BulkChannel *bulk = new BulkChannel(Channel::Outbound, connection);
+    QSignalSpy openedSpy(bulk, &Channel::channelOpened);
+    QVERIFY(bulk->openChannel());
+    QTRY_COMPARE(openedSpy.count(), 1);
+    const quint16 bulkId = quint16(bulk->identifier());
+
+    // A window much longer than the test, so only flushing can send packets
+    connection->setAggregationWindow(10000);
+    Connection::CellStats before = connection->cellStats();
+    receivedChannels.clear();
+
+    QByteArray data(20, 'x');
+    for (int i = 0; i < 10; i++)
+        QVERIFY(bulk->send(data));
+    QTest::qWait(100);
+    QCOMPARE(receivedChannels.count(bulkId), 0);
+
+    // A priority packet takes the held packets with it, in one cell
+    connection->findChannel<ControlChannel>()->keepAlive();
+    QTRY_COMPARE_WITH_TIMEOUT(receivedChannels.count(bulkId), 10, 1000);
+    QCOMPARE(keepAliveRequests, 1);
+
+    Connection::CellStats stats = connection->cellStats();
+    QCOMPARE(stats.packets - before.packets, quint64(11));
+    QCOMPARE(stats.cells - before.cells, quint64(1));
+    QCOMPARE(stats.cellsSaved() - before.cellsSaved(), quint64(10));
+
+    // Packets are sent once they fill a cell
+    receivedChannels.clear();
+    int count = 0;
+    while (count * (data.size() + 4) < 498) {
+        QVERIFY(bulk->send(data));
+        count++;
+    }
+    QTRY_COMPARE_WITH_TIMEOUT(receivedChannels.count(bulkId), count, 1000);
+
+    // And otherwise after the window
+    connection->setAggregationWindow(20);
+    receivedChannels.clear();
+    QVERIFY(bulk->send(data));
+    QTRY_COMPARE(receivedChannels.count(bulkId), 1);
+}
+
+void TestConnection::keepAlive()
+{
+    BulkChannel *bulk = new BulkChannel(Channel::Outbound, connection);
+    QSignalSpy openedSpy(bulk, &Channel::channelOpened);
+    QVERIFY(bulk->openChannel());
+    QTRY_COMPARE(openedSpy.count(), 1);
+
+    // Responses measure the round trip time
+    answerKeepAlives = true;
+    QSignalSpy rttSpy(connection, &Connection::roundTripTimeChanged);
+    QCOMPARE(connection->roundTripTime(), -1);
+    connection->setPeerTimeout(300, 1000);
+    connection->setKeepAliveInterval(50);
+    QTRY_VERIFY(rttSpy.count() >= 1);
+    QVERIFY(connection->roundTripTime() >= 0);
+    QVERIFY(connection->roundTripTimeVariance() >= 0);
+
+    // While idle, the interval backs off from 300ms, doubling each time. The
+    // two intervals after the next request are at least 7/8 of 600 + 1200ms,
+    // less polling delay; without backoff they would take about 600ms.
+    int requests = keepAliveRequests;
+    QTRY_VERIFY_WITH_TIMEOUT(keepAliveRequests > requests, 2000);
+    QElapsedTimer idleTimer;
+    idleTimer.start();
+    requests = keepAliveRequests;
+    QTRY_VERIFY_WITH_TIMEOUT(keepAliveRequests >= requests + 2, 5000);
+    QVERIFY2(idleTimer.elapsed() >= 1300, qPrintable(QStringLiteral("Two idle KeepAlive messages in %1ms").arg(idleTimer.elapsed())));
+
+    // Sending brings the next one forward
+    requests = keepAliveRequests;
+    QVERIFY(bulk->send(QByteArray(10, 'x')));
+    QTRY_VERIFY_WITH_TIMEOUT(keepAliveRequests > requests, 500);
+    QVERIFY(connection->isConnected());
+
+    // A peer that stops responding is dropped after the peer timeout
+    answerKeepAlives = false;
+    QSignalSpy closedSpy(connection, &Connection::closed);
+    QTRY_COMPARE_WITH_TIMEOUT(closedSpy.count(), 1, 5000);
+    QVERIFY(!connection->isConnected());
+
+    delete connection;
+    connection = nullptr;
+}
+
+void TestConnection::pipelinedIntroduction()
+{
+    // A separate connection, because init has already sent the introduction
+    QTcpServer pipelineServer;
+    QVERIFY(pipelineServer.listen(QHostAddress::LocalHost));
+    QTcpSocket raw;
+    raw.connectToHost(pipelineServer.serverAddress(), pipelineServer.serverPort());
+    QVERIFY(raw.waitForConnected(5000));
+    QVERIFY(pipelineServer.waitForNewConnection(5000));
+    QTcpSocket *socket = pipelineServer.nextPendingConnection();
+    socket->setProperty("localHostname", QString::fromLatin1(serverHostname));
+    QScopedPointer<Connection> pipelined(new Connection(socket, Connection::ServerSide));
+    pipelined->setKeepAliveInterval(0);
+
+    // The introduction and the authentication OpenChannel in one write, as a
+    // pipelined OutboundConnector sends them
+    Data::Control::Packet open;
+    Data::Control::OpenChannel *request = open.mutable_open_channel();
+    request->set_channel_identifier(1);
+    request->set_channel_type("im.ricochet.auth.hidden-service");
+    request->SetExtension(Data::AuthHiddenService::client_cookie, std::string(16, 'c'));
+    const char intro[] = { 0x49, 0x4D, 0x01, 0x01 };
+    raw.write(QByteArray(intro, sizeof(intro)) + makePacket(0, open));
+
+    // The version, then the result of the request
+    QByteArray response;
+    auto haveResult = [&]() {
+        response.append(raw.readAll());
+        return response.size() >= 5 && response.size() >= 1 + qFromBigEndian<quint16>(reinterpret_cast<const uchar*>(response.constData() + 1));
+    };
+    QTRY_VERIFY(haveResult());
+    QCOMPARE(response.at(0), char(1));
+
+    quint16 size = qFromBigEndian<quint16>(reinterpret_cast<const uchar*>(response.constData() + 1));
+    QCOMPARE(qFromBigEndian<quint16>(reinterpret_cast<const uchar*>(response.constData() + 3)), quint16(0));
+    Data::Control::Packet result;
+    QVERIFY(result.ParseFromArray(response.constData() + 5, size - 4));
+    QVERIFY(result.has_channel_result());
+    QCOMPARE(result.channel_result().channel_identifier(), 1);
+    QVERIFY(result.channel_result().opened());
+    QCOMPARE(int(result.channel_result().GetExtension(Data::AuthHiddenService::server_cookie).size()), 16);
+
+    QSignalSpy closedSpy(pipelined.data(), &Connection::closed);
+    pipelined->close();
+    QTRY_COMPARE(closedSpy.count(), 1);
+}
+
+void TestConnection::earlyChatMessages()
+{
+    QStringList received;
+    connect(connection, &Connection::channelOpened, this,
+        [&received](Channel *channel) {
+            if (ChatChannel *chat = qobject_cast<ChatChannel*>(channel))
+                connect(chat, &ChatChannel::messageReceived, chat, [&received](const QString &text) { received.append(text); });
+        }
+    );
+
+    // One more message than the limit, and an invalid one
+    Data::Control::Packet open;
+    Data::Control::OpenChannel *request = open.mutable_open_channel();
+    request->set_channel_identifier(1);
+    request->set_channel_type("im.ricochet.chat");
+    for (int i = 0; i <= ChatChannel::MaxEarlyMessages; i++) {
+        Data::Chat::ChatMessage *message = request->AddExtension(Data::Chat::early_message);
+        message->set_message_id(100 + i);
+        message->set_message_text(i == 1 ? std::string() : QStringLiteral("early %1").arg(i).toStdString());
+    }
+    client->write(makePacket(0, open));
+
+    QTRY_COMPARE(channelResults, 1);
+    QVERIFY(lastChannelResult.opened());
+    QCOMPARE(lastChannelResult.ExtensionSize(Data::Chat::early_acknowledge), int(ChatChannel::MaxEarlyMessages));
+    for (int i = 0; i < ChatChannel::MaxEarlyMessages; i++) {
+        const Data::Chat::ChatAcknowledge &ack = lastChannelResult.GetExtension(Data::Chat::early_acknowledge, i);
+        QCOMPARE(ack.message_id(), quint32(100 + i));
+        QCOMPARE(ack.accepted(), i != 1);
+    }
+
+    // Delivered in order while the result is sent, without the invalid one
+    QCOMPARE(received, QStringList() << QStringLiteral("early 0") << QStringLiteral("early 2") << QStringLiteral("early 3"));
+}
+
+void TestConnection::attachedChatMessages_data()
+{
+    QTest::addColumn<bool>("acknowledged");
+    QTest::newRow("acknowledged") << true;
+    QTest::newRow("unsupported") << false;
+}
+
+void TestConnection::attachedChatMessages()
+{
+    QFETCH(bool, acknowledged);
+    acknowledgeEarlyMessages = acknowledged;
+
+    ChatChannel *chat = new ChatChannel(Channel::Outbound, connection);
+    QSignalSpy ackSpy(chat, &ChatChannel::messageAcknowledged);
+    ChatChannel::MessageId first = 0, second = 0;
+    QVERIFY(chat->attachChatMessage(QStringLiteral("first"), QDateTime(), first));
+    QVERIFY(chat->attachChatMessage(QStringLiteral("second"), QDateTime(), second));
+    QVERIFY(chat->openChannel());
+    QTRY_VERIFY(chat->isOpened());
+
+    QCOMPARE(lastOpenChannel.ExtensionSize(Data::Chat::early_message), 2);
+    QCOMPARE(lastOpenChannel.GetExtension(Data::Chat::early_message, 0).message_text(), std::string("first"));
+    QCOMPARE(lastOpenChannel.GetExtension(Data::Chat::early_message, 1).message_id(), second);
+
+    // Messages can't be attached once the request is sent
+    ChatChannel::MessageId late = 0;
+    QVERIFY(!chat->attachChatMessage(QStringLiteral("late"), QDateTime(), late));
+
+    if (acknowledged) {
+        QTRY_COMPARE(ackSpy.count(), 2);
+        QCOMPARE(ackSpy.at(0).at(0).toUInt(), first);
+        QCOMPARE(ackSpy.at(1).at(0).toUInt(), second);
+
+        // Nothing is sent again on the channel
+        QTest::qWait(100);
+        QVERIFY(!receivedChannels.contains(quint16(chat->identifier())));
+    } else {
+        // Peers that ignore the extension get the messages on the channel, in order
+        QTRY_COMPARE(receivedChannels.count(quint16(chat->identifier())), 2);
+        Data::Chat::Packet packet;
+        QVERIFY(packet.ParseFromArray(lastPayload.constData(), lastPayload.size()));
+        QCOMPARE(packet.chat_message().message_text(), std::string("second"));
+        QCOMPARE(packet.chat_message().message_id(), second);
+        QCOMPARE(ackSpy.count(), 0);
+
+        Data::Chat::Packet ack;
+        ack.mutable_chat_acknowledge()->set_message_id(first);
+        client->write(makePacket(chat->identifier(), ack));
+        QTRY_COMPARE(ackSpy.count(), 1);
+        QCOMPARE(ackSpy.at(0).at(0).toUInt(), first);
+    }
+}
+
+void TestConnection::batchAcknowledgeInbound()
+{
+    Data::Control::Packet open;
+    Data::Control::OpenChannel *request = open.mutable_open_channel();
+    request->set_channel_identifier(1);
+    request->set_channel_type("im.ricochet.chat");
+    request->SetExtension(Data::Chat::batch_acknowledge, true);
+    client->write(makePacket(0, open));
+
+    QTRY_COMPARE(channelResults, 1);
+    QVERIFY(lastChannelResult.opened());
+    QVERIFY(lastChannelResult.GetExtension(Data::Chat::batch_acknowledge_enabled));
+
+    // IDs wrap around in the middle, and one message is rejected
+    const int count = 500;
+    const quint32 firstId = quint32(0) - 100;
+    const quint32 rejectedId = firstId + 300;
+    QByteArray data;
+    for (int i = 0; i < count; i++) {
+        Data::Chat::Packet packet;
+        quint32 id = firstId + quint32(i);
+        packet.mutable_chat_message()->set_message_id(id);
+        packet.mutable_chat_message()->set_message_text(id == rejectedId ? std::string() : std::string("message"));
+        data.append(makePacket(1, packet));
+    }
+    client->write(data);
+
+    QSet<quint32> accepted;
+    QList<quint32> rejected;
+    auto collectAcknowledgements = [&]() {
+        accepted.clear();
+        rejected.clear();
+        for (const QByteArray &payload : channelOnePayloads) {
+            Data::Chat::Packet packet;
+            if (!packet.ParseFromArray(payload.constData(), payload.size()) || !packet.has_chat_acknowledge_batch())
+                return false;
+            for (const Data::Chat::AcknowledgeRange &range : packet.chat_acknowledge_batch().accepted()) {
+                for (quint32 i = 0; i < range.count(); i++)
+                    accepted.insert(range.first_id() + i);
+            }
+            for (quint32 id : packet.chat_acknowledge_batch().rejected_id())
+                rejected.append(id);
+        }
+        return accepted.size() + rejected.size() == count;
+    };
+    QTRY_VERIFY(collectAcknowledgements());
+
+    QCOMPARE(rejected, QList<quint32>() << rejectedId);
+    QVERIFY(!accepted.contains(rejectedId));
+    QVERIFY(accepted.contains(firstId) && accepted.contains(0) && accepted.contains(firstId + count - 1));
+    // At most one batch per MaxPendingAcknowledgements, plus one per read
+    QVERIFY2(channelOnePayloads.size() <= 16, qPrintable(QString::number(channelOnePayloads.size())));
+}
+
+void TestConnection::batchAcknowledgeOutbound()
+{
+    batchAcknowledgeChat = true;
+
+    ChatChannel *chat = new ChatChannel(Channel::Outbound, connection);
+    QSignalSpy ackSpy(chat, &ChatChannel::messageAcknowledged);
+    QVERIFY(chat->openChannel());
+    QTRY_VERIFY(chat->isOpened());
+    QVERIFY(lastOpenChannel.GetExtension(Data::Chat::batch_acknowledge));
+
+    const int count = 10;
+    QList<ChatChannel::MessageId> ids;
+    for (int i = 0; i < count; i++) {
+        ChatChannel::MessageId id = 0;
+        QVERIFY(chat->sendChatMessage(QStringLiteral("message %1").arg(i), QDateTime(), id));
+        ids.append(id);
+    }
+    QTRY_COMPARE(receivedChannels.count(quint16(chat->identifier())), count);
+
+    // One packet acknowledges all of them
+    Data::Chat::Packet ack;
+    Data::Chat::AcknowledgeRange *range = ack.mutable_chat_acknowledge_batch()->add_accepted();
+    range->set_first_id(ids.first());
+    range->set_count(count - 1);
+    ack.mutable_chat_acknowledge_batch()->add_rejected_id(ids.last());
+    client->write(makePacket(chat->identifier(), ack));
+
+    QTRY_COMPARE(ackSpy.count(), count);
+    for (int i = 0; i < count; i++) {
+        QCOMPARE(ackSpy.at(i).at(0).toUInt(), ids.at(i));
+        QCOMPARE(ackSpy.at(i).at(1).toBool(), i != count - 1);
+    }
+}
+
+void TestConnection::versionTwoFraming()
+{
+    // A separate connection, because init has negotiated version 1
+    QTcpServer v2Server;
+    QVERIFY(v2Server.listen(QHostAddress::LocalHost));
+    QTcpSocket raw;
+    raw.connectToHost(v2Server.serverAddress(), v2Server.serverPort());
+    QVERIFY(raw.waitForConnected(5000));
+    QVERIFY(v2Server.waitForNewConnection(5000));
+    QTcpSocket *socket = v2Server.nextPendingConnection();
+    socket->setProperty("localHostname", QString::fromLatin1(serverHostname));
+    QScopedPointer<Connection> v2(new Connection(socket, Connection::ServerSide));
+    v2->setKeepAliveInterval(0);
+
+    // A pipelined packet with a version 1 header, the switch marker, and then
+    // version 2 packets, all before reading the version
+    Data::Control::Packet keepAlive;
+    keepAlive.mutable_keep_alive()->set_response_requested(true);
+    Data::Control::Packet features;
+    features.mutable_enable_features()->set_max_packet_size(200000);
+    const char intro[] = { 0x49, 0x4D, 0x03, 0x02, 0x01, 0x00 };
+    const char marker[] = { 0x00, 0x04, 0x00, 0x00 };
+    raw.write(QByteArray(intro, sizeof(intro)) + makeKeepAlive() + QByteArray(marker, sizeof(marker)) +
+              makePacketV2(0, keepAlive) + makePacketV2(0, features));
+
+    QTRY_VERIFY(raw.bytesAvailable() >= 1);
+    char version = 0;
+    QCOMPARE(raw.read(&version, 1), qint64(1));
+    QCOMPARE(version, char(2));
+    QCOMPARE(v2->protocolVersion(), 2);
+
+    // Everything from the server has version 2 headers
+    QByteArray buffer;
+    QList<Data::Control::Packet> control;
+    QList<QByteArray> bulkPackets;
+    auto readPackets = [&]() {
+        buffer.append(raw.readAll());
+        int channelId;
+        QByteArray data;
+        while (takePacketV2(buffer, channelId, data)) {
+            if (channelId == 0) {
+                Data::Control::Packet message;
+                if (message.ParseFromArray(data.constData(), data.size()))
+                    control.append(message);
+            } else {
+                bulkPackets.append(data);
+            }
+        }
+    };
+    auto waitForControl = [&](int count) {
+        readPackets();
+        return control.size() >= count;
+    };
+
+    QTRY_VERIFY(waitForControl(3));
+    QVERIFY(control.at(0).has_keep_alive());
+    QVERIFY(control.at(1).has_keep_alive());
+    QVERIFY(control.at(2).has_features_enabled());
+    QCOMPARE(control.at(2).features_enabled().max_packet_size(), quint32(1048576));
+    QCOMPARE(v2->maxPacketSize(), 200000);
+
+    // Packets larger than version 1 allows, in both directions
+    BulkChannel *bulk = new BulkChannel(Channel::Outbound, v2.data());
+    QVERIFY(bulk->openChannel());
+    QTRY_VERIFY(waitForControl(4));
+    QVERIFY(control.at(3).has_open_channel());
+    Data::Control::Packet result;
+    result.mutable_channel_result()->set_channel_identifier(control.at(3).open_channel().channel_identifier());
+    result.mutable_channel_result()->set_opened(true);
+    raw.write(makePacketV2(0, result));
+    QTRY_VERIFY(bulk->isOpened());
+
+    QByteArray large(150000, 'x');
+    QVERIFY(bulk->send(large));
+    QTRY_VERIFY((readPackets(), bulkPackets.size() == 1));
+    QCOMPARE(bulkPackets.at(0), large);
+
+    Data::Control::Packet largeFeatures;
+    for (int i = 0; i < 3000; i++)
+        largeFeatures.mutable_enable_features()->add_feature(std::string(100, char('a' + i % 26)));
+    QVERIFY(largeFeatures.ByteSize() > 300000);
+    raw.write(makePacketV2(0, largeFeatures));
+    QTRY_VERIFY(waitForControl(5));
+    QVERIFY(control.at(4).has_features_enabled());
+
+    // Packets larger than the limit we announced abort the connection
+    QSignalSpy closedSpy(v2.data(), &Connection::closed);
+    QByteArray oversized;
+    appendVarint(oversized, 1048577);
+    appendVarint(oversized, 0);
+    raw.write(oversized + QByteArray(4096, 0));
+    QTRY_COMPARE(closedSpy.count(), 1);
+}
+
+void TestConnection::versionNegotiation_data()
+{
+    QTest::addColumn<int>("clientVersion");
+    QTest::addColumn<int>("serverVersion");
+    QTest::addColumn<int>("expected");
+
+    QTest::newRow("both version 2") << 2 << 2 << 2;
+    QTest::newRow("version 1 client") << 1 << 2 << 1;
+    QTest::newRow("version 1 server") << 2 << 1 << 1;
+}
+
+void TestConnection::versionNegotiation()
+{
+    QFETCH(int, clientVersion);
+    QFETCH(int, serverVersion);
+    QFETCH(int, expected);
+
+    QTcpServer pairServer;
+    QVERIFY(pairServer.listen(QHostAddress::LocalHost));
+    OnionSocket *socket = new OnionSocket;
+    socket->connectToHost(pairServer.serverAddress(), pairServer.serverPort());
+    QVERIFY(socket->waitForConnected(5000));
+    QVERIFY(pairServer.waitForNewConnection(5000));
+    socket->setOnionPeerName(QString::fromLatin1(serverHostname));
+    QTcpSocket *serverSocket = pairServer.nextPendingConnection();
+    serverSocket->setProperty("localHostname", QString::fromLatin1(serverHostname));
+
+    // The maximum version applies to connections created afterwards
+    Connection::setMaximumProtocolVersion(serverVersion);
+    QScopedPointer<Connection> serverSide(new Connection(serverSocket, Connection::ServerSide));
+    Connection::setMaximumProtocolVersion(clientVersion);
+    QScopedPointer<Connection> clientSide(new Connection(socket, Connection::ClientSide));
+    serverSide->setKeepAliveInterval(0);
+    clientSide->setKeepAliveInterval(0);
+
+    QSignalSpy readySpy(clientSide.data(), &Connection::ready);
+    QTRY_COMPARE(readySpy.count(), 1);
+    QCOMPARE(clientSide->protocolVersion(), expected);
+    QCOMPARE(serverSide->protocolVersion(), expected);
+
+    // Feature negotiation is an exchange in each direction with the new headers
+    QTRY_VERIFY(clientSide->isCompressionEnabled());
+    QTRY_VERIFY(serverSide->isCompressionEnabled());
+    int maxPacketSize = expected >= 2 ? 1048576 : UINT16_MAX - 4;
+    QCOMPARE(clientSide->maxPacketSize(), maxPacketSize);
+    QCOMPARE(serverSide->maxPacketSize(), maxPacketSize);
+
+    QSignalSpy closedSpy(serverSide.data(), &Connection::closed);
+    clientSide->close();
+    QTRY_COMPARE(closedSpy.count(), 1);
+}
+
+QTEST_MAIN(TestConnection)
+#include "tst_connection.moc"
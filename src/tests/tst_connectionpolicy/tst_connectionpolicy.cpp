@@ -0,0 +1,433 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// C++
+#include <QtTest>
+
+// libtego_ui
+#include <core/ConnectionPolicy.h>
+
+/* Policy with a simulated clock; tests advance it and call update() */
+class SimulatedPolicy : public ConnectionPolicy
+{
+public:
+    qint64 time = 0;
+
+protected:
+    qint64 now() const override { return time; }
+};
+
+class Network;
+
+/* A contact that comes online and goes offline on its own */
+class SimulatedContact : public ConnectionPolicy::Client
+{
+public:
+    Network *network = nullptr;
+    int index = 0;
+    bool online = false;
+    bool connected = false;
+    bool connecting = false;
+    qint64 attemptStarted = -1;
+    // Outgoing messages, waiting since queuedAt
+    bool undelivered = false;
+    qint64 queuedAt = -1;
+    qint64 lastActivity = -1;
+    qint64 lastConnected = -1;
+
+    void setConnecting(bool value) override;
+    void closeIdleConnection() override;
+};
+
+class Network
+{
+public:
+    static const int AttemptDuration = 30 * 1000;
+
+    SimulatedPolicy policy;
+    QVector<SimulatedContact> contacts;
+    QList<SimulatedContact*> closed;
+    QList<QPair<int,qint64>> closedOrder;
+    int visible = -1;
+
+    explicit Network(int count)
+        : contacts(count)
+    {
+        for (int i = 0; i < count; i++) {
+            contacts[i].network = this;
+            contacts[i].index = i;
+            policy.add(&contacts[i]);
+            policy.setEligible(&contacts[i], true);
+        }
+    }
+
+    void setConnected(SimulatedContact &contact, bool connected)
+    {
+        contact.connected = connected;
+        contact.lastConnected = policy.time;
+        policy.setConnected(&contact, connected);
+        // As ContactUser: only contacts that are offline try to connect
+        policy.setEligible(&contact, !connected);
+    }
+
+    void touch(SimulatedContact &contact)
+    {
+        contact.lastActivity = policy.time;
+        policy.touch(&contact);
+    }
+
+    void setUndelivered(SimulatedContact &contact, bool undelivered)
+    {
+        if (undelivered && !contact.undelivered)
+            contact.queuedAt = policy.time;
+        contact.undelivered = undelivered;
+        policy.setDemand(&contact, ConnectionPolicy::UndeliveredMessages, undelivered);
+    }
+
+    void setVisible(int index)
+    {
+        if (visible >= 0)
+            policy.setDemand(&contacts[visible], ConnectionPolicy::ConversationVisible, false);
+        visible = index;
+        policy.setDemand(&contacts[visible], ConnectionPolicy::ConversationVisible, true);
+    }
+
+    bool hasDemand(const SimulatedContact &contact) const
+    {
+        return contact.undelivered || contact.index == visible;
+    }
+
+    /* The order in which idle connections are closed: contacts that aren't
+     * warm first, then the least recently used */
+    QPair<int,qint64> closeOrder(const SimulatedContact &contact) const
+    {
+        bool warm = contact.lastActivity >= 0 && policy.time - contact.lastActivity < ConnectionPolicy::WarmPeriod;
+        return qMakePair(warm ? 1 : 0, qMax(contact.lastActivity, contact.lastConnected));
+    }
+};
+
+void SimulatedContact::setConnecting(bool value)
+{
+    if (value && !connecting)
+        attemptStarted = network->policy.time;
+    connecting = value;
+}
+
+void SimulatedContact::closeIdleConnection()
+{
+    // The connection closes right away, and is reported as ContactUser would
+    network->closed.append(this);
+    network->closedOrder.append(network->closeOrder(*this));
+    network->setConnected(*this, false);
+}
+
+class TestConnectionPolicy : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void spareConnections();
+    void demand();
+    void leastRecentlyUsed();
+    void inboundReconnect();
+    void budget();
+};
+
+void TestConnectionPolicy::spareConnections()
+{
+    // With fewer contacts than the limit, every contact tries to connect
+    Network network(10);
+    network.policy.setMaxConnections(16);
+    network.policy.update();
+    QCOMPARE(network.policy.connectingCount(), 10);
+
+    // Otherwise only as many as there are spare connections, most recently used first
+    network.policy.setMaxConnections(4);
+    network.policy.time = 1000;
+    network.touch(network.contacts[7]);
+    network.policy.time = 2000 + ConnectionPolicy::WarmPeriod;
+    network.touch(network.contacts[3]);
+    network.policy.update();
+    QCOMPARE(network.policy.connectingCount(), 4);
+    QVERIFY(network.contacts[3].connecting);
+    QVERIFY(network.contacts[7].connecting);
+
+    // Live connections use up the spares
+    network.setConnected(network.contacts[3], true);
+    network.setConnected(network.contacts[7], true);
+    network.setConnected(network.contacts[0], true);
+    network.policy.update();
+    QCOMPARE(network.policy.liveCount(), 3);
+    QCOMPARE(network.policy.connectingCount(), 1);
+    QVERIFY(!network.contacts[3].connecting);
+}
+
+void TestConnectionPolicy::demand()
+{
+    Network network(10);
+    network.policy.setMaxConnections(2);
+    network.setConnected(network.contacts[0], true);
+    network.setConnected(network.contacts[1], true);
+    network.policy.update();
+    QCOMPARE(network.policy.connectingCount(), 0);
+
+    // Contacts with demand connect even without spare connections, and
+    // the idle connections make room
+    network.setUndelivered(network.contacts[5], true);
+    network.setVisible(6);
+    network.policy.update();
+    QVERIFY(network.contacts[5].connecting);
+    QVERIFY(network.contacts[6].connecting);
+    QCOMPARE(network.policy.connectingCount(), 2);
+
+    network.setConnected(network.contacts[5], true);
+    network.setConnected(network.contacts[6], true);
+    network.policy.update();
+    QCOMPARE(network.closed.size(), 2);
+    QVERIFY(!network.contacts[0].connected);
+    QVERIFY(!network.contacts[1].connected);
+    QCOMPARE(network.policy.liveCount(), 2);
+
+    // Connections with demand are never closed, even over the limit
+    network.setUndelivered(network.contacts[8], true);
+    network.setConnected(network.contacts[8], true);
+    network.policy.update();
+    QCOMPARE(network.policy.liveCount(), 3);
+    QCOMPARE(network.closed.size(), 2);
+
+    // Once delivered, the connection is only warm, and it's the one closed
+    network.touch(network.contacts[8]);
+    network.setUndelivered(network.contacts[8], false);
+    network.policy.update();
+    QCOMPARE(network.policy.liveCount(), 2);
+    QCOMPARE(network.closed.size(), 3);
+    QCOMPARE(network.closed.last()->index, 8);
+}
+
+void TestConnectionPolicy::leastRecentlyUsed()
+{
+    Network network(10);
+    network.policy.setMaxConnections(10);
+    for (int i = 0; i < 6; i++) {
+        network.policy.time = i * 1000;
+        network.setConnected(network.contacts[i], true);
+    }
+
+    // 2 has recent activity and stays warm; 4 was used recently, but not warm
+    network.policy.time = ConnectionPolicy::WarmPeriod;
+    network.touch(network.contacts[4]);
+    network.policy.time = 3 * ConnectionPolicy::WarmPeriod;
+    network.touch(network.contacts[2]);
+    network.policy.update();
+    QCOMPARE(network.closed.size(), 0);
+
+    network.policy.setMaxConnections(3);
+    network.policy.update();
+    QCOMPARE(network.policy.liveCount(), 3);
+    QCOMPARE(network.closed.size(), 3);
+    QCOMPARE(network.closed[0]->index, 0);
+    QCOMPARE(network.closed[1]->index, 1);
+    QCOMPARE(network.closed[2]->index, 3);
+
+    network.policy.setMaxConnections(1);
+    network.policy.update();
+    QCOMPARE(network.closed.size(), 5);
+    QCOMPARE(network.closed[3]->index, 5);
+    QCOMPARE(network.closed[4]->index, 4);
+    QVERIFY(network.contacts[2].connected);
+}
+
+void TestConnectionPolicy::inboundReconnect()
+{
+    const qint64 backoff = ConnectionPolicy::EvictionBackoff;
+    Network network(2);
+    network.policy.setMaxConnections(1);
+    network.setConnected(network.contacts[0], true);
+    network.policy.time = 1000;
+    network.setConnected(network.contacts[1], true);
+    network.policy.update();
+    QCOMPARE(network.closed.size(), 1);
+    QCOMPARE(network.closed[0]->index, 0);
+
+    // The peer reconnects without being asked to, as one that can't be told
+    // to stay away does; it's kept, and the other connection is closed
+    network.policy.time = 2000;
+    QVERIFY(!network.contacts[0].connecting);
+    network.setConnected(network.contacts[0], true);
+    network.policy.update();
+    QCOMPARE(network.closed.size(), 2);
+    QCOMPARE(network.closed[1]->index, 1);
+    QVERIFY(network.contacts[0].connected);
+    QVERIFY(network.policy.isKept(&network.contacts[0]));
+
+    // Connections that are kept can exceed the limit
+    network.policy.time = 2000 + backoff - 1;
+    network.setConnected(network.contacts[1], true);
+    network.policy.update();
+    QCOMPARE(network.policy.liveCount(), 2);
+    QCOMPARE(network.closed.size(), 2);
+
+    // Until the backoff ends
+    network.policy.time = 2000 + backoff;
+    network.policy.update();
+    QCOMPARE(network.closed.size(), 3);
+    QCOMPARE(network.closed[2]->index, 0);
+
+    // Reconnecting again keeps it for twice as long
+    network.setConnected(network.contacts[0], true);
+    network.policy.update();
+    QCOMPARE(network.closed.size(), 3);
+
+    network.policy.time = 2000 + 2 * backoff;
+    network.policy.update();
+    QCOMPARE(network.closed.size(), 4);
+    QCOMPARE(network.closed[3]->index, 1);
+    QVERIFY(network.contacts[0].connected);
+    QCOMPARE(network.policy.liveCount(), 1);
+}
+
+/* Thousands of contacts coming online and going offline for a day, with
+ * inbound connections, messages to send and conversations being opened
+ */
+void TestConnectionPolicy::budget()
+{
+    const int count = 2000;
+    const int limit = 32;
+    const qint64 step = 10 * 1000;
+    const qint64 end = 24 * 3600 * 1000LL;
+
+    Network network(count);
+    network.policy.setMaxConnections(limit);
+
+    quint32 seed = 2468;
+    auto nextRandom = [&seed](quint32 max) {
+        seed = seed * 1103515245 + 12345;
+        return (seed >> 8) % max;
+    };
+
+    // About a fifth of contacts are online at any time, for an hour on average
+    for (SimulatedContact &contact : network.contacts)
+        contact.online = nextRandom(5) == 0;
+
+    int maxLive = 0, messages = 0, delivered = 0, attempts = 0;
+    qint64 slowestDelivery = 0;
+    for (qint64 time = 0; time < end; time += step) {
+        network.policy.time = time;
+        network.closed.clear();
+        network.closedOrder.clear();
+
+        if (time % (10 * 60 * 1000) == 0)
+            network.setVisible(int(nextRandom(count)));
+        if (nextRandom(50) == 0) {
+            network.setUndelivered(network.contacts[int(nextRandom(count))], true);
+            messages++;
+        }
+
+        for (SimulatedContact &contact : network.contacts) {
+            if (contact.online ? nextRandom(360) == 0 : nextRandom(1440) == 0) {
+                contact.online = !contact.online;
+                if (!contact.online && contact.connected)
+                    network.setConnected(contact, false);
+            }
+
+            if (contact.connected) {
+                if (contact.undelivered) {
+                    slowestDelivery = qMax(slowestDelivery, time - contact.queuedAt);
+                    network.touch(contact);
+                    network.setUndelivered(contact, false);
+                    delivered++;
+                }
+            } else if (contact.connecting && time - contact.attemptStarted >= Network::AttemptDuration) {
+                attempts++;
+                if (contact.online) {
+                    network.setConnected(contact, true);
+                } else {
+                    // Tries again, as OutboundConnector would
+                    contact.attemptStarted = time;
+                }
+            } else if (contact.online && nextRandom(2000) == 0) {
+                // The contact connects to send a message
+                network.setConnected(contact, true);
+                network.touch(contact);
+            }
+        }
+
+        network.policy.update();
+
+        // The limit holds, unless every connection has demand or is kept
+        // after the peer reconnected on its own
+        int live = 0, liveWithDemand = 0, connectingWithoutDemand = 0;
+        for (SimulatedContact &contact : network.contacts) {
+            if (contact.connected) {
+                live++;
+                if (network.hasDemand(contact) || network.policy.isKept(&contact))
+                    liveWithDemand++;
+            } else if (contact.connecting && !network.hasDemand(contact)) {
+                connectingWithoutDemand++;
+            }
+
+            // Contacts with demand always try to connect
+            if (network.hasDemand(contact) && !contact.connected)
+                QVERIFY(contact.connecting);
+        }
+        QCOMPARE(live, network.policy.liveCount());
+        QVERIFY2(live <= limit || live == liveWithDemand,
+                 qPrintable(QStringLiteral("%1 live connections, %2 with demand").arg(live).arg(liveWithDemand)));
+        QVERIFY(connectingWithoutDemand <= qMax(0, limit - live));
+        maxLive = qMax(maxLive, live);
+
+        // Closed connections had no demand, and were closed in order
+        QPair<int,qint64> lastClosed(-1, -1);
+        for (int i = 0; i < network.closed.size(); i++) {
+            QVERIFY(!network.hasDemand(*network.closed[i]));
+            QVERIFY(!(network.closedOrder[i] < lastClosed));
+            lastClosed = network.closedOrder[i];
+        }
+        if (!network.closed.isEmpty()) {
+            for (SimulatedContact &contact : network.contacts) {
+                if (contact.connected && !network.hasDemand(contact) && !network.policy.isKept(&contact))
+                    QVERIFY(!(network.closeOrder(contact) < lastClosed));
+            }
+        }
+    }
+
+    // There are always more contacts online than the limit, so it's used
+    QVERIFY(maxLive >= limit);
+    QVERIFY(messages > 0);
+    QVERIFY(delivered > messages / 2);
+    QVERIFY(attempts > 0);
+    qDebug() << messages << "messages," << delivered << "delivered; slowest after" << slowestDelivery / 1000
+             << "s;" << attempts << "attempts";
+}
+
+QTEST_MAIN(TestConnectionPolicy)
+#include "tst_connectionpolicy.moc"
@@ -0,0 +1,328 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// C++
+#include <QtTest>
+
+// libtego_ui
+#include <tor/ConnectScheduler.h>
+
+using namespace Tor;
+
+/* Scheduler with a simulated clock; tests advance it and call process() */
+class SimulatedScheduler : public ConnectScheduler
+{
+public:
+    qint64 time = 0;
+
+protected:
+    qint64 now() const override { return time; }
+};
+
+/* A contact that never comes online; each attempt fails after 'duration' */
+class OfflineContact : public ConnectScheduler::Client
+{
+public:
+    int index = 0;
+    qint64 duration = 0;
+    QDateTime lastSeen;
+    bool pendingMessages = false;
+    QVector<qint64> attempts;
+
+    QMultiMap<qint64,OfflineContact*> *failures = nullptr;
+    SimulatedScheduler *scheduler = nullptr;
+    int *active = nullptr;
+    int *maxActive = nullptr;
+    QList<OfflineContact*> *order = nullptr;
+
+    void startConnectAttempt() override
+    {
+        attempts.append(scheduler->time);
+        order->append(this);
+        *maxActive = qMax(*maxActive, ++*active);
+        failures->insert(scheduler->time + duration, this);
+    }
+};
+
+class TestConnectScheduler : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void concurrencyLimit();
+    void backoff();
+    void pause();
+    void offlineContacts();
+};
+
+void TestConnectScheduler::concurrencyLimit()
+{
+    SimulatedScheduler scheduler;
+    scheduler.setMaxConcurrent(3);
+    QMultiMap<qint64,OfflineContact*> failures;
+    QList<OfflineContact*> order;
+    int active = 0, maxActive = 0;
+
+    OfflineContact contacts[10];
+    for (int i = 0; i < 10; i++) {
+        contacts[i].index = i;
+        contacts[i].scheduler = &scheduler;
+        contacts[i].failures = &failures;
+        contacts[i].active = &active;
+        contacts[i].maxActive = &maxActive;
+        contacts[i].order = &order;
+        scheduler.request(&contacts[i]);
+    }
+
+    // Requests start from the event loop, not immediately
+    QCOMPARE(order.size(), 0);
+    QCOMPARE(scheduler.nextWakeup(), qint64(0));
+    scheduler.process();
+    QCOMPARE(order.size(), 3);
+    QCOMPARE(scheduler.activeCount(), 3);
+    QCOMPARE(scheduler.readyCount(), 7);
+
+    // Requests from clients that are active or waiting are ignored
+    scheduler.request(&contacts[0]);
+    scheduler.request(&contacts[5]);
+    QCOMPARE(scheduler.activeCount() + scheduler.readyCount(), 10);
+
+    // A finished attempt frees its slot for the next, in order
+    scheduler.attemptFinished(&contacts[1], true);
+    scheduler.process();
+    QCOMPARE(order.size(), 4);
+    QCOMPARE(order.last(), &contacts[3]);
+
+    // Cancelled clients release their slot too
+    scheduler.cancel(&contacts[0]);
+    scheduler.remove(&contacts[4]);
+    scheduler.process();
+    QCOMPARE(order.last(), &contacts[5]);
+    QCOMPARE(scheduler.activeCount(), 3);
+    QCOMPARE(scheduler.readyCount(), 4);
+
+    // Attempts that never report a result time out
+    scheduler.time += ConnectScheduler::AttemptTimeout;
+    QCOMPARE(scheduler.nextWakeup(), qint64(ConnectScheduler::AttemptTimeout));
+    scheduler.process();
+    QCOMPARE(scheduler.activeCount(), 3);
+    QCOMPARE(scheduler.readyCount(), 1);
+}
+
+void TestConnectScheduler::backoff()
+{
+    SimulatedScheduler scheduler;
+    QMultiMap<qint64,OfflineContact*> failures;
+    QList<OfflineContact*> order;
+    int active = 0, maxActive = 0;
+
+    OfflineContact contact;
+    contact.scheduler = &scheduler;
+    contact.failures = &failures;
+    contact.active = &active;
+    contact.maxActive = &maxActive;
+    contact.order = &order;
+    scheduler.setMaxRetryDelay(&contact, 240 * 1000);
+
+    scheduler.request(&contact);
+    scheduler.process();
+    QCOMPARE(contact.attempts.size(), 1);
+
+    // Each delay is between half and all of 30, 60, 120, then 240 seconds
+    qint64 expected = ConnectScheduler::InitialRetryDelay;
+    for (int failure = 1; failure <= 6; failure++) {
+        scheduler.attemptFinished(&contact, false);
+        QCOMPARE(scheduler.failureCount(&contact), failure);
+        QCOMPARE(scheduler.waitingCount(), 1);
+
+        qint64 delay = scheduler.nextWakeup() - scheduler.time;
+        QVERIFY2(delay >= expected / 2 && delay <= expected, qPrintable(QString::number(delay)));
+        expected = qMin(expected * 2, qint64(240 * 1000));
+
+        scheduler.time = scheduler.nextWakeup();
+        scheduler.process();
+        QCOMPARE(contact.attempts.size(), failure + 1);
+    }
+
+    // After success and a reset, a lost connection retries after the initial delay
+    scheduler.attemptFinished(&contact, true);
+    scheduler.resetAttempts(&contact);
+    scheduler.attemptFinished(&contact, false);
+    QVERIFY(scheduler.nextWakeup() - scheduler.time <= ConnectScheduler::InitialRetryDelay);
+}
+
+void TestConnectScheduler::pause()
+{
+    SimulatedScheduler scheduler;
+    QMultiMap<qint64,OfflineContact*> failures;
+    QList<OfflineContact*> order;
+    int active = 0, maxActive = 0;
+
+    OfflineContact contact;
+    contact.scheduler = &scheduler;
+    contact.failures = &failures;
+    contact.active = &active;
+    contact.maxActive = &maxActive;
+    contact.order = &order;
+
+    scheduler.setPaused(true);
+    scheduler.request(&contact);
+    QCOMPARE(scheduler.nextWakeup(), qint64(-1));
+    scheduler.process();
+    QCOMPARE(order.size(), 0);
+    QCOMPARE(scheduler.readyCount(), 1);
+
+    scheduler.setPaused(false);
+    QCOMPARE(scheduler.nextWakeup(), qint64(0));
+    scheduler.process();
+    QCOMPARE(order.size(), 1);
+}
+
+/* 5000 contacts that stay offline, all requested at once as when Tor gains
+ * connectivity, simulated for a day. Attempts take 20 to 90 seconds to fail,
+ * like circuits to offline services.
+ */
+void TestConnectScheduler::offlineContacts()
+{
+    const int count = 5000;
+    const int limit = 8;
+    const qint64 day = qint64(24) * 60 * 60 * 1000;
+
+    SimulatedScheduler scheduler;
+    scheduler.setMaxConcurrent(limit);
+    QMultiMap<qint64,OfflineContact*> failures;
+    QList<OfflineContact*> order;
+    int active = 0, maxActive = 0;
+
+    QDateTime now = QDateTime::currentDateTime();
+    QVector<OfflineContact> contacts(count);
+    quint32 seed = 12345;
+    auto random = [&seed](quint32 max) {
+        seed = seed * 1103515245 + 12345;
+        return (seed >> 8) % max;
+    };
+
+    for (int i = 0; i < count; i++) {
+        OfflineContact &contact = contacts[i];
+        contact.index = i;
+        contact.duration = (20 + random(71)) * 1000;
+        // Some were never seen; the rest within the last 90 days
+        if (random(10) != 0)
+            contact.lastSeen = now.addSecs(-qint64(random(90 * 24 * 60 * 60)));
+        contact.pendingMessages = random(100) == 0;
+        contact.scheduler = &scheduler;
+        contact.failures = &failures;
+        contact.active = &active;
+        contact.maxActive = &maxActive;
+        contact.order = &order;
+
+        scheduler.setPriority(&contact, contact.lastSeen, contact.pendingMessages);
+        scheduler.request(&contact);
+    }
+
+    // No attempt starts at the moment everything is requested
+    QCOMPARE(order.size(), 0);
+    QCOMPARE(scheduler.readyCount(), count);
+
+    while (scheduler.time < day) {
+        qint64 next = scheduler.nextWakeup();
+        if (!failures.isEmpty() && (next < 0 || failures.firstKey() < next))
+            next = failures.firstKey();
+        QVERIFY(next >= scheduler.time);
+        scheduler.time = next;
+
+        while (!failures.isEmpty() && failures.firstKey() <= scheduler.time) {
+            OfflineContact *contact = failures.take(failures.firstKey());
+            active--;
+            scheduler.attemptFinished(contact, false);
+        }
+        scheduler.process();
+
+        // Slots are never over the limit, and never idle while attempts are due
+        QVERIFY(active <= limit);
+        QCOMPARE(scheduler.activeCount(), active);
+        QVERIFY(active == limit || scheduler.readyCount() == 0);
+    }
+    QCOMPARE(maxActive, limit);
+
+    // Every contact was tried, and contacts with pending messages went first
+    int pendingCount = 0;
+    for (const OfflineContact &contact : contacts) {
+        QVERIFY(!contact.attempts.isEmpty());
+        if (contact.pendingMessages)
+            pendingCount++;
+    }
+    for (int i = 0; i < pendingCount; i++)
+        QVERIFY(order.at(i)->pendingMessages);
+
+    // Other contacts' first attempts are ordered by when they were last seen
+    QList<OfflineContact*> firstAttempts;
+    QSet<OfflineContact*> seen;
+    for (OfflineContact *contact : order) {
+        if (!contact->pendingMessages && !seen.contains(contact)) {
+            seen.insert(contact);
+            firstAttempts.append(contact);
+        }
+    }
+    QCOMPARE(firstAttempts.size(), count - pendingCount);
+    for (int i = 1; i < firstAttempts.size(); i++) {
+        QDateTime previous = firstAttempts.at(i - 1)->lastSeen;
+        QDateTime current = firstAttempts.at(i)->lastSeen;
+        // The recency bonus is rounded to milliseconds, so contacts seen within
+        // a few minutes of each other may start in either order
+        QVERIFY(!current.isValid() || (previous.isValid() && previous.addSecs(3600) >= current));
+    }
+
+    // Retries wait for contacts that haven't been tried yet: no contact is on
+    // its third attempt before every contact without a bonus had its first
+    qint64 lastFirstAttempt = 0;
+    for (OfflineContact *contact : firstAttempts)
+        lastFirstAttempt = qMax(lastFirstAttempt, contact->attempts.first());
+    for (const OfflineContact &contact : contacts) {
+        if (contact.attempts.size() >= 4)
+            QVERIFY(contact.pendingMessages || contact.attempts.at(3) >= lastFirstAttempt);
+    }
+
+    // Over the day, attempts are spread fairly: contacts without pending
+    // messages get a similar number of attempts, whenever they were seen
+    int fewest = INT_MAX, most = 0;
+    for (const OfflineContact &contact : contacts) {
+        if (contact.pendingMessages)
+            continue;
+        fewest = qMin(fewest, contact.attempts.size());
+        most = qMax(most, contact.attempts.size());
+    }
+    QVERIFY2(most <= fewest * 3 + 3, qPrintable(QStringLiteral("%1 to %2 attempts").arg(fewest).arg(most)));
+}
+
+QTEST_MAIN(TestConnectScheduler)
+#include "tst_connectscheduler.moc"
@@ -0,0 +1,188 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// C++
+#include <QtTest>
+#include <QTemporaryFile>
+
+// libtego_ui
+#include <protocol/ChatChannel.h>
+#include <protocol/Connection.h>
+#include <protocol/DirectTransport.h>
+
+// tests
+#include <OnionSocket.h>
+
+using namespace Protocol;
+
+class TestDirectTransport : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void cleanup();
+
+    void routes();
+    void loadRoutes();
+    void loadInvalidRoutes();
+    void socketPair();
+};
+
+static const char hostnameA[] = "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa.onion";
+static const char hostnameB[] = "bbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbb.onion";
+
+static DirectTransport::Endpoint endpoint(const char *address, quint16 port)
+{
+    DirectTransport::Endpoint re;
+    re.address = QHostAddress(QString::fromLatin1(address));
+    re.port = port;
+    return re;
+}
+
+void TestDirectTransport::cleanup()
+{
+    DirectTransport::removeRoute(QString::fromLatin1(hostnameA));
+    DirectTransport::removeRoute(QString::fromLatin1(hostnameB));
+    DirectTransport::setEnabled(false);
+}
+
+void TestDirectTransport::routes()
+{
+    QVERIFY(!DirectTransport::route(QString::fromLatin1(hostnameA)).isValid());
+
+    // Hostnames are matched without case, with or without the suffix
+    DirectTransport::addRoute(QString::fromLatin1(hostnameA).toUpper(), endpoint("127.0.0.1", 9001));
+    DirectTransport::Endpoint found = DirectTransport::route(QString::fromLatin1(hostnameA).left(56));
+    QVERIFY(found.isValid());
+    QCOMPARE(found.address, QHostAddress(QHostAddress::LocalHost));
+    QCOMPARE(found.port, quint16(9001));
+    QVERIFY(!DirectTransport::route(QString::fromLatin1(hostnameB)).isValid());
+
+    // Adding a route replaces the old one
+    DirectTransport::addRoute(QString::fromLatin1(hostnameA), endpoint("::1", 9002));
+    found = DirectTransport::route(QString::fromLatin1(hostnameA));
+    QCOMPARE(found.address, QHostAddress(QHostAddress::LocalHostIPv6));
+    QCOMPARE(found.port, quint16(9002));
+
+    DirectTransport::removeRoute(QString::fromLatin1(hostnameA));
+    QVERIFY(!DirectTransport::route(QString::fromLatin1(hostnameA)).isValid());
+
+    // Routes don't enable direct mode by themselves
+    QVERIFY(!DirectTransport::isEnabled());
+}
+
+void TestDirectTransport::loadRoutes()
+{
+    QTemporaryFile file;
+    QVERIFY(file.open());
+    file.write("# Two instances on this machine\n"
+               "\n"
+               "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa.onion 127.0.0.1 9001\n"
+               "  bbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbb\t127.0.0.1   9002 # second\n");
+    file.close();
+
+    QVERIFY(DirectTransport::loadRoutes(file.fileName()));
+    QVERIFY(DirectTransport::isEnabled());
+    QCOMPARE(DirectTransport::route(QString::fromLatin1(hostnameA)).port, quint16(9001));
+    QCOMPARE(DirectTransport::route(QString::fromLatin1(hostnameB)).port, quint16(9002));
+}
+
+void TestDirectTransport::loadInvalidRoutes()
+{
+    QTemporaryFile file;
+    QVERIFY(file.open());
+    file.write("aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa.onion 127.0.0.1 9001\n"
+               "bbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbb.onion 127.0.0.1 port\n");
+    file.close();
+
+    // Routes before the invalid line are kept
+    QVERIFY(!DirectTransport::loadRoutes(file.fileName()));
+    QVERIFY(DirectTransport::route(QString::fromLatin1(hostnameA)).isValid());
+    QVERIFY(!DirectTransport::route(QString::fromLatin1(hostnameB)).isValid());
+
+    QVERIFY(!DirectTransport::loadRoutes(file.fileName() + QStringLiteral(".missing")));
+}
+
+void TestDirectTransport::socketPair()
+{
+#ifndef Q_OS_UNIX
+    QSKIP("Socket pairs are not supported on this platform");
+#endif
+
+    OnionSocket *clientSocket = new OnionSocket;
+    QTcpSocket *serverSocket = new QTcpSocket;
+    QVERIFY(DirectTransport::createSocketPair(clientSocket, serverSocket));
+    QCOMPARE(clientSocket->state(), QAbstractSocket::ConnectedState);
+    QCOMPARE(serverSocket->state(), QAbstractSocket::ConnectedState);
+    clientSocket->setOnionPeerName(QString::fromLatin1(hostnameB));
+    serverSocket->setProperty("localHostname", QString::fromLatin1(hostnameB));
+
+    // The whole protocol runs over the pair as it would over Tor
+    QScopedPointer<Connection> clientSide(new Connection(clientSocket, Connection::ClientSide));
+    QScopedPointer<Connection> serverSide(new Connection(serverSocket, Connection::ServerSide));
+    clientSide->setKeepAliveInterval(0);
+    serverSide->setKeepAliveInterval(0);
+    QCOMPARE(clientSide->serverHostname(), QString::fromLatin1(hostnameB));
+
+    QSignalSpy readySpy(clientSide.data(), &Connection::ready);
+    QTRY_COMPARE(readySpy.count(), 1);
+
+    clientSide->grantAuthentication(Connection::HiddenServiceAuth, QString::fromLatin1(hostnameB));
+    serverSide->grantAuthentication(Connection::HiddenServiceAuth, QString::fromLatin1(hostnameA));
+    QVERIFY(clientSide->setPurpose(Connection::Purpose::KnownContact));
+    QVERIFY(serverSide->setPurpose(Connection::Purpose::KnownContact));
+
+    QString received;
+    connect(serverSide.data(), &Connection::channelOpened, this,
+        [&](Channel *channel) {
+            ChatChannel *chat = qobject_cast<ChatChannel*>(channel);
+            if (chat) {
+                connect(chat, &ChatChannel::messageReceived, this,
+                    [&](const QString &text) { received = text; });
+            }
+        }
+    );
+
+    ChatChannel *channel = new ChatChannel(Channel::Outbound, clientSide.data());
+    QVERIFY(channel->openChannel());
+    QTRY_VERIFY(channel->isOpened());
+    ChatChannel::MessageId id = 0;
+    QVERIFY(channel->sendChatMessage(QStringLiteral("direct"), QDateTime::currentDateTime(), id));
+    QTRY_COMPARE(received, QStringLiteral("direct"));
+
+    QSignalSpy closedSpy(serverSide.data(), &Connection::closed);
+    clientSide->close();
+    QTRY_COMPARE(closedSpy.count(), 1);
+}
+
+QTEST_MAIN(TestDirectTransport)
+#include "tst_directtransport.moc"
@@ -0,0 +1,315 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// C++
+#include <QtTest>
+#include <QTemporaryDir>
+
+// libtego_ui
+#include <protocol/Connection.h>
+#include <protocol/FileTransferChannel.h>
+
+// tests
+#include <LoopbackPeers.h>
+#include <TestIdentities.h>
+
+using namespace Protocol;
+
+/* Sends files from a ClientSide to a ServerSide Connection over loopback.
+ * Authentication is covered by tst_authentication, so it's granted directly.
+ */
+class TestFileTransfer : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void init();
+    void cleanup();
+
+    void transfer_data();
+    void transfer();
+    void resume();
+    void corruptedPrefix();
+    void otherTransferPartial();
+    void existingDestination();
+    void noDestination();
+
+private:
+    QTemporaryDir dir;
+    QScopedPointer<LoopbackPeers> peers;
+    Connection *client = nullptr;
+    Connection *serverConnection = nullptr;
+    // Inbound transfers are stored here, or rejected if it's empty
+    QString destination;
+
+    static QByteArray fileData(qint64 size);
+    QString writeFile(const QString &name, const QByteArray &data);
+    void connectPeers();
+    void disconnectPeers();
+    void sendFile(const QString &path, const QByteArray &transferId, bool expectCompleted);
+};
+
+QByteArray TestFileTransfer::fileData(qint64 size)
+{
+    QByteArray data(int(size), Qt::Uninitialized);
+    for (int i = 0; i < data.size(); i++)
+        data[i] = char((i * 131 + i / 4099) & 0xff);
+    return data;
+}
+
+QString TestFileTransfer::writeFile(const QString &name, const QByteArray &data)
+{
+    QString path = dir.filePath(name);
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate) || file.write(data) != data.size())
+        return QString();
+    return path;
+}
+
+void TestFileTransfer::init()
+{
+    QVERIFY(dir.isValid());
+    destination = dir.filePath(QStringLiteral("received"));
+    QFile::remove(destination);
+    connectPeers();
+}
+
+void TestFileTransfer::cleanup()
+{
+    disconnectPeers();
+}
+
+void TestFileTransfer::connectPeers()
+{
+    peers.reset(new LoopbackPeers);
+    QVERIFY(peers->connect(QString::fromLatin1(serverHostname)));
+    client = peers->client.data();
+    serverConnection = peers->server.data();
+    QVERIFY(peers->waitForReady());
+    QVERIFY(peers->makeContacts(QString::fromLatin1(clientHostname)));
+
+    connect(serverConnection, &Connection::channelRequestingInboundApproval, this,
+        [this](Channel *channel) {
+            FileTransferChannel *transfer = qobject_cast<FileTransferChannel*>(channel);
+            if (transfer && !destination.isEmpty())
+                transfer->setDestination(destination);
+        }
+    );
+}
+
+void TestFileTransfer::disconnectPeers()
+{
+    if (peers)
+        QVERIFY(peers->close());
+    peers.reset();
+    client = nullptr;
+    serverConnection = nullptr;
+}
+
+/* Send 'path' from the client, and wait until the transfer finishes */
+void TestFileTransfer::sendFile(const QString &path, const QByteArray &transferId, bool expectCompleted)
+{
+    FileTransferChannel *transfer = new FileTransferChannel(Channel::Outbound, client);
+    QVERIFY(transfer->setFile(path, transferId));
+    QSignalSpy finishedSpy(transfer, &FileTransferChannel::transferFinished);
+    QVERIFY(transfer->openChannel());
+
+    QTRY_COMPARE(finishedSpy.count(), 1);
+    QCOMPARE(finishedSpy.at(0).at(0).toBool(), expectCompleted);
+}
+
+void TestFileTransfer::transfer_data()
+{
+    QTest::addColumn<qint64>("size");
+    QTest::newRow("empty") << qint64(0);
+    QTest::newRow("one byte") << qint64(1);
+    QTest::newRow("one chunk") << qint64(FileTransferChannel::ChunkSize);
+    QTest::newRow("partial chunk") << qint64(FileTransferChannel::ChunkSize * 4 + 1234);
+}
+
+void TestFileTransfer::transfer()
+{
+    QFETCH(qint64, size);
+    QByteArray data = fileData(size);
+    QString path = writeFile(QStringLiteral("sent.bin"), data);
+    QVERIFY(!path.isEmpty());
+
+    QString inboundName;
+    qint64 inboundSize = -1;
+    connect(serverConnection, &Connection::channelRequestingInboundApproval, this,
+        [&](Channel *channel) {
+            FileTransferChannel *transfer = qobject_cast<FileTransferChannel*>(channel);
+            inboundName = transfer->fileName();
+            inboundSize = transfer->fileSize();
+        }
+    );
+
+    sendFile(path, QByteArray(), true);
+    QCOMPARE(inboundName, QStringLiteral("sent.bin"));
+    QCOMPARE(inboundSize, size);
+
+    QFile received(destination);
+    QVERIFY(received.open(QIODevice::ReadOnly));
+    QVERIFY(received.readAll() == data);
+}
+
+void TestFileTransfer::resume()
+{
+    const qint64 size = qint64(FileTransferChannel::ChunkSize) * 8 + 100;
+    QByteArray data = fileData(size);
+    QString path = writeFile(QStringLiteral("sent.bin"), data);
+    QVERIFY(!path.isEmpty());
+
+    // Interrupt the connection partway through
+    FileTransferChannel *transfer = new FileTransferChannel(Channel::Outbound, client);
+    QVERIFY(transfer->setFile(path));
+    transfer->setWindowSize(1);
+    QByteArray transferId = transfer->transferId();
+    QCOMPARE(transferId.size(), int(FileTransferChannel::TransferIdSize));
+    connect(transfer, &FileTransferChannel::progress, this,
+        [this](qint64 bytes) {
+            if (bytes >= FileTransferChannel::ChunkSize * 3 && client->isConnected())
+                client->close();
+        }
+    );
+    QSignalSpy finishedSpy(transfer, &FileTransferChannel::transferFinished);
+    QSignalSpy serverClosed(serverConnection, &Connection::closed);
+    QVERIFY(transfer->openChannel());
+    QTRY_COMPARE(finishedSpy.count(), 1);
+    QCOMPARE(finishedSpy.at(0).at(0).toBool(), false);
+    QTRY_COMPARE(serverClosed.count(), 1);
+    disconnectPeers();
+
+    QString partialPath = FileTransferChannel::partialPath(destination, transferId);
+    qint64 partial = QFileInfo(partialPath).size();
+    QVERIFY(partial >= FileTransferChannel::ChunkSize * 3);
+    QVERIFY(partial < size);
+    QVERIFY(!QFile::exists(destination));
+
+    // A new channel with the same id continues after the stored chunks
+    connectPeers();
+    qint64 resumedAt = -1;
+    connect(client, &Connection::channelOpened, this,
+        [&resumedAt](Channel *channel) {
+            if (FileTransferChannel *transfer = qobject_cast<FileTransferChannel*>(channel))
+                resumedAt = transfer->bytesTransferred();
+        }
+    );
+    sendFile(path, transferId, true);
+    QCOMPARE(resumedAt, partial - partial % FileTransferChannel::ChunkSize);
+
+    QFile received(destination);
+    QVERIFY(received.open(QIODevice::ReadOnly));
+    QVERIFY(received.readAll() == data);
+    QVERIFY(!QFile::exists(partialPath));
+}
+
+void TestFileTransfer::corruptedPrefix()
+{
+    const qint64 size = qint64(FileTransferChannel::ChunkSize) * 3;
+    QByteArray data = fileData(size);
+    QString path = writeFile(QStringLiteral("sent.bin"), data);
+    QVERIFY(!path.isEmpty());
+
+    // Stored data from an "earlier attempt" that doesn't match the file
+    QByteArray transferId(FileTransferChannel::TransferIdSize, 'c');
+    QString partialPath = FileTransferChannel::partialPath(destination, transferId);
+    QByteArray wrong = data.left(FileTransferChannel::ChunkSize * 2);
+    wrong[100] = char(wrong[100] ^ 0x01);
+    QVERIFY(!writeFile(QFileInfo(partialPath).fileName(), wrong).isEmpty());
+
+    sendFile(path, transferId, false);
+    QTRY_VERIFY(!QFile::exists(partialPath));
+    QVERIFY(!QFile::exists(destination));
+}
+
+void TestFileTransfer::otherTransferPartial()
+{
+    const qint64 size = qint64(FileTransferChannel::ChunkSize) * 3;
+    QByteArray data = fileData(size);
+    QString path = writeFile(QStringLiteral("sent.bin"), data);
+    QVERIFY(!path.isEmpty());
+
+    // A partial file from a different transfer isn't resumed or changed
+    QByteArray otherId(FileTransferChannel::TransferIdSize, 'o');
+    QString otherPartial = FileTransferChannel::partialPath(destination, otherId);
+    QByteArray other = fileData(FileTransferChannel::ChunkSize * 2 + 10);
+    QVERIFY(!writeFile(QFileInfo(otherPartial).fileName(), other).isEmpty());
+
+    qint64 resumedAt = -1;
+    connect(client, &Connection::channelOpened, this,
+        [&resumedAt](Channel *channel) {
+            if (FileTransferChannel *transfer = qobject_cast<FileTransferChannel*>(channel))
+                resumedAt = transfer->bytesTransferred();
+        }
+    );
+    sendFile(path, QByteArray(), true);
+    QCOMPARE(resumedAt, qint64(0));
+
+    QFile received(destination);
+    QVERIFY(received.open(QIODevice::ReadOnly));
+    QVERIFY(received.readAll() == data);
+
+    QFile untouched(otherPartial);
+    QVERIFY(untouched.open(QIODevice::ReadOnly));
+    QVERIFY(untouched.readAll() == other);
+}
+
+void TestFileTransfer::existingDestination()
+{
+    QString path = writeFile(QStringLiteral("sent.bin"), fileData(1000));
+    QVERIFY(!path.isEmpty());
+
+    // An existing file is never resumed, resized or replaced
+    QByteArray existing("unrelated data");
+    QVERIFY(!writeFile(QStringLiteral("received"), existing).isEmpty());
+
+    sendFile(path, QByteArray(), false);
+    QVERIFY(client->isConnected());
+
+    QFile unchanged(destination);
+    QVERIFY(unchanged.open(QIODevice::ReadOnly));
+    QVERIFY(unchanged.readAll() == existing);
+}
+
+void TestFileTransfer::noDestination()
+{
+    QString path = writeFile(QStringLiteral("sent.bin"), fileData(1000));
+    QVERIFY(!path.isEmpty());
+
+    destination.clear();
+    sendFile(path, QByteArray(), false);
+    QVERIFY(client->isConnected());
+}
+
+QTEST_MAIN(TestFileTransfer)
+#include "tst_filetransfer.moc"
@@ -0,0 +1,4 @@
+include(../tests.pri)
+include(../support/support.pri)
+
+SOURCES += tst_filetransfer.cpp
@@ -0,0 +1,267 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// C++
+#include <QtTest>
+
+// libtego_ui
+#include <core/ContactUser.h>
+#include <core/ConversationModel.h>
+#include <core/UserIdentity.h>
+#include <protocol/ChatChannel.h>
+#include <protocol/Connection.h>
+#include <tor/TorControl.h>
+#include <utils/Settings.h>
+
+// tests
+#include <LoopbackPeers.h>
+#include <TestIdentities.h>
+
+using namespace Protocol;
+
+typedef ChatChannel::MessageId MessageId;
+
+// Key of the second identity; the first uses keyBlob
+constexpr char peerKeyBlob[] = "ED25519-V3:2FBqT9+bOencDhK6rQ30irOTi6ny2XbNvrH2Dx5Us3Mkth1IUFjjmc73fmDlCULCn1g1xfWaT4bDcnFjapgH4Q==";
+
+/* Counts the chat messages that arrive on a peer's connections, below
+ * ConversationModel, which drops duplicates before they're shown
+ */
+class ChatCounter : public QObject
+{
+public:
+    QHash<MessageId,int> received;
+
+    void watch(Connection *connection)
+    {
+        connect(connection, &Connection::channelOpened, this,
+            [this](Channel *channel) {
+                ChatChannel *chat = qobject_cast<ChatChannel*>(channel);
+                if (chat && chat->direction() == Channel::Inbound) {
+                    connect(chat, &ChatChannel::messageReceived, this,
+                        [this](const QString &, const QDateTime &, MessageId id) { received[id]++; });
+                }
+            }
+        );
+    }
+
+    int duplicates() const
+    {
+        int re = 0;
+        for (int count : received.values())
+            re += count - 1;
+        return re;
+    }
+};
+
+/* Races between connections made from both sides at the same time, over
+ * loopback. Each side is a UserIdentity with a ContactUser for the other,
+ * which is given both connections with assignConnection, as UserIdentity
+ * and OutboundConnector would when they authenticate. Both conversations
+ * keep sending while the contacts switch to the connection they agree on,
+ * and the other one drains before it closes.
+ *
+ * Settings are kept in memory. UserIdentity reads its key when it's
+ * created, so the identities are made one after the other with different
+ * keys in the same settings.
+ */
+class TestHandover : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+
+    void simultaneousConnect_data();
+    void simultaneousConnect();
+
+private:
+    UserIdentity *identityA = nullptr;
+    UserIdentity *identityB = nullptr;
+    int nextContactId = 0;
+
+    ContactUser *addContact(UserIdentity *identity, const QString &hostname);
+    static QStringList messageTexts(ConversationModel *conversation, bool isOutgoing);
+};
+
+void TestHandover::initTestCase()
+{
+    SettingsObject::setDefaultFile(new SettingsFile(this));
+    // UserIdentity publishes its service through torControl
+    torControl = new Tor::TorControl(this);
+
+    SettingsObject settings(QStringLiteral("identity"));
+    settings.write("serviceKey", QString::fromLatin1(keyBlob));
+    identityA = new UserIdentity(0, this);
+    settings.write("serviceKey", QString::fromLatin1(peerKeyBlob));
+    identityB = new UserIdentity(1, this);
+
+    QCOMPARE(identityA->hostname(), QString::fromLatin1(serverHostname));
+    QVERIFY(!identityB->hostname().isEmpty());
+    QVERIFY(identityA->hostname() != identityB->hostname());
+}
+
+ContactUser *TestHandover::addContact(UserIdentity *identity, const QString &hostname)
+{
+    int id = ++nextContactId;
+    SettingsObject settings(QStringLiteral("contacts.%1").arg(id));
+    settings.write("hostname", hostname);
+    return new ContactUser(identity, id);
+}
+
+QStringList TestHandover::messageTexts(ConversationModel *conversation, bool isOutgoing)
+{
+    QStringList re;
+    for (int row = 0; row < conversation->rowCount(); row++) {
+        QModelIndex index = conversation->index(row);
+        if (index.data(ConversationModel::IsOutgoingRole).toBool() == isOutgoing)
+            re.append(index.data().toString());
+    }
+    re.sort();
+    return re;
+}
+
+void TestHandover::simultaneousConnect_data()
+{
+    // The winning connection is the one to the identity with the lesser
+    // hostname. Each side assigns one connection once both have connected,
+    // then the other after a while.
+    QTest::addColumn<bool>("winnerFirstA");
+    QTest::addColumn<bool>("winnerFirstB");
+    QTest::newRow("losing connection first") << false << false;
+    QTest::newRow("winning connection first") << true << true;
+    QTest::newRow("crossed") << true << false;
+    QTest::newRow("crossed reverse") << false << true;
+}
+
+void TestHandover::simultaneousConnect()
+{
+    QFETCH(bool, winnerFirstA);
+    QFETCH(bool, winnerFirstB);
+
+    const QString hostnameA = identityA->hostname();
+    const QString hostnameB = identityB->hostname();
+    QScopedPointer<ContactUser> contactB(addContact(identityA, hostnameB));
+    QScopedPointer<ContactUser> contactA(addContact(identityB, hostnameA));
+
+    // X is from A to B, and Y is from B to A
+    LoopbackPeers x, y;
+    QVERIFY(x.connect(hostnameB));
+    QVERIFY(y.connect(hostnameA));
+    QVERIFY(x.waitForReady());
+    QVERIFY(y.waitForReady());
+
+    // As AuthHiddenServiceChannel does on each side
+    x.server->grantAuthentication(Connection::HiddenServiceAuth, hostnameA);
+    x.client->grantAuthentication(Connection::KnownToPeer);
+    y.server->grantAuthentication(Connection::HiddenServiceAuth, hostnameB);
+    y.client->grantAuthentication(Connection::KnownToPeer);
+
+    ChatCounter countA, countB;
+    countA.watch(x.client.data());
+    countA.watch(y.server.data());
+    countB.watch(x.server.data());
+    countB.watch(y.client.data());
+
+    bool winnerIsY = QString::compare(hostnameA, hostnameB) < 0;
+    LoopbackPeers &winner = winnerIsY ? y : x;
+    LoopbackPeers &loser = winnerIsY ? x : y;
+    // Connections of each side, in the order that side assigns them
+    QSharedPointer<Connection> winnerA = winnerIsY ? y.server : x.client;
+    QSharedPointer<Connection> loserA = winnerIsY ? x.client : y.server;
+    QSharedPointer<Connection> winnerB = winnerIsY ? y.client : x.server;
+    QSharedPointer<Connection> loserB = winnerIsY ? x.server : y.client;
+
+    // Messages are written before, during, and after the handover
+    ConversationModel *conversationA = contactB->conversation();
+    ConversationModel *conversationB = contactA->conversation();
+    const int count = 60;
+    int written = 0;
+    QStringList sentA, sentB;
+    QTimer writer;
+    writer.setInterval(10);
+    connect(&writer, &QTimer::timeout, this,
+        [&]() {
+            sentA.append(QStringLiteral("from a %1").arg(written));
+            sentB.append(QStringLiteral("from b %1").arg(written));
+            conversationA->sendMessage(sentA.last());
+            conversationB->sendMessage(sentB.last());
+            if (++written == count)
+                writer.stop();
+        }
+    );
+
+    contactB->assignConnection(winnerFirstA ? winnerA : loserA);
+    contactA->assignConnection(winnerFirstB ? winnerB : loserB);
+    writer.start();
+    QTest::qWait(100);
+    contactB->assignConnection(winnerFirstA ? loserA : winnerA);
+    contactA->assignConnection(winnerFirstB ? loserB : winnerB);
+
+    // Both keep the connection from the server with the lesser hostname
+    QVERIFY(contactB->connection() == winnerA);
+    QVERIFY(contactA->connection() == winnerB);
+    QVERIFY(loserA->isDraining());
+    QVERIFY(loserB->isDraining());
+
+    QTRY_COMPARE(written, count);
+    QTRY_VERIFY(!conversationA->hasUndeliveredMessages());
+    QTRY_VERIFY(!conversationB->hasUndeliveredMessages());
+
+    // Every message arrived once, and none was sent again or failed
+    sentA.sort();
+    sentB.sort();
+    QCOMPARE(messageTexts(conversationA, false), sentB);
+    QCOMPARE(messageTexts(conversationB, false), sentA);
+    QCOMPARE(countA.received.size(), count);
+    QCOMPARE(countB.received.size(), count);
+    QCOMPARE(countA.duplicates(), 0);
+    QCOMPARE(countB.duplicates(), 0);
+    for (ConversationModel *conversation : { conversationA, conversationB }) {
+        for (int row = 0; row < conversation->rowCount(); row++) {
+            QModelIndex index = conversation->index(row);
+            if (index.data(ConversationModel::IsOutgoingRole).toBool())
+                QCOMPARE(index.data(ConversationModel::StatusRole).toInt(), int(ConversationModel::Delivered));
+        }
+    }
+
+    // The losing connection closes once it's drained, long before its timeout
+    QTRY_VERIFY_WITH_TIMEOUT(!loser.client->isConnected(), 5000);
+    QTRY_VERIFY_WITH_TIMEOUT(!loser.server->isConnected(), 5000);
+    QVERIFY(winner.client->isConnected());
+    QVERIFY(winner.server->isConnected());
+    QCOMPARE(contactA->status(), ContactUser::Online);
+    QCOMPARE(contactB->status(), ContactUser::Online);
+}
+
+QTEST_MAIN(TestHandover)
+#include "tst_handover.moc"
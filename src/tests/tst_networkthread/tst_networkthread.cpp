@@ -0,0 +1,447 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// C++
+#include <algorithm>
+#include <QtTest>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QThread>
+
+// libtego_ui
+#include <protocol/Connection.h>
+#include <protocol/ChatChannel.h>
+#include <protocol/NetworkThread.h>
+#include <protocol/ControlChannel.pb.h>
+#include <protocol/ChatChannel.pb.h>
+
+// tests
+#include <RawPackets.h>
+#include <TestIdentities.h>
+
+using namespace Protocol;
+
+/* Peer that floods a chat channel from its own thread
+ *
+ * Uses blocking socket calls, so it doesn't need an event loop and doesn't
+ * compete with the main thread that the benchmark measures.
+ */
+class FloodClient : public QThread
+{
+public:
+    FloodClient(quint16 port, int count, int perTick)
+        : port(port), count(count), perTick(perTick)
+    {
+    }
+
+    QAtomicInt failed;
+
+protected:
+    void run() override
+    {
+        QTcpSocket socket;
+        socket.connectToHost(QHostAddress::LocalHost, port);
+        if (!socket.waitForConnected(5000)) {
+            failed = 1;
+            return;
+        }
+
+        const char intro[] = { 0x49, 0x4D, 0x01, 0x01 };
+        socket.write(intro, sizeof(intro));
+        while (socket.bytesAvailable() < 1) {
+            if (!socket.waitForReadyRead(5000)) {
+                failed = 1;
+                return;
+            }
+        }
+        socket.read(1);
+
+        Data::Control::Packet open;
+        open.mutable_open_channel()->set_channel_identifier(1);
+        open.mutable_open_channel()->set_channel_type("im.ricochet.chat");
+        socket.write(makePacket(0, open));
+
+        // Ten ticks a frame, roughly
+        for (int sent = 0; sent < count; ) {
+            QByteArray data;
+            for (int i = 0; i < perTick && sent < count; i++, sent++) {
+                Data::Chat::Packet message;
+                message.mutable_chat_message()->set_message_text("Stress test message " + std::to_string(sent));
+                message.mutable_chat_message()->set_message_id(sent + 1);
+                data.append(makePacket(1, message));
+            }
+
+            socket.write(data);
+            while (socket.bytesToWrite() > 0 && socket.waitForBytesWritten(1000))
+                ;
+
+            // Discard acknowledgements
+            socket.waitForReadyRead(0);
+            socket.readAll();
+            QThread::usleep(1600);
+        }
+
+        socket.waitForReadyRead(100);
+        socket.disconnectFromHost();
+        if (socket.state() != QAbstractSocket::UnconnectedState)
+            socket.waitForDisconnected(1000);
+    }
+
+private:
+    quint16 port;
+    int count;
+    int perTick;
+};
+
+/* Exercises a ServerSide Connection with its socket on the network thread.
+ * The client end is a plain QTcpSocket on the main thread, as in tst_connection.
+ */
+class TestNetworkThread : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void init();
+    void cleanup();
+
+    void keepAliveBurst();
+    void fragmentedPackets();
+    void closeFlushesPackets();
+    void peerDisconnect();
+    void destroyWhileOpen();
+    void partialPacketHandover();
+    void benchmarkFrameTimes_data();
+    void benchmarkFrameTimes();
+
+private:
+    QTcpServer *server = nullptr;
+    QTcpSocket *client = nullptr;
+    Connection *connection = nullptr;
+    QByteArray clientBuffer;
+    int keepAliveResponses = 0;
+
+    void readResponses();
+    Connection *acceptConnection(QTcpSocket *socket);
+};
+
+void TestNetworkThread::readResponses()
+{
+    clientBuffer.append(client->readAll());
+
+    while (clientBuffer.size() >= 4) {
+        quint16 size = qFromBigEndian<quint16>(reinterpret_cast<const uchar*>(clientBuffer.constData()));
+        quint16 channelId = qFromBigEndian<quint16>(reinterpret_cast<const uchar*>(clientBuffer.constData() + 2));
+        QVERIFY(size >= 4);
+        if (clientBuffer.size() < size)
+            break;
+
+        if (channelId == 0) {
+            Data::Control::Packet message;
+            QVERIFY(message.ParseFromArray(clientBuffer.constData() + 4, size - 4));
+            if (message.has_keep_alive() && !message.keep_alive().response_requested())
+                keepAliveResponses++;
+        }
+
+        clientBuffer.remove(0, size);
+    }
+}
+
+Connection *TestNetworkThread::acceptConnection(QTcpSocket *socket)
+{
+    socket->setProperty("localHostname", QString::fromLatin1(serverHostname));
+    Connection *c = new Connection(socket, Connection::ServerSide);
+    // Avoid the timeout for connections without a purpose
+    c->grantAuthentication(Connection::HiddenServiceAuth, QString::fromLatin1(serverHostname));
+    c->setPurpose(Connection::Purpose::KnownContact);
+    return c;
+}
+
+void TestNetworkThread::init()
+{
+    NetworkThread::setEnabled(true);
+
+    server = new QTcpServer;
+    QVERIFY(server->listen(QHostAddress::LocalHost));
+
+    client = new QTcpSocket;
+    client->connectToHost(server->serverAddress(), server->serverPort());
+    QVERIFY(client->waitForConnected(5000));
+    QVERIFY(server->waitForNewConnection(5000));
+
+    QTcpSocket *socket = server->nextPendingConnection();
+    QVERIFY(socket);
+    connection = acceptConnection(socket);
+    QSignalSpy readySpy(connection, &Connection::ready);
+
+    const char intro[] = { 0x49, 0x4D, 0x01, 0x01 };
+    client->write(intro, sizeof(intro));
+    QTRY_COMPARE(readySpy.count(), 1);
+    QTRY_VERIFY(client->bytesAvailable() >= 1);
+
+    char version = 0;
+    QCOMPARE(client->read(&version, 1), qint64(1));
+    QCOMPARE(version, char(1));
+
+    // The socket now belongs to the network thread, once the handover has run
+    QTRY_VERIFY(connection->findChildren<QTcpSocket*>().isEmpty());
+    QVERIFY(connection->isConnected());
+
+    clientBuffer.clear();
+    keepAliveResponses = 0;
+    connect(client, &QIODevice::readyRead, this, &TestNetworkThread::readResponses);
+}
+
+void TestNetworkThread::cleanup()
+{
+    if (connection) {
+        QSignalSpy closedSpy(connection, &Connection::closed);
+        connection->close();
+        QTRY_COMPARE(closedSpy.count(), 1);
+    }
+
+    delete connection;
+    connection = nullptr;
+    delete client;
+    client = nullptr;
+    delete server;
+    server = nullptr;
+    NetworkThread::setEnabled(false);
+}
+
+void TestNetworkThread::keepAliveBurst()
+{
+    const int count = 500;
+    QByteArray burst;
+    for (int i = 0; i < count; i++)
+        burst.append(makeKeepAlive());
+
+    client->write(burst);
+    QTRY_COMPARE(keepAliveResponses, count);
+    QVERIFY(connection->isConnected());
+    QTRY_COMPARE(connection->bytesToWrite(), qint64(0));
+}
+
+void TestNetworkThread::fragmentedPackets()
+{
+    const int count = 20;
+    QByteArray data;
+    for (int i = 0; i < count; i++)
+        data.append(makeKeepAlive());
+
+    for (int i = 0; i < data.size(); i += 3) {
+        client->write(data.mid(i, 3));
+        client->flush();
+        QTest::qWait(1);
+    }
+
+    QTRY_COMPARE(keepAliveResponses, count);
+    QVERIFY(connection->isConnected());
+}
+
+void TestNetworkThread::closeFlushesPackets()
+{
+    // Responses queued just before close are still written by the worker
+    QByteArray burst;
+    for (int i = 0; i < 50; i++)
+        burst.append(makeKeepAlive());
+
+    QSignalSpy closedSpy(connection, &Connection::closed);
+    client->write(burst);
+    QTRY_COMPARE(keepAliveResponses, 50);
+
+    connection->close();
+    QVERIFY(!connection->isConnected());
+    QTRY_COMPARE(closedSpy.count(), 1);
+    QTRY_COMPARE(client->state(), QAbstractSocket::UnconnectedState);
+
+    delete connection;
+    connection = nullptr;
+}
+
+void TestNetworkThread::peerDisconnect()
+{
+    QSignalSpy closedSpy(connection, &Connection::closed);
+    client->disconnectFromHost();
+    QTRY_COMPARE(closedSpy.count(), 1);
+    QVERIFY(!connection->isConnected());
+    QVERIFY(connection->channels().isEmpty());
+
+    delete connection;
+    connection = nullptr;
+}
+
+void TestNetworkThread::destroyWhileOpen()
+{
+    ChatChannel *channel = new ChatChannel(Channel::Outbound, connection);
+    QVERIFY(channel->openChannel());
+    QSignalSpy invalidatedSpy(channel, &Channel::invalidated);
+    QSignalSpy closedSpy(connection, &Connection::closed);
+
+    // The worker aborts the socket later; channels are closed right away
+    delete connection;
+    connection = nullptr;
+    QCOMPARE(invalidatedSpy.count(), 1);
+    QCOMPARE(closedSpy.count(), 1);
+}
+
+void TestNetworkThread::partialPacketHandover()
+{
+    QTcpSocket raw;
+    raw.connectToHost(server->serverAddress(), server->serverPort());
+    QVERIFY(raw.waitForConnected(5000));
+    QVERIFY(server->waitForNewConnection(5000));
+    QScopedPointer<Connection> v2(acceptConnection(server->nextPendingConnection()));
+    v2->setKeepAliveInterval(0);
+
+    // The switch marker is followed by the start of a version 2 packet that
+    // is larger than the receive buffer, so it's still incomplete when the
+    // socket moves to the network thread
+    Data::Control::Packet features;
+    for (int i = 0; i < 2000; i++)
+        features.mutable_enable_features()->add_feature(std::string(100, char('a' + i % 26)));
+    QByteArray large = makePacketV2(0, features);
+    QVERIFY(large.size() > 200000);
+
+    const char intro[] = { 0x49, 0x4D, 0x03, 0x02, 0x01, 0x00 };
+    const char marker[] = { 0x00, 0x04, 0x00, 0x00 };
+    const int split = 40000;
+    raw.write(QByteArray(intro, sizeof(intro)) + QByteArray(marker, sizeof(marker)) + large.left(split));
+    QTRY_VERIFY(raw.bytesAvailable() >= 1);
+    char version = 0;
+    QCOMPARE(raw.read(&version, 1), qint64(1));
+    QCOMPARE(version, char(2));
+    QTRY_VERIFY(v2->findChildren<QTcpSocket*>().isEmpty());
+
+    // The rest of the packet arrives on the network thread
+    Data::Control::Packet keepAlive;
+    keepAlive.mutable_keep_alive()->set_response_requested(true);
+    raw.write(large.mid(split) + makePacketV2(0, keepAlive));
+
+    QByteArray buffer;
+    QList<Data::Control::Packet> control;
+    auto waitForControl = [&](int count) {
+        buffer.append(raw.readAll());
+        int channelId;
+        QByteArray data;
+        while (takePacketV2(buffer, channelId, data)) {
+            Data::Control::Packet message;
+            if (channelId == 0 && message.ParseFromArray(data.constData(), data.size()))
+                control.append(message);
+        }
+        return control.size() >= count;
+    };
+
+    QTRY_VERIFY(waitForControl(2));
+    QVERIFY(control.at(0).has_features_enabled());
+    QVERIFY(control.at(1).has_keep_alive());
+    QVERIFY(v2->isConnected());
+
+    QSignalSpy closedSpy(v2.data(), &Connection::closed);
+    v2->close();
+    QTRY_COMPARE(closedSpy.count(), 1);
+}
+
+void TestNetworkThread::benchmarkFrameTimes_data()
+{
+    QTest::addColumn<bool>("networkThread");
+    QTest::newRow("gui thread") << false;
+    QTest::newRow("network thread") << true;
+}
+
+/* Measure frame intervals on the main thread while chat messages arrive
+ *
+ * A 60Hz timer stands in for the UI's frames. The result is the worst frame
+ * interval while roughly 15000 messages per second are received.
+ */
+void TestNetworkThread::benchmarkFrameTimes()
+{
+    QFETCH(bool, networkThread);
+    NetworkThread::setEnabled(networkThread);
+
+    const int count = 30000;
+    int received = 0;
+    Connection *peer = nullptr;
+
+    connect(server, &QTcpServer::newConnection, this, [&]() {
+        peer = acceptConnection(server->nextPendingConnection());
+        connect(peer, &Connection::channelOpened, this, [&](Channel *channel) {
+            if (ChatChannel *chat = qobject_cast<ChatChannel*>(channel)) {
+                connect(chat, &ChatChannel::messageReceived, this, [&]() { received++; });
+            }
+        });
+    });
+
+    QVector<qint64> frames;
+    frames.reserve(4096);
+    QElapsedTimer frameClock;
+    QTimer frameTimer;
+    frameTimer.setTimerType(Qt::PreciseTimer);
+    frameTimer.setInterval(16);
+    connect(&frameTimer, &QTimer::timeout, this, [&]() {
+        frames.append(frameClock.nsecsElapsed() / 1000);
+        frameClock.restart();
+    });
+
+    QElapsedTimer elapsed;
+    elapsed.start();
+    frameClock.start();
+    frameTimer.start();
+
+    FloodClient flood(server->serverPort(), count, 25);
+    flood.start();
+    QTRY_COMPARE_WITH_TIMEOUT(received, count, 60000);
+    qint64 msecs = elapsed.elapsed();
+    frameTimer.stop();
+    QVERIFY(flood.wait(5000));
+    QCOMPARE(int(flood.failed), 0);
+    QVERIFY(frames.size() > 10);
+
+    std::sort(frames.begin(), frames.end());
+    qint64 p50 = frames.at(frames.size() / 2);
+    qint64 p99 = frames.at(frames.size() * 99 / 100);
+    qint64 worst = frames.last();
+    qDebug() << (networkThread ? "network thread:" : "gui thread:")
+             << qRound(count * 1000.0 / qMax(msecs, qint64(1))) << "messages/s,"
+             << "frame interval p50" << p50 << "us, p99" << p99 << "us, max" << worst << "us";
+    QTest::setBenchmarkResult(worst / 1000.0, QTest::WalltimeMilliseconds);
+
+    if (peer) {
+        QSignalSpy closedSpy(peer, &Connection::closed);
+        peer->close();
+        QTRY_COMPARE(closedSpy.count(), 1);
+        delete peer;
+    }
+}
+
+QTEST_MAIN(TestNetworkThread)
+#include "tst_networkthread.moc"
@@ -0,0 +1,375 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// C++
+#include <QtTest>
+#include <QTcpServer>
+#include <QTcpSocket>
+
+// libtego_ui
+#include <protocol/Connection.h>
+#include <protocol/OutboundConnector.h>
+#include <tor/HiddenService.h>
+#include <tor/TorControl.h>
+#include <utils/CryptoKey.h>
+
+// tests
+#include <OnionNetwork.h>
+#include <TestIdentities.h>
+
+using namespace Protocol;
+
+constexpr char unknownHostname[] = "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa.onion";
+static const quint16 servicePort = 9878;
+
+/* Writes back everything it receives, on each connection */
+class EchoServer : public QTcpServer
+{
+public:
+    EchoServer()
+    {
+        connect(this, &QTcpServer::newConnection, this,
+            [this]() {
+                while (QTcpSocket *socket = nextPendingConnection())
+                    connect(socket, &QIODevice::readyRead, socket, [socket]() { socket->write(socket->readAll()); });
+            }
+        );
+    }
+};
+
+/* A stream through the network, as TorSocket makes with tor's proxy */
+class Stream : public QTcpSocket
+{
+public:
+    QByteArray received;
+
+    explicit Stream(const QNetworkProxy &proxy)
+    {
+        setProxy(proxy);
+        connect(this, &QIODevice::readyRead, this, [this]() { received += readAll(); });
+    }
+};
+
+class TestOnionNetwork : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void init();
+    void cleanup();
+
+    void circuitDelay();
+    void unreachable();
+    void roundTripTime();
+    void bandwidth();
+    void window();
+    void dropRate();
+    void dropCircuits();
+    void outboundConnector();
+
+private:
+    OnionNetwork *network = nullptr;
+    EchoServer *echo = nullptr;
+
+    void streamUntilCollapse(quint64 seed, qint64 &cells, int &received);
+};
+
+void TestOnionNetwork::initTestCase()
+{
+    // TorSocket, and the ConnectScheduler it uses, find the proxy through torControl
+    torControl = new Tor::TorControl(this);
+}
+
+void TestOnionNetwork::init()
+{
+    network = new OnionNetwork;
+    QVERIFY(network->listen());
+    echo = new EchoServer;
+    QVERIFY(echo->listen(QHostAddress::LocalHost));
+    network->addService(QString::fromLatin1(serverHostname), servicePort, echo->serverAddress(), echo->serverPort());
+}
+
+void TestOnionNetwork::cleanup()
+{
+    delete network;
+    network = nullptr;
+    delete echo;
+    echo = nullptr;
+}
+
+void TestOnionNetwork::circuitDelay()
+{
+    OnionNetwork::Shaping shaping;
+    shaping.circuitDelay = 200;
+    network->setShaping(shaping);
+
+    QSignalSpy openedSpy(network, &OnionNetwork::circuitOpened);
+    QElapsedTimer timer;
+    timer.start();
+    Stream stream(network->proxy());
+    stream.connectToHost(QString::fromLatin1(serverHostname), servicePort);
+    QTRY_COMPARE(stream.state(), QAbstractSocket::ConnectedState);
+    // Timers may fire a little early
+    QVERIFY(timer.elapsed() >= 190);
+
+    QCOMPARE(openedSpy.count(), 1);
+    QCOMPARE(openedSpy.at(0).at(0).toString(), QString::fromLatin1(serverHostname));
+    QCOMPARE(stream.peerName(), QString::fromLatin1(serverHostname));
+    QCOMPARE(network->circuitCount(), 1);
+
+    stream.write("hello");
+    QTRY_COMPARE(stream.received, QByteArray("hello"));
+    QCOMPARE(network->attemptCount(), 1);
+    QCOMPARE(network->failureCount(), 0);
+
+    QSignalSpy closedSpy(network, &OnionNetwork::circuitClosed);
+    stream.disconnectFromHost();
+    QTRY_COMPARE(closedSpy.count(), 1);
+    QCOMPARE(network->circuitCount(), 0);
+}
+
+void TestOnionNetwork::unreachable()
+{
+    QSignalSpy failedSpy(network, &OnionNetwork::circuitFailed);
+
+    // No such service
+    Stream unknown(network->proxy());
+    unknown.connectToHost(QString::fromLatin1(unknownHostname), servicePort);
+    QTRY_COMPARE(failedSpy.count(), 1);
+    QCOMPARE(failedSpy.at(0).at(0).toString(), QString::fromLatin1(unknownHostname));
+    QTRY_COMPARE(unknown.state(), QAbstractSocket::UnconnectedState);
+
+    // A service on a port that it doesn't have
+    Stream wrongPort(network->proxy());
+    wrongPort.connectToHost(QString::fromLatin1(serverHostname), servicePort + 1);
+    QTRY_COMPARE(failedSpy.count(), 2);
+    QTRY_COMPARE(wrongPort.state(), QAbstractSocket::UnconnectedState);
+
+    // Every attempt fails
+    OnionNetwork::Shaping shaping;
+    shaping.failureRate = 1;
+    network->setShaping(shaping);
+    Stream failing(network->proxy());
+    failing.connectToHost(QString::fromLatin1(serverHostname), servicePort);
+    QTRY_COMPARE(failedSpy.count(), 3);
+    QTRY_COMPARE(failing.state(), QAbstractSocket::UnconnectedState);
+
+    QCOMPARE(network->attemptCount(), 3);
+    QCOMPARE(network->failureCount(), 3);
+    QTRY_COMPARE(network->circuitCount(), 0);
+}
+
+void TestOnionNetwork::roundTripTime()
+{
+    OnionNetwork::Shaping shaping;
+    shaping.roundTripTime = 100;
+    shaping.jitter = 20;
+    network->setShaping(shaping);
+
+    Stream stream(network->proxy());
+    stream.connectToHost(QString::fromLatin1(serverHostname), servicePort);
+    QTRY_COMPARE(stream.state(), QAbstractSocket::ConnectedState);
+
+    // The echo crosses the circuit in both directions
+    QElapsedTimer timer;
+    timer.start();
+    stream.write("ping");
+    QTRY_COMPARE(stream.received, QByteArray("ping"));
+    QVERIFY(timer.elapsed() >= 95);
+}
+
+void TestOnionNetwork::bandwidth()
+{
+    OnionNetwork::Shaping shaping;
+    shaping.bandwidth = 100000;
+    network->setShaping(shaping);
+
+    Stream stream(network->proxy());
+    stream.connectToHost(QString::fromLatin1(serverHostname), servicePort);
+    QTRY_COMPARE(stream.state(), QAbstractSocket::ConnectedState);
+
+    // 41 cells, of 514 bytes each at 100000 bytes per second, in each direction
+    const int size = 20000;
+    const int cells = (size + OnionNetwork::CellPayloadSize - 1) / OnionNetwork::CellPayloadSize;
+    QElapsedTimer timer;
+    timer.start();
+    QByteArray data(size, 'x');
+    stream.write(data);
+    QTRY_COMPARE_WITH_TIMEOUT(stream.received.size(), size, 10000);
+    QCOMPARE(stream.received, data);
+    QVERIFY(timer.elapsed() >= qint64(cells) * OnionNetwork::CellSize * 1000 / shaping.bandwidth - 10);
+    QVERIFY(network->cellCount() >= 2 * cells);
+}
+
+void TestOnionNetwork::window()
+{
+    OnionNetwork::Shaping shaping;
+    shaping.roundTripTime = 400;
+    shaping.window = 10;
+    network->setShaping(shaping);
+
+    Stream stream(network->proxy());
+    stream.connectToHost(QString::fromLatin1(serverHostname), servicePort);
+    QTRY_COMPARE(stream.state(), QAbstractSocket::ConnectedState);
+
+    // Reading stops with a full window, until the first cell arrives 200ms later
+    const int cells = 100;
+    QByteArray data(cells * OnionNetwork::CellPayloadSize, 'x');
+    QElapsedTimer timer;
+    timer.start();
+    stream.write(data);
+    QTRY_COMPARE(network->cellCount(), qint64(shaping.window));
+    QTest::qWait(50);
+    QCOMPARE(network->cellCount(), qint64(shaping.window));
+
+    // Each window takes a one-way delay to cross before more is read
+    QTRY_COMPARE_WITH_TIMEOUT(stream.received.size(), data.size(), 20000);
+    QCOMPARE(stream.received, data);
+    QVERIFY(timer.elapsed() >= (cells / shaping.window) * shaping.roundTripTime / 2 - 10);
+}
+
+/* Stream data through a circuit with a dropRate until it collapses, with
+ * the network's random numbers starting from 'seed'
+ */
+void TestOnionNetwork::streamUntilCollapse(quint64 seed, qint64 &cells, int &received)
+{
+    network->setSeed(seed);
+    qint64 before = network->cellCount();
+    QSignalSpy closedSpy(network, &OnionNetwork::circuitClosed);
+
+    Stream stream(network->proxy());
+    stream.connectToHost(QString::fromLatin1(serverHostname), servicePort);
+    QTRY_COMPARE(stream.state(), QAbstractSocket::ConnectedState);
+
+    stream.write(QByteArray(100000, 'x'));
+    QTRY_COMPARE_WITH_TIMEOUT(closedSpy.count(), 1, 10000);
+    QTRY_COMPARE(stream.state(), QAbstractSocket::UnconnectedState);
+    cells = network->cellCount() - before;
+    received = stream.received.size();
+}
+
+void TestOnionNetwork::dropRate()
+{
+    OnionNetwork::Shaping shaping;
+    shaping.dropRate = 0.05;
+    network->setShaping(shaping);
+
+    // Each cell has the same chance to collapse the circuit, so a stream of
+    // about 400 cells is very unlikely to finish
+    qint64 cells = 0;
+    int received = 0;
+    streamUntilCollapse(1234, cells, received);
+    if (QTest::currentTestFailed())
+        return;
+    QVERIFY(cells > 0);
+    QVERIFY(received < 100000);
+    QCOMPARE(network->circuitCount(), 0);
+
+    // The same seed collapses the circuit at the same cell
+    qint64 repeatCells = 0;
+    int repeatReceived = 0;
+    streamUntilCollapse(1234, repeatCells, repeatReceived);
+    if (QTest::currentTestFailed())
+        return;
+    QCOMPARE(repeatCells, cells);
+}
+
+void TestOnionNetwork::dropCircuits()
+{
+    Stream stream(network->proxy());
+    stream.connectToHost(QString::fromLatin1(serverHostname), servicePort);
+    QTRY_COMPARE(stream.state(), QAbstractSocket::ConnectedState);
+
+    QSignalSpy closedSpy(network, &OnionNetwork::circuitClosed);
+    QSignalSpy disconnectedSpy(&stream, &QAbstractSocket::disconnected);
+    network->dropCircuits(QString::fromLatin1(serverHostname));
+    QCOMPARE(closedSpy.count(), 1);
+    QCOMPARE(network->circuitCount(), 0);
+    QTRY_COMPARE(disconnectedSpy.count(), 1);
+
+    // A service that went away can't be reached again
+    network->removeService(QString::fromLatin1(serverHostname));
+    QSignalSpy failedSpy(network, &OnionNetwork::circuitFailed);
+    Stream again(network->proxy());
+    again.connectToHost(QString::fromLatin1(serverHostname), servicePort);
+    QTRY_COMPARE(failedSpy.count(), 1);
+}
+
+void TestOnionNetwork::outboundConnector()
+{
+    CryptoKey key;
+    QVERIFY(key.loadFromKeyBlob(QByteArray(keyBlob)));
+
+    // The service, as UserIdentity sets it up; torControl keeps it
+    QTcpServer incoming;
+    QVERIFY(incoming.listen(QHostAddress::LocalHost));
+    Tor::HiddenService *service = new Tor::HiddenService(key, this);
+    service->addTarget(servicePort, incoming.serverAddress(), incoming.serverPort());
+    torControl->addHiddenService(service);
+
+    OnionNetwork::Shaping shaping;
+    shaping.circuitDelay = 100;
+    shaping.roundTripTime = 50;
+    network->setShaping(shaping);
+    network->attach(torControl);
+    QVERIFY(torControl->hasConnectivity());
+    QCOMPARE(service->status(), Tor::HiddenService::Online);
+
+    QScopedPointer<Connection> serverConnection;
+    connect(&incoming, &QTcpServer::newConnection, this,
+        [&]() {
+            QTcpSocket *socket = incoming.nextPendingConnection();
+            socket->setProperty("localHostname", QString::fromLatin1(serverHostname));
+            serverConnection.reset(new Connection(socket, Connection::ServerSide));
+        }
+    );
+
+    QScopedPointer<OutboundConnector> connector(new OutboundConnector(nullptr));
+    connector->setAuthPrivateKey(key);
+    QSignalSpy readySpy(connector.data(), &OutboundConnector::ready);
+    QVERIFY(connector->connectToHost(QString::fromLatin1(serverHostname), servicePort));
+    QTRY_COMPARE_WITH_TIMEOUT(readySpy.count(), 1, 10000);
+
+    QSharedPointer<Connection> connection = connector->takeConnection();
+    QCOMPARE(connection->serverHostname(), QString::fromLatin1(serverHostname));
+    QVERIFY(serverConnection);
+    QVERIFY(serverConnection->hasAuthenticated(Connection::HiddenServiceAuth));
+    QCOMPARE(network->attemptCount(), 1);
+
+    QSignalSpy closedSpy(serverConnection.data(), &Connection::closed);
+    connection->close();
+    QTRY_COMPARE(closedSpy.count(), 1);
+}
+
+QTEST_MAIN(TestOnionNetwork)
+#include "tst_onionnetwork.moc"
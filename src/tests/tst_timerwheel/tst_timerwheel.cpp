@@ -0,0 +1,353 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// C++
+#include <QtTest>
+
+// libtego_ui
+#include <utils/TimerWheel.h>
+
+/* Wheel with a simulated clock; tests advance it and call process() */
+class SimulatedWheel : public TimerWheel
+{
+public:
+    qint64 time = 0;
+
+    /* Process every wakeup up to 'end', as the wheel's timer would */
+    void runUntil(qint64 end)
+    {
+        for (qint64 next = nextWakeup(); next >= 0 && next <= end; next = nextWakeup()) {
+            time = qMax(time, next);
+            process();
+        }
+        time = qMax(time, end);
+    }
+
+protected:
+    qint64 now() const override { return time; }
+};
+
+/* Records when a timer expired, relative to when it was due */
+class Expiry : public QObject
+{
+    Q_OBJECT
+
+public:
+    WheelTimer timer;
+    SimulatedWheel *wheel;
+    qint64 deadline = -1;
+    QVector<qint64> expired;
+
+    explicit Expiry(SimulatedWheel *wheel)
+        : timer(wheel), wheel(wheel)
+    {
+        timer.setSingleShot(true);
+        connect(&timer, &WheelTimer::timeout, this, &Expiry::onTimeout);
+    }
+
+    void start(int msecs)
+    {
+        deadline = wheel->time + msecs;
+        timer.start(msecs);
+    }
+
+private slots:
+    void onTimeout()
+    {
+        expired.append(wheel->time);
+    }
+};
+
+/* Creates a stopped timer on its thread's wheel, which outlives the thread */
+class TimerThread : public QThread
+{
+public:
+    WheelTimer *timer = nullptr;
+    QPointer<TimerWheel> wheel;
+
+protected:
+    void run() override
+    {
+        timer = new WheelTimer;
+        wheel = timer->wheel();
+        timer->start(60000);
+        timer->stop();
+    }
+};
+
+class TestTimerWheel : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void expiresWithinTolerance();
+    void coalescing();
+    void preciseTimers();
+    void stopAndRestart();
+    void repeating();
+    void handlers();
+    void realTime();
+    void threadExit();
+};
+
+void TestTimerWheel::expiresWithinTolerance()
+{
+    SimulatedWheel wheel;
+    quint32 seed = 4321;
+    auto random = [&seed](quint32 max) {
+        seed = seed * 1103515245 + 12345;
+        return (seed >> 8) % max;
+    };
+
+    const int intervals[] = { 0, 1, 7, 8, 9, 100, 5000, 15000, 60000, 900000, 3600000, 3 * 24 * 3600000 };
+    const int tolerances[] = { -1, -1, -1, 0, 5, 1000 };
+    QList<Expiry*> timers;
+    for (int i = 0; i < 1000; i++) {
+        Expiry *expiry = new Expiry(&wheel);
+        int tolerance = tolerances[random(sizeof(tolerances) / sizeof(*tolerances))];
+        if (tolerance >= 0)
+            expiry->timer.setTolerance(tolerance);
+        timers.append(expiry);
+    }
+
+    // Start timers at different times, so they don't line up with the slots
+    qint64 end = 0;
+    for (int round = 0; round < 20; round++) {
+        for (Expiry *expiry : timers) {
+            if (random(20) != 0)
+                continue;
+            int interval = intervals[random(sizeof(intervals) / sizeof(*intervals))];
+            interval += int(random(interval / 4 + 1));
+            expiry->start(interval);
+            end = qMax(end, expiry->deadline);
+        }
+        wheel.runUntil(wheel.time + random(3600000));
+    }
+
+    int active = 0;
+    for (Expiry *expiry : timers)
+        active += expiry->timer.isActive() ? 1 : 0;
+    QCOMPARE(wheel.timerCount(), active);
+    wheel.runUntil(end + 24 * 3600000);
+    QCOMPARE(wheel.timerCount(), 0);
+    QCOMPARE(wheel.nextWakeup(), qint64(-1));
+
+    for (Expiry *expiry : timers) {
+        if (expiry->deadline < 0) {
+            QVERIFY(expiry->expired.isEmpty());
+            continue;
+        }
+        // Only the last start is checked; restarting moves the deadline
+        QVERIFY(!expiry->expired.isEmpty());
+        qint64 late = expiry->expired.last() - expiry->deadline;
+        QVERIFY2(late >= 0, qPrintable(QStringLiteral("expired %1ms early").arg(-late)));
+        QVERIFY2(late <= qMax(expiry->timer.tolerance(), int(TimerWheel::Granularity)),
+                 qPrintable(QStringLiteral("expired %1ms late, with a tolerance of %2ms").arg(late).arg(expiry->timer.tolerance())));
+    }
+
+    qDeleteAll(timers);
+}
+
+void TestTimerWheel::coalescing()
+{
+    SimulatedWheel wheel;
+    QList<Expiry*> timers;
+
+    // 2000 timeouts of about a minute, spread over two seconds
+    for (int i = 0; i < 2000; i++) {
+        Expiry *expiry = new Expiry(&wheel);
+        wheel.time = i;
+        expiry->start(60000);
+        timers.append(expiry);
+    }
+
+    quint64 before = wheel.wakeups();
+    wheel.runUntil(120000);
+    int wakeups = int(wheel.wakeups() - before);
+
+    for (Expiry *expiry : timers)
+        QCOMPARE(expiry->expired.size(), 1);
+
+    // With a tolerance of 7.5s, they fit in at most two slots of 4096ms
+    QVERIFY2(wakeups <= 2, qPrintable(QStringLiteral("%1 wakeups").arg(wakeups)));
+    qDeleteAll(timers);
+}
+
+void TestTimerWheel::preciseTimers()
+{
+    SimulatedWheel wheel;
+    wheel.time = 12345;
+
+    // Deadlines far beyond the first levels, with no tolerance, are moved
+    // down the levels and still expire at the first slot after the deadline
+    Expiry hour(&wheel), day(&wheel), week(&wheel);
+    hour.timer.setTolerance(0);
+    day.timer.setTolerance(0);
+    week.timer.setTolerance(0);
+    hour.start(3600000 + 3);
+    day.start(24 * 3600000 + 5);
+    week.start(7 * 24 * 3600000 + 1);
+
+    wheel.runUntil(8 * 24 * 3600000LL);
+    for (Expiry *expiry : { &hour, &day, &week }) {
+        QCOMPARE(expiry->expired.size(), 1);
+        QVERIFY(expiry->expired.first() >= expiry->deadline);
+        QVERIFY(expiry->expired.first() - expiry->deadline < TimerWheel::Granularity);
+    }
+}
+
+void TestTimerWheel::stopAndRestart()
+{
+    SimulatedWheel wheel;
+    Expiry a(&wheel), b(&wheel);
+
+    a.start(1000);
+    b.start(1000);
+    QCOMPARE(wheel.timerCount(), 2);
+    QCOMPARE(a.timer.remainingTime(), 1000);
+
+    b.timer.stop();
+    QVERIFY(!b.timer.isActive());
+    QCOMPARE(b.timer.remainingTime(), -1);
+    QCOMPARE(wheel.timerCount(), 1);
+
+    // Restarting replaces the deadline
+    wheel.time = 500;
+    a.start(1000);
+    QCOMPARE(wheel.timerCount(), 1);
+    wheel.runUntil(1400);
+    QVERIFY(a.expired.isEmpty());
+    wheel.runUntil(2000);
+    QCOMPARE(a.expired.size(), 1);
+    QVERIFY(b.expired.isEmpty());
+
+    // Stopping the only timer leaves nothing to wake up for
+    b.start(60000);
+    QVERIFY(wheel.nextWakeup() >= 0);
+    b.timer.stop();
+    QCOMPARE(wheel.nextWakeup(), qint64(-1));
+
+    // Timers that are deleted while active are removed
+    {
+        Expiry c(&wheel);
+        c.start(10);
+        QCOMPARE(wheel.timerCount(), 1);
+    }
+    QCOMPARE(wheel.timerCount(), 0);
+    QCOMPARE(wheel.nextWakeup(), qint64(-1));
+}
+
+void TestTimerWheel::repeating()
+{
+    SimulatedWheel wheel;
+    Expiry expiry(&wheel);
+    expiry.timer.setSingleShot(false);
+    expiry.start(1000);
+
+    wheel.runUntil(10 * 1000 + 500);
+    QCOMPARE(expiry.expired.size(), 10);
+    for (int i = 0; i < expiry.expired.size(); i++) {
+        QVERIFY(expiry.expired[i] >= (i + 1) * 1000);
+        QVERIFY(expiry.expired[i] <= (i + 1) * 1000 + 125 * (i + 1));
+    }
+    QVERIFY(expiry.timer.isActive());
+    QCOMPARE(wheel.timerCount(), 1);
+}
+
+void TestTimerWheel::handlers()
+{
+    SimulatedWheel wheel;
+    WheelTimer *first = new WheelTimer(&wheel);
+    WheelTimer *second = new WheelTimer(&wheel);
+    WheelTimer *third = new WheelTimer(&wheel);
+    first->setSingleShot(true);
+    second->setSingleShot(true);
+    third->setSingleShot(true);
+    int secondExpired = 0, thirdExpired = 0;
+
+    // Expiring in the same slot, the first deletes the second and restarts
+    // the third, before either has emitted timeout
+    connect(first, &WheelTimer::timeout, [&]() {
+        delete second;
+        second = nullptr;
+        third->start(100);
+    });
+    connect(second, &WheelTimer::timeout, [&]() { secondExpired++; });
+    connect(third, &WheelTimer::timeout, [&]() { thirdExpired++; });
+
+    first->start(50);
+    second->start(50);
+    third->start(50);
+    wheel.runUntil(60);
+    QVERIFY(!second);
+    QCOMPARE(secondExpired, 0);
+    QCOMPARE(thirdExpired, 0);
+    QVERIFY(third->isActive());
+
+    wheel.runUntil(200);
+    QCOMPARE(thirdExpired, 1);
+    QCOMPARE(wheel.timerCount(), 0);
+
+    delete first;
+    delete third;
+}
+
+void TestTimerWheel::realTime()
+{
+    // Timers on the thread's wheel run from the event loop
+    WheelTimer timer;
+    timer.setSingleShot(true);
+    QSignalSpy spy(&timer, &WheelTimer::timeout);
+    QElapsedTimer elapsed;
+    elapsed.start();
+    timer.start(50);
+    QTRY_COMPARE(spy.count(), 1);
+    QVERIFY(elapsed.elapsed() >= 50);
+    QCOMPARE(timer.wheel(), TimerWheel::instance());
+}
+
+void TestTimerWheel::threadExit()
+{
+    // Each thread's wheel is deleted when the thread exits
+    TimerThread thread;
+    thread.start();
+    QVERIFY(thread.wait(5000));
+    QVERIFY(thread.timer);
+    QVERIFY(!thread.wheel);
+    QVERIFY(!thread.timer->wheel());
+
+    // A timer that outlived its wheel can still be deleted
+    delete thread.timer;
+}
+
+QTEST_MAIN(TestTimerWheel)
+#include "tst_timerwheel.moc"